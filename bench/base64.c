@@ -0,0 +1,69 @@
+/*
+ * Decodes a large base64 attachment, wrapped at 76 characters like MIME does
+ * and all on one line, and reports the throughput of each.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+#include "util/base64.h"
+
+static char *encode(size_t size, size_t wrap, size_t *length) {
+	unsigned char *data = malloc(size);
+	unsigned int seed = 1;
+	for (size_t i = 0; i < size; ++i) {
+		seed = seed * 1103515245 + 12345;
+		data[i] = seed >> 16;
+	}
+	size_t _;
+	char *flat = b64_encode((char *)data, size, &_);
+	free(data);
+	size_t flat_len = strlen(flat);
+	if (!wrap) {
+		*length = flat_len;
+		return flat;
+	}
+	char *wrapped = malloc(flat_len + flat_len / wrap * 2 + 1);
+	size_t len = 0;
+	for (size_t i = 0; i < flat_len; i += wrap) {
+		size_t n = flat_len - i < wrap ? flat_len - i : wrap;
+		memcpy(wrapped + len, flat + i, n);
+		len += n;
+		if (i + n < flat_len) {
+			wrapped[len++] = '\r';
+			wrapped[len++] = '\n';
+		}
+	}
+	wrapped[len] = '\0';
+	free(flat);
+	*length = len;
+	return wrapped;
+}
+
+static int decode(const char *mode, size_t size, size_t wrap) {
+	size_t length, decoded;
+	char *encoded = encode(size, wrap, &length);
+	double wall = bench_seconds(CLOCK_MONOTONIC);
+	unsigned char *plain = b64_decode(encoded, length, &decoded);
+	wall = bench_seconds(CLOCK_MONOTONIC) - wall;
+	double mb = length / (1024.0 * 1024.0);
+	printf("%-8s %8.1f MB %9.1f MB/s\n", mode, mb, mb / wall);
+	free(plain);
+	free(encoded);
+	return decoded != size;
+}
+
+int run_bench_base64(int argc, char **argv) {
+	size_t size = 64;
+	if (argc > 0) {
+		size = strtoul(argv[0], NULL, 10);
+	}
+	size *= 1024 * 1024;
+	int ret = 0;
+	ret += decode("mime", size, 76);
+	ret += decode("flat", size, 0);
+	return ret;
+}
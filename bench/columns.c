@@ -0,0 +1,146 @@
+/*
+ * Builds a mailbox of 100k fetched messages and reports the heap used per
+ * message by the messages and by their list view columns, then times a full
+ * pass over the rows and a local sort, reading the messages the way the list
+ * view used to and reading the columns.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "bench.h"
+#include "columns.h"
+#include "email/headers.h"
+#include "sort.h"
+#include "state.h"
+#include "worker.h"
+
+static size_t heap_used(void) {
+#ifdef __GLIBC__
+	// Big arrays come straight from mmap and are only counted in hblkhd
+	struct mallinfo2 info = mallinfo2();
+	return info.uordblks + info.hblkhd;
+#else
+	return 0;
+#endif
+}
+
+static struct aerc_message *make_message(size_t i) {
+	char headers[1024];
+	snprintf(headers, sizeof(headers),
+			"Date: Mon, 15 Jul 2024 %02zd:%02zd:00 +0000\r\n"
+			"From: Developer %zd <dev%zd@example.org>\r\n"
+			"To: dev@lists.example.org\r\n"
+			"Subject: %s[dev] Thread number %zd about something\r\n"
+			"Message-ID: <%zd@example.org>\r\n"
+			"In-Reply-To: <%zd@example.org>\r\n"
+			"\r\n",
+			i / 60 % 24, i % 60, i % 97, i % 97, i % 3 ? "Re: " : "",
+			i * 7919 % 4000, i, i / 3);
+	struct aerc_message *msg = calloc(1, sizeof(struct aerc_message));
+	msg->index = i;
+	msg->fetched = true;
+	msg->uid = i + 1;
+	msg->size = 2000 + i * 7 % 90000;
+	msg->flags = i % 4 ? FLAG_SEEN : 0;
+	msg->headers = parse_headers(headers);
+	msg->internal_date = 1704067200 + i * 317;
+	return msg;
+}
+
+/* What drawing a row used to read, following pointers from the message */
+static size_t scan_messages(struct aerc_mailbox *mbox) {
+	size_t sum = 0;
+	for (size_t i = 0; i < mbox->messages->length; ++i) {
+		struct aerc_message *msg = mbox->messages->items[i];
+		sum += msg->fetched + (msg->flags & FLAG_SEEN)
+			+ msg->internal_date % 31
+			+ strlen(get_message_header(msg, HEADER_SUBJECT));
+	}
+	return sum;
+}
+
+static size_t scan_columns(struct aerc_mailbox *mbox) {
+	struct message_columns *columns = get_message_columns(mbox);
+	size_t sum = 0;
+	for (size_t i = 0; i < columns->length; ++i) {
+		sum += columns->fetched[i] + (columns->flags[i] & FLAG_SEEN)
+			+ columns->date[i] % 31
+			+ strlen(columns->strings + columns->subject[i]);
+	}
+	return sum;
+}
+
+static struct aerc_mailbox *sort_mbox;
+
+static int compare_senders(const void *_a, const void *_b) {
+	struct aerc_message *a = sort_mbox->messages->items[*(const size_t *)_a];
+	struct aerc_message *b = sort_mbox->messages->items[*(const size_t *)_b];
+	return strcasecmp(get_message_header(a, HEADER_FROM),
+			get_message_header(b, HEADER_FROM));
+}
+
+static void sort_messages(struct aerc_mailbox *mbox) {
+	size_t n = mbox->messages->length;
+	size_t *order = malloc(n * sizeof(size_t));
+	for (size_t i = 0; i < n; ++i) {
+		order[i] = i;
+	}
+	sort_mbox = mbox;
+	qsort(order, n, sizeof(size_t), compare_senders);
+	free(order);
+}
+
+int run_bench_columns(int argc, char **argv) {
+	size_t n = 100000;
+	if (argc > 0) {
+		n = strtoul(argv[0], NULL, 10);
+	}
+	if (!state) {
+		// sort_locally asks for a redraw
+		state = calloc(1, sizeof(struct aerc_state));
+	}
+	struct aerc_mailbox *mbox = calloc(1, sizeof(struct aerc_mailbox));
+	mbox->messages = create_list();
+
+	size_t before = heap_used();
+	for (size_t i = 0; i < n; ++i) {
+		list_add(mbox->messages, make_message(i));
+	}
+	size_t messages = heap_used() - before;
+	before = heap_used();
+	struct message_columns *columns = get_message_columns(mbox);
+	size_t built = heap_used() - before;
+	printf("%zd messages: %.1f bytes each, columns %.1f bytes each "
+			"(%zd of them strings)\n", n, (double)messages / n,
+			(double)built / n, columns->strings_size / n);
+
+	double wall = bench_seconds(CLOCK_MONOTONIC);
+	size_t a = scan_messages(mbox);
+	double scan_before = bench_seconds(CLOCK_MONOTONIC) - wall;
+	wall = bench_seconds(CLOCK_MONOTONIC);
+	size_t b = scan_columns(mbox);
+	double scan_after = bench_seconds(CLOCK_MONOTONIC) - wall;
+	printf("%-8s %9.2f ms messages %9.2f ms columns\n", "scan",
+			scan_before * 1000, scan_after * 1000);
+
+	wall = bench_seconds(CLOCK_MONOTONIC);
+	sort_messages(mbox);
+	double sort_before = bench_seconds(CLOCK_MONOTONIC) - wall;
+	struct account_state account = { 0 };
+	account.ui.sort.key = SORT_FROM;
+	wall = bench_seconds(CLOCK_MONOTONIC);
+	sort_locally(&account, mbox);
+	double sort_after = bench_seconds(CLOCK_MONOTONIC) - wall;
+	printf("%-8s %9.2f ms messages %9.2f ms columns\n", "sort",
+			sort_before * 1000, sort_after * 1000);
+
+	free_aerc_mailbox(mbox);
+	return a == 0 || b == 0;
+}
@@ -0,0 +1,195 @@
+/*
+ * Downloads a large literal from a TLS server on the loopback interface and
+ * reports how much CPU the receiving thread spent per MB, with and without
+ * kernel TLS.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef USE_OPENSSL
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#endif
+
+#include "absocket.h"
+#include "bench.h"
+#include "urlparse.h"
+
+#ifdef USE_OPENSSL
+
+#define CHUNK_SIZE 16384
+
+struct server {
+	int fd;
+	SSL_CTX *ctx;
+	size_t size;
+};
+
+static SSL_CTX *server_context() {
+	EVP_PKEY *key = EVP_EC_gen("P-256");
+	X509 *cert = X509_new();
+	if (!key || !cert) {
+		return NULL;
+	}
+	X509_set_version(cert, 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+	X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+	X509_gmtime_adj(X509_getm_notAfter(cert), 60 * 60);
+	X509_set_pubkey(cert, key);
+	X509_NAME *name = X509_get_subject_name(cert);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+			(const unsigned char *)"localhost", -1, -1, 0);
+	X509_set_issuer_name(cert, name);
+	X509_sign(cert, key, EVP_sha256());
+
+	SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+	SSL_CTX_use_certificate(ctx, cert);
+	SSL_CTX_use_PrivateKey(ctx, key);
+	X509_free(cert);
+	EVP_PKEY_free(key);
+	return ctx;
+}
+
+static void *serve(void *_server) {
+	struct server *server = _server;
+	int fd = accept(server->fd, NULL, NULL);
+	if (fd == -1) {
+		return NULL;
+	}
+	SSL *ssl = SSL_new(server->ctx);
+	SSL_set_fd(ssl, fd);
+	if (SSL_accept(ssl) != 1) {
+		fprintf(stderr, "Server handshake failed\n");
+		goto done;
+	}
+	char chunk[CHUNK_SIZE];
+	for (size_t i = 0; i < sizeof(chunk); ++i) {
+		chunk[i] = (i + 1) % 77 == 0 ? '\n'
+			: "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"[i % 64];
+	}
+	char header[64];
+	int len = snprintf(header, sizeof(header),
+			"* 1 FETCH (BODY[2] {%zd}\r\n", server->size);
+	SSL_write(ssl, header, len);
+	for (size_t sent = 0; sent < server->size; sent += CHUNK_SIZE) {
+		size_t amt = server->size - sent;
+		if (amt > CHUNK_SIZE) {
+			amt = CHUNK_SIZE;
+		}
+		if (SSL_write(ssl, chunk, amt) <= 0) {
+			break;
+		}
+	}
+	SSL_write(ssl, ")\r\n", 3);
+	SSL_shutdown(ssl);
+done:
+	SSL_free(ssl);
+	close(fd);
+	return NULL;
+}
+
+static int download(const char *mode, int flags, size_t size) {
+	struct server server = { .size = size };
+	server.ctx = server_context();
+	server.fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	socklen_t addrlen = sizeof(addr);
+	if (!server.ctx || server.fd == -1
+			|| bind(server.fd, (struct sockaddr *)&addr, addrlen) == -1
+			|| getsockname(server.fd, (struct sockaddr *)&addr, &addrlen) == -1
+			|| listen(server.fd, 1) == -1) {
+		fprintf(stderr, "Unable to start the test server\n");
+		return 1;
+	}
+	char port[8];
+	snprintf(port, sizeof(port), "%d", ntohs(addr.sin_port));
+	struct uri uri = { .hostname = "127.0.0.1", .port = port };
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, serve, &server);
+	absocket_t *abs = absocket_new(&uri, true, flags);
+	while (abs && ab_connect_step(abs, 100) < AB_CONNECTED);
+	if (!abs || abs->state != AB_CONNECTED) {
+		fprintf(stderr, "Unable to connect to the test server\n");
+		absocket_free(abs);
+		pthread_join(thread, NULL);
+		return 1;
+	}
+	const char *backend = abs->ktls_recv ? "ktls"
+		: ab_async(abs) ? "io_uring" : "openssl";
+
+	static char buffer[65536];
+	size_t total = 0;
+	double wall = bench_seconds(CLOCK_MONOTONIC);
+	double cpu = bench_seconds(CLOCK_THREAD_CPUTIME_ID);
+	while (true) {
+		ab_flush(abs);
+		if (!ab_async(abs) && !ab_pending(abs)) {
+			struct pollfd pfd = { .fd = abs->basefd, .events = POLLIN };
+			poll(&pfd, 1, -1);
+		}
+		ssize_t amt = ab_recv(abs, buffer, sizeof(buffer));
+		if (amt == 0) {
+			break;
+		} else if (amt < 0) {
+			if (errno == EAGAIN && !ab_pending(abs)) {
+				struct timespec spec = { 0, 50000 };
+				nanosleep(&spec, NULL);
+				continue;
+			} else if (errno == EAGAIN) {
+				continue;
+			}
+			break;
+		}
+		total += amt;
+	}
+	cpu = bench_seconds(CLOCK_THREAD_CPUTIME_ID) - cpu;
+	wall = bench_seconds(CLOCK_MONOTONIC) - wall;
+
+	absocket_free(abs);
+	pthread_join(thread, NULL);
+	close(server.fd);
+	SSL_CTX_free(server.ctx);
+
+	double mb = total / (1024.0 * 1024.0);
+	printf("%-8s %-9s %8.1f MB %9.3f ms CPU/MB %9.1f MB/s\n",
+			mode, backend, mb, cpu * 1000 / mb, mb / wall);
+	return total < size;
+}
+
+int run_bench_ktls(int argc, char **argv) {
+	size_t size = 256;
+	if (argc > 0) {
+		size = strtoul(argv[0], NULL, 10);
+	}
+	size *= 1024 * 1024;
+	abs_init();
+	int ret = 0;
+	ret += download("default", 0, size);
+	ret += download("ktls", AB_KTLS, size);
+	return ret;
+}
+
+#else
+
+int run_bench_ktls(int argc, char **argv) {
+	fprintf(stderr, "aerc was compiled without SSL support\n");
+	return 0;
+}
+
+#endif
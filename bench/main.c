@@ -0,0 +1,49 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "bench.h"
+#include "state.h"
+
+struct aerc_state *state;
+
+struct benchmark {
+	const char *name;
+	int (*run)(int argc, char **argv);
+};
+
+static struct benchmark benchmarks[] = {
+	{ "base64", run_bench_base64 },
+	{ "columns", run_bench_columns },
+	{ "ktls", run_bench_ktls },
+	{ "parse", run_bench_parse },
+};
+
+double bench_seconds(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+	int ret = 0;
+	size_t n = sizeof(benchmarks) / sizeof(struct benchmark);
+	if (argc < 2) {
+		for (size_t i = 0; i < n; ++i) {
+			printf("== %s\n", benchmarks[i].name);
+			ret += benchmarks[i].run(0, NULL);
+		}
+		return ret;
+	}
+	for (size_t i = 0; i < n; ++i) {
+		if (strcmp(benchmarks[i].name, argv[1]) == 0) {
+			return benchmarks[i].run(argc - 2, argv + 2);
+		}
+	}
+	fprintf(stderr, "Usage: %s [benchmark [args...]]\nBenchmarks:", argv[0]);
+	for (size_t i = 0; i < n; ++i) {
+		fprintf(stderr, " %s", benchmarks[i].name);
+	}
+	fprintf(stderr, "\n");
+	return 1;
+}
@@ -0,0 +1,104 @@
+/*
+ * Parses the kind of FETCH responses we get when opening a mailbox and reports
+ * the throughput of the IMAP parser, and of the delimiter scanner it uses to
+ * find the end of each token.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+#include "imap/imap.h"
+#include "internal/imap.h"
+#include "util/scan.h"
+
+/* Taken from a session with Dovecot, with the personal bits changed */
+static const char *responses[] = {
+	"* %d FETCH (UID %d FLAGS (\\Seen) INTERNALDATE \"17-Jul-2024 "
+	"09:12:44 +0000\" RFC822.SIZE 48213 BODYSTRUCTURE ((\"text\" \"plain\" "
+	"(\"charset\" \"utf-8\") NIL NIL \"quoted-printable\" 1843 41 NIL NIL "
+	"NIL NIL)(\"application\" \"pdf\" (\"name\" \"invoice-2024-07.pdf\") "
+	"NIL NIL \"base64\" 45120 NIL (\"attachment\" (\"filename\" "
+	"\"invoice-2024-07.pdf\")) NIL NIL) \"mixed\" (\"boundary\" "
+	"\"=_5f1c2b0e7d3a\") NIL NIL NIL) BODY[HEADER.FIELDS (DATE FROM "
+	"SUBJECT TO CC MESSAGE-ID REFERENCES IN-REPLY-TO)] {%zd}\r\n%s)\r\n",
+	"* %d FETCH (UID %d FLAGS () INTERNALDATE \"18-Jul-2024 21:03:10 "
+	"+0200\" RFC822.SIZE 5120 BODYSTRUCTURE (\"text\" \"plain\" "
+	"(\"charset\" \"us-ascii\" \"format\" \"flowed\") NIL NIL \"7bit\" "
+	"4380 97 NIL NIL NIL NIL) BODY[HEADER.FIELDS (DATE FROM SUBJECT TO CC "
+	"MESSAGE-ID REFERENCES IN-REPLY-TO)] {%zd}\r\n%s)\r\n",
+};
+
+static const char *header =
+	"Date: Wed, 17 Jul 2024 09:12:40 +0000\r\n"
+	"From: Accounts Payable <billing@example.com>\r\n"
+	"To: someone@example.org\r\n"
+	"Subject: Your invoice for July\r\n"
+	"Message-ID: <20240717091240.4f2a@mail.example.com>\r\n"
+	"References: <20240617080011.1c3b@mail.example.com>\r\n"
+	" <20240517075522.9d0e@mail.example.com>\r\n"
+	"\r\n";
+
+static char *record(size_t size, size_t *length) {
+	char *buffer = malloc(size + 4096);
+	size_t len = 0;
+	for (int i = 1; len < size; ++i) {
+		const char *fmt = responses[i % 3 == 0];
+		len += sprintf(buffer + len, fmt, i, i + 1000, strlen(header), header);
+	}
+	*length = len;
+	return buffer;
+}
+
+static double parse_all(const char *buffer, size_t length, size_t *count) {
+	double start = bench_seconds(CLOCK_MONOTONIC);
+	size_t consumed = 0;
+	*count = 0;
+	while (consumed < length) {
+		int remaining;
+		imap_arg_t *arg = calloc(1, sizeof(imap_arg_t));
+		int len = imap_parse_args_n(buffer + consumed, length - consumed,
+				arg, &remaining);
+		imap_arg_free(arg);
+		if (remaining || len <= 0) {
+			break;
+		}
+		consumed += len;
+		++*count;
+	}
+	return bench_seconds(CLOCK_MONOTONIC) - start;
+}
+
+static double scan_all(const char *buffer, size_t length,
+		const char *(*find)(const char *, const char *, const char *)) {
+	double start = bench_seconds(CLOCK_MONOTONIC);
+	const char *end = buffer + length;
+	for (const char *s = buffer; s < end; ++s) {
+		s = find(s, end, " )[\r");
+	}
+	return bench_seconds(CLOCK_MONOTONIC) - start;
+}
+
+int run_bench_parse(int argc, char **argv) {
+	size_t size = 64;
+	if (argc > 0) {
+		size = strtoul(argv[0], NULL, 10);
+	}
+	size *= 1024 * 1024;
+	size_t length, count;
+	char *buffer = record(size, &length);
+	double mb = length / (1024.0 * 1024.0);
+
+	double elapsed = parse_all(buffer, length, &count);
+	printf("%-8s %8.1f MB %9zd responses %9.1f MB/s\n",
+			"parse", mb, count, mb / elapsed);
+	elapsed = scan_all(buffer, length, scan_find_scalar);
+	printf("%-8s %8.1f MB %19s %9.1f MB/s\n", "scalar", mb, "", mb / elapsed);
+	elapsed = scan_all(buffer, length, scan_find);
+	printf("%-8s %8.1f MB %19s %9.1f MB/s\n", "scan", mb, "", mb / elapsed);
+
+	free(buffer);
+	return count == 0;
+}
@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef USE_OPENSSL
@@ -12,27 +13,109 @@
 #include "urlparse.h"
 
 /*
- * Abstract socket utility, handles adding SSL if necessary.
+ * Abstract socket utility, handles adding SSL and compression if necessary.
  */
 
+/*
+ * Byte counters for the socket. "wire" counts what actually crossed the
+ * network (after compression), "data" counts what was handed to/from the
+ * caller. Without compression the two are equal.
+ */
+struct absocket_stats {
+	size_t wire_in, wire_out;
+	size_t data_in, data_out;
+};
+
+enum absocket_flags {
+	/* Hand the TLS session to the kernel after the handshake, if it can */
+	AB_KTLS = 1 << 0,
+};
+
+enum absocket_state {
+	AB_CONNECTING,
+	AB_HANDSHAKING,
+	AB_CONNECTED,
+	AB_FAILED,
+};
+
+/* How long each phase of connecting took, in milliseconds */
+struct absocket_timings {
+	double dns, tcp, tls;
+};
+
+struct ab_eyeballs;
+#ifdef USE_ZLIB
+struct ab_deflate;
+#endif
+#ifdef USE_IO_URING
+struct ab_uring;
+#endif
+
 struct absocket {
 	int basefd;
 	bool use_ssl;
+	int flags;
+	enum absocket_state state;
+	/* Set if state is AB_FAILED */
+	char *error;
+	struct ab_eyeballs *eyeballs;
+	struct absocket_timings timings;
+	struct timespec handshake_start;
 #ifdef USE_OPENSSL
 	SSL *ssl;
 	SSL_CTX *ctx;
 	X509 *cert;
+	/* Set when the kernel does the record encryption in that direction */
+	bool ktls_send, ktls_recv;
+	char *hostname;
+	/* Where the last session ticket for this server/user is kept */
+	char *session_path;
 #endif
+#ifdef USE_ZLIB
+	struct ab_deflate *deflate;
+#endif
+#ifdef USE_IO_URING
+	struct ab_uring *uring;
+#endif
+	struct absocket_stats stats;
 };
 typedef struct absocket absocket_t;
 
 void abs_init();
-absocket_t *absocket_new(const struct uri *uri, bool use_ssl);
+/*
+ * Starts connecting in the background, drive it with ab_connect_step until the
+ * state is AB_CONNECTED or AB_FAILED.
+ */
+absocket_t *absocket_new(const struct uri *uri, bool use_ssl, int flags);
+/* Waits up to timeout ms for the connection to make progress */
+enum absocket_state ab_connect_step(absocket_t *socket, int timeout);
 void absocket_free(absocket_t *socket);
 ssize_t ab_recv(absocket_t *socket, void *buffer, size_t len);
 ssize_t ab_send(absocket_t *socket, void *buffer, size_t len);
+bool ab_pending(absocket_t *socket);
+/*
+ * Returns true if the socket tracks incoming data itself (see ab_pending), in
+ * which case there's no need to poll() its fd.
+ */
+bool ab_async(absocket_t *socket);
+/*
+ * Sends may be batched until this is called. Returns -1 on error.
+ */
+int ab_flush(absocket_t *socket);
 #ifdef USE_OPENSSL
+/*
+ * Starts a TLS handshake on a connected socket, i.e. after STARTTLS. Drive it
+ * with ab_connect_step, as for a new connection.
+ */
 bool ab_enable_ssl(absocket_t *socket);
 #endif
+#ifdef USE_ZLIB
+/*
+ * Stacks a raw DEFLATE layer (RFC 1951) on top of the socket. Any bytes that
+ * were already read from the wire but belong to the compressed stream should be
+ * passed in as "prefix".
+ */
+bool ab_enable_compress(absocket_t *socket, const void *prefix, size_t len);
+#endif
 
 #endif
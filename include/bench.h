@@ -0,0 +1,15 @@
+#ifndef __BENCH_H
+#define __BENCH_H
+
+#include <time.h>
+
+/* Helpers */
+double bench_seconds(clockid_t clock);
+
+/* Benchmarks */
+int run_bench_base64(int argc, char **argv);
+int run_bench_columns(int argc, char **argv);
+int run_bench_ktls(int argc, char **argv);
+int run_bench_parse(int argc, char **argv);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef _COLUMNS_H
+#define _COLUMNS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+struct aerc_mailbox;
+
+/*
+ * What the message list shows and sorts by, one array per field and indexed
+ * like mailbox->messages, so drawing and sorting read a few small arrays
+ * instead of following pointers out to every message.
+ */
+struct message_columns {
+	size_t length, size;
+	bool *fetched;
+	long *uid;
+	time_t *date;
+	short *zone;
+	uint64_t *flags;
+	long *bytes;
+	/*
+	 * Offsets into strings. thread_subject is the subject without its Re:
+	 * and Fwd: prefixes. 0 is an empty string, for headers we don't have.
+	 */
+	uint32_t *subject, *thread_subject, *from;
+	char *strings;
+	size_t strings_len, strings_size;
+	/* strings_len after the last full build, to know when to compact */
+	size_t built_len;
+};
+
+/* The columns for a mailbox, built from its messages if they're stale */
+struct message_columns *get_message_columns(struct aerc_mailbox *mbox);
+/* Refreshes the row for the message at index after it was updated */
+void update_message_columns(struct aerc_mailbox *mbox, size_t index);
+/* Drops the row for the message at index after it was expunged */
+void remove_message_columns(struct aerc_mailbox *mbox, size_t index);
+void free_message_columns(struct message_columns *columns);
+
+#endif
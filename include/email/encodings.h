@@ -1,9 +1,30 @@
 #ifndef _EMAIL_ENCODINGS_H
 #define _EMAIL_ENCODINGS_H
 
+#include <stddef.h>
+
 enum qp_flavor { QP_BODY, QP_HEADERS };
 
 int iso_8859_1_to_utf8(unsigned char **data, int len);
 int quoted_printable_decode(char *data, int len, int qp_flavor);
 
+/*
+ * Decodes quoted-printable a piece at a time, for when it comes in pieces.
+ * The pieces can split an escape anywhere, and the output never gets ahead of
+ * the input (counting what was held back from earlier pieces), so dst may be
+ * where src is.
+ */
+struct qp_decoder {
+	enum qp_flavor flavor;
+	char pending[2];
+	size_t pending_len;
+};
+
+void qp_decoder_init(struct qp_decoder *decoder, enum qp_flavor flavor);
+/* Returns the number of bytes written to dst */
+size_t qp_decoder_update(struct qp_decoder *decoder, const char *src,
+		size_t len, char *dst);
+/* Writes out whatever was held back in case more was coming */
+size_t qp_decoder_finish(struct qp_decoder *decoder, char *dst);
+
 #endif
@@ -0,0 +1,39 @@
+#ifndef _EMAIL_FLAGS_H
+#define _EMAIL_FLAGS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* The system flags from RFC 3501, each a bit of a message's flags */
+enum message_flag {
+	FLAG_SEEN = 1 << 0,
+	FLAG_ANSWERED = 1 << 1,
+	FLAG_FLAGGED = 1 << 2,
+	FLAG_DELETED = 1 << 3,
+	FLAG_DRAFT = 1 << 4,
+	FLAG_RECENT = 1 << 5,
+};
+
+#define FLAG_SYSTEM_COUNT 6
+/* The bits above the system flags are keywords, numbered by each mailbox */
+#define FLAG_KEYWORD_MAX (64 - FLAG_SYSTEM_COUNT)
+
+/* A mailbox's keywords, which only ever get added to */
+struct keyword_table {
+	char *names[FLAG_KEYWORD_MAX];
+	size_t length;
+};
+
+/*
+ * Returns the bit for a flag, or 0 if it's a keyword we haven't seen and add
+ * isn't set (or the table is full).
+ */
+uint64_t flag_bit(struct keyword_table *keywords, const char *flag, bool add);
+/* The name of the flag with this bit, or NULL */
+const char *flag_name(const struct keyword_table *keywords, uint64_t bit);
+void keyword_table_copy(struct keyword_table *dest,
+		const struct keyword_table *src);
+void keyword_table_finish(struct keyword_table *keywords);
+
+#endif
@@ -1,13 +1,48 @@
 #ifndef _EMAIL_HEADERS_H
 #define _EMAIL_HEADERS_H
 
-#include "util/list.h"
+#include <stddef.h>
+
+/* The headers we look up ourselves, anything else is HEADER_OTHER */
+enum header_id {
+	HEADER_OTHER,
+	HEADER_DATE,
+	HEADER_FROM,
+	HEADER_SENDER,
+	HEADER_REPLY_TO,
+	HEADER_TO,
+	HEADER_CC,
+	HEADER_BCC,
+	HEADER_SUBJECT,
+	HEADER_MESSAGE_ID,
+	HEADER_IN_REPLY_TO,
+	HEADER_REFERENCES,
+	HEADER_COUNT,
+};
 
 struct email_header {
 	char *key, *value;
+	enum header_id id;
+};
+
+/*
+ * A message's headers, in the order they were sent. The keys and values all
+ * live in one allocation.
+ */
+struct email_headers {
+	struct email_header *items;
+	size_t length;
+	/* The first header with each id, or -1 */
+	int first[HEADER_COUNT];
+	char *arena;
+	size_t arena_len;
 };
 
-int parse_headers(const char *headers, list_t *output);
-void free_headers(list_t *headers);
+enum header_id header_id(const char *name, size_t len);
+struct email_headers *parse_headers(const char *headers);
+struct email_headers *copy_headers(const struct email_headers *headers);
+/* The value of the first header with this id, or NULL */
+const char *find_header(const struct email_headers *headers, enum header_id id);
+void free_headers(struct email_headers *headers);
 
 #endif
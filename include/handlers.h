@@ -8,6 +8,10 @@ void handle_worker_connect_done(struct account_state *account,
 		struct worker_message *message);
 void handle_worker_connect_error(struct account_state *account,
 		struct worker_message *message);
+void handle_worker_disconnected(struct account_state *account,
+		struct worker_message *message);
+void handle_worker_reconnect_done(struct account_state *account,
+		struct worker_message *message);
 void handle_worker_select_done(struct account_state *account,
 		struct worker_message *message);
 void handle_worker_select_error(struct account_state *account,
@@ -20,6 +24,18 @@ void handle_worker_connect_cert_check(struct account_state *account,
 		struct worker_message *message);
 void handle_worker_mailbox_updated(struct account_state *account,
 		struct worker_message *message);
+void handle_worker_mailbox_status(struct account_state *account,
+		struct worker_message *message);
+void handle_worker_sort_done(struct account_state *account,
+		struct worker_message *message);
+void handle_worker_message_part_progress(struct account_state *account,
+		struct worker_message *message);
+void handle_worker_search_done(struct account_state *account,
+		struct worker_message *message);
+void handle_worker_search_error(struct account_state *account,
+		struct worker_message *message);
+void handle_worker_sort_error(struct account_state *account,
+		struct worker_message *message);
 void handle_worker_message_updated(struct account_state *account,
 		struct worker_message *message);
 void handle_worker_message_deleted(struct account_state *account,
@@ -3,6 +3,10 @@
 
 #include <time.h>
 
-char *parse_imap_date(const char *str, struct tm *time);
+/*
+ * Parses an IMAP date-time into seconds since the epoch and the offset of its
+ * zone in minutes, returning the end of the date or NULL if it isn't one.
+ */
+const char *parse_imap_date(const char *str, time_t *time, short *zone);
 
 #endif
@@ -5,8 +5,10 @@
 
 #include <poll.h>
 #include <stdbool.h>
+#include <time.h>
 
 #include "absocket.h"
+#include "email/flags.h"
 #include "urlparse.h"
 #include "util/hashtable.h"
 #include "util/list.h"
@@ -24,6 +26,19 @@ struct imap_capabilities {
 	bool auth_login;
 	bool idle;
 	bool sasl_ir;
+	bool compress_deflate;
+	bool condstore; // RFC 7162
+	bool qresync; // RFC 7162
+	bool move; // RFC 6851
+	bool uidplus; // RFC 4315
+	bool literal_plus; // RFC 7888
+	bool esearch; // RFC 4731
+	bool sort; // RFC 5256
+	bool thread_references; // RFC 5256
+	bool thread_orderedsubject; // RFC 5256
+	bool list_status; // RFC 5819
+	bool binary; // RFC 3516
+	bool notify; // RFC 5465
 };
 
 enum imap_status {
@@ -37,11 +52,35 @@ enum recv_mode {
 	RECV_IDLE,
 };
 
+enum imap_lane {
+	LANE_INTERACTIVE, // The account's main connection
+	LANE_BULK, // Message bodies
+	LANE_IDLE, // Stays in IDLE on INBOX
+	LANE_COUNT,
+};
+
+enum reconnect_state {
+	RECONNECT_NONE,
+	RECONNECT_WAITING,
+	RECONNECT_CONNECTING,
+	RECONNECT_RESYNCING,
+};
+
 struct imap_connection;
 
 typedef void (*imap_callback_t)(struct imap_connection *imap,
 		void *data, enum imap_status status, const char *args);
 
+struct imap_pending_callback {
+	bool active;
+	unsigned int tag;
+	struct timespec sent;
+	imap_callback_t callback;
+	void *data;
+};
+
+#define IMAP_LATENCY_BUCKETS 12
+
 struct mailbox_flag {
 	char *name;
 	bool permanent;
@@ -65,29 +104,53 @@ struct message_part {
 struct mailbox_message {
 	bool fetching, populated;
 	int index;
-	long uid;
-	list_t *flags, *headers;
-	struct tm *internal_date;
+	long uid, size;
+	uint64_t flags;
+	struct email_headers *headers;
+	time_t internal_date;
+	/* Minutes east of UTC, for showing internal_date as the server did */
+	short internal_zone;
 	char *multipart_type;
 	list_t *parts;
 };
 
 struct mailbox {
 	list_t *flags;
+	struct keyword_table keywords;
 	list_t *messages;
 	char *name;
 	long exists, recent, unseen;
 	long nextuid; // Predicted, not definite
+	long uidvalidity;
 	bool read_write;
 	bool selected;
 };
 
+struct imap_range {
+	long min, max;
+};
+
 struct imap_connection {
 	struct {
 		void (*mailbox_updated)(struct imap_connection *, struct mailbox *mbox);
 		void (*mailbox_deleted)(struct imap_connection *, const char *name);
 		void (*message_updated)(struct imap_connection *, struct mailbox_message *);
 		void (*message_deleted)(struct imap_connection *, struct mailbox_message *);
+		/* error is NULL if the connection succeeded */
+		void (*connected)(struct imap_connection *, const char *error);
+		/* The socket is already gone and pending commands have failed */
+		void (*disconnected)(struct imap_connection *, const char *error);
+		/* A lane was told about a change it leaves to the main connection */
+		void (*lane_update)(struct imap_connection *, const char *cmd);
+		/* STATUS changed the counts of a mailbox other than the selected one */
+		void (*mailbox_status)(struct imap_connection *, struct mailbox *mbox);
+		/*
+		 * Part of a message part arrived from a partial fetch, decoded if it
+		 * came from BINARY
+		 */
+		void (*part_chunk)(struct imap_connection *, struct mailbox_message *,
+				size_t part, size_t offset, const char *data, size_t len,
+				bool decoded);
 	} events;
 
 	void *data;
@@ -95,18 +158,101 @@ struct imap_connection {
 	struct timespec idle_start;
 	struct timespec last_network;
 	absocket_t *socket;
+	int socket_flags;
+	bool use_ssl;
+	/* For timing the greeting and login, reported once connected */
+	struct timespec connect_mark;
+	double greeting_time;
+	bool compress_pending;
 	enum recv_mode mode;
 	char *line;
 	int line_index, line_size;
+	/* Commands queued by imap_send, written once per imap_receive */
+	char *out;
+	size_t out_len, out_size;
+	/* out has credentials in it and is wiped once it's been sent */
+	bool out_sensitive;
 	struct pollfd poll[1];
-	int next_tag;
-	hashtable_t *pending;
+	unsigned int next_tag;
+	/* Outstanding commands, indexed by tag modulo pending_size */
+	struct imap_pending_callback *pending;
+	size_t pending_size;
+	struct imap_pending_callback greeting;
+	/* Called once the handshake imap_starttls started is done */
+	struct imap_pending_callback starttls;
+	/* The [code] on the tagged reply whose callback is running, if any */
+	const char *resp_code;
+	/* Round trip times, bucket i counts replies that took under 2^i ms */
+	unsigned long latency[IMAP_LATENCY_BUCKETS];
 	struct imap_capabilities *cap;
+	/*
+	 * cap is a guess, from the cache or from before we logged in, and the
+	 * server hasn't confirmed it yet
+	 */
+	bool cap_cached;
 	struct imap_state *state;
 	struct uri *uri;
 	list_t *mailboxes;
 	char *selected;
 	list_t *select_queue;
+	/* Large message parts coming in a chunk at a time, see worker/download.c */
+	list_t *downloads;
+	/* What the last SEARCH or ESEARCH found, for its callback to take */
+	struct {
+		/* Sequence numbers in ascending, non-overlapping ranges */
+		struct imap_range *ranges;
+		size_t length, size;
+		long count;
+	} searched;
+	/* What the last SORT or THREAD said, for its callback to take */
+	struct {
+		long *seq;
+		/* Only for THREAD, how many replies deep each message is */
+		unsigned char *depth;
+		size_t length, size;
+	} sorted;
+	/* Managed by the worker, see imap/worker/reconnect.c */
+	struct {
+		/* Set once we've logged in for the first time */
+		bool enabled;
+		enum reconnect_state state;
+		int attempts;
+		struct timespec next_attempt;
+		/*
+		 * What the server offered before we logged in last time, after
+		 * STARTTLS if we used it, so only reused on a connection with TLS
+		 */
+		struct imap_capabilities *cap;
+		/* Actions that arrived while we were offline */
+		list_t *deferred;
+	} reconnect;
+	/* Extra connections for the same account, see imap/worker/lanes.c */
+	struct {
+		enum imap_lane type;
+		/* How many connections (including this one) the user allows */
+		int wanted;
+		bool ready, dead;
+		/*
+		 * Set on lanes other than LANE_INTERACTIVE. They share its mailboxes
+		 * but leave keeping them up to date to it.
+		 */
+		struct imap_connection *primary;
+		struct imap_connection *open[LANE_COUNT];
+		/* The IDLE lane is watching our mailbox, so we needn't */
+		bool idle_covered;
+		/* The IDLE lane asked us to NOOP and we haven't heard back yet */
+		bool nudged;
+	} lanes;
+	/* Managed by the worker, see imap/worker/watch.c */
+	struct {
+		/* Set once the mailboxes have been listed */
+		bool started;
+		/* The server sends us STATUS for other mailboxes as they change */
+		bool notify;
+		/* Seconds between polls from poll-interval, 0 for the default */
+		int interval;
+		struct timespec next_poll;
+	} watch;
 };
 
 enum imap_type {
@@ -123,6 +269,8 @@ struct imap_arg {
 	enum imap_type type;
 	struct imap_arg *next;
 	char *str;
+	/* The length of str for IMAP_STRING, which can hold NULs from ~{n} */
+	size_t len;
 	long num;
 	struct imap_arg *list;
 	char *original;
@@ -133,17 +281,69 @@ void imap_arg_free(imap_arg_t *args);
 
 bool imap_connect(struct imap_connection *imap, const struct uri *uri,
 		bool use_ssl, imap_callback_t callback, void *data);
+#ifdef USE_OPENSSL
+/*
+ * Upgrades the connection to TLS after the server's OK to STARTTLS. callback
+ * gets STATUS_OK once the handshake is done, a failed one disconnects.
+ */
+bool imap_starttls(struct imap_connection *imap, imap_callback_t callback,
+		void *data);
+#endif
+/* Drops the connection, failing pending commands, and raises disconnected */
+void imap_disconnect(struct imap_connection *imap, const char *error);
+/* Opens a new socket to imap->uri after the old one was lost */
+bool imap_reconnect(struct imap_connection *imap, imap_callback_t callback,
+		void *data);
 int imap_receive(struct imap_connection *imap);
 void imap_send(struct imap_connection *imap, imap_callback_t callback,
 		void *data, const char *fmt, ...);
 void imap_close(struct imap_connection *imap);
+/* For callbacks, whether their reply came with [name ...], e.g. CAPABILITY */
+bool imap_resp_code_is(struct imap_connection *imap, const char *name);
 
 void imap_list(struct imap_connection *imap, imap_callback_t callback,
 		void *data, const char *refname, const char *boxname);
+/* LIST with RETURN (STATUS ...), needs cap->list_status */
+void imap_list_status(struct imap_connection *imap, imap_callback_t callback,
+		void *data, const char *refname, const char *boxname);
+/* Don't ask for the selected mailbox, SELECT already keeps it up to date */
+void imap_status(struct imap_connection *imap, imap_callback_t callback,
+		void *data, const char *mailbox);
+/* Asks for STATUS on changes to any personal mailbox, needs cap->notify */
+void imap_notify(struct imap_connection *imap, imap_callback_t callback,
+		void *data);
 void imap_capability(struct imap_connection *imap, imap_callback_t callback,
 		void *data);
+/* Space separated capability names, for caching */
+char *imap_capabilities_format(const struct imap_capabilities *cap);
+struct imap_capabilities *imap_capabilities_parse(const char *str);
+void imap_compress(struct imap_connection *imap, imap_callback_t callback,
+		void *data);
 void imap_select(struct imap_connection *imap, imap_callback_t callback,
 		void *data, const char *mailbox);
+/*
+ * Selects imap->selected again after reconnecting, keeping the messages we
+ * already know about if the server's UIDVALIDITY, UIDNEXT and EXISTS show that
+ * none of them were expunged in the meantime.
+ */
+void imap_resync(struct imap_connection *imap, imap_callback_t callback,
+		void *data);
+/* RFC 5256, results go in imap->sorted as sequence numbers */
+void imap_sort(struct imap_connection *imap, imap_callback_t callback,
+		void *data, const char *criteria);
+void imap_thread(struct imap_connection *imap, imap_callback_t callback,
+		void *data, const char *algorithm);
+void imap_sorted_clear(struct imap_connection *imap);
+/*
+ * Turns a query like 'from:alice subject:"lunch plans" since:2024-01-01
+ * -is:read' into IMAP search keys. Returns NULL and sets error if it can't.
+ */
+char *imap_search_compile(const char *query, bool literal_plus,
+		const char **error);
+/* Results go in imap->searched, using ESEARCH if the server has it */
+void imap_search(struct imap_connection *imap, imap_callback_t callback,
+		void *data, const char *keys);
+void imap_searched_clear(struct imap_connection *imap);
 void imap_fetch(struct imap_connection *imap, imap_callback_t callback,
 		void *data, size_t min, size_t max, const char *what);
 void imap_delete(struct imap_connection *imap, imap_callback_t callback,
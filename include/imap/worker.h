@@ -7,7 +7,40 @@
 void *imap_worker(void *_pipe);
 struct aerc_mailbox *serialize_mailbox(struct mailbox *source);
 struct aerc_message *serialize_message(struct mailbox_message *source);
+void handle_message(struct worker_pipe *pipe, struct worker_message *message);
+bool imap_worker_login(struct imap_connection *imap, imap_callback_t callback,
+		void *data);
+void fetch_message_part(struct imap_connection *imap, int index, int part);
+// Downloading large parts in chunks
+bool imap_worker_download_part(struct imap_connection *imap, int index,
+		int part);
+void imap_worker_resume_downloads(struct imap_connection *imap);
+void imap_worker_cancel_downloads(struct imap_connection *imap);
+// Lanes
+void imap_worker_open_lanes(struct imap_connection *imap);
+void imap_worker_close_lanes(struct imap_connection *imap);
+bool imap_worker_lanes(struct worker_pipe *pipe);
+bool imap_worker_route(struct worker_pipe *pipe, struct worker_message *message);
+/* The given lane, if it's logged in, or NULL */
+struct imap_connection *imap_worker_lane(struct imap_connection *imap,
+		enum imap_lane type);
+/* The bulk lane, with the main connection's mailbox selected, or NULL */
+struct imap_connection *imap_worker_bulk_lane(struct imap_connection *imap);
+// Unread counts for other mailboxes
+void imap_worker_watch_start(struct imap_connection *imap, bool listed);
+bool imap_worker_watch(struct worker_pipe *pipe);
+// Reconnecting
+bool imap_worker_reconnect(struct worker_pipe *pipe);
+bool imap_worker_defer_action(struct worker_pipe *pipe,
+		struct worker_message *message);
+void imap_resync_after_reconnect(struct imap_connection *imap, char *summary);
+// IMAP events
+void handle_imap_connected(struct imap_connection *imap, const char *error);
+void handle_imap_disconnected(struct imap_connection *imap, const char *error);
+void handle_imap_ready(struct imap_connection *imap, void *data,
+		enum imap_status status, const char *args);
 // Worker handlers
+void handle_worker_configure(struct worker_pipe *pipe, struct worker_message *message);
 void handle_worker_connect(struct worker_pipe *pipe, struct worker_message *message);
 void handle_worker_cert_okay(struct worker_pipe *pipe, struct worker_message *message);
 void handle_worker_list(struct worker_pipe *pipe, struct worker_message *message);
@@ -15,9 +48,12 @@ void handle_worker_select_mailbox(struct worker_pipe *pipe, struct worker_messag
 void handle_worker_create_mailbox(struct worker_pipe *pipe, struct worker_message *message);
 void handle_worker_fetch_messages(struct worker_pipe *pipe, struct worker_message *message);
 void handle_worker_fetch_message_part(struct worker_pipe *pipe, struct worker_message *message);
+void handle_worker_cancel_message_part(struct worker_pipe *pipe, struct worker_message *message);
 void handle_worker_delete_mailbox(struct worker_pipe *pipe, struct worker_message *message);
 void handle_worker_delete_message(struct worker_pipe *pipe, struct worker_message *message);
 void handle_worker_copy_message(struct worker_pipe *pipe, struct worker_message *message);
 void handle_worker_move_message(struct worker_pipe *pipe, struct worker_message *message);
+void handle_worker_sort_mailbox(struct worker_pipe *pipe, struct worker_message *message);
+void handle_worker_search_mailbox(struct worker_pipe *pipe, struct worker_message *message);
 
 #endif
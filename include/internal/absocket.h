@@ -0,0 +1,45 @@
+#ifndef _INTERNAL_ABSOCKET_H
+#define _INTERNAL_ABSOCKET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <unistd.h>
+
+struct absocket_timings;
+
+/*
+ * Resolves a host and races connections to its addresses (RFC 8305). DNS and
+ * TCP times are written to timings as they become known.
+ */
+struct ab_eyeballs;
+struct ab_eyeballs *ab_eyeballs_new(const char *hostname, const char *port,
+		struct absocket_timings *timings);
+void ab_eyeballs_free(struct ab_eyeballs *eyeballs);
+/*
+ * Waits up to timeout ms for progress. Returns the connected (non-blocking) fd,
+ * -1 if we're still trying, or -2 if every address failed.
+ */
+int ab_eyeballs_poll(struct ab_eyeballs *eyeballs, int timeout);
+const char *ab_eyeballs_error(struct ab_eyeballs *eyeballs);
+
+#ifdef USE_IO_URING
+/*
+ * io_uring backend for absocket. Receives go through a single multishot recv
+ * into a ring of kernel-provided buffers, and sends are staged in userspace
+ * and submitted together by ab_uring_flush.
+ */
+struct ab_uring;
+
+/* Returns NULL if io_uring is unavailable, in which case use plain syscalls */
+struct ab_uring *ab_uring_new(int fd);
+/* Flushes staged sends and waits for outstanding requests before freeing */
+void ab_uring_free(struct ab_uring *uring);
+/* Never blocks, fails with EAGAIN if nothing has been received yet */
+ssize_t ab_uring_recv(struct ab_uring *uring, void *buffer, size_t len);
+/* Stages data for the next flush, always takes the whole buffer */
+ssize_t ab_uring_send(struct ab_uring *uring, const void *buffer, size_t len);
+int ab_uring_flush(struct ab_uring *uring);
+bool ab_uring_pending(struct ab_uring *uring);
+#endif
+
+#endif
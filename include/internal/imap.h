@@ -1,15 +1,11 @@
 #ifndef _INTERNAL_IMAP_H
 #define _INTERNAL_IMAP_H
 
+#include <stdbool.h>
 #include <stdio.h>
 
 #include "imap/imap.h"
 
-struct imap_pending_callback {
-	imap_callback_t callback;
-	void *data;
-};
-
 int handle_line(struct imap_connection *imap, imap_arg_t *arg);
 
 void init_status_handlers();
@@ -21,10 +17,22 @@ void handle_imap_list(struct imap_connection *imap, const char *token,
 		const char *cmd, imap_arg_t *args);
 void handle_imap_flags(struct imap_connection *imap, const char *token,
 		const char *cmd, imap_arg_t *args);
+void handle_imap_search(struct imap_connection *imap, const char *token,
+		const char *cmd, imap_arg_t *args);
+void handle_imap_esearch(struct imap_connection *imap, const char *token,
+		const char *cmd, imap_arg_t *args);
+void handle_imap_sort(struct imap_connection *imap, const char *token,
+		const char *cmd, imap_arg_t *args);
+void handle_imap_thread(struct imap_connection *imap, const char *token,
+		const char *cmd, imap_arg_t *args);
+void handle_imap_mailbox_status(struct imap_connection *imap,
+		const char *token, const char *cmd, imap_arg_t *args);
 void handle_imap_existsunseenrecent(struct imap_connection *imap,
 		const char *token, const char *cmd, imap_arg_t *args);
 void handle_imap_uidnext(struct imap_connection *imap, const char *token,
 		const char *cmd, imap_arg_t *args);
+void handle_imap_uidvalidity(struct imap_connection *imap, const char *token,
+		const char *cmd, imap_arg_t *args);
 void handle_imap_readwrite(struct imap_connection *imap, const char *token,
 		const char *cmd, imap_arg_t *args);
 void handle_imap_fetch(struct imap_connection *imap, const char *token,
@@ -37,13 +45,23 @@ void handle_imap_expunge(struct imap_connection *imap, const char *token,
  * arg string). Returns the number of bytes used from the string.
  */
 int imap_parse_args(const char *str, imap_arg_t *args, int *remaining);
+/* The same, for input that may have NULs in its literals */
+int imap_parse_args_n(const char *str, size_t len, imap_arg_t *args,
+		int *remaining);
 void print_imap_args(FILE *f, imap_arg_t *args, int indent);
 char *serialize_args(const imap_arg_t *args);
 
 /*
  * Utility functions
  */
-struct imap_pending_callback *make_callback(imap_callback_t callback, void *data);
+/* Assigns the next tag to a command and remembers its callback */
+unsigned int imap_pending_push(struct imap_connection *imap,
+		imap_callback_t callback, void *data);
+/* Finds and forgets the command a tagged response is for */
+bool imap_pending_pop(struct imap_connection *imap, const char *token,
+		struct imap_pending_callback *out);
+/* Fails SELECTs that were queued behind one that was in flight */
+void abort_select_queue(struct imap_connection *imap, const char *error);
 struct mailbox *get_mailbox(struct imap_connection *imap, const char *name);
 struct mailbox *get_or_make_mailbox(struct imap_connection *imap,
 		const char *name);
@@ -53,5 +71,7 @@ struct mailbox_message *get_message(struct mailbox *mbox, long index);
 void mailbox_free(struct mailbox *mbox);
 void mailbox_message_free(struct mailbox_message *msg);
 void message_part_free(struct message_part *msg);
+/* Undoes the transfer encoding and converts the content to UTF-8 */
+void message_part_decode(struct message_part *part, bool decoded);
 
 #endif
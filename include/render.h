@@ -17,7 +17,8 @@ void render_account_bar(struct geometry geo);
 void render_sidebar(struct geometry geo);
 void render_status(struct geometry geo);
 void render_items(struct geometry geo);
-void render_item(struct geometry geo, struct aerc_message *message, bool selected);
+void render_item(struct geometry geo, struct aerc_mailbox *mailbox,
+		size_t index, int depth, bool selected);
 void render_message_view(struct geometry geo);
 
 #endif
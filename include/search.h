@@ -0,0 +1,9 @@
+#ifndef _SEARCH_H
+#define _SEARCH_H
+
+#include "state.h"
+
+/* Filters the selected mailbox by account->ui.search, or stops filtering */
+void request_search(struct account_state *account);
+
+#endif
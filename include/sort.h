@@ -0,0 +1,13 @@
+#ifndef _SORT_H
+#define _SORT_H
+
+#include <stdbool.h>
+#include "state.h"
+#include "worker.h"
+
+bool parse_sort_key(const char *name, enum aerc_sort_key *key);
+/* Orders the selected mailbox according to account->ui.sort */
+void request_sort(struct account_state *account);
+void sort_locally(struct account_state *account, struct aerc_mailbox *mbox);
+
+#endif
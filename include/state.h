@@ -8,6 +8,7 @@
 #include <poll.h>
 
 #include "bind.h"
+#include "email/headers.h"
 #include "util/list.h"
 #include "worker.h"
 
@@ -48,12 +49,26 @@ struct account_state {
 		size_t selected_message;
 		size_t list_offset;
 		list_t *fetch_requests;
+		struct {
+			enum aerc_sort_key key;
+			bool reverse;
+			/* The server can't sort, so we sort what we've fetched */
+			bool local, dirty;
+		} sort;
+		struct {
+			/* Run again whenever the mailbox changes */
+			char *query;
+			/* Say how many matched once the results are in */
+			bool announce;
+		} search;
 	} ui;
 	
 	struct {
 		struct aerc_message *msg;
 		struct subprocess *term;
 		list_t *processes;
+		/* A large part is coming in, see handle_worker_message_part_progress */
+		bool downloading;
 	} viewer;
 
 	char *name;
@@ -96,9 +111,23 @@ void set_status(struct account_state *account, enum account_status state,
 struct aerc_mailbox *get_aerc_mailbox(struct account_state *account,
 		const char *name);
 void free_aerc_mailbox(struct aerc_mailbox *mbox);
+/* Rows count from the top of the message list */
+size_t get_message_rows(struct aerc_mailbox *mbox);
+size_t get_message_index(struct aerc_mailbox *mbox, size_t row);
+/* SIZE_MAX if the message is filtered out */
+size_t get_message_row(struct aerc_mailbox *mbox, size_t index);
+unsigned char get_message_depth(struct aerc_mailbox *mbox, size_t row);
+/* Takes ownership of order and depth, or goes back to arrival order if NULL */
+void set_message_order(struct aerc_mailbox *mbox, size_t *order,
+		unsigned char *depth, size_t length);
+/* Takes ownership of filter, or shows every message again if NULL */
+void set_message_filter(struct aerc_mailbox *mbox, struct aerc_range *filter,
+		size_t length);
+/* Keeps the order and filter after the message at index was expunged */
+void remove_message_order(struct aerc_mailbox *mbox, size_t index);
 void free_aerc_message(struct aerc_message *msg);
-const char *get_message_header(struct aerc_message *msg, char *key);
-bool get_message_flag(struct aerc_message *msg, char *flag);
+const char *get_message_header(struct aerc_message *msg, enum header_id id);
+bool get_message_flag(struct aerc_message *msg, uint64_t flag);
 bool get_mailbox_flag(struct aerc_mailbox *mbox, char *flag);
 struct account_config *config_for_account(const char *name);
 
@@ -20,7 +20,12 @@ int __wrap_ab_recv(absocket_t *socket, void *buffer, size_t len);
 int run_tests_urlparse();
 int run_tests_imap();
 int run_tests_headers();
+int run_tests_encodings();
 int run_tests_bind();
 int run_tests_subprocess();
+int run_tests_base64();
+int run_tests_unicode();
+int run_tests_columns();
+int run_tests_date();
 
 #endif
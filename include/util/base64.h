@@ -31,10 +31,37 @@
 #ifndef BASE64_H
 #define BASE64_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 char *b64_encode(const char* binaryData, size_t len, size_t *flen);
+/* *flen is set to the exact length of the result, which is NUL terminated */
 unsigned char *b64_decode(const char *ascii, size_t len, size_t *flen);
 
+/*
+ * Decodes base64 a piece at a time, as it comes in. Line breaks may fall
+ * anywhere, and decoding stops at the padding or at anything else that isn't
+ * base64.
+ */
+struct b64_decoder {
+	uint32_t bits;
+	int count;
+	bool done;
+};
+
+/* The room to leave for decoding len bytes, with b64_decoder_finish */
+#define B64_DECODE_SIZE(len) ((len) / 4 * 3 + 16)
+
+void b64_decoder_init(struct b64_decoder *decoder);
+/*
+ * Returns the number of bytes written to dst. The output is never further
+ * along than the input, so dst may be src.
+ */
+size_t b64_decoder_update(struct b64_decoder *decoder, const char *src,
+		size_t len, unsigned char *dst);
+/* Writes out whatever was left over for lack of padding */
+size_t b64_decoder_finish(struct b64_decoder *decoder, unsigned char *dst);
+
 #endif
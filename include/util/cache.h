@@ -0,0 +1,20 @@
+#ifndef _UTIL_CACHE_H
+#define _UTIL_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Returns the path for "name" in aerc's cache directory, creating the directory
+ * if necessary. Characters that don't belong in a file name are replaced.
+ */
+char *get_cache_path(const char *name);
+/*
+ * Reads an entire cache file, or returns NULL. Files readable by anyone else
+ * are ignored, since the cache may hold secrets.
+ */
+void *read_cache_file(const char *path, size_t *len);
+/* Atomically replaces a cache file, readable only by the user */
+bool write_cache_file(const char *path, const void *data, size_t len);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef _UTIL_SCAN_H
+#define _UTIL_SCAN_H
+
+/* The most characters scan_find can look for at once */
+#define SCAN_SET_MAX 4
+
+/*
+ * Returns the first character in [str, end) that's in set or is NUL, or end
+ * if there isn't one.
+ */
+const char *scan_find(const char *str, const char *end, const char *set);
+/* scan_find a byte at a time, which it falls back on for the last few bytes */
+const char *scan_find_scalar(const char *str, const char *end,
+		const char *set);
+/* Returns the first byte in [str, end) that isn't ASCII, or end */
+const char *scan_ascii(const char *str, const char *end);
+/*
+ * Returns the first byte in [str, end) that isn't printable ASCII or a line
+ * break, or end
+ */
+const char *scan_printable(const char *str, const char *end);
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef _SWAY_STRINGOP_H
 #define _SWAY_STRINGOP_H
 
+#include <stdbool.h>
 #include "list.h"
 
 #if !HAVE_DECL_SETENV
@@ -20,6 +21,8 @@ void strip_quotes(char *str);
 // strcmp that also handles null pointers.
 int lenient_strcmp(const void *a, const void *b);
 int is_prefix_of(const char *prefix, const char *str);
+// True for yes, true, on, enable(d) and 1, in any case
+bool parse_boolean(const char *value);
 
 // Simply split a string with delims, free with `free_flat_list`
 list_t *split_string(const char *str, const char *delims);
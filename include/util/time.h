@@ -4,5 +4,7 @@
 #include "state.h"
 
 void get_nanoseconds(struct timespec *tp);
+/* Milliseconds since a timestamp from get_nanoseconds */
+double get_elapsed_ms(const struct timespec *since);
 
 #endif
@@ -35,4 +35,11 @@ size_t utf8_chsize(uint32_t ch);
  */
 size_t utf8_strlen(const char *str);
 
+/**
+ * Copies UTF-8 text without control characters (other than line breaks), DEL
+ * or zero width spaces, and with U+FFFD for anything that isn't valid UTF-8.
+ * The result is NUL terminated and *outlen is set to its length.
+ */
+char *utf8_sanitize(const char *str, size_t len, size_t *outlen);
+
 #endif
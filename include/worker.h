@@ -3,11 +3,13 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <time.h>
 
 #ifdef USE_OPENSSL
 #include <openssl/ossl_typ.h>
 #endif
 
+#include "email/flags.h"
 #include "util/aqueue.h"
 #include "util/list.h"
 
@@ -32,6 +34,8 @@ enum worker_message_type {
 	WORKER_CONNECT,
 	WORKER_CONNECT_DONE,
 	WORKER_CONNECT_ERROR,
+	WORKER_DISCONNECTED,
+	WORKER_RECONNECT_DONE,
 #ifdef USE_OPENSSL
 	WORKER_CONNECT_CERT_CHECK,
 	WORKER_CONNECT_CERT_OKAY,
@@ -48,9 +52,18 @@ enum worker_message_type {
 	WORKER_CREATE_MAILBOX,
 	WORKER_MAILBOX_DELETED,
 	WORKER_MAILBOX_UPDATED,
+	WORKER_MAILBOX_STATUS,
+	WORKER_SORT_MAILBOX,
+	WORKER_SORT_MAILBOX_DONE,
+	WORKER_SORT_MAILBOX_ERROR,
+	WORKER_SEARCH_MAILBOX,
+	WORKER_SEARCH_MAILBOX_DONE,
+	WORKER_SEARCH_MAILBOX_ERROR,
 	/* Messages */
 	WORKER_FETCH_MESSAGES,
 	WORKER_FETCH_MESSAGE_PART,
+	WORKER_MESSAGE_PART_PROGRESS,
+	WORKER_CANCEL_MESSAGE_PART,
 	WORKER_MESSAGE_UPDATED,
 	WORKER_DELETE_MESSAGE,
 	WORKER_MESSAGE_DELETED,
@@ -78,6 +91,12 @@ struct fetch_part_request {
 	int part;
 };
 
+struct aerc_part_progress {
+	int index, part;
+	size_t received, total;
+	bool done, cancelled;
+};
+
 struct message_range {
 	int min, max;
 };
@@ -87,6 +106,50 @@ struct aerc_message_update {
 	struct aerc_message *message;
 };
 
+/* New counts for a mailbox that isn't selected */
+struct aerc_mailbox_status {
+	char *name;
+	long exists, recent, unseen;
+};
+
+enum aerc_sort_key {
+	SORT_NONE,
+	SORT_ARRIVAL,
+	SORT_DATE,
+	SORT_FROM,
+	SORT_SUBJECT,
+	SORT_SIZE,
+	SORT_THREAD,
+};
+
+struct aerc_sort_request {
+	enum aerc_sort_key key;
+	/* Largest first is the default, like the unsorted list */
+	bool reverse;
+};
+
+struct aerc_sort_result {
+	char *mailbox;
+	size_t length;
+	/* order[row] is the index of the message shown there, top row first */
+	size_t *order;
+	/* How far each row is into its thread, NULL unless threaded */
+	unsigned char *depth;
+};
+
+/* Message indexes from min to max, inclusive */
+struct aerc_range {
+	size_t min, max;
+};
+
+struct aerc_search_result {
+	char *mailbox;
+	/* In ascending order, with no two touching */
+	struct aerc_range *ranges;
+	size_t length;
+	size_t count;
+};
+
 struct aerc_message_delete {
 	int index;
 };
@@ -104,14 +167,21 @@ struct aerc_message_part {
 	char *body_encoding;
 	long size;
 	uint8_t *content; // Note: do not free this, you don't own it
+	/* content without control characters, made when it's first viewed */
+	uint8_t *filtered;
+	size_t filtered_size;
 };
 
 struct aerc_message {
 	bool fetching, fetched;
 	int index;
-	long uid;
-	list_t *flags, *headers, *parts;
-	struct tm *internal_date;
+	long uid, size;
+	uint64_t flags;
+	list_t *parts;
+	struct email_headers *headers;
+	time_t internal_date;
+	/* Minutes east of UTC, for showing internal_date as the server did */
+	short internal_zone;
 };
 
 struct aerc_mailbox {
@@ -120,7 +190,23 @@ struct aerc_mailbox {
 	bool selected;
 	long exists, recent, unseen;
 	list_t *flags;
+	struct keyword_table keywords;
 	list_t *messages;
+	/* What the message list shows, see get_message_columns */
+	struct message_columns *columns;
+	/* Set by sorting, see set_message_order */
+	size_t *order, *rows;
+	unsigned char *depth;
+	size_t order_length;
+	/* Set by searching, see set_message_filter */
+	struct aerc_range *filter;
+	size_t filter_length;
+	/* The rows that make it through the filter, worked out when needed */
+	struct {
+		size_t *order, *rows;
+		size_t length, total;
+		bool built;
+	} view;
 };
 
 #ifdef USE_OPENSSL
@@ -1,12 +1,15 @@
 /*
  * absocket.c - abstract socket implementation
  *
- * Abstracts reads/writes on a socket to optionally support TLS/SSL
+ * Abstracts reads/writes on a socket to optionally support TLS/SSL and DEFLATE
+ * compression (RFC 4978), and to do the I/O through io_uring or kernel TLS
+ * where available
  */
 #define _POSIX_C_SOURCE 201112LL
 
 #include <errno.h>
-#include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -21,189 +24,692 @@
 #include <assert.h>
 #endif
 
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+
+#if defined(USE_OPENSSL) && defined(SSL_OP_ENABLE_KTLS) \
+	&& !defined(OPENSSL_NO_KTLS)
+#define HAVE_KTLS
+#endif
+
 #include "log.h"
 #include "absocket.h"
+#include "internal/absocket.h"
 #include "urlparse.h"
+#include "util/cache.h"
+#include "util/time.h"
+
+#ifdef USE_ZLIB
+#define DEFLATE_BUFFER_SIZE 4096
+
+struct ab_deflate {
+	z_stream inflate, deflate;
+	/* Compressed bytes read from the wire, not yet inflated */
+	unsigned char *in;
+	size_t in_size;
+	/* Scratch space for compressed output */
+	unsigned char *out;
+	size_t out_size;
+	/* The last inflate filled the caller's buffer and may have more */
+	bool pending_output;
+};
+#endif
+
+#if defined(USE_IO_URING) && defined(USE_OPENSSL)
+/*
+ * Lets OpenSSL do its record I/O through io_uring once the handshake is done.
+ */
+static BIO_METHOD *uring_bio_method = NULL;
+
+static int uring_bio_write(BIO *bio, const char *buffer, int len) {
+	BIO_clear_retry_flags(bio);
+	return ab_uring_send(BIO_get_data(bio), buffer, len);
+}
+
+static int uring_bio_read(BIO *bio, char *buffer, int len) {
+	BIO_clear_retry_flags(bio);
+	ssize_t amt = ab_uring_recv(BIO_get_data(bio), buffer, len);
+	if (amt < 0 && errno == EAGAIN) {
+		BIO_set_retry_read(bio);
+	}
+	return amt;
+}
+
+static long uring_bio_ctrl(BIO *bio, int cmd, long num, void *ptr) {
+	switch (cmd) {
+	case BIO_CTRL_FLUSH:
+		// Sends go out with the next ab_flush
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static int uring_bio_create(BIO *bio) {
+	BIO_set_init(bio, 1);
+	return 1;
+}
+#endif
 
 void abs_init() {
 #ifdef USE_OPENSSL
 	SSL_load_error_strings();
 	SSL_library_init();
+#ifdef USE_IO_URING
+	uring_bio_method = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK,
+			"io_uring");
+	BIO_meth_set_write(uring_bio_method, uring_bio_write);
+	BIO_meth_set_read(uring_bio_method, uring_bio_read);
+	BIO_meth_set_ctrl(uring_bio_method, uring_bio_ctrl);
+	BIO_meth_set_create(uring_bio_method, uring_bio_create);
+#endif
 #endif
 }
 
+static void ab_enable_uring(absocket_t *abs) {
+#ifdef USE_IO_URING
 #ifdef USE_OPENSSL
-
-static bool ab_ssl_negotiate(absocket_t *abs) {
-	SSL_set_mode(abs->ssl, SSL_MODE_AUTO_RETRY);
-	int err;
-	if ((err = SSL_connect(abs->ssl)) != 1) {
-		const char *errmsg;
-		switch (SSL_get_error(abs->ssl, err))
-		{
-		case SSL_ERROR_SYSCALL:
-			errmsg = "I/O error";
-			break;
-		case SSL_ERROR_SSL:
-			errmsg = ERR_error_string(ERR_get_error(), NULL);
-			break;
-		default:
-			errmsg = "Unknown error";
-			break;
+	if (abs->ktls_send || abs->ktls_recv) {
+		// OpenSSL needs its own socket BIO to drive kTLS
+		return;
+	}
+#endif
+	abs->uring = ab_uring_new(abs->basefd);
+#ifdef USE_OPENSSL
+	if (abs->uring && abs->ssl) {
+		BIO *bio = BIO_new(uring_bio_method);
+		if (!bio) {
+			ab_uring_free(abs->uring);
+			abs->uring = NULL;
+			return;
 		}
-		worker_log(L_ERROR, "SSL error %s", errmsg);
-		return false;
+		BIO_set_data(bio, abs->uring);
+		SSL_set_bio(abs->ssl, bio, bio);
 	}
-	/*
-	 * Grabs the certificate because presumably the consumer of this function
-	 * will want it. We don't use it for anything here
-	 */
-	abs->cert = SSL_get_peer_certificate(abs->ssl);
-	if (!abs->cert) {
-		worker_log(L_ERROR, "Unable to get peer certificate");
-		return false;
+#endif
+#endif
+}
+
+static void ab_disable_uring(absocket_t *abs) {
+#ifdef USE_IO_URING
+	ab_uring_free(abs->uring);
+	abs->uring = NULL;
+#endif
+}
+
+#ifdef USE_OPENSSL
+
+static int ab_new_session(SSL *ssl, SSL_SESSION *session) {
+	absocket_t *abs = SSL_get_app_data(ssl);
+	if (!abs->session_path || !SSL_SESSION_is_resumable(session)) {
+		return 0;
 	}
-	worker_log(L_DEBUG, "%s connection established using %s (%s)",
-			SSL_get_version(abs->ssl),
-			SSL_get_cipher_version(abs->ssl),
-			SSL_get_cipher_name(abs->ssl));
-	return true;
+	int len = i2d_SSL_SESSION(session, NULL);
+	if (len <= 0) {
+		return 0;
+	}
+	unsigned char *data = malloc(len), *p = data;
+	i2d_SSL_SESSION(session, &p);
+	if (!write_cache_file(abs->session_path, data, len)) {
+		worker_log(L_DEBUG, "Unable to save TLS session");
+	}
+	free(data);
+	// We didn't keep a reference
+	return 0;
 }
 
-bool ab_enable_ssl(absocket_t *abs) {
-	/*
-	 * This function assumes that the connection has already been established,
-	 * it just does the SSL stuff.
-	 */
+static void ab_load_session(absocket_t *abs) {
+	size_t len;
+	unsigned char *data;
+	if (!abs->session_path
+			|| !(data = read_cache_file(abs->session_path, &len))) {
+		return;
+	}
+	const unsigned char *p = data;
+	SSL_SESSION *session = d2i_SSL_SESSION(NULL, &p, len);
+	free(data);
+	if (!session) {
+		return;
+	}
+	if (SSL_SESSION_is_resumable(session)) {
+		/*
+		 * Early data could be replayed, which is never okay for IMAP commands.
+		 * We don't send any, but make sure the session won't offer it either.
+		 */
+		SSL_SESSION_set_max_early_data(session, 0);
+		SSL_set_session(abs->ssl, session);
+	}
+	SSL_SESSION_free(session);
+}
+
+static bool ab_ssl_setup(absocket_t *abs) {
 	long ssl_options = 0;
 	abs->ctx = SSL_CTX_new(SSLv23_client_method());
 	if (!abs->ctx) {
 		worker_log(L_ERROR, "Unable to allocate SSL context");
-		goto bail_abs;
+		return false;
 	}
 	// TODO: Make ssl_options customizable
 	ssl_options |= SSL_OP_NO_SSLv3 | SSL_OP_NO_SSLv2;
+#ifdef HAVE_KTLS
+	if (abs->flags & AB_KTLS) {
+		/*
+		 * OpenSSL quietly keeps the records in userspace if the kernel or the
+		 * negotiated cipher don't support kTLS, so this is always safe to ask.
+		 */
+		ssl_options |= SSL_OP_ENABLE_KTLS;
+	}
+#endif
 	if (!SSL_CTX_set_options(abs->ctx, ssl_options)) {
 		worker_log(L_ERROR, "Unable to set SSL options");
-		goto bail_sslctx;
+		return false;
 	}
 	// TODO: client certificates
 	//SSL_CTX_set_cipher_list(abs->ctx, ""); // TODO: configurable
+	/*
+	 * Sessions are kept on disk rather than in the context, so they survive
+	 * reconnects and restarts.
+	 */
+	SSL_CTX_set_session_cache_mode(abs->ctx,
+			SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(abs->ctx, ab_new_session);
 	abs->ssl = SSL_new(abs->ctx);
 	if (!abs->ssl) {
 		worker_log(L_ERROR, "Unable to allocate SSL");
-		goto bail_sslctx;
+		return false;
+	}
+	SSL_set_app_data(abs->ssl, abs);
+	SSL_set_mode(abs->ssl, SSL_MODE_AUTO_RETRY);
+	if (abs->hostname) {
+		SSL_set_tlsext_host_name(abs->ssl, abs->hostname);
 	}
+	ab_load_session(abs);
 	if (SSL_set_fd(abs->ssl, abs->basefd) != 1) {
 		worker_log(L_ERROR, "Unable to set SSL fd");
-		goto bail_ssl;
+		return false;
+	}
+	get_nanoseconds(&abs->handshake_start);
+	return true;
+}
+
+static void ab_ssl_cleanup(absocket_t *abs) {
+	SSL_free(abs->ssl);
+	SSL_CTX_free(abs->ctx);
+	abs->ssl = NULL;
+	abs->ctx = NULL;
+}
+
+/*
+ * Returns 1 when the handshake is done, 0 if it's waiting on the network and -1
+ * on failure. Waits up to timeout ms on a non-blocking socket.
+ */
+static int ab_ssl_handshake(absocket_t *abs, int timeout) {
+	int ret = SSL_connect(abs->ssl);
+	if (ret == 1) {
+		return 1;
+	}
+	const char *errmsg;
+	int err = SSL_get_error(abs->ssl, ret);
+	switch (err)
+	{
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:;
+		struct pollfd pfd = {
+			.fd = abs->basefd,
+			.events = err == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT,
+		};
+		if (timeout != 0 && poll(&pfd, 1, timeout) > 0) {
+			return ab_ssl_handshake(abs, 0);
+		}
+		return 0;
+	case SSL_ERROR_SYSCALL:
+		errmsg = "I/O error";
+		break;
+	case SSL_ERROR_SSL:
+		errmsg = ERR_error_string(ERR_get_error(), NULL);
+		break;
+	default:
+		errmsg = "Unknown error";
+		break;
 	}
-	if (!ab_ssl_negotiate(abs)) {
-		goto bail_ssl;
+	worker_log(L_ERROR, "SSL error %s", errmsg);
+	return -1;
+}
+
+static bool ab_ssl_finish(absocket_t *abs) {
+	abs->timings.tls = get_elapsed_ms(&abs->handshake_start);
+	/*
+	 * Grabs the certificate because presumably the consumer of this function
+	 * will want it. We don't use it for anything here
+	 */
+	abs->cert = SSL_get_peer_certificate(abs->ssl);
+	if (!abs->cert) {
+		worker_log(L_ERROR, "Unable to get peer certificate");
+		return false;
 	}
+	worker_log(L_DEBUG, "%s connection %s using %s (%s)",
+			SSL_get_version(abs->ssl),
+			SSL_session_reused(abs->ssl) ? "resumed" : "established",
+			SSL_get_cipher_version(abs->ssl),
+			SSL_get_cipher_name(abs->ssl));
+#ifdef HAVE_KTLS
+	abs->ktls_send = BIO_get_ktls_send(SSL_get_wbio(abs->ssl));
+	abs->ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(abs->ssl));
+	if (abs->flags & AB_KTLS) {
+		worker_log(L_DEBUG, "Kernel TLS: send %s, receive %s",
+				abs->ktls_send ? "enabled" : "unavailable",
+				abs->ktls_recv ? "enabled" : "unavailable");
+	}
+#endif
+	return true;
+}
+
+bool ab_enable_ssl(absocket_t *abs) {
+	/*
+	 * This function assumes that the connection has already been established,
+	 * it just starts the SSL stuff, which ab_connect_step finishes like it
+	 * does for a new connection, without ever blocking on the server.
+	 */
+	// OpenSSL talks to the fd directly during the handshake
+	ab_disable_uring(abs);
+	if (!ab_ssl_setup(abs)) {
+		ab_ssl_cleanup(abs);
+		ab_enable_uring(abs);
+		return false;
+	}
+	int flags = fcntl(abs->basefd, F_GETFL);
+	fcntl(abs->basefd, F_SETFL, flags | O_NONBLOCK);
+	abs->use_ssl = true;
+	abs->state = AB_HANDSHAKING;
 	return true;
-bail_ssl:
-	free(abs->ctx);
-bail_sslctx:
-	free(abs->ssl);
-bail_abs:
-	absocket_free(abs);
-	return false;
 }
 
 #endif
 
-absocket_t *absocket_new(const struct uri *uri, bool use_ssl) {
+absocket_t *absocket_new(const struct uri *uri, bool use_ssl, int flags) {
+#ifndef USE_OPENSSL
+	if (use_ssl) {
+		worker_log(L_ERROR, "aerc was compiled without SSL support");
+		return NULL;
+	}
+#endif
 	absocket_t *abs = calloc(1, sizeof(absocket_t));
-
-	struct addrinfo hints;
-	memset(&hints, 0, sizeof(struct addrinfo));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = 0;
-	hints.ai_protocol = 0;
-
-	struct addrinfo *result, *rp;
-	int s;
-	if ((s = getaddrinfo(uri->hostname, uri->port, &hints, &result))) {
-		worker_log(L_ERROR, "Connection failed: %s", gai_strerror(s));
+	abs->basefd = -1;
+	abs->use_ssl = use_ssl;
+	abs->flags = flags;
+#ifdef USE_OPENSSL
+	abs->hostname = strdup(uri->hostname);
+	char *key = malloc(strlen(uri->hostname) + strlen(uri->port)
+			+ (uri->username ? strlen(uri->username) : 0) + 16);
+	sprintf(key, "%s@%s:%s.tls-session", uri->username ? uri->username : "",
+			uri->hostname, uri->port);
+	abs->session_path = get_cache_path(key);
+	free(key);
+#endif
+	abs->state = AB_CONNECTING;
+	abs->eyeballs = ab_eyeballs_new(uri->hostname, uri->port, &abs->timings);
+	if (!abs->eyeballs) {
 		absocket_free(abs);
-		// This might fail becuase i.e. you screwed up the name of the server
 		return NULL;
 	}
+	return abs;
+}
+
+static void ab_connect_failed(absocket_t *abs, const char *error) {
+	worker_log(L_ERROR, "Connection failed: %s", error);
+	abs->error = strdup(error);
+	abs->state = AB_FAILED;
+}
+
+static void ab_connect_done(absocket_t *abs) {
+	// Everything past connecting expects a blocking socket
+	int flags = fcntl(abs->basefd, F_GETFL);
+	fcntl(abs->basefd, F_SETFL, flags & ~O_NONBLOCK);
+	abs->state = AB_CONNECTED;
+	ab_enable_uring(abs);
+}
 
-	int err = -1;
-	for (rp = result; rp != NULL; rp = rp->ai_next) {
-		abs->basefd = socket(rp->ai_family, rp->ai_socktype,
-				rp->ai_protocol);
-		if (abs->basefd == -1) {
-			// This might fail because i.e. you don't support ipv6
-			continue;
+enum absocket_state ab_connect_step(absocket_t *abs, int timeout) {
+	switch (abs->state) {
+	case AB_CONNECTING:;
+		int fd = ab_eyeballs_poll(abs->eyeballs, timeout);
+		if (fd == -1) {
+			break;
 		}
-		if (connect(abs->basefd, rp->ai_addr, rp->ai_addrlen) != -1) {
-			// This might fail because i.e. the server is dead
+		if (fd < 0) {
+			ab_connect_failed(abs, ab_eyeballs_error(abs->eyeballs));
+			ab_eyeballs_free(abs->eyeballs);
+			abs->eyeballs = NULL;
 			break;
 		}
-		err = errno;
-		close(abs->basefd);
-	}
-	if (rp == NULL) {
-		freeaddrinfo(result);
-		worker_log(L_ERROR, "Connection failed: %s", strerror(err));
-		return NULL;
-	}
-	freeaddrinfo(result);
-	abs->use_ssl = use_ssl;
-	if (use_ssl) {
-#ifndef USE_OPENSSL
-		worker_log(L_ERROR, "aerc was compiled without SSL support");
-		absocket_free(abs);
-		return NULL;
-#else
-		if (!ab_enable_ssl(abs)) {
-			absocket_free(abs);
-			return NULL;
+		ab_eyeballs_free(abs->eyeballs);
+		abs->eyeballs = NULL;
+		abs->basefd = fd;
+		if (!abs->use_ssl) {
+			ab_connect_done(abs);
+			break;
+		}
+#ifdef USE_OPENSSL
+		if (!ab_ssl_setup(abs)) {
+			ab_connect_failed(abs, "Unable to set up TLS");
+			break;
+		}
+		abs->state = AB_HANDSHAKING;
+		timeout = 0;
+#endif
+		// fallthrough
+	case AB_HANDSHAKING:
+#ifdef USE_OPENSSL
+		switch (ab_ssl_handshake(abs, timeout)) {
+		case 1:
+			if (!ab_ssl_finish(abs)) {
+				ab_connect_failed(abs, "Invalid certificate");
+				break;
+			}
+			ab_connect_done(abs);
+			break;
+		case -1:
+			ab_connect_failed(abs, "TLS handshake failed");
+			break;
 		}
 #endif
+		break;
+	case AB_CONNECTED:
+	case AB_FAILED:
+		break;
 	}
-	return abs;
+	return abs->state;
 }
 
 void absocket_free(absocket_t *socket) {
 	if (!socket) return;
-	if (socket->use_ssl) {
+#ifdef USE_ZLIB
+	if (socket->deflate) {
+		worker_log(L_DEBUG, "Compression: received %zd bytes (%zd on the wire), "
+				"sent %zd bytes (%zd on the wire)",
+				socket->stats.data_in, socket->stats.wire_in,
+				socket->stats.data_out, socket->stats.wire_out);
+		inflateEnd(&socket->deflate->inflate);
+		deflateEnd(&socket->deflate->deflate);
+		free(socket->deflate->in);
+		free(socket->deflate->out);
+		free(socket->deflate);
+	}
+#endif
 #ifdef USE_OPENSSL
+	if (socket->use_ssl && socket->state == AB_CONNECTED) {
 		SSL_shutdown(socket->ssl);
-		SSL_free(socket->ssl);
-		SSL_CTX_free(socket->ctx);
+	}
+#endif
+	// Flushes anything still staged, including the close_notify
+	ab_disable_uring(socket);
+#ifdef USE_OPENSSL
+	SSL_free(socket->ssl);
+	SSL_CTX_free(socket->ctx);
+	free(socket->hostname);
+	free(socket->session_path);
 #endif
+	ab_eyeballs_free(socket->eyeballs);
+	if (socket->basefd != -1) {
+		close(socket->basefd);
 	}
-	close(socket->basefd);
+	free(socket->error);
 	free(socket);
 }
 
-ssize_t ab_recv(absocket_t *socket, void *buffer, size_t len) {
+static ssize_t ab_raw_recv(absocket_t *socket, void *buffer, size_t len) {
+	ssize_t amt;
 	if (socket->use_ssl) {
 #ifdef USE_OPENSSL
-		return SSL_read(socket->ssl, buffer, len);
+		if (socket->ktls_recv) {
+			amt = recv(socket->basefd, buffer, len, 0);
+			if (amt < 0 && errno == EIO) {
+				/*
+				 * The next record isn't application data (i.e. a session
+				 * ticket), which only OpenSSL knows how to deal with.
+				 */
+				amt = SSL_read(socket->ssl, buffer, len);
+			}
+		} else {
+			amt = SSL_read(socket->ssl, buffer, len);
+		}
+		if (amt <= 0) {
+			// Make OpenSSL's errors look like recv's to the caller
+			switch (SSL_get_error(socket->ssl, amt)) {
+			case SSL_ERROR_WANT_READ:
+			case SSL_ERROR_WANT_WRITE:
+				errno = EAGAIN;
+				amt = -1;
+				break;
+			case SSL_ERROR_ZERO_RETURN:
+				amt = 0;
+				break;
+			case SSL_ERROR_SYSCALL:
+				if (errno == 0) {
+					amt = 0;
+				}
+				break;
+			case SSL_ERROR_SSL:
+				errno = EPROTO;
+				amt = -1;
+				break;
+			}
+		}
 #else
 		assert(false);
 		return -1;
 #endif
 	} else {
-		return recv(socket->basefd, buffer, len, 0);
+#ifdef USE_IO_URING
+		if (socket->uring) {
+			amt = ab_uring_recv(socket->uring, buffer, len);
+		} else
+#endif
+		amt = recv(socket->basefd, buffer, len, 0);
 	}
+	if (amt > 0) {
+		socket->stats.wire_in += amt;
+	}
+	return amt;
 }
 
-ssize_t ab_send(absocket_t *socket, void *buffer, size_t len) {
+static ssize_t ab_raw_send(absocket_t *socket, void *buffer, size_t len) {
+	ssize_t amt;
 	if (socket->use_ssl) {
 #ifdef USE_OPENSSL
-		return SSL_write(socket->ssl, buffer, len);
+		if (socket->ktls_send) {
+			amt = send(socket->basefd, buffer, len, 0);
+		} else {
+			amt = SSL_write(socket->ssl, buffer, len);
+		}
 #else
 		assert(false);
 		return -1;
 #endif
 	} else {
-		return send(socket->basefd, buffer, len, 0);
+#ifdef USE_IO_URING
+		if (socket->uring) {
+			amt = ab_uring_send(socket->uring, buffer, len);
+		} else
+#endif
+		amt = send(socket->basefd, buffer, len, 0);
+	}
+	if (amt > 0) {
+		socket->stats.wire_out += amt;
+	}
+	return amt;
+}
+
+#ifdef USE_ZLIB
+
+bool ab_enable_compress(absocket_t *abs, const void *prefix, size_t len) {
+	struct ab_deflate *z = calloc(1, sizeof(struct ab_deflate));
+	if (!z) {
+		return false;
+	}
+	/* Negative window bits select a raw DEFLATE stream, as per RFC 4978 */
+	if (inflateInit2(&z->inflate, -15) != Z_OK) {
+		worker_log(L_ERROR, "Unable to initialize decompressor");
+		free(z);
+		return false;
+	}
+	if (deflateInit2(&z->deflate, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+				-15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		worker_log(L_ERROR, "Unable to initialize compressor");
+		inflateEnd(&z->inflate);
+		free(z);
+		return false;
+	}
+	z->in_size = len > DEFLATE_BUFFER_SIZE ? len : DEFLATE_BUFFER_SIZE;
+	z->in = malloc(z->in_size);
+	z->out_size = DEFLATE_BUFFER_SIZE;
+	z->out = malloc(z->out_size);
+	memcpy(z->in, prefix, len);
+	z->inflate.next_in = z->in;
+	z->inflate.avail_in = len;
+	abs->deflate = z;
+	worker_log(L_DEBUG, "Enabled DEFLATE compression");
+	return true;
+}
+
+static ssize_t ab_inflate_recv(absocket_t *abs, void *buffer, size_t len) {
+	struct ab_deflate *z = abs->deflate;
+	z->inflate.next_out = buffer;
+	z->inflate.avail_out = len;
+	/*
+	 * With input or output already buffered, ab_pending may have sent the
+	 * caller here without poll() saying the socket is readable, and it's
+	 * blocking.
+	 */
+	bool read = z->inflate.avail_in > 0 || z->pending_output;
+	while (true) {
+		if (z->inflate.avail_in > 0 || z->pending_output) {
+			int ret = inflate(&z->inflate, Z_SYNC_FLUSH);
+			if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+				worker_log(L_ERROR, "Decompression error: %s",
+						z->inflate.msg ? z->inflate.msg : "unknown");
+				errno = EIO;
+				return -1;
+			}
+			z->pending_output = z->inflate.avail_out == 0;
+			if (z->inflate.avail_out < len) {
+				break;
+			}
+		}
+		if (read) {
+			/*
+			 * We only read from the wire once per call, and not at all if we
+			 * came for buffered data, so we never block on a socket the caller
+			 * didn't poll. What we have so far doesn't complete a block yet.
+			 */
+			z->pending_output = false;
+			errno = EAGAIN;
+			return -1;
+		}
+		ssize_t amt = ab_raw_recv(abs, z->in, z->in_size);
+		if (amt <= 0) {
+			return amt;
+		}
+		z->inflate.next_in = z->in;
+		z->inflate.avail_in = amt;
+		read = true;
+	}
+	size_t amt = len - z->inflate.avail_out;
+	abs->stats.data_in += amt;
+	return amt;
+}
+
+static ssize_t ab_deflate_send(absocket_t *abs, void *buffer, size_t len) {
+	struct ab_deflate *z = abs->deflate;
+	z->deflate.next_in = buffer;
+	z->deflate.avail_in = len;
+	do {
+		z->deflate.next_out = z->out;
+		z->deflate.avail_out = z->out_size;
+		deflate(&z->deflate, Z_SYNC_FLUSH);
+		size_t have = z->out_size - z->deflate.avail_out;
+		size_t sent = 0;
+		while (sent < have) {
+			ssize_t amt = ab_raw_send(abs, z->out + sent, have - sent);
+			if (amt <= 0) {
+				return -1;
+			}
+			sent += amt;
+		}
+	} while (z->deflate.avail_out == 0);
+	abs->stats.data_out += len;
+	return len;
+}
+
+#endif
+
+bool ab_pending(absocket_t *socket) {
+	/*
+	 * Returns true if a read would return data without touching the wire,
+	 * which poll() can't tell us about.
+	 */
+	if (!socket) {
+		return false;
+	}
+#ifdef USE_IO_URING
+	if (socket->uring && ab_uring_pending(socket->uring)) {
+		return true;
+	}
+#endif
+#ifdef USE_ZLIB
+	if (socket->deflate && (socket->deflate->inflate.avail_in > 0
+				|| socket->deflate->pending_output)) {
+		return true;
+	}
+#endif
+#ifdef USE_OPENSSL
+	if (socket->use_ssl && SSL_pending(socket->ssl) > 0) {
+		return true;
+	}
+#endif
+	return false;
+}
+
+bool ab_async(absocket_t *socket) {
+#ifdef USE_IO_URING
+	return socket && socket->uring;
+#else
+	return false;
+#endif
+}
+
+int ab_flush(absocket_t *socket) {
+#ifdef USE_IO_URING
+	if (socket && socket->uring) {
+		return ab_uring_flush(socket->uring);
+	}
+#endif
+	return 0;
+}
+
+ssize_t ab_recv(absocket_t *socket, void *buffer, size_t len) {
+#ifdef USE_ZLIB
+	if (socket->deflate) {
+		return ab_inflate_recv(socket, buffer, len);
+	}
+#endif
+	ssize_t amt = ab_raw_recv(socket, buffer, len);
+	if (amt > 0) {
+		socket->stats.data_in += amt;
+	}
+	return amt;
+}
+
+ssize_t ab_send(absocket_t *socket, void *buffer, size_t len) {
+#ifdef USE_ZLIB
+	if (socket->deflate) {
+		return ab_deflate_send(socket, buffer, len);
+	}
+#endif
+	ssize_t amt = ab_raw_send(socket, buffer, len);
+	if (amt > 0) {
+		socket->stats.data_out += amt;
 	}
+	return amt;
 }
@@ -0,0 +1,328 @@
+/*
+ * absocket_connect.c - asynchronous resolution and connection racing
+ *
+ * Implements Happy Eyeballs (RFC 8305): IPv6 and IPv4 lookups run in parallel
+ * on helper threads, and connection attempts alternate between the families,
+ * starting a new one every 250ms until one of them goes through.
+ */
+#define _POSIX_C_SOURCE 201112L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "absocket.h"
+#include "internal/absocket.h"
+#include "log.h"
+#include "util/time.h"
+
+/* RFC 8305 section 3 and 5 */
+#define RESOLUTION_DELAY 50
+#define CONNECTION_ATTEMPT_DELAY 250
+#define MAX_ATTEMPTS 8
+
+enum {
+	FAMILY_INET6,
+	FAMILY_INET,
+	FAMILY_COUNT,
+};
+
+struct lookup {
+	bool done;
+	int error;
+	struct addrinfo *result;
+};
+
+/*
+ * Shared with the lookup threads. getaddrinfo can't be cancelled, so whoever is
+ * done with it last frees it.
+ */
+struct resolver {
+	pthread_mutex_t lock;
+	int refs;
+	char *hostname, *port;
+	/* Written to whenever a lookup finishes, so we can poll for it */
+	int notify[2];
+	struct lookup lookups[FAMILY_COUNT];
+};
+
+struct lookup_job {
+	struct resolver *resolver;
+	int family;
+};
+
+struct ab_eyeballs {
+	struct resolver *resolver;
+	struct absocket_timings *timings;
+	struct timespec start, last_attempt, first_resolved;
+	bool resolved[FAMILY_COUNT];
+	bool connecting;
+	/* An attempt failed, so don't wait to start the next one */
+	bool attempt_now;
+	struct addrinfo *results[FAMILY_COUNT];
+	struct addrinfo *next[FAMILY_COUNT];
+	int prefer;
+	int attempts[MAX_ATTEMPTS];
+	int attempt_count;
+	int last_error;
+	const char *error;
+};
+
+static void resolver_unref(struct resolver *r) {
+	pthread_mutex_lock(&r->lock);
+	bool last = --r->refs == 0;
+	pthread_mutex_unlock(&r->lock);
+	if (!last) {
+		return;
+	}
+	for (int i = 0; i < FAMILY_COUNT; ++i) {
+		if (r->lookups[i].result) {
+			freeaddrinfo(r->lookups[i].result);
+		}
+	}
+	close(r->notify[0]);
+	close(r->notify[1]);
+	pthread_mutex_destroy(&r->lock);
+	free(r->hostname);
+	free(r->port);
+	free(r);
+}
+
+static void *lookup_thread(void *_job) {
+	struct lookup_job *job = _job;
+	struct resolver *r = job->resolver;
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = job->family == FAMILY_INET6 ? AF_INET6 : AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo *result = NULL;
+	int error = getaddrinfo(r->hostname, r->port, &hints, &result);
+	pthread_mutex_lock(&r->lock);
+	r->lookups[job->family].done = true;
+	r->lookups[job->family].error = error;
+	r->lookups[job->family].result = error ? NULL : result;
+	pthread_mutex_unlock(&r->lock);
+	char c = 0;
+	if (write(r->notify[1], &c, 1) == -1) {
+		// The poll timeout will catch it
+	}
+	free(job);
+	resolver_unref(r);
+	return NULL;
+}
+
+static struct resolver *resolver_new(const char *hostname, const char *port) {
+	struct resolver *r = calloc(1, sizeof(struct resolver));
+	if (!r || pipe(r->notify) == -1) {
+		free(r);
+		return NULL;
+	}
+	fcntl(r->notify[0], F_SETFL, O_NONBLOCK);
+	pthread_mutex_init(&r->lock, NULL);
+	r->hostname = strdup(hostname);
+	r->port = strdup(port);
+	r->refs = 1;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (int i = 0; i < FAMILY_COUNT; ++i) {
+		struct lookup_job *job = malloc(sizeof(struct lookup_job));
+		job->resolver = r;
+		job->family = i;
+		pthread_mutex_lock(&r->lock);
+		r->refs++;
+		pthread_mutex_unlock(&r->lock);
+		pthread_t thread;
+		if (pthread_create(&thread, &attr, lookup_thread, job) != 0) {
+			pthread_mutex_lock(&r->lock);
+			r->refs--;
+			r->lookups[i].done = true;
+			r->lookups[i].error = EAI_SYSTEM;
+			pthread_mutex_unlock(&r->lock);
+			free(job);
+		}
+	}
+	pthread_attr_destroy(&attr);
+	return r;
+}
+
+struct ab_eyeballs *ab_eyeballs_new(const char *hostname, const char *port,
+		struct absocket_timings *timings) {
+	struct ab_eyeballs *e = calloc(1, sizeof(struct ab_eyeballs));
+	e->resolver = resolver_new(hostname, port);
+	if (!e->resolver) {
+		free(e);
+		return NULL;
+	}
+	e->timings = timings;
+	get_nanoseconds(&e->start);
+	return e;
+}
+
+void ab_eyeballs_free(struct ab_eyeballs *e) {
+	if (!e) return;
+	for (int i = 0; i < e->attempt_count; ++i) {
+		close(e->attempts[i]);
+	}
+	for (int i = 0; i < FAMILY_COUNT; ++i) {
+		if (e->results[i]) {
+			freeaddrinfo(e->results[i]);
+		}
+	}
+	resolver_unref(e->resolver);
+	free(e);
+}
+
+const char *ab_eyeballs_error(struct ab_eyeballs *e) {
+	return e->error ? e->error : strerror(e->last_error);
+}
+
+static void collect_lookups(struct ab_eyeballs *e) {
+	struct resolver *r = e->resolver;
+	char buf[8];
+	while (read(r->notify[0], buf, sizeof(buf)) == sizeof(buf));
+	pthread_mutex_lock(&r->lock);
+	for (int i = 0; i < FAMILY_COUNT; ++i) {
+		struct lookup *lookup = &r->lookups[i];
+		if (!lookup->done || e->resolved[i]) {
+			continue;
+		}
+		e->resolved[i] = true;
+		e->results[i] = e->next[i] = lookup->result;
+		lookup->result = NULL;
+		if (lookup->error) {
+			worker_log(L_DEBUG, "%s lookup failed: %s",
+					i == FAMILY_INET6 ? "IPv6" : "IPv4",
+					gai_strerror(lookup->error));
+			e->error = gai_strerror(lookup->error);
+		} else if (!e->first_resolved.tv_sec && !e->first_resolved.tv_nsec) {
+			get_nanoseconds(&e->first_resolved);
+		}
+	}
+	pthread_mutex_unlock(&r->lock);
+}
+
+static bool start_attempt(struct ab_eyeballs *e) {
+	while (e->attempt_count < MAX_ATTEMPTS) {
+		struct addrinfo *ai = NULL;
+		for (int k = 0; k < FAMILY_COUNT && !ai; ++k) {
+			int i = (e->prefer + k) % FAMILY_COUNT;
+			if (e->next[i]) {
+				ai = e->next[i];
+				e->next[i] = ai->ai_next;
+				// Alternate families, as per RFC 8305 section 4
+				e->prefer = (i + 1) % FAMILY_COUNT;
+			}
+		}
+		if (!ai) {
+			return false;
+		}
+		int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd == -1) {
+			// This might fail because i.e. you don't support ipv6
+			e->last_error = errno;
+			continue;
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == -1
+				&& errno != EINPROGRESS) {
+			e->last_error = errno;
+			close(fd);
+			continue;
+		}
+		e->attempts[e->attempt_count++] = fd;
+		get_nanoseconds(&e->last_attempt);
+		e->attempt_now = false;
+		return true;
+	}
+	return false;
+}
+
+static void remove_attempt(struct ab_eyeballs *e, int index) {
+	e->attempts[index] = e->attempts[--e->attempt_count];
+}
+
+int ab_eyeballs_poll(struct ab_eyeballs *e, int timeout) {
+	collect_lookups(e);
+	bool all_resolved = e->resolved[FAMILY_INET6] && e->resolved[FAMILY_INET];
+	if (!e->connecting) {
+		/*
+		 * IPv6 goes first, but we don't wait on its lookup for long if the
+		 * IPv4 one is already done.
+		 */
+		bool have_v6 = e->results[FAMILY_INET6] != NULL;
+		bool have_any = have_v6 || e->results[FAMILY_INET] != NULL;
+		if (have_v6 || (have_any && (all_resolved
+					|| get_elapsed_ms(&e->first_resolved) >= RESOLUTION_DELAY))) {
+			e->connecting = true;
+			e->error = NULL;
+			e->timings->dns = get_elapsed_ms(&e->start);
+		} else if (all_resolved) {
+			return -2;
+		}
+	}
+	bool more = e->next[FAMILY_INET6] || e->next[FAMILY_INET];
+	if (e->connecting && more && (e->attempt_count == 0 || e->attempt_now
+				|| get_elapsed_ms(&e->last_attempt) >= CONNECTION_ATTEMPT_DELAY)) {
+		more = start_attempt(e) && (e->next[FAMILY_INET6] || e->next[FAMILY_INET]);
+	}
+	if (e->connecting && e->attempt_count == 0 && !more && all_resolved) {
+		return -2;
+	}
+
+	struct pollfd fds[MAX_ATTEMPTS + 1];
+	int nfds = 0;
+	for (int i = 0; i < e->attempt_count; ++i) {
+		fds[nfds].fd = e->attempts[i];
+		fds[nfds++].events = POLLOUT;
+	}
+	if (!all_resolved) {
+		fds[nfds].fd = e->resolver->notify[0];
+		fds[nfds++].events = POLLIN;
+	}
+	// Wake up in time to start the next attempt
+	if (more && e->attempt_count > 0) {
+		int delay = CONNECTION_ATTEMPT_DELAY - get_elapsed_ms(&e->last_attempt);
+		if (delay < timeout) {
+			timeout = delay < 0 ? 0 : delay;
+		}
+	} else if (!e->connecting && e->results[FAMILY_INET]) {
+		int delay = RESOLUTION_DELAY - get_elapsed_ms(&e->first_resolved);
+		if (delay < timeout) {
+			timeout = delay < 0 ? 0 : delay;
+		}
+	}
+	if (poll(fds, nfds, timeout) <= 0) {
+		return -1;
+	}
+	for (int i = e->attempt_count - 1; i >= 0; --i) {
+		if (!fds[i].revents) {
+			continue;
+		}
+		int error = 0;
+		socklen_t len = sizeof(error);
+		getsockopt(e->attempts[i], SOL_SOCKET, SO_ERROR, &error, &len);
+		if (error) {
+			// This might fail because i.e. the server is dead
+			e->last_error = error;
+			close(e->attempts[i]);
+			remove_attempt(e, i);
+			e->attempt_now = true;
+			continue;
+		}
+		int fd = e->attempts[i];
+		remove_attempt(e, i);
+		e->timings->tcp = get_elapsed_ms(&e->start) - e->timings->dns;
+		return fd;
+	}
+	return -1;
+}
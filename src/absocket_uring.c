@@ -0,0 +1,472 @@
+/*
+ * absocket_uring.c - io_uring socket backend
+ *
+ * Keeps a multishot recv armed on the socket so received data lands in a ring
+ * of registered buffers without a syscall per read, and batches sends into one
+ * submission. Talks to the kernel directly so we don't depend on liburing.
+ */
+#define _DEFAULT_SOURCE
+#ifdef USE_IO_URING
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "internal/absocket.h"
+#include "log.h"
+
+#define URING_ENTRIES 16
+/* Must be a power of two */
+#define URING_BUFFERS 8
+#define URING_BUFFER_SIZE 16384
+#define URING_BUFFER_GROUP 0
+
+enum {
+	URING_RECV = 1,
+	URING_SEND,
+	URING_CANCEL,
+};
+
+struct uring_buffer {
+	unsigned short bid;
+	size_t len;
+};
+
+struct ab_uring {
+	int fd;
+	/* Submission queue */
+	void *sq_ring;
+	size_t sq_ring_size;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned to_submit;
+	/* Completion queue */
+	void *cq_ring;
+	size_t cq_ring_size;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* Provided buffers, handed back to the kernel once we've read them */
+	struct io_uring_buf_ring *br;
+	size_t br_size;
+	unsigned short br_tail;
+	unsigned char *buffers;
+	/* Received buffers in order, the first one is partially read */
+	struct uring_buffer ready[URING_BUFFERS];
+	int ready_head, ready_count;
+	size_t ready_offset;
+	bool armed, eof;
+	int error;
+	/* Data staged for the next send, and the send the kernel is working on */
+	unsigned char *staged;
+	size_t staged_len, staged_size;
+	unsigned char *flight;
+	size_t flight_len, flight_size, flight_offset;
+	bool sending;
+	/* For the debug log */
+	size_t enters, completions;
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(struct ab_uring *u, unsigned to_submit,
+		unsigned min_complete, unsigned flags) {
+	u->enters++;
+	return syscall(__NR_io_uring_enter, u->fd, to_submit, min_complete,
+			flags, NULL, 0);
+}
+
+static int uring_register(struct ab_uring *u, unsigned opcode,
+		void *arg, unsigned nr_args) {
+	return syscall(__NR_io_uring_register, u->fd, opcode, arg, nr_args);
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct ab_uring *u) {
+	unsigned tail = *u->sq_tail;
+	unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	if (tail - head >= u->sq_entries) {
+		return NULL;
+	}
+	unsigned index = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[index] = index;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->to_submit++;
+	return sqe;
+}
+
+static int uring_submit(struct ab_uring *u, unsigned min_complete) {
+	unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+	int ret;
+	do {
+		ret = uring_enter(u, u->to_submit, min_complete, flags);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0) {
+		return -1;
+	}
+	u->to_submit -= ret > (int)u->to_submit ? u->to_submit : (unsigned)ret;
+	return 0;
+}
+
+static void uring_provide_buffer(struct ab_uring *u, unsigned short bid) {
+	struct io_uring_buf *buf =
+		&u->br->bufs[u->br_tail & (URING_BUFFERS - 1)];
+	buf->addr = (uintptr_t)(u->buffers + (size_t)bid * URING_BUFFER_SIZE);
+	buf->len = URING_BUFFER_SIZE;
+	buf->bid = bid;
+	u->br_tail++;
+	__atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+static bool uring_arm_recv(struct ab_uring *u) {
+	struct io_uring_sqe *sqe = uring_get_sqe(u);
+	if (!sqe) {
+		return false;
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = 0; // Index into the registered files
+	sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe->user_data = URING_RECV;
+	u->armed = true;
+	return true;
+}
+
+static bool uring_queue_send(struct ab_uring *u) {
+	struct io_uring_sqe *sqe = uring_get_sqe(u);
+	if (!sqe) {
+		return false;
+	}
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = 0;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->addr = (uintptr_t)(u->flight + u->flight_offset);
+	sqe->len = u->flight_len - u->flight_offset;
+	sqe->user_data = URING_SEND;
+	u->sending = true;
+	return true;
+}
+
+static void uring_handle_recv(struct ab_uring *u, struct io_uring_cqe *cqe) {
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		u->armed = false;
+	}
+	if (cqe->res > 0) {
+		int i = (u->ready_head + u->ready_count) % URING_BUFFERS;
+		u->ready[i].bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		u->ready[i].len = cqe->res;
+		u->ready_count++;
+	} else if (cqe->res == 0) {
+		u->eof = true;
+	} else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+		// ENOBUFS just means we have to re-arm once we free a buffer
+		u->error = -cqe->res;
+	}
+}
+
+static void uring_handle_send(struct ab_uring *u, struct io_uring_cqe *cqe) {
+	u->sending = false;
+	if (cqe->res < 0) {
+		u->error = -cqe->res;
+		u->flight_len = u->flight_offset = 0;
+		return;
+	}
+	u->flight_offset += cqe->res;
+	if (u->flight_offset == u->flight_len) {
+		u->flight_len = u->flight_offset = 0;
+	}
+	// Short sends are picked up again by the next flush
+}
+
+static void uring_reap(struct ab_uring *u) {
+	unsigned head = *u->cq_head;
+	unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+		switch (cqe->user_data) {
+		case URING_RECV:
+			uring_handle_recv(u, cqe);
+			break;
+		case URING_SEND:
+			uring_handle_send(u, cqe);
+			break;
+		}
+		u->completions++;
+		head++;
+	}
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+int ab_uring_flush(struct ab_uring *u) {
+	uring_reap(u);
+	if (!u->sending && u->flight_len == 0 && u->staged_len > 0) {
+		unsigned char *buf = u->flight;
+		size_t size = u->flight_size;
+		u->flight = u->staged;
+		u->flight_size = u->staged_size;
+		u->flight_len = u->staged_len;
+		u->staged = buf;
+		u->staged_size = size;
+		u->staged_len = 0;
+	}
+	if (!u->sending && u->flight_len > 0) {
+		uring_queue_send(u);
+	}
+	if (!u->armed && !u->eof && !u->error
+			&& u->ready_count < URING_BUFFERS) {
+		uring_arm_recv(u);
+	}
+	if (u->to_submit == 0) {
+		return 0;
+	}
+	return uring_submit(u, 0);
+}
+
+ssize_t ab_uring_recv(struct ab_uring *u, void *buffer, size_t len) {
+	uring_reap(u);
+	if (u->ready_count == 0) {
+		if (u->eof) {
+			return 0;
+		}
+		if (u->error) {
+			errno = u->error;
+			return -1;
+		}
+		if (!u->armed) {
+			ab_uring_flush(u);
+		}
+		errno = EAGAIN;
+		return -1;
+	}
+	size_t total = 0;
+	while (u->ready_count > 0 && total < len) {
+		struct uring_buffer *ready = &u->ready[u->ready_head];
+		size_t amt = ready->len - u->ready_offset;
+		if (amt > len - total) {
+			amt = len - total;
+		}
+		memcpy((unsigned char *)buffer + total, u->buffers
+				+ (size_t)ready->bid * URING_BUFFER_SIZE + u->ready_offset, amt);
+		total += amt;
+		u->ready_offset += amt;
+		if (u->ready_offset == ready->len) {
+			uring_provide_buffer(u, ready->bid);
+			u->ready_head = (u->ready_head + 1) % URING_BUFFERS;
+			u->ready_count--;
+			u->ready_offset = 0;
+		}
+	}
+	if (!u->armed && !u->eof && !u->error) {
+		// The recv stopped when we ran out of buffers, restart it
+		ab_uring_flush(u);
+	}
+	return total;
+}
+
+ssize_t ab_uring_send(struct ab_uring *u, const void *buffer, size_t len) {
+	if (u->error) {
+		errno = u->error;
+		return -1;
+	}
+	if (u->staged_len + len > u->staged_size) {
+		size_t size = u->staged_size ? u->staged_size : URING_BUFFER_SIZE;
+		while (size < u->staged_len + len) {
+			size *= 2;
+		}
+		unsigned char *staged = realloc(u->staged, size);
+		if (!staged) {
+			errno = ENOMEM;
+			return -1;
+		}
+		u->staged = staged;
+		u->staged_size = size;
+	}
+	memcpy(u->staged + u->staged_len, buffer, len);
+	u->staged_len += len;
+	return len;
+}
+
+bool ab_uring_pending(struct ab_uring *u) {
+	uring_reap(u);
+	return u->ready_count > 0 || u->eof || u->error;
+}
+
+static void uring_unmap(struct ab_uring *u) {
+	if (u->br) {
+		munmap(u->br, u->br_size);
+	}
+	if (u->sqes) {
+		munmap(u->sqes, u->sqes_size);
+	}
+	if (u->cq_ring && u->cq_ring != u->sq_ring) {
+		munmap(u->cq_ring, u->cq_ring_size);
+	}
+	if (u->sq_ring) {
+		munmap(u->sq_ring, u->sq_ring_size);
+	}
+	close(u->fd);
+	free(u->buffers);
+	free(u->staged);
+	free(u->flight);
+	free(u);
+}
+
+void ab_uring_free(struct ab_uring *u) {
+	if (!u) return;
+	ab_uring_flush(u);
+	/*
+	 * The socket may outlive us (i.e. STARTTLS), so the recv has to be gone
+	 * before anyone else reads from it or it could swallow their data.
+	 */
+	if (u->armed) {
+		struct io_uring_sqe *sqe = uring_get_sqe(u);
+		if (sqe) {
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = URING_RECV;
+			sqe->user_data = URING_CANCEL;
+		}
+	}
+	while ((u->armed || u->sending) && !u->error) {
+		if (uring_submit(u, 1) == -1) {
+			break;
+		}
+		uring_reap(u);
+		if (!u->sending && u->flight_len > 0) {
+			uring_queue_send(u);
+		}
+	}
+	if (u->ready_count > 0) {
+		worker_log(L_DEBUG, "io_uring: discarding unread data");
+	}
+	worker_log(L_DEBUG, "io_uring: %zd completions in %zd syscalls",
+			u->completions, u->enters);
+	uring_unmap(u);
+}
+
+static bool uring_map(struct ab_uring *u, struct io_uring_params *p) {
+	u->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	u->cq_ring_size = p->cq_off.cqes
+		+ p->cq_entries * sizeof(struct io_uring_cqe);
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_size > u->sq_ring_size) {
+			u->sq_ring_size = u->cq_ring_size;
+		}
+		u->cq_ring_size = u->sq_ring_size;
+	}
+	u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED) {
+		u->sq_ring = NULL;
+		return false;
+	}
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ring = u->sq_ring;
+	} else {
+		u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED) {
+			u->cq_ring = NULL;
+			return false;
+		}
+	}
+	u->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		return false;
+	}
+	unsigned char *sq = u->sq_ring, *cq = u->cq_ring;
+	u->sq_head = (unsigned *)(sq + p->sq_off.head);
+	u->sq_tail = (unsigned *)(sq + p->sq_off.tail);
+	u->sq_mask = (unsigned *)(sq + p->sq_off.ring_mask);
+	u->sq_array = (unsigned *)(sq + p->sq_off.array);
+	u->sq_entries = p->sq_entries;
+	u->cq_head = (unsigned *)(cq + p->cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p->cq_off.tail);
+	u->cq_mask = (unsigned *)(cq + p->cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+	return true;
+}
+
+static bool uring_register_buffers(struct ab_uring *u) {
+	u->br_size = URING_BUFFERS * sizeof(struct io_uring_buf);
+	u->br = mmap(NULL, u->br_size, PROT_READ | PROT_WRITE,
+			MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (u->br == MAP_FAILED) {
+		u->br = NULL;
+		return false;
+	}
+	u->buffers = malloc(URING_BUFFERS * URING_BUFFER_SIZE);
+	if (!u->buffers) {
+		return false;
+	}
+	struct io_uring_buf_reg reg = {
+		.ring_addr = (uintptr_t)u->br,
+		.ring_entries = URING_BUFFERS,
+		.bgid = URING_BUFFER_GROUP,
+	};
+	if (uring_register(u, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+		return false;
+	}
+	for (unsigned short i = 0; i < URING_BUFFERS; ++i) {
+		uring_provide_buffer(u, i);
+	}
+	return true;
+}
+
+struct ab_uring *ab_uring_new(int fd) {
+	struct ab_uring *u = calloc(1, sizeof(struct ab_uring));
+	if (!u) {
+		return NULL;
+	}
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	u->fd = uring_setup(URING_ENTRIES, &p);
+	if (u->fd < 0) {
+		worker_log(L_DEBUG, "io_uring unavailable: %s", strerror(errno));
+		free(u);
+		return NULL;
+	}
+	if (!uring_map(u, &p)) {
+		worker_log(L_DEBUG, "Unable to map io_uring: %s", strerror(errno));
+		goto bail;
+	}
+	if (uring_register(u, IORING_REGISTER_FILES, &fd, 1) != 0
+			|| !uring_register_buffers(u)) {
+		worker_log(L_DEBUG, "Unable to register io_uring resources: %s",
+				strerror(errno));
+		goto bail;
+	}
+	/*
+	 * Kernels without multishot recv reject the request when it's submitted,
+	 * so we find out right away and can fall back to plain syscalls.
+	 */
+	if (!uring_arm_recv(u) || uring_submit(u, 0) == -1) {
+		goto bail;
+	}
+	uring_reap(u);
+	if (!u->armed && u->error) {
+		worker_log(L_DEBUG, "io_uring multishot recv unsupported: %s",
+				strerror(u->error));
+		goto bail;
+	}
+	worker_log(L_DEBUG, "Using io_uring for socket I/O");
+	return u;
+bail:
+	uring_unmap(u);
+	return NULL;
+}
+
+#endif
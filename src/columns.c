@@ -0,0 +1,183 @@
+/*
+ * columns.c - the message list's fields, one array each
+ *
+ * Drawing a row used to go from the message list to the message, to its
+ * headers, to their strings, and sorting did the same for every comparison.
+ * Here each field the list uses is an array of its own, and the subjects and
+ * senders share one buffer, so a screenful of rows is a handful of cache lines
+ * per field. The columns are rebuilt from the messages when they fall out of
+ * step, and patched a row at a time as messages are updated or expunged.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "columns.h"
+#include "email/headers.h"
+#include "state.h"
+#include "worker.h"
+
+/* Skips the Re: and Fwd: that replies pile on the front of a subject */
+static const char *base_subject(const char *subject) {
+	const char *prefixes[] = { "re:", "fwd:", "fw:" };
+	bool stripped = true;
+	while (stripped) {
+		stripped = false;
+		while (isspace((unsigned char)*subject)) {
+			++subject;
+		}
+		for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); ++i) {
+			size_t len = strlen(prefixes[i]);
+			if (strncasecmp(subject, prefixes[i], len) == 0) {
+				subject += len;
+				stripped = true;
+			}
+		}
+	}
+	return subject;
+}
+
+static uint32_t add_string(struct message_columns *columns, const char *str) {
+	if (!str || !*str) {
+		return 0;
+	}
+	size_t len = strlen(str) + 1;
+	if (columns->strings_len + len > columns->strings_size) {
+		columns->strings_size = (columns->strings_len + len) * 2;
+		columns->strings = realloc(columns->strings, columns->strings_size);
+	}
+	uint32_t offset = columns->strings_len;
+	memcpy(columns->strings + offset, str, len);
+	columns->strings_len += len;
+	return offset;
+}
+
+static void fill_row(struct message_columns *columns, size_t i,
+		struct aerc_message *msg) {
+	columns->fetched[i] = msg && msg->fetched;
+	if (!columns->fetched[i]) {
+		columns->uid[i] = -1;
+		columns->date[i] = 0;
+		columns->zone[i] = 0;
+		columns->flags[i] = 0;
+		columns->bytes[i] = 0;
+		columns->subject[i] = columns->thread_subject[i] = 0;
+		columns->from[i] = 0;
+		return;
+	}
+	columns->uid[i] = msg->uid;
+	columns->date[i] = msg->internal_date;
+	columns->zone[i] = msg->internal_zone;
+	columns->flags[i] = msg->flags;
+	columns->bytes[i] = msg->size;
+	columns->subject[i] = add_string(columns,
+			get_message_header(msg, HEADER_SUBJECT));
+	const char *subject = columns->strings + columns->subject[i];
+	columns->thread_subject[i] = columns->subject[i]
+		+ (base_subject(subject) - subject);
+	columns->from[i] = add_string(columns,
+			get_message_header(msg, HEADER_FROM));
+}
+
+static void reserve(struct message_columns *columns, size_t n) {
+	if (n <= columns->size) {
+		return;
+	}
+	size_t size = columns->size ? columns->size : 64;
+	while (size < n) {
+		size *= 2;
+	}
+	columns->fetched = realloc(columns->fetched, size * sizeof(bool));
+	columns->uid = realloc(columns->uid, size * sizeof(long));
+	columns->date = realloc(columns->date, size * sizeof(time_t));
+	columns->zone = realloc(columns->zone, size * sizeof(short));
+	columns->flags = realloc(columns->flags, size * sizeof(uint64_t));
+	columns->bytes = realloc(columns->bytes, size * sizeof(long));
+	columns->subject = realloc(columns->subject, size * sizeof(uint32_t));
+	columns->thread_subject = realloc(columns->thread_subject,
+			size * sizeof(uint32_t));
+	columns->from = realloc(columns->from, size * sizeof(uint32_t));
+	columns->size = size;
+}
+
+static void build_columns(struct message_columns *columns, list_t *messages) {
+	reserve(columns, messages->length);
+	// Offset 0 is the empty string
+	columns->strings_len = 0;
+	if (!columns->strings) {
+		columns->strings_size = 4096;
+		columns->strings = malloc(columns->strings_size);
+	}
+	columns->strings[columns->strings_len++] = '\0';
+	for (size_t i = 0; i < messages->length; ++i) {
+		fill_row(columns, i, messages->items[i]);
+	}
+	columns->length = messages->length;
+	columns->built_len = columns->strings_len;
+}
+
+struct message_columns *get_message_columns(struct aerc_mailbox *mbox) {
+	if (!mbox->columns) {
+		mbox->columns = calloc(1, sizeof(struct message_columns));
+		build_columns(mbox->columns, mbox->messages);
+	}
+	struct message_columns *columns = mbox->columns;
+	// Updates leave their old strings behind, so now and then we start over
+	if (columns->length != mbox->messages->length
+			|| columns->strings_len > columns->built_len * 2 + 4096) {
+		build_columns(columns, mbox->messages);
+	}
+	return columns;
+}
+
+void update_message_columns(struct aerc_mailbox *mbox, size_t index) {
+	struct message_columns *columns = mbox->columns;
+	if (!columns || columns->length != mbox->messages->length
+			|| index >= columns->length) {
+		// Stale already, the next get_message_columns will rebuild them
+		return;
+	}
+	fill_row(columns, index, mbox->messages->items[index]);
+}
+
+void remove_message_columns(struct aerc_mailbox *mbox, size_t index) {
+	struct message_columns *columns = mbox->columns;
+	if (!columns || columns->length != mbox->messages->length + 1
+			|| index >= columns->length) {
+		return;
+	}
+	size_t n = columns->length - index - 1;
+#define SHIFT(column) memmove(&columns->column[index], \
+		&columns->column[index + 1], n * sizeof(*columns->column))
+	SHIFT(fetched);
+	SHIFT(uid);
+	SHIFT(date);
+	SHIFT(zone);
+	SHIFT(flags);
+	SHIFT(bytes);
+	SHIFT(subject);
+	SHIFT(thread_subject);
+	SHIFT(from);
+#undef SHIFT
+	columns->length--;
+}
+
+void free_message_columns(struct message_columns *columns) {
+	if (!columns) {
+		return;
+	}
+	free(columns->fetched);
+	free(columns->uid);
+	free(columns->date);
+	free(columns->zone);
+	free(columns->flags);
+	free(columns->bytes);
+	free(columns->subject);
+	free(columns->thread_subject);
+	free(columns->from);
+	free(columns->strings);
+	free(columns);
+}
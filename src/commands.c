@@ -1,5 +1,6 @@
 #define _POSIX_C_SOURCE 200809L
 #include <stdbool.h>
+#include <stdio.h>
 #include <strings.h>
 #include <string.h>
 #include <stdlib.h>
@@ -9,17 +10,36 @@
 #include "commands.h"
 #include "subprocess.h"
 #include "config.h"
+#include "search.h"
+#include "sort.h"
 #include "state.h"
 #include "log.h"
 #include "ui.h"
 
 static void close_message(struct account_state *account) {
+	if (account->viewer.downloading) {
+		// Nobody's going to look at it
+		worker_post_action(account->worker.pipe, WORKER_CANCEL_MESSAGE_PART,
+				NULL, NULL);
+		account->viewer.downloading = false;
+	}
 	subprocess_free(account->viewer.term);
 	account->viewer.term = NULL;
 	account->viewer.msg = NULL;
 	request_rerender(PANEL_MESSAGE_LIST);
 }
 
+static void handle_cancel_download(int argc, char **argv) {
+	struct account_state *account =
+		state->accounts->items[state->selected_account];
+	if (!account->viewer.downloading) {
+		set_status(account, ACCOUNT_ERROR, "Nothing is downloading");
+		return;
+	}
+	worker_post_action(account->worker.pipe, WORKER_CANCEL_MESSAGE_PART,
+			NULL, NULL);
+}
+
 static void handle_quit(int argc, char **argv) {
 	// TODO: We may occasionally want to confirm the user's choice here
 	state->exit = true;
@@ -63,7 +83,7 @@ static void handle_message_seek(char *cmd, int mul, int argc, char **argv) {
 	}
 	int new = (int)account->ui.selected_message + amt;
 	if (new < 0) amt -= new;
-	if (new >= (int)mbox->messages->length) amt -= new - mbox->messages->length + 1;
+	if (new >= (int)get_message_rows(mbox)) amt -= new - get_message_rows(mbox) + 1;
 	if (scroll) {
 		account->ui.list_offset += amt;
 	}
@@ -99,9 +119,9 @@ static void handle_select_message(int argc, char **argv) {
 		return;
 	}
 	if (requested < 0) {
-		requested = mbox->messages->length + requested;
+		requested = get_message_rows(mbox) + requested;
 	}
-	if (requested > (int)mbox->messages->length) {
+	if (requested > (int)get_message_rows(mbox)) {
 		set_status(account, ACCOUNT_ERROR, "Requested message is out of range.");
 		return;
 	}
@@ -267,12 +287,12 @@ static void handle_view_message(int argc, char **argv) {
 		set_status(account, ACCOUNT_ERROR, "Failed to read mailbox");
 		return;
 	}
-	if (!mbox->messages->length) {
+	if (!get_message_rows(mbox)) {
 		set_status(account, ACCOUNT_ERROR, "Failed to read empty message");
 		return;
 	}
 	account->viewer.msg = mbox->messages->items[
-		mbox->messages->length - account->ui.selected_message - 1];
+		get_message_index(mbox, account->ui.selected_message)];
 	load_message_viewer(account);
 	request_rerender(PANEL_MESSAGE_VIEW);
 }
@@ -334,11 +354,11 @@ static void handle_delete_message(int argc, char **argv) {
 	if (!mbox) {
 		return;
 	}
-	if (requested > mbox->messages->length) {
+	if (requested >= get_message_rows(mbox)) {
 		set_status(account, ACCOUNT_ERROR, "Requested message is out of range.");
 		return;
 	}
-	requested = mbox->messages->length - requested - 1;
+	requested = get_message_index(mbox, requested);
 	size_t *req = malloc(sizeof(size_t));
 	memcpy(req, &requested, sizeof(size_t));
 	worker_post_action(account->worker.pipe, WORKER_DELETE_MESSAGE, NULL, req);
@@ -358,11 +378,11 @@ static void handle_copy_message(int argc, char **argv) {
 	if (!mbox) {
 		return;
 	}
-	if (requested > mbox->messages->length) {
+	if (requested >= get_message_rows(mbox)) {
 		set_status(account, ACCOUNT_ERROR, "Requested message is out of range.");
 		return;
 	}
-	requested = mbox->messages->length - requested - 1;
+	requested = get_message_index(mbox, requested);
 	struct aerc_message_move *req = malloc(sizeof(struct aerc_message_move));
 	req->index = requested;
 	req->destination = join_args(argv, argc);
@@ -383,11 +403,11 @@ static void handle_move_message(int argc, char **argv) {
 	if (!mbox) {
 		return;
 	}
-	if (requested > mbox->messages->length) {
+	if (requested >= get_message_rows(mbox)) {
 		set_status(account, ACCOUNT_ERROR, "Requested message is out of range.");
 		return;
 	}
-	requested = mbox->messages->length - requested - 1;
+	requested = get_message_index(mbox, requested);
 	struct aerc_message_move *req = malloc(sizeof(struct aerc_message_move));
 	req->index = requested;
 	req->destination = join_args(argv, argc);
@@ -397,6 +417,54 @@ static void handle_move_message(int argc, char **argv) {
 	request_rerender(PANEL_MESSAGE_LIST);
 }
 
+static void handle_sort(int argc, char **argv) {
+	struct account_state *account =
+		state->accounts->items[state->selected_account];
+	bool reverse = false;
+	if (argc == 2 && strcmp(argv[0], "-r") == 0) {
+		reverse = true;
+		argv++;
+		argc--;
+	}
+	enum aerc_sort_key key;
+	if (argc != 1 || !parse_sort_key(argv[0], &key)) {
+		set_status(account, ACCOUNT_ERROR, "Usage: sort [-r] "
+				"[none|arrival|date|from|subject|size|thread]");
+		return;
+	}
+	account->ui.sort.key = key;
+	account->ui.sort.reverse = reverse;
+	account->ui.sort.local = false;
+	account->ui.selected_message = 0;
+	account->ui.list_offset = 0;
+	request_sort(account);
+	request_rerender(PANEL_MESSAGE_LIST);
+}
+
+static void handle_search(int argc, char **argv) {
+	struct account_state *account =
+		state->accounts->items[state->selected_account];
+	free(account->ui.search.query);
+	account->ui.search.query = NULL;
+	if (argc) {
+		for (int i = 0; i < argc; ++i) {
+			if (strchr(argv[i], ' ') && !strchr(argv[i], '"')) {
+				// Put back the quotes that kept the phrase together
+				char *quoted = malloc(strlen(argv[i]) + 3);
+				sprintf(quoted, "\"%s\"", argv[i]);
+				free(argv[i]);
+				argv[i] = quoted;
+			}
+		}
+		account->ui.search.query = join_args(argv, argc);
+		account->ui.search.announce = true;
+	}
+	account->ui.selected_message = 0;
+	account->ui.list_offset = 0;
+	request_search(account);
+	request_rerender(PANEL_MESSAGE_LIST);
+}
+
 struct cmd_handler {
 	char *command;
 	void (*handler)(int argc, char **argv);
@@ -404,6 +472,7 @@ struct cmd_handler {
 
 // Keep alphabetized, please
 struct cmd_handler cmd_handlers[] = {
+	{ "cancel-download", handle_cancel_download },
 	{ "cd", handle_cd },
 	{ "close-message", handle_close_message },
 	{ "confirm", handle_confirm },
@@ -426,8 +495,10 @@ struct cmd_handler cmd_handlers[] = {
 	{ "q", handle_quit },
 	{ "quit", handle_quit },
 	{ "reload", handle_reload },
+	{ "search", handle_search },
 	{ "select-message", handle_select_message },
 	{ "set", handle_set },
+	{ "sort", handle_sort },
 	{ "term-exec", handle_term_exec },
 	{ "view-message", handle_view_message },
 };
@@ -1,59 +1,135 @@
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <ctype.h>
 #include <string.h>
 #include "email/encodings.h"
+#include "util/scan.h"
 #include "util/unicode.h"
 
 int iso_8859_1_to_utf8(unsigned char **data, int len) {
-	size_t new_len = 0, new_size = len;
-	char *new_str = malloc(new_size);
-	for (int i = 0; i < len; ++i) {
-		if (new_len + utf8_chsize((*data)[i]) >= new_size) {
-			new_size += 16;
-			char *_ = realloc(new_str, new_size);
-			if (!_) {
-				return len;
-			}
-			new_str = _;
+	// Each byte is one or two in UTF-8
+	char *new_str = malloc(2 * (size_t)len + 1), *out = new_str;
+	if (!new_str) {
+		return len;
+	}
+	const char *in = (const char *)*data, *end = in + len;
+	while (in < end) {
+		const char *ascii = scan_ascii(in, end);
+		memcpy(out, in, ascii - in);
+		out += ascii - in;
+		for (in = ascii; in < end && (unsigned char)*in >= 0x80; ++in) {
+			out += utf8_encode(out, (unsigned char)*in);
 		}
-		new_len += utf8_encode(&new_str[new_len], (*data)[i]);
 	}
+	*out = '\0';
 	free(*data);
 	*data = (unsigned char *)new_str;
-	return new_len;
+	return out - new_str;
+}
+
+/* Hex digits map to 0x10 | value, so anything else is 0 */
+static const unsigned char hex_values[256] = {
+	['0'] = 0x10, ['1'] = 0x11, ['2'] = 0x12, ['3'] = 0x13, ['4'] = 0x14,
+	['5'] = 0x15, ['6'] = 0x16, ['7'] = 0x17, ['8'] = 0x18, ['9'] = 0x19,
+	['A'] = 0x1A, ['B'] = 0x1B, ['C'] = 0x1C, ['D'] = 0x1D, ['E'] = 0x1E,
+	['F'] = 0x1F, ['a'] = 0x1A, ['b'] = 0x1B, ['c'] = 0x1C, ['d'] = 0x1D,
+	['e'] = 0x1E, ['f'] = 0x1F,
+};
+
+/*
+ * Decodes src into dst in one pass. The output never gets ahead of the input,
+ * so dst may be src. Unless final is set, an escape cut off at the end is
+ * left for next time and *consumed stops short of it.
+ */
+static size_t qp_decode_run(const char *src, size_t len, char *dst,
+		enum qp_flavor flavor, bool final, size_t *consumed) {
+	const char *in = src, *end = src + len;
+	char *out = dst;
+	const char *special = flavor == QP_HEADERS ? "=_" : "=";
+	while (in < end) {
+		// Most of it is plain text, which we copy in runs
+		const char *next = scan_find(in, end, special);
+		if (next != in) {
+			if (out != in) {
+				memmove(out, in, next - in);
+			}
+			out += next - in;
+			in = next;
+			continue;
+		}
+		unsigned char a = in + 1 < end ? hex_values[(unsigned char)in[1]] : 0;
+		unsigned char b = in + 2 < end ? hex_values[(unsigned char)in[2]] : 0;
+		if (*in == '_') {
+			*out++ = ' ';
+			++in;
+		} else if (*in != '=') {
+			// scan_find stops at NUL too
+			*out++ = *in++;
+		} else if (in + 1 < end && in[1] == '\n') {
+			in += 2;
+		} else if (in + 2 < end && in[1] == '\r' && in[2] == '\n') {
+			in += 3;
+		} else if (a && b) {
+			*out++ = (a & 0xF) << 4 | (b & 0xF);
+			in += 3;
+		} else if (!final && in + 2 >= end
+				&& (in + 1 == end || in[1] == '\r' || a)) {
+			break;
+		} else {
+			// An = that doesn't start anything is left alone
+			*out++ = *in++;
+		}
+	}
+	*consumed = in - src;
+	return out - dst;
 }
 
 int quoted_printable_decode(char *data, int len, int qp_flavor) {
 	if (!data) {
 		return -1;
 	}
-	for (int i = 0; i < len; ++i) {
-		if (!*data) {
-			break;
-		}
-		if (*data == '_' && qp_flavor == QP_HEADERS) {
-			*data = ' ';
-		} else if (*data == '=' && len - i >= 1) {
-			int c;
-			if (data[1] == '\r') {
-				len -= 3;
-				memmove(data, data + 3, len - i);
-				data--, i--;
-			} else if (data[1] == '\n') {
-				len -= 2;
-				memmove(data, data + 2, len - i);
-				data--, i--;
-			} else if (len - i >= 2
-					&& isxdigit(data[1])
-					&& isxdigit(data[2])
-					&& sscanf(&data[1], "%2x", &c)) {
-				*data = c;
-				len -= 2;
-				memmove(data + 1, data + 3, len - i);
-			}
+	size_t _;
+	return (int)qp_decode_run(data, len, data, qp_flavor, true, &_);
+}
+
+void qp_decoder_init(struct qp_decoder *decoder, enum qp_flavor flavor) {
+	decoder->flavor = flavor;
+	decoder->pending_len = 0;
+}
+
+size_t qp_decoder_update(struct qp_decoder *decoder, const char *src,
+		size_t len, char *dst) {
+	size_t written = 0, consumed;
+	if (decoder->pending_len) {
+		// Finish the escape that was split between this piece and the last
+		char buf[4];
+		size_t pending = decoder->pending_len;
+		size_t take = len < sizeof(buf) - pending ? len : sizeof(buf) - pending;
+		memcpy(buf, decoder->pending, pending);
+		memcpy(buf + pending, src, take);
+		written = qp_decode_run(buf, pending + take, dst, decoder->flavor,
+				false, &consumed);
+		if (consumed < pending) {
+			// Still not enough of it, so take is all of src
+			decoder->pending_len = pending + take - consumed;
+			memcpy(decoder->pending, buf + consumed, decoder->pending_len);
+			return written;
 		}
-		++data;
+		src += consumed - pending;
+		len -= consumed - pending;
+		decoder->pending_len = 0;
 	}
-	return len;
+	written += qp_decode_run(src, len, dst + written, decoder->flavor,
+			false, &consumed);
+	decoder->pending_len = len - consumed;
+	memcpy(decoder->pending, src + consumed, decoder->pending_len);
+	return written;
+}
+
+size_t qp_decoder_finish(struct qp_decoder *decoder, char *dst) {
+	size_t consumed;
+	size_t written = qp_decode_run(decoder->pending, decoder->pending_len, dst,
+			decoder->flavor, true, &consumed);
+	decoder->pending_len = 0;
+	return written;
 }
@@ -0,0 +1,75 @@
+/*
+ * email/flags.c - message flags as bits
+ *
+ * The system flags always have the same bits. Keywords get the next free bit
+ * in their mailbox's table the first time we see them, so a message's flags
+ * fit in one word and checking one is a single AND.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "email/flags.h"
+#include "log.h"
+
+static const char *system_flags[FLAG_SYSTEM_COUNT] = {
+	"\\Seen",
+	"\\Answered",
+	"\\Flagged",
+	"\\Deleted",
+	"\\Draft",
+	"\\Recent",
+};
+
+uint64_t flag_bit(struct keyword_table *keywords, const char *flag, bool add) {
+	if (flag[0] == '\\') {
+		for (int i = 0; i < FLAG_SYSTEM_COUNT; ++i) {
+			if (strcasecmp(system_flags[i], flag) == 0) {
+				return (uint64_t)1 << i;
+			}
+		}
+		return 0;
+	}
+	for (size_t i = 0; i < keywords->length; ++i) {
+		if (strcasecmp(keywords->names[i], flag) == 0) {
+			return (uint64_t)1 << (FLAG_SYSTEM_COUNT + i);
+		}
+	}
+	if (!add) {
+		return 0;
+	}
+	if (keywords->length == FLAG_KEYWORD_MAX) {
+		worker_log(L_DEBUG, "Too many keywords, ignoring %s", flag);
+		return 0;
+	}
+	keywords->names[keywords->length] = strdup(flag);
+	return (uint64_t)1 << (FLAG_SYSTEM_COUNT + keywords->length++);
+}
+
+const char *flag_name(const struct keyword_table *keywords, uint64_t bit) {
+	if (!bit || (bit & (bit - 1))) {
+		return NULL;
+	}
+	size_t i = __builtin_ctzll(bit);
+	if (i < FLAG_SYSTEM_COUNT) {
+		return system_flags[i];
+	}
+	i -= FLAG_SYSTEM_COUNT;
+	return i < keywords->length ? keywords->names[i] : NULL;
+}
+
+void keyword_table_copy(struct keyword_table *dest,
+		const struct keyword_table *src) {
+	dest->length = src->length;
+	for (size_t i = 0; i < src->length; ++i) {
+		dest->names[i] = strdup(src->names[i]);
+	}
+}
+
+void keyword_table_finish(struct keyword_table *keywords) {
+	for (size_t i = 0; i < keywords->length; ++i) {
+		free(keywords->names[i]);
+	}
+	keywords->length = 0;
+}
@@ -8,45 +8,81 @@
 #include "email/encodings.h"
 #include "email/headers.h"
 #include "log.h"
-#include "util/list.h"
 #include "util/base64.h"
 #include "util/iconv.h"
 
-static void strapp(char **stringp, char *str, size_t n) {
-	if (!str || !*str || !stringp)
-		return;
-	size_t m = *stringp ? strlen(*stringp) : 0;
-	*stringp = realloc(*stringp, m + n + 1);
-	memcpy(*stringp + m, str, n);
-	(*stringp)[m + n] = 0;
+/*
+ * Everything for one message goes into an arena as it's parsed, keys and
+ * values alike, and while a header is being parsed its value is always the
+ * last thing in it. Folded lines just extend it.
+ */
+struct arena {
+	char *data;
+	size_t len, size;
+};
+
+static size_t arena_append(struct arena *arena, const char *str, size_t n) {
+	if (arena->len + n > arena->size) {
+		arena->size = (arena->len + n) * 2;
+		arena->data = realloc(arena->data, arena->size);
+	}
+	size_t offset = arena->len;
+	memcpy(arena->data + offset, str, n);
+	arena->len += n;
+	return offset;
+}
+
+static const char *header_names[] = {
+	[HEADER_DATE] = "Date",
+	[HEADER_FROM] = "From",
+	[HEADER_SENDER] = "Sender",
+	[HEADER_REPLY_TO] = "Reply-To",
+	[HEADER_TO] = "To",
+	[HEADER_CC] = "Cc",
+	[HEADER_BCC] = "Bcc",
+	[HEADER_SUBJECT] = "Subject",
+	[HEADER_MESSAGE_ID] = "Message-ID",
+	[HEADER_IN_REPLY_TO] = "In-Reply-To",
+	[HEADER_REFERENCES] = "References",
+};
+
+enum header_id header_id(const char *name, size_t len) {
+	for (int id = HEADER_OTHER + 1; id < HEADER_COUNT; ++id) {
+		if (strlen(header_names[id]) == len
+				&& strncasecmp(header_names[id], name, len) == 0) {
+			return id;
+		}
+	}
+	return HEADER_OTHER;
 }
 
-static char *decode_rfc1342(char *input) {
-	char *res = NULL, *p, *cur;
+/* Decodes RFC 1342 encoded words in input onto the end of the arena */
+static void decode_rfc1342(struct arena *res, char *input) {
+	char *p, *cur;
 	for (cur = input; *cur;) {
 		p = strstr(cur, "=?");
 		if (!p) {
-			strapp(&res, cur, strlen(cur));
+			arena_append(res, cur, strlen(cur));
 			break;
 		} else if (p == cur) {
 			char *start = cur;
 			char *charset = start + 2;
 			char *encoding = strchr(charset, '?');
 			if (!encoding) {
-				strapp(&res, cur, charset - cur);
+				arena_append(res, cur, charset - cur);
 				cur = charset;
 				continue;
 			}
 			encoding++;
 			if (encoding[1] != '?') {
-				strapp(&res, cur, encoding - cur);
+				arena_append(res, cur, encoding - cur);
 				cur = encoding;
 				continue;
 			}
 			char *data = encoding + 2;
 			char *end = strstr(data, "?=");
 			if (!end) {
-				strapp(&res, cur, strlen(cur));
+				arena_append(res, cur, strlen(cur));
 				break;
 			}
 			char *buf;
@@ -59,7 +95,7 @@ static char *decode_rfc1342(char *input) {
 				len = quoted_printable_decode(buf, end - data, QP_HEADERS);
 				buf[len] = 0;
 			} else {
-				strapp(&res, cur, end + 2 - cur);
+				arena_append(res, cur, end + 2 - cur);
 				cur = end + 2;
 				continue;
 			}
@@ -68,101 +104,160 @@ static char *decode_rfc1342(char *input) {
 				// everything's fine
 			} else {
 				char *new;
-				if (!(new = (char *)iconv_convert(buf, charset))) {
+				if (!(new = (char *)iconv_convert4(buf, charset, len, &len))) {
 					*(encoding - 1) = '?';
 					// leave the header as is, if an unknown encoding is encountered
 					free(buf);
-					strapp(&res, cur, end + 2 - cur);
+					arena_append(res, cur, end + 2 - cur);
 					cur = end + 2;
 					continue;
 				}
+				free(buf);
 				buf = new;
-				len = strlen(buf);
 			}
 			*(encoding - 1) = '?';
-			strapp(&res, buf, len);
+			arena_append(res, buf, len);
+			free(buf);
 			cur = end + 2;
 		} else {
-			strapp(&res, cur, p - cur);
+			arena_append(res, cur, p - cur);
 			cur = p;
 		}
 	}
-	return res;
 }
 
-int parse_headers(const char *headers, list_t *output) {
-	while (*headers && strstr(headers, "\r\n") == headers) {
+struct parsed_header {
+	size_t key, value;
+	enum header_id id;
+};
+
+static void finish_header(struct arena *arena, struct parsed_header *header) {
+	char *value = arena->data + header->value;
+	if (!strstr(value, "=?")) {
+		return;
+	}
+	// The decoded value replaces the raw one at the end of the arena
+	char *raw = strdup(value);
+	arena->len = header->value;
+	decode_rfc1342(arena, raw);
+	arena_append(arena, "", 1);
+	free(raw);
+}
+
+struct email_headers *parse_headers(const char *headers) {
+	struct arena arena = { 0 };
+	struct parsed_header *parsed = NULL;
+	size_t length = 0, size = 0;
+	while (strncmp(headers, "\r\n", 2) == 0) {
 		headers += 2;
 	}
 	while (*headers) {
-		char *crlf = strstr(headers, "\r\n");
-		char *null = strchr(headers, '\0');
-		char *eol = crlf == NULL ? null : crlf;
-		int eol_i = eol - headers;
-
-		if (isspace(*headers)) {
-			while (isspace(*++headers));
-			if (output->length != 0) {
-				/* Concat with previous line */
-				struct email_header *h = output->items[output->length - 1];
-				char *prev = h->value;
-				char *new = malloc(strlen(prev) + eol_i + 2);
-				strcpy(new, prev);
-				strcat(new, " ");
-				strncat(new, headers, eol_i);
-				new[eol_i + strlen(prev)] = '\0';
-				h->value = new;
-				free(prev);
-				headers = eol;
-				if (*headers) headers += 2;
+		const char *eol = strstr(headers, "\r\n");
+		if (!eol) {
+			eol = headers + strlen(headers);
+		}
+		const char *next = *eol ? eol + 2 : eol;
+		if (eol == headers) {
+			// The blank line after the last header
+			break;
+		}
+		if (isspace((unsigned char)*headers)) {
+			const char *text = headers;
+			while (text < eol && isspace((unsigned char)*text)) {
+				++text;
+			}
+			if (length != 0) {
+				/* Concat with previous line, in place of its NUL */
+				arena.len--;
+				arena_append(&arena, " ", 1);
+				arena_append(&arena, text, eol - text);
+				arena_append(&arena, "", 1);
+				headers = next;
 				continue;
 			}
+			headers = text;
 		}
 
-		char *colon = strchr(headers, ':');
+		const char *colon = memchr(headers, ':', eol - headers);
 		if (!colon) {
-			headers = eol;
-			if (*headers) headers += 2;
+			headers = next;
+			continue;
+		}
+		if (length != 0) {
+			finish_header(&arena, &parsed[length - 1]);
+		}
+		if (length == size) {
+			size = size ? size * 2 : 16;
+			parsed = realloc(parsed, size * sizeof(struct parsed_header));
 		}
-		int colon_i = colon - headers;
-		char *key = malloc(colon_i + 1);
-		strncpy(key, headers, colon_i);
-		key[colon_i] = '\0';
-		if (strstr(colon + 1, "\r\n") != colon + 1) {
-			colon_i += 2;
+		struct parsed_header *header = &parsed[length++];
+		header->id = header_id(headers, colon - headers);
+		header->key = arena_append(&arena, headers, colon - headers);
+		arena_append(&arena, "", 1);
+		const char *value = colon + 1;
+		while (value < eol && (*value == ' ' || *value == '\t')) {
+			++value;
 		}
-		char *value = malloc(eol_i - colon_i + 1);
-		strncpy(value, headers + colon_i, eol_i - colon_i);
-		value[eol_i - colon_i] = '\0';
-		headers = eol;
-		if (*headers) headers += 2;
-		struct email_header *header = calloc(1, sizeof(struct email_header));
-		header->key = key;
-		header->value = value;
-		list_add(output, header);
+		header->value = arena_append(&arena, value, eol - value);
+		arena_append(&arena, "", 1);
+		headers = next;
 	}
-	// Extra decoding here if necessary
-	for (size_t i = 0; i < output->length; ++i) {
-		struct email_header *header = output->items[i];
-		char *new, *old = header->value;
-		if ((new = decode_rfc1342(header->value))) {
-			header->value = new;
-			free(old);
+	if (length != 0) {
+		finish_header(&arena, &parsed[length - 1]);
+	}
+
+	struct email_headers *result = calloc(1, sizeof(struct email_headers));
+	result->items = calloc(length ? length : 1, sizeof(struct email_header));
+	result->length = length;
+	result->arena = arena.data;
+	result->arena_len = arena.len;
+	for (int id = 0; id < HEADER_COUNT; ++id) {
+		result->first[id] = -1;
+	}
+	for (size_t i = 0; i < length; ++i) {
+		struct email_header *header = &result->items[i];
+		header->key = arena.data + parsed[i].key;
+		header->value = arena.data + parsed[i].value;
+		header->id = parsed[i].id;
+		if (result->first[header->id] == -1) {
+			result->first[header->id] = (int)i;
 		}
 		worker_log(L_DEBUG, "Parsed header: %s: %s", header->key, header->value);
 	}
-	return 0;
+	free(parsed);
+	return result;
 }
 
-void free_headers(list_t *headers) {
-	if (!headers) return;
+struct email_headers *copy_headers(const struct email_headers *headers) {
+	if (!headers) {
+		return NULL;
+	}
+	struct email_headers *copy = malloc(sizeof(struct email_headers));
+	*copy = *headers;
+	copy->items = malloc((headers->length ? headers->length : 1)
+			* sizeof(struct email_header));
+	copy->arena = malloc(headers->arena_len ? headers->arena_len : 1);
+	memcpy(copy->arena, headers->arena, headers->arena_len);
 	for (size_t i = 0; i < headers->length; ++i) {
-		struct email_header *header = headers->items[i];
-		if (header) {
-			free(header->key);
-			free(header->value);
-			free(header);
-		}
+		const struct email_header *header = &headers->items[i];
+		copy->items[i].key = copy->arena + (header->key - headers->arena);
+		copy->items[i].value = copy->arena + (header->value - headers->arena);
+		copy->items[i].id = header->id;
+	}
+	return copy;
+}
+
+const char *find_header(const struct email_headers *headers, enum header_id id) {
+	if (!headers || id <= HEADER_OTHER || id >= HEADER_COUNT
+			|| headers->first[id] == -1) {
+		return NULL;
 	}
-	list_free(headers);
+	return headers->items[headers->first[id]].value;
+}
+
+void free_headers(struct email_headers *headers) {
+	if (!headers) return;
+	free(headers->items);
+	free(headers->arena);
+	free(headers);
 }
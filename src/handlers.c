@@ -11,6 +11,8 @@
 #include <errno.h>
 #include "config.h"
 #include "log.h"
+#include "search.h"
+#include "sort.h"
 #include "state.h"
 #include "ui.h"
 #include "email/headers.h"
@@ -18,12 +20,19 @@
 #include "worker.h"
 #include "pipeline.h"
 #include "subprocess.h"
+#include "columns.h"
 #include "commands.h"
 
 void handle_worker_connect_done(struct account_state *account,
 		struct worker_message *message) {
 	worker_post_action(account->worker.pipe, WORKER_LIST, NULL, NULL);
-	set_status(account, ACCOUNT_OKAY, "Connected.");
+	if (message->data) {
+		// Includes how long each phase of connecting took
+		set_status(account, ACCOUNT_OKAY, "%s", (char *)message->data);
+		free(message->data);
+	} else {
+		set_status(account, ACCOUNT_OKAY, "Connected.");
+	}
 }
 
 void handle_worker_connect_error(struct account_state *account,
@@ -31,11 +40,36 @@ void handle_worker_connect_error(struct account_state *account,
 	set_status(account, ACCOUNT_ERROR, (char *)message->data);
 }
 
+void handle_worker_disconnected(struct account_state *account,
+		struct worker_message *message) {
+	set_status(account, ACCOUNT_ERROR, "%s", (char *)message->data);
+	free(message->data);
+}
+
+void handle_worker_reconnect_done(struct account_state *account,
+		struct worker_message *message) {
+	/*
+	 * Unlike the first time we connected, our mailboxes are still good and
+	 * the worker has already told us about anything that changed.
+	 */
+	set_status(account, ACCOUNT_OKAY, "%s", (char *)message->data);
+	free(message->data);
+}
+
 void handle_worker_select_done(struct account_state *account,
 		struct worker_message *message) {
 	set_status(account, ACCOUNT_OKAY, "Connected.");
 	account->ui.list_offset = 0;
+	// Searches only apply to the mailbox they were made in
+	struct aerc_mailbox *previous = get_aerc_mailbox(account, account->selected);
+	if (previous) {
+		set_message_filter(previous, NULL, 0);
+	}
+	free(account->ui.search.query);
+	account->ui.search.query = NULL;
 	account->selected = strdup((char *)message->data);
+	account->ui.sort.local = false;
+	request_sort(account);
 	request_rerender(PANEL_MESSAGE_LIST);
 }
 
@@ -103,11 +137,23 @@ void handle_worker_mailbox_updated(struct account_state *account,
 			break;
 		}
 	}
+	if (old->filter) {
+		// Keep showing what matched until the search runs again
+		new->filter = old->filter;
+		new->filter_length = old->filter_length;
+		old->filter = NULL;
+	}
 	char buf[64];
 	sprintf(buf, "select-message %ld", new->exists - old->exists);
 	handle_command(buf);
 	int diff = new->exists - old->exists;
 	free_aerc_mailbox(old);
+	if (strcmp(new->name, account->selected) == 0) {
+		request_sort(account);
+		if (account->ui.search.query) {
+			request_search(account);
+		}
+	}
 	if (diff > 0) {
 		set_status(account, ACCOUNT_OKAY, "New email in this mailbox");
 		char bell = '\a';
@@ -122,6 +168,108 @@ void handle_worker_mailbox_updated(struct account_state *account,
 	request_rerender(PANEL_MESSAGE_LIST | PANEL_SIDEBAR);
 }
 
+void handle_worker_mailbox_status(struct account_state *account,
+		struct worker_message *message) {
+	struct aerc_mailbox_status *status = message->data;
+	struct aerc_mailbox *mbox = get_aerc_mailbox(account, status->name);
+	if (mbox) {
+		if (status->unseen > mbox->unseen && mbox->unseen != -1) {
+			set_status(account, ACCOUNT_OKAY, "New email in %s", mbox->name);
+		}
+		mbox->exists = status->exists;
+		mbox->recent = status->recent;
+		mbox->unseen = status->unseen;
+		request_rerender(PANEL_SIDEBAR);
+	}
+	free(status->name);
+	free(status);
+}
+
+void handle_worker_sort_done(struct account_state *account,
+		struct worker_message *message) {
+	struct aerc_sort_result *result = message->data;
+	struct aerc_mailbox *mbox = get_aerc_mailbox(account, result->mailbox);
+	if (mbox && account->ui.sort.key != SORT_NONE
+			&& strcmp(result->mailbox, account->selected) == 0) {
+		set_message_order(mbox, result->order, result->depth, result->length);
+		request_rerender(PANEL_MESSAGE_LIST);
+	} else {
+		free(result->order);
+		free(result->depth);
+	}
+	free(result->mailbox);
+	free(result);
+}
+
+void handle_worker_message_part_progress(struct account_state *account,
+		struct worker_message *message) {
+	struct aerc_part_progress *progress = message->data;
+	account->viewer.downloading = !progress->done;
+	if (progress->done) {
+		if (progress->cancelled) {
+			set_status(account, ACCOUNT_OKAY, "Download cancelled");
+		} else {
+			set_status(account, ACCOUNT_OKAY, "Downloaded %.1f MiB",
+					progress->received / 1048576.0);
+		}
+	} else {
+		set_status(account, ACCOUNT_OKAY, "Downloading message: %.1f of "
+				"%.1f MiB (%d%%)", progress->received / 1048576.0,
+				progress->total / 1048576.0,
+				(int)(progress->received * 100 / progress->total));
+	}
+	free(progress);
+}
+
+void handle_worker_search_done(struct account_state *account,
+		struct worker_message *message) {
+	struct aerc_search_result *result = message->data;
+	struct aerc_mailbox *mbox = get_aerc_mailbox(account, result->mailbox);
+	if (mbox && account->ui.search.query
+			&& strcmp(result->mailbox, account->selected) == 0) {
+		set_message_filter(mbox, result->ranges, result->length);
+		size_t rows = get_message_rows(mbox);
+		if (account->ui.selected_message >= rows) {
+			account->ui.selected_message = rows ? rows - 1 : 0;
+		}
+		if (account->ui.list_offset > account->ui.selected_message) {
+			account->ui.list_offset = account->ui.selected_message;
+		}
+		if (account->ui.search.announce) {
+			set_status(account, ACCOUNT_OKAY, "%zd %s match", result->count,
+					result->count == 1 ? "message" : "messages");
+			account->ui.search.announce = false;
+		}
+		request_rerender(PANEL_MESSAGE_LIST);
+	} else {
+		free(result->ranges);
+	}
+	free(result->mailbox);
+	free(result);
+}
+
+void handle_worker_search_error(struct account_state *account,
+		struct worker_message *message) {
+	set_status(account, ACCOUNT_ERROR, "Search failed: %s",
+			(char *)message->data);
+	free(message->data);
+	free(account->ui.search.query);
+	account->ui.search.query = NULL;
+	request_search(account);
+}
+
+void handle_worker_sort_error(struct account_state *account,
+		struct worker_message *message) {
+	if (message->data) {
+		worker_log(L_DEBUG, "Server couldn't sort: %s", (char *)message->data);
+		free(message->data);
+	}
+	if (account->ui.sort.key != SORT_NONE) {
+		account->ui.sort.local = true;
+		request_sort(account);
+	}
+}
+
 void load_message_viewer(struct account_state *account) {
 	struct aerc_message *msg = account->viewer.msg;
 	if (!msg->parts) {
@@ -164,7 +312,14 @@ void handle_worker_message_updated(struct account_state *account,
 		if (old->index == new->index) {
 			free_aerc_message(mbox->messages->items[i]);
 			mbox->messages->items[i] = new;
-			rerender_item(i);
+			update_message_columns(mbox, i);
+			if (account->ui.sort.local) {
+				// Its headers might put it somewhere else now
+				account->ui.sort.dirty = true;
+				request_rerender(PANEL_MESSAGE_LIST);
+			} else {
+				rerender_item(i);
+			}
 			if (account->viewer.msg == old) {
 				account->viewer.msg = new;
 				load_message_viewer(account);
@@ -191,6 +346,8 @@ void handle_worker_message_deleted(struct account_state *account,
 		}
 	}
 	if (msg) {
+		remove_message_order(mbox, delete->index);
+		remove_message_columns(mbox, delete->index);
 		free_aerc_message(msg);
 		// Note: we need to be careful not to reference the viewer's message
 		// because it could have been freed here
@@ -3,12 +3,54 @@
  */
 #define _POSIX_C_SOURCE 201112LL
 
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdbool.h>
 
 #include "imap/imap.h"
 
+/*
+ * Each one of these capabilities is supported (or at least tracked) by aerc.
+ * This array includes the name of the capability and the offset of the
+ * corresponding bool in the imap_capabilities structure.
+ */
+static const struct {
+	const char *name;
+	size_t offset;
+} capabilities[] = {
+	{ "IMAP4rev1", offsetof(struct imap_capabilities, imap4rev1) },
+	{ "STARTTLS", offsetof(struct imap_capabilities, starttls) },
+	{ "LOGINDISABLED", offsetof(struct imap_capabilities, logindisabled) },
+	{ "AUTH=PLAIN", offsetof(struct imap_capabilities, auth_plain) },
+	{ "AUTH=LOGIN", offsetof(struct imap_capabilities, auth_login) },
+	{ "IDLE", offsetof(struct imap_capabilities, idle) },
+	{ "SASL-IR", offsetof(struct imap_capabilities, sasl_ir) },
+	{ "COMPRESS=DEFLATE", offsetof(struct imap_capabilities, compress_deflate) },
+	{ "CONDSTORE", offsetof(struct imap_capabilities, condstore) },
+	{ "QRESYNC", offsetof(struct imap_capabilities, qresync) },
+	{ "MOVE", offsetof(struct imap_capabilities, move) },
+	{ "UIDPLUS", offsetof(struct imap_capabilities, uidplus) },
+	{ "LITERAL+", offsetof(struct imap_capabilities, literal_plus) },
+	{ "ESEARCH", offsetof(struct imap_capabilities, esearch) },
+	{ "SORT", offsetof(struct imap_capabilities, sort) },
+	{ "THREAD=REFERENCES", offsetof(struct imap_capabilities, thread_references) },
+	{ "THREAD=ORDEREDSUBJECT", offsetof(struct imap_capabilities, thread_orderedsubject) },
+	{ "LIST-STATUS", offsetof(struct imap_capabilities, list_status) },
+	{ "BINARY", offsetof(struct imap_capabilities, binary) },
+	{ "NOTIFY", offsetof(struct imap_capabilities, notify) },
+};
+
+static void set_capability(struct imap_capabilities *cap, const char *name) {
+	for (size_t i = 0; i < sizeof(capabilities) / sizeof(capabilities[0]); ++i) {
+		if (strcasecmp(capabilities[i].name, name) == 0) {
+			*(bool *)((char *)cap + capabilities[i].offset) = true;
+		}
+	}
+}
+
 void imap_capability(struct imap_connection *imap, imap_callback_t callback,
 		void *data) {
 	imap_send(imap, callback, data, "CAPABILITY");
@@ -19,32 +61,49 @@ void handle_imap_capability(struct imap_connection *imap, const char *token,
 	struct imap_capabilities *cap = calloc(1,
 			sizeof(struct imap_capabilities));
 
-	/*
-	 * Each one of these capabilities is supported (or at least tracked) by
-	 * aerc. This array includes the name of the capability and a pointer to the
-	 * corresponding bool in the imap_capabilities structure.
-	 */
-	struct { const char *name; bool *ptr; } ptrs[] = {
-		{ "IMAP4rev1", &cap->imap4rev1 },
-		{ "STARTTLS", &cap->starttls },
-		{ "LOGINDISABLED", &cap->logindisabled },
-		{ "AUTH=PLAIN", &cap->auth_plain },
-		{ "AUTH=LOGIN", &cap->auth_login },
-		{ "IDLE", &cap->idle },
-		{ "SASL-IR", &cap->sasl_ir }
-	};
-
 	while (args) {
 		if (args->type == IMAP_STRING || args->type == IMAP_ATOM) {
-			for (size_t j = 0; j < sizeof(ptrs) / (sizeof(void*) * 2); ++j) {
-				if (strcmp(ptrs[j].name, args->str) == 0) {
-					*ptrs[j].ptr = true;
-				}
-			}
+			set_capability(cap, args->str);
 		}
 		args = args->next;
 	}
 
 	free(imap->cap);
 	imap->cap = cap;
+	imap->cap_cached = false;
+}
+
+char *imap_capabilities_format(const struct imap_capabilities *cap) {
+	size_t len = 0;
+	for (size_t i = 0; i < sizeof(capabilities) / sizeof(capabilities[0]); ++i) {
+		len += strlen(capabilities[i].name) + 1;
+	}
+	char *str = malloc(len + 1);
+	str[0] = '\0';
+	for (size_t i = 0; i < sizeof(capabilities) / sizeof(capabilities[0]); ++i) {
+		if (*(bool *)((char *)cap + capabilities[i].offset)) {
+			if (str[0]) {
+				strcat(str, " ");
+			}
+			strcat(str, capabilities[i].name);
+		}
+	}
+	return str;
+}
+
+struct imap_capabilities *imap_capabilities_parse(const char *str) {
+	struct imap_capabilities *cap = calloc(1,
+			sizeof(struct imap_capabilities));
+	char name[64];
+	while (*str) {
+		size_t len = strcspn(str, " \t\r\n");
+		if (len > 0 && len < sizeof(name)) {
+			memcpy(name, str, len);
+			name[len] = '\0';
+			set_capability(cap, name);
+		}
+		str += len;
+		str += strspn(str, " \t\r\n");
+	}
+	return cap;
 }
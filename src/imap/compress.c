@@ -0,0 +1,54 @@
+/*
+ * imap/compress.c - issues IMAP COMPRESS commands (RFC 4978)
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+
+#include "imap/imap.h"
+#include "internal/imap.h"
+#include "log.h"
+
+#ifdef USE_ZLIB
+
+struct callback_data {
+	void *data;
+	imap_callback_t callback;
+};
+
+static void imap_compress_callback(struct imap_connection *imap,
+		void *data, enum imap_status status, const char *args) {
+	struct callback_data *cbdata = data;
+	if (status == STATUS_OK) {
+		/*
+		 * The server starts compressing right after the CRLF of its OK. We
+		 * can't switch the socket over from here, because the receive loop
+		 * may already hold compressed bytes that followed this response; it
+		 * hands those to the socket when it sees this flag.
+		 */
+		imap->compress_pending = true;
+	} else {
+		worker_log(L_DEBUG, "Server refused compression: %s", args);
+	}
+	if (cbdata->callback) {
+		cbdata->callback(imap, cbdata->data, status, args);
+	}
+	free(cbdata);
+}
+
+#endif
+
+void imap_compress(struct imap_connection *imap, imap_callback_t callback,
+		void *data) {
+#ifdef USE_ZLIB
+	struct callback_data *cbdata = malloc(sizeof(struct callback_data));
+	cbdata->data = data;
+	cbdata->callback = callback;
+	imap_send(imap, imap_compress_callback, cbdata, "COMPRESS DEFLATE");
+#else
+	if (callback) {
+		callback(imap, data, STATUS_PRE_ERROR,
+				"aerc was compiled without compression support");
+	}
+#endif
+}
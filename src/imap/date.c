@@ -1,11 +1,92 @@
-#define _XOPEN_SOURCE
+/*
+ * imap/date.c - parses IMAP's date-time
+ *
+ * INTERNALDATE always looks like "17-Jul-2024 09:12:44 +0200", so we read
+ * the fields where they are rather than going through strptime, which has to
+ * interpret a format string and look the month names up in the locale.
+ */
+#define _POSIX_C_SOURCE 200809L
 
+#include <stdbool.h>
+#include <strings.h>
 #include <time.h>
 
-char *parse_imap_date(const char *str, struct tm *time) {
+#include "imap/date.h"
+
+static const char *months[] = {
+	"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+	"Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
+};
+
+/* Reads between min and max digits */
+static bool number(const char **str, int min, int max, int *out) {
+	int n = 0, value = 0;
+	for (; n < max && **str >= '0' && **str <= '9'; ++n, ++*str) {
+		value = value * 10 + (**str - '0');
+	}
+	*out = value;
+	return n >= min;
+}
+
+static bool expect(const char **str, char c) {
+	if (**str != c) {
+		return false;
+	}
+	++*str;
+	return true;
+}
+
+static long long days_from_civil(long long year, int month, int day) {
+	year -= month <= 2;
+	long long era = (year >= 0 ? year : year - 399) / 400;
+	long long yoe = year - era * 400;
+	long long doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+	long long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+const char *parse_imap_date(const char *str, time_t *time, short *zone) {
 	/*
 	 * Note: IMAP dates and email header dates (i.e. RFC2822) are two different
 	 * formats.
 	 */
-	return strptime(str, "%d-%b-%Y %H:%M:%S %z", time);
+	int day, month = -1, year, hour, min, sec, zh, zm;
+	if (*str == ' ') {
+		// The day is padded with a space rather than a zero
+		++str;
+	}
+	if (!number(&str, 1, 2, &day) || !expect(&str, '-')) {
+		return NULL;
+	}
+	for (int i = 0; i < 12; ++i) {
+		if (strncasecmp(str, months[i], 3) == 0) {
+			month = i + 1;
+			break;
+		}
+	}
+	if (month == -1) {
+		return NULL;
+	}
+	str += 3;
+	if (!expect(&str, '-') || !number(&str, 4, 4, &year)
+			|| !expect(&str, ' ') || !number(&str, 2, 2, &hour)
+			|| !expect(&str, ':') || !number(&str, 2, 2, &min)
+			|| !expect(&str, ':') || !number(&str, 2, 2, &sec)
+			|| !expect(&str, ' ')) {
+		return NULL;
+	}
+	if (*str != '+' && *str != '-') {
+		return NULL;
+	}
+	int sign = *str++ == '-' ? -1 : 1;
+	if (!number(&str, 2, 2, &zh) || !number(&str, 2, 2, &zm)) {
+		return NULL;
+	}
+	if (day < 1 || day > 31 || hour > 23 || min > 59 || sec > 60 || zm > 59) {
+		return NULL;
+	}
+	*zone = sign * (zh * 60 + zm);
+	*time = days_from_civil(year, month, day) * 86400
+		+ hour * 3600 + min * 60 + sec - *zone * 60;
+	return str;
 }
@@ -12,6 +12,7 @@
 #include <time.h>
 
 #include "email/encodings.h"
+#include "email/flags.h"
 #include "email/headers.h"
 #include "imap/date.h"
 #include "imap/imap.h"
@@ -52,47 +53,53 @@ void imap_fetch(struct imap_connection *imap, imap_callback_t callback,
 	}
 }
 
-static int handle_flags(struct mailbox_message *msg, imap_arg_t *args) {
+static int handle_flags(struct imap_connection *imap,
+		struct mailbox_message *msg, imap_arg_t *args) {
+	struct mailbox *mbox = get_mailbox(imap, imap->selected);
 	args = args->list;
-	free_flat_list(msg->flags);
-	msg->flags = create_list();
+	msg->flags = 0;
 	while (args) {
 		assert(args->type == IMAP_ATOM);
-		list_add(msg->flags, strdup(args->str));
+		msg->flags |= flag_bit(&mbox->keywords, args->str, true);
 		worker_log(L_DEBUG, "Set flag for message: %s", args->str);
 		args = args->next;
 	}
 	return 0;
 }
 
-static int handle_uid(struct mailbox_message *msg, imap_arg_t *args) {
+static int handle_uid(struct imap_connection *imap,
+		struct mailbox_message *msg, imap_arg_t *args) {
 	assert(args->type == IMAP_NUMBER);
 	worker_log(L_DEBUG, "Message UID: %ld", args->num);
 	msg->uid = args->num;
 	return 0;
 }
 
-static int handle_internaldate(struct mailbox_message *msg, imap_arg_t *args) {
+static int handle_size(struct imap_connection *imap,
+		struct mailbox_message *msg, imap_arg_t *args) {
+	assert(args->type == IMAP_NUMBER);
+	msg->size = args->num;
+	return 0;
+}
+
+static int handle_internaldate(struct imap_connection *imap,
+		struct mailbox_message *msg, imap_arg_t *args) {
 	assert(args->type == IMAP_STRING);
-	msg->internal_date = malloc(sizeof(struct tm));
-	char *r = parse_imap_date(args->str, msg->internal_date);
+	const char *r = parse_imap_date(args->str,
+			&msg->internal_date, &msg->internal_zone);
 	if (!r || *r) {
 		worker_log(L_DEBUG, "Warning: received invalid date for message (%s)",
 				args->str);
+		msg->internal_date = 0;
+		msg->internal_zone = 0;
 	} else {
-		char date[64];
-		strftime(date, sizeof(date), "%F %H:%M %z", msg->internal_date);
-		worker_log(L_DEBUG, "Message internal date: %s", date);
+		worker_log(L_DEBUG, "Message internal date: %s", args->str);
 	}
 	return 0;
 }
 
-static void handle_body_content(struct message_part *part, imap_arg_t *args) {
-	free(part->content);
-	part->content = malloc(part->size);
-	memcpy(part->content, args->str, part->size);
-	worker_log(L_DEBUG, "Received message body");
-	if (part->body_encoding) {
+void message_part_decode(struct message_part *part, bool decoded) {
+	if (part->body_encoding && !decoded) {
 		if (strcasecmp(part->body_encoding, "7bit") == 0 ||
 			strcasecmp(part->body_encoding, "8bit") == 0 ||
 			strcasecmp(part->body_encoding, "binary") == 0) {
@@ -110,7 +117,7 @@ static void handle_body_content(struct message_part *part, imap_arg_t *args) {
 			}
 			free(part->content);
 			part->content = plain;
-			part->size = strlen((char *)plain);
+			part->size = len;
 		} else {
 			worker_log(L_ERROR, "Unknown encoding %s. Please report this.", part->body_encoding);
 		}
@@ -139,13 +146,22 @@ static void handle_body_content(struct message_part *part, imap_arg_t *args) {
 	}
 }
 
-static int flag_cmp(const void *_item, const void *_flag) {
-	const char *item = _item;
-	const char *flag = _flag;
-	return strcmp(item, flag);
+/* With BINARY, the server has already undone the transfer encoding for us */
+static void handle_body_content(struct message_part *part, imap_arg_t *args,
+		bool decoded) {
+	free(part->content);
+	// NIL comes through as an atom
+	part->size = args->type == IMAP_STRING ? (long)args->len : 0;
+	part->content = malloc(part->size + 1);
+	memcpy(part->content, args->str, part->size);
+	part->content[part->size] = '\0';
+	worker_log(L_DEBUG, "Received message body (%ld bytes%s)", part->size,
+			decoded ? ", decoded by the server" : "");
+	message_part_decode(part, decoded);
 }
 
-static int handle_body(struct mailbox_message *msg, imap_arg_t *args) {
+static int handle_section(struct imap_connection *imap,
+		struct mailbox_message *msg, imap_arg_t *args, bool binary) {
 	assert(args->type == IMAP_RESPONSE);
 	worker_log(L_DEBUG, "Handling message body fields");
 	imap_arg_t *resp = calloc(1, sizeof(imap_arg_t));
@@ -154,11 +170,17 @@ static int handle_body(struct mailbox_message *msg, imap_arg_t *args) {
 	assert(_ == 2); // imap_parse_args expects \r\n, not present
 	args = args->next;
 	assert(args);
+	long offset = -1;
+	if (args->type == IMAP_ATOM && args->str[0] == '<') {
+		// A partial fetch like BODY[2]<65536>, which starts that far in
+		offset = strtol(args->str + 1, NULL, 10);
+		args = args->next;
+		assert(args);
+	}
 	switch (resp->type) {
 	case IMAP_ATOM:
 		if (strcmp(resp->str, "HEADER.FIELDS") == 0) {
-			list_t *headers = create_list();
-			parse_headers(args->str, headers);
+			struct email_headers *headers = parse_headers(args->str);
 			free_headers(msg->headers);
 			msg->headers = headers;
 			worker_log(L_DEBUG, "Received message headers");
@@ -168,12 +190,21 @@ static int handle_body(struct mailbox_message *msg, imap_arg_t *args) {
 		size_t i = resp->num - 1;
 		assert(msg->parts);
 		assert(i < msg->parts->length);
-		int seen = list_seq_find(msg->flags, flag_cmp, "\\Seen");
-		if (seen != -1) {
-			list_add(msg->flags, strdup("\\Seen"));
+		/*
+		 * Fetching without .PEEK sets \Seen, but we may have asked with it,
+		 * so we leave that to the FLAGS that come with it.
+		 */
+		if (offset != -1) {
+			// Whoever asked for it puts the pieces together
+			if (imap->events.part_chunk) {
+				imap->events.part_chunk(imap, msg, i, offset,
+						args->type == IMAP_STRING ? args->str : "",
+						args->type == IMAP_STRING ? args->len : 0, binary);
+			}
+			break;
 		}
 		struct message_part *part = msg->parts->items[i];
-		handle_body_content(part, args);
+		handle_body_content(part, args, binary);
 		break;
 	}
 	default:
@@ -181,7 +212,17 @@ static int handle_body(struct mailbox_message *msg, imap_arg_t *args) {
 		break;
 	}
 	imap_arg_free(resp);
-	return 1; // We used one extra argument
+	return offset == -1 ? 1 : 2; // We used one or two extra arguments
+}
+
+static int handle_body(struct imap_connection *imap,
+		struct mailbox_message *msg, imap_arg_t *args) {
+	return handle_section(imap, msg, args, false);
+}
+
+static int handle_binary(struct imap_connection *imap,
+		struct mailbox_message *msg, imap_arg_t *args) {
+	return handle_section(imap, msg, args, true);
 }
 
 static char *get_str(imap_arg_t *args) {
@@ -251,7 +292,8 @@ static void extract_parts(struct mailbox_message *msg, imap_arg_t *args) {
 	}
 }
 
-static int handle_bodystructure(struct mailbox_message *msg, imap_arg_t *args) {
+static int handle_bodystructure(struct imap_connection *imap,
+		struct mailbox_message *msg, imap_arg_t *args) {
 	assert(args->type == IMAP_LIST);
 	if (!msg->parts) {
 		msg->parts = create_list();
@@ -267,13 +309,48 @@ static int handle_bodystructure(struct mailbox_message *msg, imap_arg_t *args) {
 	return 0;
 }
 
+/*
+ * Lanes can't trust their sequence numbers to match the main connection's, so
+ * they find messages by UID instead.
+ */
+static struct mailbox_message *get_message_by_uid(struct mailbox *mbox,
+		imap_arg_t *args) {
+	long uid = -1;
+	for (; args && args->next; args = args->next->next) {
+		if (args->type == IMAP_ATOM && strcmp(args->str, "UID") == 0
+				&& args->next->type == IMAP_NUMBER) {
+			uid = args->next->num;
+			break;
+		}
+	}
+	for (size_t i = 0; uid != -1 && i < mbox->messages->length; ++i) {
+		struct mailbox_message *msg = mbox->messages->items[i];
+		if (msg->populated && msg->uid == uid) {
+			return msg;
+		}
+	}
+	return NULL;
+}
+
 void handle_imap_fetch(struct imap_connection *imap, const char *token,
 		const char *cmd, imap_arg_t *args) {
 	assert(args->type == IMAP_NUMBER);
 	char *selected = imap->selected;
-	struct mailbox *mbox = get_mailbox(imap, selected);
+	struct mailbox *mbox = selected ? get_mailbox(imap, selected) : NULL;
 	int index = args->num - 1;
-	struct mailbox_message *msg = get_message(mbox, index);
+	struct mailbox_message *msg;
+	if (imap->lanes.primary) {
+		msg = mbox ? get_message_by_uid(mbox, args->next->list) : NULL;
+		if (!msg) {
+			// i.e. a flag change, which the main connection will hear about
+			if (imap->events.lane_update) {
+				imap->events.lane_update(imap, cmd);
+			}
+			return;
+		}
+	} else {
+		msg = get_message(mbox, index);
+	}
 	worker_log(L_DEBUG, "Received FETCH for message %d", index + 1);
 	args = args->next;
 	assert(args->type == IMAP_LIST);
@@ -283,13 +360,18 @@ void handle_imap_fetch(struct imap_connection *imap, const char *token,
 	const struct {
 		const char *name;
 		enum imap_type expected_type;
-		int (*handler)(struct mailbox_message *, imap_arg_t *);
+		int (*handler)(struct imap_connection *, struct mailbox_message *,
+				imap_arg_t *);
+		/* Doesn't count towards the message being populated */
+		bool optional;
 	} handlers[] = {
-		{ "UID", IMAP_NUMBER, handle_uid },
-		{ "FLAGS", IMAP_LIST, handle_flags },
-		{ "INTERNALDATE", IMAP_STRING, handle_internaldate },
-		{ "BODY", IMAP_RESPONSE, handle_body },
-		{ "BODYSTRUCTURE", IMAP_LIST, handle_bodystructure },
+		{ "UID", IMAP_NUMBER, handle_uid, false },
+		{ "FLAGS", IMAP_LIST, handle_flags, false },
+		{ "INTERNALDATE", IMAP_STRING, handle_internaldate, false },
+		{ "RFC822.SIZE", IMAP_NUMBER, handle_size, true },
+		{ "BODY", IMAP_RESPONSE, handle_body, false },
+		{ "BODYSTRUCTURE", IMAP_LIST, handle_bodystructure, false },
+		{ "BINARY", IMAP_RESPONSE, handle_binary, true },
 	};
 	bool handled[sizeof(handlers) / sizeof(handlers[0])] = { false };
 
@@ -302,7 +384,7 @@ void handle_imap_fetch(struct imap_connection *imap, const char *token,
 		for (size_t i = 0; i < sizeof(handlers) / sizeof(handlers[0]); ++i) {
 			if (strcmp(handlers[i].name, name) == 0) {
 				assert(args->type == handlers[i].expected_type);
-				int j = handlers[i].handler(msg, args);
+				int j = handlers[i].handler(imap, msg, args);
 				handled[i] = true;
 				while (j-- && args) args = args->next;
 			}
@@ -321,7 +403,7 @@ void handle_imap_fetch(struct imap_connection *imap, const char *token,
 		for (size_t i = 0; i < sizeof(handled) / sizeof(handled[0]); ++i) {
 			worker_log(L_DEBUG, "%s was %shandled", handlers[i].name,
 				   handled[i] ? "" : "not ");
-			msg->populated &= handled[i];
+			msg->populated &= handled[i] || handlers[i].optional;
 		}
 	}
 
@@ -4,6 +4,7 @@
 #define _POSIX_C_SOURCE 201112LL
 
 #include <assert.h>
+#include <errno.h>
 #include <poll.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -23,6 +24,8 @@
 #include "util/stringop.h"
 
 #define BUFFER_SIZE 1024
+/* Outstanding commands we make room for up front, must be a power of two */
+#define PENDING_WINDOW 64
 
 bool inited = false;
 hashtable_t *internal_handlers = NULL;
@@ -34,12 +37,94 @@ FILE *raw;
 typedef void (*imap_handler_t)(struct imap_connection *imap,
 	const char *token, const char *cmd, imap_arg_t *args);
 
-struct imap_pending_callback *make_callback(imap_callback_t callback, void *data) {
-	// This just holds the user reference along with the callback pointer
-	struct imap_pending_callback *cb = malloc(sizeof(struct imap_pending_callback));
+unsigned int imap_pending_push(struct imap_connection *imap,
+		imap_callback_t callback, void *data) {
+	unsigned int tag = imap->next_tag++;
+	while (imap->pending[tag & (imap->pending_size - 1)].active) {
+		/*
+		 * The window is full of commands the server hasn't answered yet, so
+		 * double it and move everything to its new slot.
+		 */
+		size_t size = imap->pending_size * 2;
+		struct imap_pending_callback *ring = calloc(size,
+				sizeof(struct imap_pending_callback));
+		for (size_t i = 0; i < imap->pending_size; ++i) {
+			if (imap->pending[i].active) {
+				ring[imap->pending[i].tag & (size - 1)] = imap->pending[i];
+			}
+		}
+		free(imap->pending);
+		imap->pending = ring;
+		imap->pending_size = size;
+	}
+	struct imap_pending_callback *cb = &imap->pending[tag & (imap->pending_size - 1)];
+	cb->active = true;
+	cb->tag = tag;
 	cb->callback = callback;
 	cb->data = data;
-	return cb;
+	get_nanoseconds(&cb->sent);
+	return tag;
+}
+
+bool imap_pending_pop(struct imap_connection *imap, const char *token,
+		struct imap_pending_callback *out) {
+	if (strcmp(token, "*") == 0) {
+		// Only the first untagged status is the greeting
+		if (!imap->greeting.active) {
+			return false;
+		}
+		*out = imap->greeting;
+		imap->greeting.active = false;
+		return true;
+	}
+	char *end;
+	if (token[0] != 'a' || token[1] < '0' || token[1] > '9') {
+		return false;
+	}
+	unsigned long tag = strtoul(token + 1, &end, 10);
+	if (*end) {
+		return false;
+	}
+	struct imap_pending_callback *cb = &imap->pending[tag & (imap->pending_size - 1)];
+	if (!cb->active || cb->tag != tag) {
+		return false;
+	}
+	*out = *cb;
+	cb->active = false;
+
+	double elapsed = get_elapsed_ms(&cb->sent);
+	int bucket = 0;
+	while (bucket < IMAP_LATENCY_BUCKETS - 1 && (1 << bucket) <= elapsed) {
+		++bucket;
+	}
+	imap->latency[bucket]++;
+	return true;
+}
+
+static void log_latency(struct imap_connection *imap) {
+	char buf[256] = "";
+	size_t len = 0;
+	for (int i = 0; i < IMAP_LATENCY_BUCKETS && len < sizeof(buf); ++i) {
+		if (imap->latency[i]) {
+			len += snprintf(buf + len, sizeof(buf) - len, " %s%dms: %lu",
+					i == IMAP_LATENCY_BUCKETS - 1 ? ">=" : "<",
+					1 << (i == IMAP_LATENCY_BUCKETS - 1 ? i - 1 : i),
+					imap->latency[i]);
+		}
+	}
+	worker_log(L_DEBUG, "Command round trips:%s", len ? buf : " none yet");
+}
+
+static bool lane_handles(const char *cmd) {
+	// LIST and STATUS only come in answer to the status polls we send
+	const char *handled[] = { "OK", "NO", "BAD", "PREAUTH", "BYE",
+		"CAPABILITY", "FETCH", "LIST", "STATUS" };
+	for (size_t i = 0; i < sizeof(handled) / sizeof(handled[0]); ++i) {
+		if (strcmp(handled[i], cmd) == 0) {
+			return true;
+		}
+	}
+	return false;
 }
 
 int handle_line(struct imap_connection *imap, imap_arg_t *arg) {
@@ -72,6 +157,13 @@ int handle_line(struct imap_connection *imap, imap_arg_t *arg) {
 	}
 	assert(arg->type == IMAP_ATOM);
 	assert(arg->next->type == IMAP_ATOM);
+	if (imap->lanes.primary && !lane_handles(arg->next->str)) {
+		// The main connection hears about this too and takes care of it
+		if (imap->events.lane_update) {
+			imap->events.lane_update(imap, arg->next->str);
+		}
+		return 0;
+	}
 	imap_handler_t handler = hashtable_get(internal_handlers, arg->next->str);
 	if (handler) {
 		handler(imap, arg->str, arg->next->str, arg->next->next);
@@ -81,69 +173,205 @@ int handle_line(struct imap_connection *imap, imap_arg_t *arg) {
 	return 0;
 }
 
+static void out_reserve(struct imap_connection *imap, size_t len) {
+	if (imap->out_size - imap->out_len > len) {
+		return;
+	}
+	size_t size = imap->out_size;
+	while (size - imap->out_len <= len) {
+		size *= 2;
+	}
+	char *out = malloc(size);
+	memcpy(out, imap->out, imap->out_len);
+	// The old buffer might have had credentials in it
+	memset(imap->out, 0, imap->out_size);
+	free(imap->out);
+	imap->out = out;
+	imap->out_size = size;
+}
+
+static void out_append(struct imap_connection *imap, const char *str, size_t len) {
+	out_reserve(imap, len);
+	memcpy(imap->out + imap->out_len, str, len);
+	imap->out_len += len;
+}
+
 void imap_send(struct imap_connection *imap, imap_callback_t callback,
 		void *data, const char *fmt, ...) {
+	if (!imap->socket) {
+		// The connection was lost, don't leave the caller hanging
+		if (callback) {
+			callback(imap, data, STATUS_PRE_ERROR, "Not connected");
+		}
+		return;
+	}
 	if (imap->mode == RECV_IDLE) {
 		worker_log(L_DEBUG, "Leaving IDLE");
 		imap->mode = RECV_LINE;
-		char *done = "DONE\r\n";
-		ab_send(imap->socket, done, strlen(done));
-#ifndef NDEBUG
-		if (raw) {
-			fwrite(done, 1, strlen(done), raw);
-			fflush(raw);
-		}
-#endif
+		out_append(imap, "DONE\r\n", 6);
 	}
 
+	/*
+	 * Commands are formatted straight into the output buffer, which goes out
+	 * in one write the next time imap_receive runs.
+	 */
+	char tag[16];
+	int taglen = snprintf(tag, sizeof(tag), "a%u",
+			imap_pending_push(imap, callback, data));
+	out_append(imap, tag, taglen);
+	out_append(imap, " ", 1);
+	size_t start = imap->out_len;
 	va_list args;
 	va_start(args, fmt);
-	int len = vsnprintf(NULL, 0, fmt, args);
+	int len = vsnprintf(imap->out + start, imap->out_size - start, fmt, args);
 	va_end(args);
-
-	char *buf = malloc(len + 1);
-	va_start(args, fmt);
-	vsnprintf(buf, len + 1, fmt, args);
-	va_end(args);
-
-	len = snprintf(NULL, 0, "a%04d", imap->next_tag);
-	char *tag = malloc(len + 1);
-	snprintf(tag, len + 1, "a%04d", imap->next_tag++);
-
-	len = snprintf(NULL, 0, "%s %s\r\n", tag, buf);
-	char *cmd = malloc(len + 1);
-	snprintf(cmd, len + 1, "%s %s\r\n", tag, buf);
-
-	ab_send(imap->socket, cmd, len);
-#ifndef NDEBUG
-	if (raw) {
-		fwrite(cmd, 1, len, raw);
-		fflush(raw);
+	if ((size_t)len + 2 >= imap->out_size - start) {
+		out_reserve(imap, len + 2);
+		va_start(args, fmt);
+		vsnprintf(imap->out + start, imap->out_size - start, fmt, args);
+		va_end(args);
 	}
-#endif
-	hashtable_set(imap->pending, tag, make_callback(callback, data));
+	imap->out_len += len;
+	out_append(imap, "\r\n", 2);
 
-	if (strncmp("LOGIN ", buf, 6) == 0) {
+	const char *cmd = imap->out + start;
+	if (strncmp("LOGIN ", cmd, 6) == 0) {
 		worker_log(L_DEBUG, "-> %s LOGIN *****", tag);
-		memset(buf, 0, strlen(buf));
-		memset(cmd, 0, strlen(cmd));
-	} else if (strncmp("AUTHENTICATE ", buf, 13) == 0) {
+		imap->out_sensitive = true;
+	} else if (strncmp("AUTHENTICATE ", cmd, 13) == 0) {
 		worker_log(L_DEBUG, "-> %s AUTHENTICATE *****", tag);
-		memset(buf, 0, strlen(buf));
-		memset(cmd, 0, strlen(cmd));
+		imap->out_sensitive = true;
 		worker_log(L_DEBUG, "Note: core dumps do not include your password past this point");
 	} else {
-		worker_log(L_DEBUG, "-> %s %s", tag, buf);
+		worker_log(L_DEBUG, "-> %s %.*s", tag, len, cmd);
 	}
+}
 
-	free(cmd);
-	free(buf);
-	free(tag);
+static void imap_flush(struct imap_connection *imap) {
+	if (!imap->socket || imap->socket->state != AB_CONNECTED) {
+		return;
+	}
+	if (imap->out_len) {
+		ssize_t amt = ab_send(imap->socket, imap->out, imap->out_len);
+		if (amt > 0) {
+#ifndef NDEBUG
+			if (raw) {
+				fwrite(imap->out, 1, amt, raw);
+				fflush(raw);
+			}
+#endif
+			memmove(imap->out, imap->out + amt, imap->out_len - amt);
+			imap->out_len -= amt;
+		}
+		if (!imap->out_len && imap->out_sensitive) {
+			memset(imap->out, 0, imap->out_size);
+			imap->out_sensitive = false;
+		}
+	}
+	ab_flush(imap->socket);
+}
+
+static void fail_pending(struct imap_connection *imap, const char *error) {
+	// The greeting belongs to the old connection, drop it quietly
+	imap->greeting.active = false;
+	imap->starttls.active = false;
+	/*
+	 * Callbacks may queue more commands (which fail right away), so walk the
+	 * tags we had rather than the ring.
+	 */
+	unsigned int first = imap->next_tag, last = imap->next_tag;
+	for (size_t i = 0; i < imap->pending_size; ++i) {
+		if (imap->pending[i].active && imap->pending[i].tag < first) {
+			first = imap->pending[i].tag;
+		}
+	}
+	for (unsigned int tag = first; tag != last; ++tag) {
+		struct imap_pending_callback *cb =
+			&imap->pending[tag & (imap->pending_size - 1)];
+		if (!cb->active || cb->tag != tag) {
+			continue;
+		}
+		cb->active = false;
+		if (cb->callback) {
+			cb->callback(imap, cb->data, STATUS_BYE, error);
+		}
+	}
+}
+
+void imap_disconnect(struct imap_connection *imap, const char *error) {
+	worker_log(L_ERROR, "Lost connection to IMAP server: %s", error);
+	absocket_free(imap->socket);
+	imap->socket = NULL;
+	imap->poll[0].fd = -1;
+	imap->logged_in = false;
+	// Whatever we hadn't sent yet is answered by fail_pending
+	memset(imap->out, 0, imap->out_size);
+	imap->out_len = 0;
+	imap->out_sensitive = false;
+	imap->compress_pending = false;
+	imap->mode = RECV_WAIT;
+	memset(imap->line, 0, imap->line_size + 1);
+	imap->line_index = 0;
+	fail_pending(imap, error);
+	abort_select_queue(imap, error);
+	if (imap->events.disconnected) {
+		imap->events.disconnected(imap, error);
+	}
+}
+
+static int imap_connect_step(struct imap_connection *imap) {
+	switch (ab_connect_step(imap->socket, 50)) {
+	case AB_CONNECTED:
+		imap->poll[0].fd = imap->socket->basefd;
+		imap->poll[0].events = POLLIN;
+		get_nanoseconds(&imap->last_network);
+		if (imap->starttls.active) {
+			imap->starttls.active = false;
+			if (imap->starttls.callback) {
+				imap->starttls.callback(imap, imap->starttls.data,
+						STATUS_OK, NULL);
+			}
+		} else if (imap->events.connected) {
+			imap->events.connected(imap, NULL);
+		}
+		break;
+	case AB_FAILED:
+		if (imap->starttls.active) {
+			// We were already connected, so this is losing the connection
+			char *error = strdup(imap->socket->error);
+			imap_disconnect(imap, error);
+			free(error);
+			break;
+		}
+		if (imap->events.connected) {
+			imap->events.connected(imap, imap->socket->error);
+		}
+		absocket_free(imap->socket);
+		imap->socket = NULL;
+		break;
+	default:
+		break;
+	}
+	/*
+	 * ab_connect_step already waited on the network, there's no need for the
+	 * worker to sleep too.
+	 */
+	return 1;
 }
 
 int imap_receive(struct imap_connection *imap) {
-	poll(imap->poll, 1, 0);
-	if (imap->poll[0].revents & POLLIN) {
+	if (imap->socket && imap->socket->state != AB_CONNECTED) {
+		return imap_connect_step(imap);
+	}
+	imap_flush(imap);
+	bool ready;
+	if (ab_async(imap->socket)) {
+		ready = ab_pending(imap->socket);
+	} else {
+		poll(imap->poll, 1, 0);
+		ready = (imap->poll[0].revents & POLLIN) || ab_pending(imap->socket);
+	}
+	if (ready) {
 		get_nanoseconds(&imap->last_network);
 		if (imap->mode == RECV_WAIT) {
 			/* The mode may be RECV_WAIT if we are waiting on the user to verify
@@ -151,38 +379,90 @@ int imap_receive(struct imap_connection *imap) {
 		} else {
 			ssize_t amt = ab_recv(imap->socket, imap->line + imap->line_index,
 					imap->line_size - imap->line_index);
+			if (amt == 0) {
+				imap_disconnect(imap, "Connection closed by server");
+				return 0;
+			} else if (amt < 0) {
+				if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+					imap_disconnect(imap, strerror(errno));
+				}
+				return 0;
+			}
 			imap->line_index += amt;
 			if (imap->line_index == imap->line_size) {
 				imap->line = realloc(imap->line,
 						imap->line_size + BUFFER_SIZE + 1);
-				memset(imap->line + imap->line_index + 1, 0,
-						(imap->line_size - imap->line_index + 1));
+				memset(imap->line + imap->line_index, 0, BUFFER_SIZE + 1);
 				imap->line_size = imap->line_size + BUFFER_SIZE;
 			}
+			/*
+			 * A busy mailbox sends a lot of short responses at once, so we
+			 * walk through them and only move what's left to the front of the
+			 * buffer when we're done.
+			 */
 			int remaining = 0;
+			size_t consumed = 0;
 			while (!remaining) {
 				imap_arg_t *arg = calloc(1, sizeof(imap_arg_t));
-				int len = imap_parse_args(imap->line, arg, &remaining);
+				char *line = imap->line + consumed;
+				int len = imap_parse_args_n(line, imap->line_index - consumed,
+						arg, &remaining);
 				if (remaining == 0) { // Parsed a complete command
-					char c = imap->line[len];
-					imap->line[len] = '\0';
-					worker_log(L_DEBUG, "Handling %s", imap->line);
+					char c = line[len];
+					line[len] = '\0';
+					worker_log(L_DEBUG, "Handling %s", line);
 #ifndef NDEBUG
 					if (raw) {
-						fwrite(imap->line, 1, len, raw);
+						fwrite(line, 1, len, raw);
 						fflush(raw);
 					}
 #endif
-					imap->line[len] = c;
+					line[len] = c;
 
 					handle_line(imap, arg);
 				}
 				imap_arg_free(arg);
 				if (len > 0 && remaining == 0) {
-					memmove(imap->line, imap->line + len, imap->line_size - len);
-					imap->line_index -= len;
-					memset(imap->line + imap->line_index, 0, imap->line_size - imap->line_index);
+					if ((size_t)imap->line_index < consumed + len) {
+						// We were disconnected and the buffer went with it
+						consumed = 0;
+						break;
+					}
+					consumed += len;
 				}
+				if (imap->compress_pending) {
+					/*
+					 * Whatever follows the COMPRESS response is already
+					 * compressed, so it goes back to the socket to be inflated.
+					 */
+					imap->compress_pending = false;
+#ifdef USE_ZLIB
+					ab_enable_compress(imap->socket, imap->line + consumed,
+							imap->line_index - consumed);
+#endif
+					memset(imap->line, 0, imap->line_index);
+					imap->line_index = 0;
+					consumed = 0;
+					break;
+				}
+			}
+			if (consumed) {
+				memmove(imap->line, imap->line + consumed,
+						imap->line_index - consumed);
+				imap->line_index -= consumed;
+				memset(imap->line + imap->line_index, 0, consumed);
+			}
+			if (remaining > 2 && imap->line_index + remaining > imap->line_size) {
+				/*
+				 * We're partway through a literal and know exactly how much
+				 * is left, so make room for all of it at once rather than
+				 * growing (and parsing again) a kilobyte at a time.
+				 */
+				size_t size = imap->line_index + remaining;
+				imap->line = realloc(imap->line, size + 1);
+				memset(imap->line + imap->line_size, 0,
+						size + 1 - imap->line_size);
+				imap->line_size = size;
 			}
 			return amt;
 		}
@@ -190,9 +470,13 @@ int imap_receive(struct imap_connection *imap) {
 		// Nothing being received, we wait 3 seconds and then start IDLE
 		struct timespec ts;
 		get_nanoseconds(&ts);
-		if (imap->logged_in && imap->cap->idle && imap->mode != RECV_IDLE) {
+		if (imap->logged_in && imap->cap->idle && imap->mode != RECV_IDLE
+				&& !imap->lanes.idle_covered) {
 			if (ts.tv_sec - imap->last_network.tv_sec > 3) {
-				worker_log(L_DEBUG, "Entering IDLE mode");
+				worker_log(L_DEBUG, "Entering IDLE mode (received %zd bytes, "
+						"%zd on the wire)", imap->socket->stats.data_in,
+						imap->socket->stats.wire_in);
+				log_latency(imap);
 				imap_send(imap, NULL, NULL, "IDLE");
 				imap->mode = RECV_IDLE;
 				get_nanoseconds(&imap->idle_start);
@@ -208,7 +492,8 @@ int imap_receive(struct imap_connection *imap) {
 			}
 		}
 	}
-	return 0;
+	// Don't let the worker sleep on commands we haven't sent yet
+	return imap->out_len > 0;
 }
 
 void handle_noop(struct imap_connection *imap, const char *token,
@@ -218,11 +503,27 @@ void handle_noop(struct imap_connection *imap, const char *token,
 
 void imap_init(struct imap_connection *imap) {
 	imap->mode = RECV_WAIT;
+	imap->socket = NULL;
+	imap->compress_pending = false;
 	imap->line = calloc(1, BUFFER_SIZE + 1);
 	imap->line_index = 0;
 	imap->line_size = BUFFER_SIZE;
+	imap->out = calloc(1, BUFFER_SIZE);
+	imap->out_len = 0;
+	imap->out_size = BUFFER_SIZE;
+	imap->out_sensitive = false;
 	imap->next_tag = 1;
-	imap->pending = create_hashtable(128, hash_string);
+	imap->lanes.primary = NULL;
+	imap->lanes.idle_covered = false;
+	imap->lanes.nudged = false;
+	memset(&imap->sorted, 0, sizeof(imap->sorted));
+	memset(&imap->searched, 0, sizeof(imap->searched));
+	imap->downloads = NULL;
+	imap->pending_size = PENDING_WINDOW;
+	imap->pending = calloc(imap->pending_size, sizeof(struct imap_pending_callback));
+	memset(&imap->greeting, 0, sizeof(imap->greeting));
+	memset(&imap->starttls, 0, sizeof(imap->starttls));
+	memset(imap->latency, 0, sizeof(imap->latency));
 	imap->mailboxes = create_list();
 	imap->select_queue = create_list();
 	if (internal_handlers == NULL) {
@@ -234,14 +535,20 @@ void imap_init(struct imap_connection *imap) {
 		hashtable_set(internal_handlers, "BYE", handle_imap_status);
 		hashtable_set(internal_handlers, "CAPABILITY", handle_imap_capability);
 		hashtable_set(internal_handlers, "LIST", handle_imap_list);
+		hashtable_set(internal_handlers, "STATUS", handle_imap_mailbox_status);
+		hashtable_set(internal_handlers, "SEARCH", handle_imap_search);
+		hashtable_set(internal_handlers, "ESEARCH", handle_imap_esearch);
+		hashtable_set(internal_handlers, "SORT", handle_imap_sort);
+		hashtable_set(internal_handlers, "THREAD", handle_imap_thread);
 		hashtable_set(internal_handlers, "FLAGS", handle_imap_flags);
 		hashtable_set(internal_handlers, "PERMANENTFLAGS", handle_imap_flags);
 		hashtable_set(internal_handlers, "EXISTS", handle_imap_existsunseenrecent);
-		hashtable_set(internal_handlers, "UNSEEN", handle_imap_existsunseenrecent);
+		// In SELECT, UNSEEN is the first unseen message rather than a count
+		hashtable_set(internal_handlers, "UNSEEN", handle_noop);
 		hashtable_set(internal_handlers, "RECENT", handle_imap_existsunseenrecent);
 		hashtable_set(internal_handlers, "UIDNEXT", handle_imap_uidnext);
 		hashtable_set(internal_handlers, "READ-WRITE", handle_imap_readwrite);
-		hashtable_set(internal_handlers, "UIDVALIDITY", handle_noop);
+		hashtable_set(internal_handlers, "UIDVALIDITY", handle_imap_uidvalidity);
 		hashtable_set(internal_handlers, "HIGHESTMODSET", handle_noop); // RFC 4551
 		hashtable_set(internal_handlers, "FETCH", handle_imap_fetch);
 		hashtable_set(internal_handlers, "EXPUNGE", handle_imap_expunge);
@@ -251,21 +558,57 @@ void imap_init(struct imap_connection *imap) {
 void imap_close(struct imap_connection *imap) {
 	absocket_free(imap->socket);
 	free(imap->line);
+	memset(imap->out, 0, imap->out_size);
+	free(imap->out);
+	free(imap->pending);
+	imap_sorted_clear(imap);
+	imap_searched_clear(imap);
 	free(imap);
 }
 
 bool imap_connect(struct imap_connection *imap, const struct uri *uri,
 		bool use_ssl, imap_callback_t callback, void *data) {
 #ifndef NDEBUG
-	raw = fopen("raw.log", "w"); // temp, todo figure out a permenant solution
+	if (!raw) {
+		raw = fopen("raw.log", "w"); // temp, todo figure out a permenant solution
+	}
 #endif
 	imap_init(imap);
-	imap->socket = absocket_new(uri, use_ssl);
+	imap->use_ssl = use_ssl;
+	imap->socket = absocket_new(uri, use_ssl, imap->socket_flags);
+	if (!imap->socket) {
+		return false;
+	}
+	imap->greeting.active = true;
+	imap->greeting.callback = callback;
+	imap->greeting.data = data;
+	return true;
+}
+
+#ifdef USE_OPENSSL
+
+bool imap_starttls(struct imap_connection *imap, imap_callback_t callback,
+		void *data) {
+	if (!ab_enable_ssl(imap->socket)) {
+		return false;
+	}
+	// imap_receive hands the socket to imap_connect_step until it's done
+	imap->starttls.active = true;
+	imap->starttls.callback = callback;
+	imap->starttls.data = data;
+	return true;
+}
+
+#endif
+
+bool imap_reconnect(struct imap_connection *imap, imap_callback_t callback,
+		void *data) {
+	imap->socket = absocket_new(imap->uri, imap->use_ssl, imap->socket_flags);
 	if (!imap->socket) {
 		return false;
 	}
-	imap->poll[0].fd = imap->socket->basefd;
-	imap->poll[0].events = POLLIN;
-	hashtable_set(imap->pending, "*", make_callback(callback, data));
+	imap->greeting.active = true;
+	imap->greeting.callback = callback;
+	imap->greeting.data = data;
 	return true;
 }
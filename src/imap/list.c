@@ -15,6 +15,13 @@ void imap_list(struct imap_connection *imap, imap_callback_t callback,
 	imap_send(imap, callback, data, "LIST \"%s\" \"%s\"", refname, boxname);
 }
 
+void imap_list_status(struct imap_connection *imap, imap_callback_t callback,
+		void *data, const char *refname, const char *boxname) {
+	// RFC 5819, the counts come back as STATUS responses alongside the LIST
+	imap_send(imap, callback, data, "LIST \"%s\" \"%s\" "
+			"RETURN (STATUS (MESSAGES UNSEEN RECENT))", refname, boxname);
+}
+
 void handle_imap_list(struct imap_connection *imap, const char *token,
 		const char *cmd, imap_arg_t *args) {
 	imap_arg_t *flags = args->list;
@@ -23,7 +30,9 @@ void handle_imap_list(struct imap_connection *imap, const char *token,
 
 	struct mailbox *mbox = get_or_make_mailbox(imap, name);
 	while (flags) {
-		if (flags->type == IMAP_ATOM) {
+		// We list again to refresh unread counts, don't add flags twice
+		if (flags->type == IMAP_ATOM
+				&& !mailbox_get_flag(imap, name, flags->str)) {
 			struct mailbox_flag *flag = calloc(1, sizeof(struct mailbox_flag));
 			flag->name = strdup(flags->str);
 			list_add(mbox->flags, flag);
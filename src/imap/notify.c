@@ -0,0 +1,76 @@
+/*
+ * imap/notify.c - issues IMAP STATUS and NOTIFY commands and handles STATUS
+ * responses
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "imap/imap.h"
+#include "internal/imap.h"
+#include "log.h"
+
+void imap_status(struct imap_connection *imap, imap_callback_t callback,
+		void *data, const char *mailbox) {
+	imap_send(imap, callback, data, "STATUS \"%s\" (MESSAGES UNSEEN RECENT)",
+			mailbox);
+}
+
+void imap_notify(struct imap_connection *imap, imap_callback_t callback,
+		void *data) {
+	/*
+	 * RFC 5465. The STATUS indicator has the server tell us where every
+	 * mailbox stands right away, and then we hear about changes to them as
+	 * they happen.
+	 */
+	imap_send(imap, callback, data, "NOTIFY SET STATUS "
+			"(selected (MessageNew MessageExpunge FlagChange)) "
+			"(personal (MessageNew MessageExpunge FlagChange))");
+}
+
+void handle_imap_mailbox_status(struct imap_connection *imap,
+		const char *token, const char *cmd, imap_arg_t *args) {
+	if (!args || !args->str || !args->next
+			|| args->next->type != IMAP_LIST) {
+		return;
+	}
+	const char *name = args->str;
+	struct mailbox *mbox = get_mailbox(imap, name);
+	// On a lane, what matters is what the main connection has selected
+	const char *selected = imap->lanes.primary ?
+		imap->lanes.primary->selected : imap->selected;
+	if (!mbox || (selected && strcmp(selected, name) == 0)) {
+		/*
+		 * We haven't listed this one, or it's selected and EXISTS and friends
+		 * keep it up to date (LIST-STATUS includes it regardless).
+		 */
+		return;
+	}
+	struct { const char *item; long *ptr; } ptrs[] = {
+		{ "MESSAGES", &mbox->exists },
+		{ "UNSEEN", &mbox->unseen },
+		{ "RECENT", &mbox->recent },
+	};
+	bool changed = false;
+	imap_arg_t *item = args->next->list;
+	for (; item && item->next; item = item->next->next) {
+		if (item->type != IMAP_ATOM || item->next->type != IMAP_NUMBER) {
+			continue;
+		}
+		for (size_t i = 0; i < sizeof(ptrs) / sizeof(ptrs[0]); ++i) {
+			if (strcmp(ptrs[i].item, item->str) == 0
+					&& *ptrs[i].ptr != item->next->num) {
+				*ptrs[i].ptr = item->next->num;
+				changed = true;
+			}
+		}
+	}
+	if (changed) {
+		worker_log(L_DEBUG, "%s has %ld messages, %ld unseen", name,
+				mbox->exists, mbox->unseen);
+		if (imap->events.mailbox_status) {
+			imap->events.mailbox_status(imap, mbox);
+		}
+	}
+}
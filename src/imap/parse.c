@@ -11,94 +11,111 @@
 #include <string.h>
 
 #include "imap/imap.h"
+#include "internal/imap.h"
+#include "util/scan.h"
 
-static long parse_number(const char **str) {
+/*
+ * The buffer we parse from isn't necessarily terminated, so everything reads
+ * through this, which treats the end of the input like a NUL.
+ */
+static char peek(const char *str, const char *end, size_t i) {
+	return str + i < end ? str[i] : '\0';
+}
+
+static size_t count_digits(const char *str, const char *end) {
+	size_t n = 0;
+	while (str + n < end && str[n] >= '0' && str[n] <= '9') {
+		++n;
+	}
+	return n;
+}
+
+static long parse_number(const char **str, const char *end) {
 	/*
 	 * Parses a base 10 number from the string and advances the pointer to the
 	 * end of the argument (usually one of ' ', ')', or '\0').
 	 */
-	char *end = NULL;
-	long l = strtol(*str, &end, 10);
-	*str = end;
+	long l = 0;
+	for (; *str < end && **str >= '0' && **str <= '9'; (*str)++) {
+		l = l * 10 + (**str - '0');
+	}
 	return l;
 }
 
-static char *parse_string(const char **str, int *remaining) {
+static char *parse_string(const char **str, const char *end_of_input,
+		size_t *length, int *remaining) {
 	/*
 	 * IMAP strings come in two forms - quoted or literal. A quoted string has
 	 * limitations on the characters in use (no quotes, no spaces, maybe some
 	 * others). A literal string begins with a prefix {n}, where n is the length
-	 * of the string in characters, followed by that many characters.
+	 * of the string in characters, followed by that many characters. Literals
+	 * prefixed with ~{n} (RFC 3516) may contain NUL, so callers that care use
+	 * the length rather than strlen.
 	 */
 	if (**str == '"') {
 		(*str)++; // advance past "
-		const char *end = strchr(*str, '"');
-		if (end == NULL) {
+		const char *end = scan_find(*str, end_of_input, "\"");
+		if (end == end_of_input || *end != '"') {
 			// We don't have the complete string, but we also don't know how
 			// long the completed string is. Just return 1 here.
 			*remaining = 1;
-			while (**str) (*str)++;
+			*str = end;
 			return NULL;
 		}
 		/* Allocate space for the string and copy it in, then advance *str */
 		char *result = malloc(end - *str + 1);
 		strncpy(result, *str, end - *str);
 		result[end - *str] = '\0';
+		*length = end - *str;
 		*str = end + 1;
 		return result;
-	} else if (**str == '{') {
+	} else if (**str == '{' || **str == '~') {
+		if (**str == '~') {
+			(*str)++; // advance past ~
+		}
 		(*str)++; // advance past {
-		long len = parse_number(str);
-		if (**str != '}') {
+		long len = parse_number(str, end_of_input);
+		if (peek(*str, end_of_input, 0) != '}') {
 			return NULL;
 		}
 		(*str)++; // advance past }
-		if ((long)strlen(*str) < len + 2) {
+		long available = end_of_input - *str;
+		if (available < len + 2) {
 			// We don't have the full string. Return the expected length of the
 			// string.
-			*remaining = (int)(len - strlen(*str)) + 2;
-			while (**str) (*str)++;
+			*remaining = (int)(len - available) + 2;
+			*str = end_of_input;
 			return NULL;
 		}
+		*str += 2; // advance past the \r\n that ends the prefix
 		/* Allocate space for the string and copy it in, then advance *str */
 		char *result = malloc(len + 1);
-		strncpy(result, *str, len);
+		memcpy(result, *str, len);
 		result[len] = '\0';
-		*str += len + 2; // Add trailing \r\n
+		*length = len;
+		*str += len;
 		return result;
 	}
 	return NULL;
 }
 
-static char *parse_atom(const char **str) {
+static char *parse_atom(const char **str, const char *end_of_input) {
 	/*
 	 * An atom is basically a shitty string. It's unquoted, not prefixed with
 	 * its length, and has limitations on the characters you can use. First, we
-	 * look for the end of it - a space or a ) if we're parsing a list. We pick
-	 * the one that's closest ahead and get just copy the text into a new
-	 * string.
+	 * look for the end of it - a space or a ) if we're parsing a list - and
+	 * then just copy the text into a new string.
 	 */
-	char *end = NULL;
-	char delims[] = " )[\r";
-	for (size_t i = 0; i < sizeof(delims) - 1; ++i) {
-		char *_ = strchr(*str, delims[i]);
-		if (_ && (!end || _ < end)) end = _;
-	}
-
-	if (!end) {
-		char *_ = strdup(*str);
-		*str = strchr(*str, '\0');
-		return _;
-	} else {
-		char *_ = malloc(end - *str + 1);
-		strncpy(_, *str, end - *str);
-		_[end - *str] = '\0';
-		*str = end;
-		return _;
-	}
+	const char *end = scan_find(*str, end_of_input, " )[\r");
+	char *_ = malloc(end - *str + 1);
+	memcpy(_, *str, end - *str);
+	_[end - *str] = '\0';
+	*str = end;
+	return _;
 }
 
-static char *parse_status_response(const char **str) {
+static char *parse_status_response(const char **str,
+		const char *end_of_input) {
 	/*
 	 * Status responses can include extra information in the command text like
 	 * this:
@@ -107,8 +124,8 @@ static char *parse_status_response(const char **str) {
 	 *
 	 * So here we pull that status response out into a string.
 	 */
-	char *end = strchr(*str, ']');
-	if (!end) {
+	const char *end = scan_find(*str, end_of_input, "]");
+	if (end == end_of_input || *end != ']') {
 		return NULL;
 	}
 	int len = (end - *str) - 1;
@@ -119,24 +136,32 @@ static char *parse_status_response(const char **str) {
 	return resp;
 }
 
-static int _imap_parse_args(const char **str, imap_arg_t *args) {
+static int _imap_parse_args(const char **str, const char *end,
+		imap_arg_t *args) {
 	assert(args && str);
 	int remaining = 0;
-	while (**str
+	while (peek(*str, end, 0)
 			&& **str != ')' /* ) for recursive list parsing */
 			&& **str != '\r' /* end of args */) {
-		if (isdigit(**str)) {
+		size_t digits = count_digits(*str, end);
+		char after = peek(*str, end, digits);
+		if (digits && (after == ',' || after == ':')) {
+			// A sequence set like 2,4:7, which we leave to the command to parse
+			args->type = IMAP_ATOM;
+			args->str = parse_atom(str, end);
+		} else if (digits) {
 			args->type = IMAP_NUMBER;
-			args->num = parse_number(str);
-		} else if (**str == '"' || **str == '{') {
+			args->num = parse_number(str, end);
+		} else if (**str == '"' || **str == '{'
+				|| (**str == '~' && peek(*str, end, 1) == '{')) {
 			args->type = IMAP_STRING;
-			args->str = parse_string(str, &remaining);
+			args->str = parse_string(str, end, &args->len, &remaining);
 			if (remaining > 0) {
 				break;
 			}
 		} else if (**str == '[') {
 			args->type = IMAP_RESPONSE;
-			args->str = parse_status_response(str);
+			args->str = parse_status_response(str, end);
 			if (!args->str) {
 				remaining = 1;
 				break;
@@ -149,12 +174,12 @@ static int _imap_parse_args(const char **str, imap_arg_t *args) {
 			 * Parsing lists is done recursively, since they're basically nested
 			 * arg strings.
 			 */
-			remaining = _imap_parse_args(str, args->list);
+			remaining = _imap_parse_args(str, end, args->list);
 			if (remaining == 2) {
 				// the recursive call will complain about the lack of CRLF
 				remaining = 0;
 			}
-			if (remaining > 0 || **str != ')') {
+			if (remaining > 0 || peek(*str, end, 0) != ')') {
 				// Incomplete list
 				if (remaining == 0) {
 					remaining = 1;
@@ -175,10 +200,11 @@ static int _imap_parse_args(const char **str, imap_arg_t *args) {
 			// to the command implementation to strcmp an atom against NIL to
 			// find the difference if it matters to that command.
 			args->type = IMAP_ATOM;
-			args->str = parse_atom(str);
+			args->str = parse_atom(str, end);
 		}
-		if (**str == ' ') (*str)++;
-		if (**str && **str != ')' && **str != '\r') {
+		if (peek(*str, end, 0) == ' ') (*str)++;
+		char next = peek(*str, end, 0);
+		if (next && next != ')' && next != '\r') {
 			/*
 			 * If we aren't at the end of the loop, allocate the next
 			 * argument.
@@ -188,9 +214,9 @@ static int _imap_parse_args(const char **str, imap_arg_t *args) {
 			prev->next = args;
 		}
 	}
-	if (**str == '\r') {
+	if (peek(*str, end, 0) == '\r') {
 		(*str)++;
-		if (**str == '\n') {
+		if (peek(*str, end, 0) == '\n') {
 			(*str)++;
 		} else {
 			remaining++;
@@ -202,10 +228,16 @@ static int _imap_parse_args(const char **str, imap_arg_t *args) {
 }
 
 int imap_parse_args(const char *str, imap_arg_t *args, int *remaining) {
+	return imap_parse_args_n(str, strlen(str), args, remaining);
+}
+
+int imap_parse_args_n(const char *str, size_t len, imap_arg_t *args,
+		int *remaining) {
 	memset(args, 0, sizeof(imap_arg_t));
 	const char *orig = str;
-	args->original = strdup(str);
-	*remaining = _imap_parse_args(&str, args);
+	*remaining = _imap_parse_args(&str, str + len, args);
+	// Just this response, not everything else that came in with it
+	args->original = strndup(orig, str - orig);
 	return (int)(str - orig); // len
 }
 
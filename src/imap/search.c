@@ -0,0 +1,386 @@
+/*
+ * imap/search.c - issues and handles IMAP SEARCH and ESEARCH commands
+ *
+ * Queries are written the way people type them into a search box:
+ *
+ *   from:alice subject:"lunch plans" since:2024-01-01 -is:read budget
+ *
+ * Each term narrows the search further. Bare words are looked for anywhere in
+ * the message, and a leading - turns a term around.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "imap/imap.h"
+#include "internal/imap.h"
+#include "log.h"
+
+struct search_buffer {
+	char *text;
+	size_t length, size;
+	bool utf8;
+};
+
+static void buffer_append(struct search_buffer *buf, const char *s, size_t len) {
+	if (buf->length + len + 1 > buf->size) {
+		buf->size = (buf->length + len + 1) * 2;
+		buf->text = realloc(buf->text, buf->size);
+	}
+	memcpy(buf->text + buf->length, s, len);
+	buf->length += len;
+	buf->text[buf->length] = '\0';
+}
+
+static void buffer_puts(struct search_buffer *buf, const char *s) {
+	buffer_append(buf, s, strlen(s));
+}
+
+struct search_field {
+	const char *name, *key;
+};
+
+static struct search_field search_fields[] = {
+	{ "from", "FROM" },
+	{ "to", "TO" },
+	{ "cc", "CC" },
+	{ "subject", "SUBJECT" },
+	{ "body", "BODY" },
+};
+
+static struct search_field search_dates[] = {
+	{ "since", "SENTSINCE" },
+	{ "before", "SENTBEFORE" },
+	{ "on", "SENTON" },
+};
+
+static struct search_field search_flags[] = {
+	{ "unread", "UNSEEN" },
+	{ "read", "SEEN" },
+	{ "flagged", "FLAGGED" },
+	{ "unflagged", "UNFLAGGED" },
+	{ "answered", "ANSWERED" },
+	{ "unanswered", "UNANSWERED" },
+	{ "deleted", "DELETED" },
+	{ "draft", "DRAFT" },
+};
+
+static const char *find_field(struct search_field *fields, size_t n,
+		const char *name, size_t len) {
+	for (size_t i = 0; i < n; ++i) {
+		if (strlen(fields[i].name) == len
+				&& strncmp(fields[i].name, name, len) == 0) {
+			return fields[i].key;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Plain text goes out as a quoted string. Anything else has to be a literal,
+ * and we only send those when LITERAL+ lets us do it without waiting for the
+ * server to ask for the rest.
+ */
+static bool append_string(struct search_buffer *buf, const char *s, size_t len,
+		bool literal_plus, const char **error) {
+	bool quotable = true;
+	for (size_t i = 0; i < len; ++i) {
+		unsigned char c = s[i];
+		if (c < 0x20 || c >= 0x7F) {
+			quotable = false;
+		}
+	}
+	if (quotable) {
+		buffer_puts(buf, "\"");
+		for (size_t i = 0; i < len; ++i) {
+			if (s[i] == '"' || s[i] == '\\') {
+				buffer_puts(buf, "\\");
+			}
+			buffer_append(buf, &s[i], 1);
+		}
+		buffer_puts(buf, "\"");
+		return true;
+	}
+	if (!literal_plus) {
+		*error = "This server can't search for text outside of ASCII";
+		return false;
+	}
+	char prefix[32];
+	snprintf(prefix, sizeof(prefix), "{%zd+}\r\n", len);
+	buffer_puts(buf, prefix);
+	buffer_append(buf, s, len);
+	buf->utf8 = true;
+	return true;
+}
+
+static bool append_date(struct search_buffer *buf, const char *s, size_t len,
+		const char **error) {
+	static const char *months[] = {
+		"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+		"Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
+	};
+	int year, month, day, end = 0;
+	char date[32];
+	if (len >= sizeof(date)) {
+		*error = "Dates look like 2024-01-31";
+		return false;
+	}
+	memcpy(date, s, len);
+	date[len] = '\0';
+	if (sscanf(date, "%4d-%2d-%2d%n", &year, &month, &day, &end) != 3
+			|| (size_t)end != len || month < 1 || month > 12
+			|| day < 1 || day > 31) {
+		*error = "Dates look like 2024-01-31";
+		return false;
+	}
+	snprintf(date, sizeof(date), "%d-%s-%04d", day, months[month - 1], year);
+	buffer_puts(buf, date);
+	return true;
+}
+
+/* Finds the end of a word, which runs to the next space outside of quotes */
+static const char *term_end(const char *s) {
+	bool quoted = false;
+	for (; *s; ++s) {
+		if (*s == '"') {
+			quoted = !quoted;
+		} else if (*s == ' ' && !quoted) {
+			break;
+		}
+	}
+	return s;
+}
+
+/* Takes the quotes off a value, if it has them */
+static void unquote(const char **s, size_t *len) {
+	if (*len >= 2 && (*s)[0] == '"' && (*s)[*len - 1] == '"') {
+		++*s;
+		*len -= 2;
+	} else if (*len >= 1 && (*s)[0] == '"') {
+		++*s;
+		--*len;
+	}
+}
+
+static bool compile_term(struct search_buffer *buf, const char *term,
+		size_t len, bool literal_plus, const char **error) {
+	if (term[0] == '-' && len > 1) {
+		buffer_puts(buf, "NOT ");
+		++term;
+		--len;
+	}
+	const char *colon = memchr(term, ':', len);
+	if (colon && term[0] != '"') {
+		size_t name_len = colon - term;
+		const char *value = colon + 1;
+		size_t value_len = len - name_len - 1;
+		unquote(&value, &value_len);
+		const char *key;
+		if ((key = find_field(search_fields,
+				sizeof(search_fields) / sizeof(search_fields[0]),
+				term, name_len))) {
+			buffer_puts(buf, key);
+			buffer_puts(buf, " ");
+			return append_string(buf, value, value_len, literal_plus, error);
+		}
+		if ((key = find_field(search_dates,
+				sizeof(search_dates) / sizeof(search_dates[0]),
+				term, name_len))) {
+			buffer_puts(buf, key);
+			buffer_puts(buf, " ");
+			return append_date(buf, value, value_len, error);
+		}
+		if (name_len == 2 && strncmp(term, "is", 2) == 0) {
+			if (!(key = find_field(search_flags,
+					sizeof(search_flags) / sizeof(search_flags[0]),
+					value, value_len))) {
+				*error = "Unknown flag, try is:unread or is:flagged";
+				return false;
+			}
+			buffer_puts(buf, key);
+			return true;
+		}
+		// Not a field we know, so search for it as it's written
+	}
+	unquote(&term, &len);
+	buffer_puts(buf, "TEXT ");
+	return append_string(buf, term, len, literal_plus, error);
+}
+
+char *imap_search_compile(const char *query, bool literal_plus,
+		const char **error) {
+	struct search_buffer keys = { 0 };
+	while (*query) {
+		if (*query == ' ') {
+			++query;
+			continue;
+		}
+		const char *end = term_end(query);
+		if (keys.length) {
+			buffer_puts(&keys, " ");
+		}
+		if (!compile_term(&keys, query, end - query, literal_plus, error)) {
+			free(keys.text);
+			return NULL;
+		}
+		query = end;
+	}
+	if (!keys.length) {
+		*error = "Nothing to search for";
+		return NULL;
+	}
+	if (!keys.utf8) {
+		return keys.text;
+	}
+	struct search_buffer charset = { 0 };
+	buffer_puts(&charset, "CHARSET UTF-8 ");
+	buffer_puts(&charset, keys.text);
+	free(keys.text);
+	return charset.text;
+}
+
+void imap_search(struct imap_connection *imap, imap_callback_t callback,
+		void *data, const char *keys) {
+	imap_searched_clear(imap);
+	if (imap->cap->esearch) {
+		// Ranges instead of every number, which adds up in large mailboxes
+		imap_send(imap, callback, data, "SEARCH RETURN (MIN MAX COUNT ALL) %s",
+				keys);
+	} else {
+		imap_send(imap, callback, data, "SEARCH %s", keys);
+	}
+}
+
+void imap_searched_clear(struct imap_connection *imap) {
+	free(imap->searched.ranges);
+	memset(&imap->searched, 0, sizeof(imap->searched));
+}
+
+static void searched_add(struct imap_connection *imap, long min, long max) {
+	if (min > max) {
+		long tmp = min;
+		min = max;
+		max = tmp;
+	}
+	size_t n = imap->searched.length;
+	if (n && imap->searched.ranges[n - 1].max + 1 >= min
+			&& imap->searched.ranges[n - 1].min <= min) {
+		// Servers tend to answer in order, so most of these join the last one
+		if (max > imap->searched.ranges[n - 1].max) {
+			imap->searched.ranges[n - 1].max = max;
+		}
+		return;
+	}
+	if (n == imap->searched.size) {
+		imap->searched.size = imap->searched.size ? imap->searched.size * 2 : 64;
+		imap->searched.ranges = realloc(imap->searched.ranges,
+				imap->searched.size * sizeof(struct imap_range));
+	}
+	imap->searched.ranges[n].min = min;
+	imap->searched.ranges[n].max = max;
+	imap->searched.length++;
+}
+
+static int compare_ranges(const void *_a, const void *_b) {
+	const struct imap_range *a = _a, *b = _b;
+	return a->min < b->min ? -1 : a->min > b->min;
+}
+
+/* Neither SEARCH nor ESEARCH promise any particular order */
+static void searched_normalize(struct imap_connection *imap) {
+	size_t n = imap->searched.length;
+	qsort(imap->searched.ranges, n, sizeof(struct imap_range), compare_ranges);
+	size_t out = 0;
+	for (size_t i = 0; i < n; ++i) {
+		struct imap_range *range = &imap->searched.ranges[i];
+		if (out && imap->searched.ranges[out - 1].max + 1 >= range->min) {
+			if (range->max > imap->searched.ranges[out - 1].max) {
+				imap->searched.ranges[out - 1].max = range->max;
+			}
+			continue;
+		}
+		imap->searched.ranges[out++] = *range;
+	}
+	imap->searched.length = out;
+	imap->searched.count = 0;
+	for (size_t i = 0; i < out; ++i) {
+		imap->searched.count += imap->searched.ranges[i].max
+			- imap->searched.ranges[i].min + 1;
+	}
+}
+
+void handle_imap_search(struct imap_connection *imap, const char *token,
+		const char *cmd, imap_arg_t *args) {
+	for (; args; args = args->next) {
+		if (args->type == IMAP_NUMBER) {
+			searched_add(imap, args->num, args->num);
+		}
+	}
+	searched_normalize(imap);
+}
+
+/* Parses a sequence set like 2,10:11,47 */
+static bool add_sequence_set(struct imap_connection *imap, const char *set) {
+	while (*set) {
+		char *end;
+		long min = strtol(set, &end, 10), max = min;
+		if (end == set) {
+			return false;
+		}
+		if (*end == ':') {
+			set = end + 1;
+			max = strtol(set, &end, 10);
+			if (end == set) {
+				return false;
+			}
+		}
+		searched_add(imap, min, max);
+		if (*end == ',') {
+			++end;
+		} else if (*end) {
+			return false;
+		}
+		set = end;
+	}
+	return true;
+}
+
+/*
+ * An ESEARCH response looks like:
+ *
+ *   * ESEARCH (TAG "a5") MIN 2 MAX 47 COUNT 4 ALL 2,10:11,47
+ *
+ * and leaves out ALL altogether when nothing matched.
+ */
+void handle_imap_esearch(struct imap_connection *imap, const char *token,
+		const char *cmd, imap_arg_t *args) {
+	for (; args; args = args->next) {
+		if (args->type != IMAP_ATOM || !args->next) {
+			continue;
+		}
+		imap_arg_t *value = args->next;
+		if (strcasecmp(args->str, "ALL") == 0) {
+			if (value->type == IMAP_NUMBER) {
+				searched_add(imap, value->num, value->num);
+			} else if (value->type != IMAP_ATOM
+					|| !add_sequence_set(imap, value->str)) {
+				worker_log(L_ERROR, "Bad ESEARCH result, ignoring it");
+				imap_searched_clear(imap);
+				return;
+			}
+			args = value;
+		} else if (strcasecmp(args->str, "MIN") == 0
+				|| strcasecmp(args->str, "MAX") == 0
+				|| strcasecmp(args->str, "COUNT") == 0) {
+			// We work these out from ALL
+			args = value;
+		}
+	}
+	searched_normalize(imap);
+	worker_log(L_DEBUG, "Search found %ld messages in %zd ranges",
+			imap->searched.count, imap->searched.length);
+}
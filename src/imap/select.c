@@ -18,20 +18,83 @@ struct callback_data {
 	void *data;
 	char *mailbox;
 	imap_callback_t callback;
+	/* Set when reselecting after a reconnect, see imap_resync */
+	bool resync;
+	list_t *messages;
+	long exists, nextuid, uidvalidity;
 };
 
+static void free_messages(list_t *messages) {
+	for (size_t i = 0; i < messages->length; ++i) {
+		mailbox_message_free(messages->items[i]);
+	}
+	list_free(messages);
+}
+
+static void resync_abort(struct mailbox *mbox, struct callback_data *cbdata) {
+	// Put things back as they were, we'll try again on the next connection
+	free_messages(mbox->messages);
+	mbox->messages = cbdata->messages;
+	mbox->exists = cbdata->exists;
+	mbox->nextuid = cbdata->nextuid;
+	mbox->uidvalidity = cbdata->uidvalidity;
+}
+
+/*
+ * If the UIDs handed out while we were away account for every new message,
+ * then nothing was expunged and the messages we had kept their sequence
+ * numbers. Returns false if the mailbox has to be loaded from scratch.
+ */
+static bool resync_finish(struct imap_connection *imap, struct mailbox *mbox,
+		struct callback_data *cbdata) {
+	long added = mbox->exists - cbdata->exists;
+	bool intact = mbox->uidvalidity == cbdata->uidvalidity
+		&& cbdata->exists == (long)cbdata->messages->length
+		&& cbdata->nextuid != -1 && mbox->nextuid != -1
+		&& added >= 0 && mbox->nextuid - cbdata->nextuid == added;
+	if (!intact) {
+		worker_log(L_DEBUG, "%s changed while we were offline, reloading it",
+				mbox->name);
+		free_messages(cbdata->messages);
+		return true;
+	}
+	worker_log(L_DEBUG, "%s has %ld new messages since we were last connected",
+			mbox->name, added);
+	for (long i = 0; i < cbdata->exists; ++i) {
+		struct mailbox_message *msg = cbdata->messages->items[i];
+		msg->fetching = false;
+		mailbox_message_free(mbox->messages->items[i]);
+		mbox->messages->items[i] = msg;
+	}
+	list_free(cbdata->messages);
+	if (cbdata->exists > 0) {
+		// Flag changes come back as message updates
+		imap_send(imap, NULL, NULL, "FETCH 1:%ld (FLAGS)", cbdata->exists);
+	}
+	return added > 0;
+}
+
 static void imap_select_callback(struct imap_connection *imap,
 		void *data, enum imap_status status, const char *args) {
 	struct callback_data *cbdata = data;
 	list_pop(imap->select_queue);
 	if (status != STATUS_OK) {
+		if (cbdata->resync) {
+			resync_abort(get_mailbox(imap, cbdata->mailbox), cbdata);
+		}
 		if (cbdata->callback) {
 			cbdata->callback(imap, cbdata->data, status, args);
 		}
+		free(cbdata->mailbox);
+		free(cbdata);
 		return;
 	}
 	struct mailbox *mbox = get_mailbox(imap, cbdata->mailbox);
 	mbox->selected = true;
+	bool changed = true;
+	if (cbdata->resync) {
+		changed = resync_finish(imap, mbox, cbdata);
+	}
 	if (imap->selected) {
 		free(imap->selected);
 	}
@@ -43,28 +106,70 @@ static void imap_select_callback(struct imap_connection *imap,
 	} else if (cbdata->callback) {
 		cbdata->callback(imap, cbdata->data, status, args);
 	}
-	if (imap->events.mailbox_updated) {
+	if (imap->events.mailbox_updated && changed) {
 		imap->events.mailbox_updated(imap, mbox);
 	}
 	free(cbdata->mailbox);
 	free(cbdata);
 }
 
+static void queue_select(struct imap_connection *imap,
+		struct callback_data *cbdata) {
+	list_enqueue(imap->select_queue, cbdata);
+	if (imap->select_queue->length > 1) {
+		return;
+	}
+	imap_send(imap, imap_select_callback, cbdata,
+			"SELECT \"%s\"", cbdata->mailbox);
+}
+
 void imap_select(struct imap_connection *imap, imap_callback_t callback,
 		void *data, const char *mailbox) {
 	if (mailbox_get_flag(imap, mailbox, "\\noselect")) {
 		callback(imap, data, STATUS_PRE_ERROR, "Cannot select this mailbox");
 		return;
 	}
-	struct callback_data *cbdata = malloc(sizeof(struct callback_data));
+	struct callback_data *cbdata = calloc(1, sizeof(struct callback_data));
 	cbdata->data = data;
 	cbdata->mailbox = strdup(mailbox);
 	cbdata->callback = callback;
-	list_enqueue(imap->select_queue, cbdata);
-	if (imap->select_queue->length > 1) {
-		return;
+	queue_select(imap, cbdata);
+}
+
+void imap_resync(struct imap_connection *imap, imap_callback_t callback,
+		void *data) {
+	struct mailbox *mbox = get_mailbox(imap, imap->selected);
+	struct callback_data *cbdata = calloc(1, sizeof(struct callback_data));
+	cbdata->data = data;
+	cbdata->mailbox = strdup(imap->selected);
+	cbdata->callback = callback;
+	cbdata->resync = true;
+	/*
+	 * The SELECT responses build a fresh message list, which we reconcile
+	 * with the old one once we know what the server looks like now.
+	 */
+	cbdata->messages = mbox->messages;
+	cbdata->exists = mbox->exists;
+	cbdata->nextuid = mbox->nextuid;
+	cbdata->uidvalidity = mbox->uidvalidity;
+	mbox->messages = create_list();
+	mbox->exists = mbox->nextuid = -1;
+	queue_select(imap, cbdata);
+}
+
+void abort_select_queue(struct imap_connection *imap, const char *error) {
+	while (imap->select_queue->length) {
+		struct callback_data *cbdata = list_peek(imap->select_queue);
+		list_pop(imap->select_queue);
+		if (cbdata->resync) {
+			resync_abort(get_mailbox(imap, cbdata->mailbox), cbdata);
+		}
+		if (cbdata->callback) {
+			cbdata->callback(imap, cbdata->data, STATUS_BYE, error);
+		}
+		free(cbdata->mailbox);
+		free(cbdata);
 	}
-	imap_send(imap, imap_select_callback, cbdata, "SELECT \"%s\"", mailbox);
 }
 
 static const char *get_selected(struct imap_connection *imap) {
@@ -75,6 +180,12 @@ static const char *get_selected(struct imap_connection *imap) {
 	return selected;
 }
 
+static bool resyncing(struct imap_connection *imap) {
+	// The UI keeps what it had until the resync tells it what changed
+	return imap->select_queue->length
+		&& ((struct callback_data *)list_peek(imap->select_queue))->resync;
+}
+
 void handle_imap_existsunseenrecent(struct imap_connection *imap, const char *token,
 		const char *cmd, imap_arg_t *args) {
 	assert(args);
@@ -84,7 +195,6 @@ void handle_imap_existsunseenrecent(struct imap_connection *imap, const char *to
 
 	struct { const char *cmd; long *ptr; } ptrs[] = {
 		{ "EXISTS", &mbox->exists },
-		{ "UNSEEN", &mbox->unseen },
 		{ "RECENT", &mbox->recent }
 	};
 
@@ -93,10 +203,8 @@ void handle_imap_existsunseenrecent(struct imap_connection *imap, const char *to
 		if (strcmp(ptrs[i].cmd, cmd) == 0) {
 			set = true;
 			if (i == 0 /* EXISTS */) {
-				int diff = args->num - mbox->exists;
-				if (mbox->exists == -1) {
-					diff = args->num;
-				}
+				// STATUS may have told us the count before we selected it
+				long diff = args->num - (long)mbox->messages->length;
 				if (diff > 0) {
 					while (diff--) {
 						struct mailbox_message *msg = calloc(1,
@@ -116,7 +224,7 @@ void handle_imap_existsunseenrecent(struct imap_connection *imap, const char *to
 	}
 
 	if (set) {
-		if (imap->events.mailbox_updated) {
+		if (imap->events.mailbox_updated && !resyncing(imap)) {
 			imap->events.mailbox_updated(imap, mbox);
 		}
 	} else {
@@ -133,12 +241,21 @@ void handle_imap_uidnext(struct imap_connection *imap, const char *token,
 	mbox->nextuid = args->num;
 }
 
+void handle_imap_uidvalidity(struct imap_connection *imap, const char *token,
+		const char *cmd, imap_arg_t *args) {
+	assert(args);
+	assert(args->type == IMAP_NUMBER);
+	const char *selected = get_selected(imap);
+	struct mailbox *mbox = get_mailbox(imap, selected);
+	mbox->uidvalidity = args->num;
+}
+
 void handle_imap_readwrite(struct imap_connection *imap, const char *token,
 		const char *cmd, imap_arg_t *args) {
 	const char *selected = get_selected(imap);
 	struct mailbox *mbox = get_mailbox(imap, selected);
 	mbox->read_write = true;
-	if (imap->events.mailbox_updated) {
+	if (imap->events.mailbox_updated && !resyncing(imap)) {
 		imap->events.mailbox_updated(imap, mbox);
 	}
 }
@@ -0,0 +1,78 @@
+/*
+ * imap/sort.c - issues and handles IMAP SORT and THREAD commands
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "imap/imap.h"
+#include "internal/imap.h"
+#include "log.h"
+
+void imap_sort(struct imap_connection *imap, imap_callback_t callback,
+		void *data, const char *criteria) {
+	imap_sorted_clear(imap);
+	imap_send(imap, callback, data, "SORT (%s) UTF-8 ALL", criteria);
+}
+
+void imap_thread(struct imap_connection *imap, imap_callback_t callback,
+		void *data, const char *algorithm) {
+	imap_sorted_clear(imap);
+	imap_send(imap, callback, data, "THREAD %s UTF-8 ALL", algorithm);
+}
+
+void imap_sorted_clear(struct imap_connection *imap) {
+	free(imap->sorted.seq);
+	free(imap->sorted.depth);
+	memset(&imap->sorted, 0, sizeof(imap->sorted));
+}
+
+static void sorted_add(struct imap_connection *imap, long seq, int depth) {
+	if (imap->sorted.length == imap->sorted.size) {
+		imap->sorted.size = imap->sorted.size ? imap->sorted.size * 2 : 1024;
+		imap->sorted.seq = realloc(imap->sorted.seq,
+				imap->sorted.size * sizeof(long));
+		imap->sorted.depth = realloc(imap->sorted.depth,
+				imap->sorted.size * sizeof(unsigned char));
+	}
+	imap->sorted.seq[imap->sorted.length] = seq;
+	// Deeper than this and the indentation won't fit on the screen anyway
+	imap->sorted.depth[imap->sorted.length] = depth > 255 ? 255 : depth;
+	imap->sorted.length++;
+}
+
+void handle_imap_sort(struct imap_connection *imap, const char *token,
+		const char *cmd, imap_arg_t *args) {
+	for (; args; args = args->next) {
+		if (args->type == IMAP_NUMBER) {
+			sorted_add(imap, args->num, 0);
+		}
+	}
+}
+
+/*
+ * Each thread is a list like (3 6 (4 23)(44 7 96)), where each number is a
+ * reply to the one before it and the lists at the end are separate branches
+ * under the last one. We flatten it depth first.
+ */
+static void add_thread(struct imap_connection *imap, imap_arg_t *args,
+		int depth) {
+	for (; args; args = args->next) {
+		if (args->type == IMAP_NUMBER) {
+			sorted_add(imap, args->num, depth++);
+		} else if (args->type == IMAP_LIST) {
+			add_thread(imap, args->list, depth);
+		}
+	}
+}
+
+void handle_imap_thread(struct imap_connection *imap, const char *token,
+		const char *cmd, imap_arg_t *args) {
+	for (; args; args = args->next) {
+		if (args->type == IMAP_LIST) {
+			add_thread(imap, args->list, 0);
+		}
+	}
+	worker_log(L_DEBUG, "Got %zd threaded messages", imap->sorted.length);
+}
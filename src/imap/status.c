@@ -6,6 +6,7 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include "imap/imap.h"
 #include "internal/imap.h"
@@ -17,8 +18,16 @@ void handle_imap_OK(struct imap_connection *imap, const char *token,
 	// This space intentionally left blank
 }
 
+bool imap_resp_code_is(struct imap_connection *imap, const char *name) {
+	size_t len = strlen(name);
+	const char *code = imap->resp_code;
+	return code && strncasecmp(code, name, len) == 0
+		&& (code[len] == '\0' || code[len] == ' ');
+}
+
 void handle_imap_status(struct imap_connection *imap, const char *token,
 		const char *cmd, imap_arg_t *args) {
+	const char *code = NULL;
 	if (args->type == IMAP_RESPONSE) {
 		/*
 		 * We have a status response included in this command. We'll produce a
@@ -38,6 +47,7 @@ void handle_imap_status(struct imap_connection *imap, const char *token,
 		handle_line(imap, a);
 		imap_arg_free(a);
 		free(status);
+		code = args->str;
 		args = args->next;
 	}
 	enum imap_status estatus;
@@ -58,16 +68,16 @@ void handle_imap_status(struct imap_connection *imap, const char *token,
 	 * STATUS commands are usually sent by the server in response to a command
 	 * we asked it to do earlier. We passed in a tag with this command, and the
 	 * server passes that tag back with the STATUS command to tell us it's done.
-	 * The pending callbacks hashtable is keyed on the tag, so we pull the
-	 * callback out and invoke it based on that tag.
+	 * Tags are sequential numbers, so we parse the number back out and find
+	 * the callback in the pending ring.
 	 */
-	bool has_callback = hashtable_contains(imap->pending, token);
-	struct imap_pending_callback *callback = hashtable_del(imap->pending, token);
-	if (has_callback) {
-		if (callback && callback->callback) {
-			callback->callback(imap, callback->data, estatus, args->original);
+	struct imap_pending_callback callback;
+	if (imap_pending_pop(imap, token, &callback)) {
+		if (callback.callback) {
+			imap->resp_code = code;
+			callback.callback(imap, callback.data, estatus, args->original);
+			imap->resp_code = NULL;
 		}
-		free(callback);
 	} else if (strcmp(token, "*") == 0) {
 		/*
 		 * Sometimes, though, the tag will be *, which is used for meta commands
@@ -29,11 +29,13 @@ struct mailbox *get_or_make_mailbox(struct imap_connection *imap,
 		const char *name) {
 	struct mailbox *mbox = get_mailbox(imap, name);
 	if (!mbox) {
-		mbox = malloc(sizeof(struct mailbox));
+		mbox = calloc(1, sizeof(struct mailbox));
 		mbox->name = strdup(name);
 		mbox->flags = create_list();
 		mbox->messages = create_list();
 		mbox->exists = mbox->unseen = mbox->recent = -1;
+		mbox->nextuid = -1;
+		mbox->uidvalidity = 0;
 		list_add(imap->mailboxes, mbox);
 	}
 	return mbox;
@@ -86,18 +88,12 @@ void message_part_free(struct message_part *msg) {
 }
 
 void mailbox_message_free(struct mailbox_message *msg) {
-	for (size_t i = 0; msg->flags && i < msg->flags->length; ++i) {
-		char *f = msg->flags->items[i];
-		free(f);
-	}
-	list_free(msg->flags);
 	for (size_t i = 0; msg->parts && i < msg->parts->length; ++i) {
 		struct message_part *part = msg->parts->items[i];
 		message_part_free(part);
 	}
 	list_free(msg->parts);
 	free_headers(msg->headers);
-	free(msg->internal_date);
 	free(msg);
 }
 
@@ -108,6 +104,7 @@ void mailbox_free(struct mailbox *mbox) {
 		free(f);
 	}
 	list_free(mbox->flags);
+	keyword_table_finish(&mbox->keywords);
 	for (size_t i = 0; i < mbox->messages->length; ++i) {
 		struct mailbox_message *m = mbox->messages->items[i];
 		mailbox_message_free(m);
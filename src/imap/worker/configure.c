@@ -0,0 +1,33 @@
+/*
+ * imap/worker/configure.c - Handles IMAP worker configure actions
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "absocket.h"
+#include "config.h"
+#include "imap/imap.h"
+#include "worker.h"
+#include "log.h"
+#include "util/stringop.h"
+
+void handle_worker_configure(struct worker_pipe *pipe, struct worker_message *message) {
+	struct imap_connection *imap = pipe->data;
+	worker_post_message(pipe, WORKER_ACK, message, NULL);
+	list_t *extras = message->data;
+	for (size_t i = 0; i < extras->length; ++i) {
+		struct account_config_extra *extra = extras->items[i];
+		if (strcmp(extra->key, "ktls") == 0) {
+			if (parse_boolean(extra->value)) {
+				imap->socket_flags |= AB_KTLS;
+			} else {
+				imap->socket_flags &= ~AB_KTLS;
+			}
+		} else if (strcmp(extra->key, "connections") == 0) {
+			imap->lanes.wanted = atoi(extra->value);
+		} else if (strcmp(extra->key, "poll-interval") == 0) {
+			imap->watch.interval = atoi(extra->value);
+		}
+	}
+}
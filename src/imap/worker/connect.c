@@ -8,21 +8,20 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "absocket.h"
 #include "util/base64.h"
+#include "util/cache.h"
+#include "util/time.h"
 #include "imap/imap.h"
+#include "imap/worker.h"
 #include "log.h"
 #include "urlparse.h"
 #include "worker.h"
 
-#ifdef USE_OPENSSL
-#include "absocket.h"
-#endif
-
-void handle_imap_ready(struct imap_connection *imap, void *data,
-		enum imap_status status, const char *args);
-
 void imap_starttls_callback(struct imap_connection *imap, void *data,
 		enum imap_status status, const char *args);
+void handle_imap_cap(struct imap_connection *imap, void *data,
+		enum imap_status status, const char *args);
 
 void handle_worker_connect(struct worker_pipe *pipe, struct worker_message *message) {
 	struct imap_connection *imap = pipe->data;
@@ -65,40 +64,295 @@ void handle_worker_connect(struct worker_pipe *pipe, struct worker_message *mess
 	worker_log(L_DEBUG, "Hostname: %s", uri->hostname);
 	worker_log(L_DEBUG, "Port: %s", uri->port);
 
-	bool res = imap_connect(imap, uri, ssl, handle_imap_ready, pipe);
-	if (res) {
-		worker_log(L_DEBUG, "Connected to IMAP server");
-		if (ssl) {
-			/*
-			 * If we're using SSL, we need to wait to start doing IMAP
-			 * housekeeping until the main thread approves of the certificate.
-			 */
+	imap->uri = uri;
+	if (!imap_connect(imap, uri, ssl, handle_imap_ready, pipe)) {
+		worker_post_message(pipe, WORKER_CONNECT_ERROR, message,
+				"Error connecting to IMAP server");
+	}
+}
+
+void handle_imap_connected(struct imap_connection *imap, const char *error) {
+	struct worker_pipe *pipe = imap->data;
+	if (error && imap->reconnect.state != RECONNECT_NONE) {
+		handle_imap_disconnected(imap, error);
+		return;
+	} else if (error) {
+		int len = snprintf(NULL, 0, "Error connecting to IMAP server: %s", error);
+		char *buf = malloc(len + 1);
+		snprintf(buf, len + 1, "Error connecting to IMAP server: %s", error);
+		worker_post_message(pipe, WORKER_CONNECT_ERROR, NULL, buf);
+		return;
+	}
+	worker_log(L_DEBUG, "Connected to IMAP server");
+	get_nanoseconds(&imap->connect_mark);
+	if (imap->socket->use_ssl) {
+		/*
+		 * If we're using SSL, we need to wait to start doing IMAP
+		 * housekeeping until the main thread approves of the certificate.
+		 */
 #ifdef USE_OPENSSL
-			struct cert_check_message *ccm = calloc(1,
-					sizeof(struct cert_check_message));
-			ccm->cert = imap->socket->cert;
-			worker_post_message(pipe, WORKER_CONNECT_CERT_CHECK, message, ccm);
+		struct cert_check_message *ccm = calloc(1,
+				sizeof(struct cert_check_message));
+		ccm->cert = imap->socket->cert;
+		worker_post_message(pipe, WORKER_CONNECT_CERT_CHECK, NULL, ccm);
 #endif
-		} else {
-			imap->mode = RECV_LINE;
-		}
 	} else {
-		worker_post_message(pipe, WORKER_CONNECT_ERROR, message,
-				"Error connecting to IMAP server");
+		imap->mode = RECV_LINE;
 	}
-	imap->uri = uri;
 }
 
 void handle_worker_cert_okay(struct worker_pipe *pipe, struct worker_message *message) {
 	struct imap_connection *imap = pipe->data;
 	imap->mode = RECV_LINE;
+	// Don't count the time the user spent looking at the certificate
+	get_nanoseconds(&imap->connect_mark);
+}
+
+static void connect_finished(struct imap_connection *imap, char *summary) {
+	struct worker_pipe *pipe = imap->data;
+	if (imap->reconnect.state != RECONNECT_NONE) {
+		imap_resync_after_reconnect(imap, summary);
+		return;
+	}
+	imap->reconnect.enabled = true;
+	worker_post_message(pipe, WORKER_CONNECT_DONE, NULL, summary);
+	imap_worker_open_lanes(imap);
+}
+
+static void handle_imap_compressed(struct imap_connection *imap, void *data,
+		enum imap_status status, const char *args) {
+	if (status == STATUS_BYE) {
+		free(data);
+		return;
+	}
+	// Compression is only an optimization, carry on without it if need be
+	connect_finished(imap, data);
+}
+
+static char *connect_summary(struct imap_connection *imap) {
+	struct absocket_timings *t = &imap->socket->timings;
+	double auth = get_elapsed_ms(&imap->connect_mark);
+	char tls[32] = "";
+	if (imap->socket->use_ssl) {
+		snprintf(tls, sizeof(tls), ", TLS %.0fms", t->tls);
+	}
+	const char *fmt = "Connected (DNS %.0fms, TCP %.0fms%s, "
+		"greeting %.0fms, auth %.0fms).";
+	int len = snprintf(NULL, 0, fmt, t->dns, t->tcp, tls,
+			imap->greeting_time, auth);
+	char *buf = malloc(len + 1);
+	snprintf(buf, len + 1, fmt, t->dns, t->tcp, tls,
+			imap->greeting_time, auth);
+	return buf;
+}
+
+static void imap_connect_done(struct imap_connection *imap,
+		struct worker_pipe *pipe) {
+	char *summary = connect_summary(imap);
+	worker_log(L_DEBUG, "%s", summary);
+	if (imap->cap->compress_deflate) {
+		imap_compress(imap, handle_imap_compressed, summary);
+	} else {
+		connect_finished(imap, summary);
+	}
+}
+
+bool imap_worker_login(struct imap_connection *imap, imap_callback_t callback,
+		void *data) {
+	if (!imap->uri->username || !imap->uri->password) {
+		return false;
+	}
+	if (imap->cap_cached && !imap->socket->use_ssl) {
+		return false;
+	}
+	if (imap->cap->auth_plain && imap->cap->sasl_ir) {
+		int len = snprintf(NULL, 0, "%c%s%c%s",
+				'\0', imap->uri->username,
+				'\0', imap->uri->password);
+		char *buf = malloc(len + 1);
+		snprintf(buf, len + 1, "%c%s%c%s",
+				'\0', imap->uri->username,
+				'\0', imap->uri->password);
+		imap->logged_in = true;
+		size_t _;
+		char *enc = b64_encode(buf, len, &_);
+		imap_send(imap, callback, data, "AUTHENTICATE PLAIN %s", enc);
+		memset(enc, 0, strlen(enc));
+		free(enc);
+		memset(buf, 0, len);
+		free(buf);
+		return true;
+	} else if (imap->cap->auth_login) {
+		imap->logged_in = true;
+		imap_send(imap, callback, data, "LOGIN \"%s\" \"%s\"",
+				imap->uri->username, imap->uri->password);
+		return true;
+	}
+	return false;
+}
+
+/*
+ * The cache remembers what the server advertised before and after we logged
+ * in, so next time we can skip asking when the greeting doesn't say. The
+ * greeting set is only kept for connections that start out with TLS, since
+ * before STARTTLS the greeting can't be trusted and the set we logged in with
+ * came after it.
+ */
+static char *capability_cache_path(struct imap_connection *imap) {
+	const struct uri *uri = imap->uri;
+	const char *fmt = "%s@%s:%s.capabilities";
+	const char *user = uri->username ? uri->username : "";
+	int len = snprintf(NULL, 0, fmt, user, uri->hostname, uri->port);
+	char *key = malloc(len + 1);
+	snprintf(key, len + 1, fmt, user, uri->hostname, uri->port);
+	char *path = get_cache_path(key);
+	free(key);
+	return path;
+}
+
+static struct imap_capabilities *read_cached_capabilities(
+		struct imap_connection *imap, const char *which) {
+	char *path = capability_cache_path(imap);
+	size_t len;
+	char *data = path ? read_cache_file(path, &len) : NULL;
+	free(path);
+	if (!data) {
+		return NULL;
+	}
+	struct imap_capabilities *cap = NULL;
+	size_t wlen = strlen(which);
+	char *save;
+	for (char *line = strtok_r(data, "\n", &save); line;
+			line = strtok_r(NULL, "\n", &save)) {
+		if (strncmp(line, which, wlen) == 0 && line[wlen] == ' ') {
+			cap = imap_capabilities_parse(line + wlen + 1);
+			break;
+		}
+	}
+	free(data);
+	return cap;
+}
+
+static void write_cached_capabilities(struct imap_connection *imap) {
+	char *path = capability_cache_path(imap);
+	if (!path) {
+		return;
+	}
+	char *greeting = imap->use_ssl ?
+		imap_capabilities_format(imap->reconnect.cap) : NULL;
+	char *authenticated = imap_capabilities_format(imap->cap);
+	const char *fmt = greeting ?
+		"greeting %s\nauthenticated %s\n" : "authenticated %s\n";
+	int len = greeting ?
+		snprintf(NULL, 0, fmt, greeting, authenticated) :
+		snprintf(NULL, 0, fmt, authenticated);
+	char *buf = malloc(len + 1);
+	if (greeting) {
+		snprintf(buf, len + 1, fmt, greeting, authenticated);
+	} else {
+		snprintf(buf, len + 1, fmt, authenticated);
+	}
+	if (!write_cache_file(path, buf, len)) {
+		worker_log(L_DEBUG, "Unable to save server capabilities");
+	}
+	free(buf);
+	free(greeting);
+	free(authenticated);
+	free(path);
+}
+
+static void handle_imap_cap_refreshed(struct imap_connection *imap,
+		void *data, enum imap_status status, const char *args) {
+	// Only a CAPABILITY response clears cap_cached
+	if (status == STATUS_OK && !imap->cap_cached) {
+		write_cached_capabilities(imap);
+	}
+}
+
+enum login_method {
+	LOGIN_NONE,
+	LOGIN_PLAIN,
+	LOGIN_LOGIN,
+};
+
+/* What imap_worker_login will do with these capabilities */
+static enum login_method login_method(const struct imap_capabilities *cap) {
+	if (cap->auth_plain && cap->sasl_ir) {
+		return LOGIN_PLAIN;
+	} else if (cap->auth_login) {
+		return LOGIN_LOGIN;
+	}
+	return LOGIN_NONE;
+}
+
+struct login_retry {
+	struct worker_pipe *pipe;
+	enum login_method method;
+	char *error;
+};
+
+static void handle_login_retry_cap(struct imap_connection *imap, void *data,
+		enum imap_status status, const char *args) {
+	struct login_retry *retry = data;
+	if (status == STATUS_BYE) {
+		// We'll reconnect, if it's appropriate
+	} else if (status == STATUS_OK && !imap->cap_cached
+			&& login_method(imap->cap) != retry->method) {
+		worker_log(L_DEBUG, "Cached capabilities were wrong about how to "
+				"log in, trying again");
+		handle_imap_cap(imap, retry->pipe, STATUS_OK, NULL);
+	} else {
+		// Logging in the same way again would fail the same way
+		worker_post_message(retry->pipe, WORKER_CONNECT_ERROR, NULL,
+				retry->error);
+		retry->error = NULL;
+	}
+	free(retry->error);
+	free(retry);
 }
 
 void handle_imap_logged_in(struct imap_connection *imap, void *data,
 		enum imap_status status, const char *args) {
 	struct worker_pipe *pipe = data;
-	if (status == STATUS_OK) {
-		worker_post_message(pipe, WORKER_CONNECT_DONE, NULL, NULL);
+	if (status == STATUS_BYE) {
+		// We'll reconnect, if it's appropriate
+		return;
+	} else if (status == STATUS_OK) {
+		if (imap_resp_code_is(imap, "CAPABILITY")) {
+			// The server told us what logging in unlocked
+			write_cached_capabilities(imap);
+		} else {
+			/*
+			 * Many servers tell us what's unlocked by logging in with the
+			 * tagged OK. This one didn't, so go on with what it said last
+			 * time and ask in the background. Until the answer comes we
+			 * might try something it no longer has, and only the answer is
+			 * written to the cache.
+			 */
+			struct imap_capabilities *cached =
+				read_cached_capabilities(imap, "authenticated");
+			if (cached) {
+				free(imap->cap);
+				imap->cap = cached;
+			}
+			imap->cap_cached = true;
+			imap_capability(imap, handle_imap_cap_refreshed, NULL);
+		}
+		imap_connect_done(imap, pipe);
+	} else if (imap->cap_cached
+			&& !imap_resp_code_is(imap, "AUTHENTICATIONFAILED")) {
+		/*
+		 * Maybe we were wrong about how to log in. Ask, and only send the
+		 * credentials again if the answer says we should log in differently.
+		 */
+		worker_log(L_DEBUG, "Login failed with cached capabilities, "
+				"asking the server for them");
+		struct login_retry *retry = malloc(sizeof(struct login_retry));
+		retry->pipe = pipe;
+		retry->method = login_method(imap->cap);
+		retry->error = args ? strdup(args) : NULL;
+		imap->logged_in = false;
+		imap_capability(imap, handle_login_retry_cap, retry);
 	} else {
 		worker_post_message(pipe, WORKER_CONNECT_ERROR, NULL, args ? strdup(args) : NULL);
 	}
@@ -107,7 +361,9 @@ void handle_imap_logged_in(struct imap_connection *imap, void *data,
 void handle_imap_cap(struct imap_connection *imap, void *data,
 		enum imap_status status, const char *args) {
 	struct worker_pipe *pipe = data;
-	if (status != STATUS_OK) {
+	if (status == STATUS_BYE) {
+		return;
+	} else if (status != STATUS_OK) {
 		// TODO: Format errors sent to main thread
 		worker_log(L_ERROR, "IMAP error: %s", args);
 		worker_post_message(pipe, WORKER_CONNECT_ERROR, NULL, NULL);
@@ -119,41 +375,28 @@ void handle_imap_cap(struct imap_connection *imap, void *data,
 		return;
 	}
 	if (imap->logged_in) return;
+	// Remember what we logged in with in case we have to do it again
+	if (!imap->reconnect.cap) {
+		imap->reconnect.cap = malloc(sizeof(struct imap_capabilities));
+	}
+	memcpy(imap->reconnect.cap, imap->cap, sizeof(struct imap_capabilities));
 	// Attempt to authenticate
 	if (status == STATUS_PREAUTH) {
 		imap->logged_in = true;
-		worker_post_message(pipe, WORKER_CONNECT_DONE, NULL, NULL);
-	} else if (imap->cap->auth_plain) {
-		if (imap->uri->username && imap->uri->password) {
-			if (imap->cap->sasl_ir) {
-				int len = snprintf(NULL, 0, "%c%s%c%s",
-						'\0', imap->uri->username,
-						'\0', imap->uri->password);
-				char *buf = malloc(len + 1);
-				snprintf(buf, len + 1, "%c%s%c%s",
-						'\0', imap->uri->username,
-						'\0', imap->uri->password);
-				imap->logged_in = true;
-				size_t _;
-				char *enc = b64_encode(buf, len, &_);
-				imap_send(imap, handle_imap_logged_in, pipe,
-						"AUTHENTICATE PLAIN %s", enc);
-				free(enc);
-				free(buf);
-				memset(imap->uri->password, 0, strlen(imap->uri->password));
-			}
-		}
-	} else if (imap->cap->auth_login) {
-		if (imap->uri->username && imap->uri->password) {
-			imap->logged_in = true;
-			imap_send(imap, handle_imap_logged_in, pipe, "LOGIN \"%s\" \"%s\"",
-					imap->uri->username, imap->uri->password);
-			memset(imap->uri->password, 0, strlen(imap->uri->password));
-		}
+		imap_connect_done(imap, pipe);
+	} else if (imap->cap_cached && !imap->socket->use_ssl) {
+		// Only what the server said on this connection decides how we log in
+		free(imap->cap);
+		imap->cap = NULL;
+		imap->cap_cached = false;
+		imap_capability(imap, handle_imap_cap, pipe);
 #ifdef USE_OPENSSL
-	} else if (imap->cap->starttls) {
+	} else if (!imap->socket->use_ssl && imap->cap->starttls) {
+		// Even if the server would take the password in the clear
 		imap_send(imap, imap_starttls_callback, pipe, "STARTTLS");
 #endif
+	} else if (imap->cap->auth_plain || imap->cap->auth_login) {
+		imap_worker_login(imap, handle_imap_logged_in, pipe);
 	} else {
 		worker_post_message(pipe, WORKER_CONNECT_ERROR, NULL,
 				"IMAP server and client do not share any supported "
@@ -164,6 +407,29 @@ void handle_imap_cap(struct imap_connection *imap, void *data,
 void handle_imap_ready(struct imap_connection *imap, void *data,
 		enum imap_status status, const char *args) {
 	struct worker_pipe *pipe = data;
+	imap->greeting_time = get_elapsed_ms(&imap->connect_mark);
+	get_nanoseconds(&imap->connect_mark);
+	if (!imap->cap) {
+		/*
+		 * The greeting didn't advertise anything. Rather than spend a round
+		 * trip asking, go with what we saw last time, and only ask if
+		 * logging in fails. Without TLS we always ask, so that someone in
+		 * the middle can't get us to log in before STARTTLS.
+		 */
+		struct imap_capabilities *cached = NULL;
+		// reconnect.cap is from after STARTTLS, if there was one
+		if (imap->socket->use_ssl && imap->reconnect.cap) {
+			cached = malloc(sizeof(struct imap_capabilities));
+			memcpy(cached, imap->reconnect.cap, sizeof(struct imap_capabilities));
+		} else if (imap->socket->use_ssl) {
+			cached = read_cached_capabilities(imap, "greeting");
+		}
+		if (cached) {
+			worker_log(L_DEBUG, "Using cached capabilities");
+			imap->cap = cached;
+			imap->cap_cached = true;
+		}
+	}
 	if (!imap->cap) {
 		// Often the server will send us these in a status message during the
 		// handshake. Sometimes it won't, though:
@@ -175,15 +441,23 @@ void handle_imap_ready(struct imap_connection *imap, void *data,
 
 #ifdef USE_OPENSSL
 
+static void handle_imap_tls(struct imap_connection *imap, void *data,
+		enum imap_status status, const char *args) {
+	struct worker_pipe *pipe = data;
+	// The handshake is in the TLS time, don't count it towards auth as well
+	get_nanoseconds(&imap->connect_mark);
+	imap_send(imap, handle_imap_cap, pipe, "CAPABILITY");
+}
+
 void imap_starttls_callback(struct imap_connection *imap, void *data,
 		enum imap_status status, const char *args) {
 	struct worker_pipe *pipe = data;
-	if (!ab_enable_ssl(imap->socket)) {
-		worker_post_message(pipe, WORKER_CONNECT_ERROR, NULL, "TLS connection failed.");
+	if (status == STATUS_BYE) {
 		return;
 	}
-	imap->socket->use_ssl = true;
-	imap_send(imap, handle_imap_cap, pipe, "CAPABILITY");
+	if (status != STATUS_OK || !imap_starttls(imap, handle_imap_tls, pipe)) {
+		worker_post_message(pipe, WORKER_CONNECT_ERROR, NULL, "TLS connection failed.");
+	}
 }
 
 #endif
@@ -0,0 +1,434 @@
+/*
+ * imap/worker/download.c - Fetches large message parts a chunk at a time
+ *
+ * A big attachment fetched with BODY[n] is one literal we can't report
+ * progress on or stop, and losing the connection halfway means starting
+ * over. Instead we ask for it in fixed size pieces with BINARY.PEEK[n]<o.l>
+ * (or BODY.PEEK without BINARY), a few at a time so the connection stays
+ * busy, and after a reconnect we only ask for the pieces we don't have yet.
+ * The pieces come in on the bulk lane when there is one. Base64 and
+ * quoted-printable parts the server didn't decode for us are decoded as their
+ * pieces come in, rather than all at once at the end.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "imap/imap.h"
+#include "worker.h" // must be included before imap/worker.h
+#include "imap/worker.h"
+#include "internal/imap.h"
+#include "log.h"
+#include "email/encodings.h"
+#include "util/base64.h"
+#include "util/list.h"
+
+// TODO: Customizable
+#define CHUNK_SIZE (256 * 1024)
+#define CHUNKS_IN_FLIGHT 4
+/* Smaller parts come in one piece */
+#define CHUNKED_THRESHOLD (1024 * 1024)
+
+enum part_encoding {
+	PART_PLAIN,
+	PART_BASE64,
+	PART_QUOTED_PRINTABLE,
+};
+
+enum chunk_state {
+	CHUNK_WANTED,
+	CHUNK_SENT,
+	CHUNK_DONE,
+};
+
+struct part_download {
+	char *mailbox;
+	long uid;
+	int index, part;
+	/* From BODYSTRUCTURE, the server may send a little more or less */
+	size_t size, length, received;
+	uint8_t *data;
+	enum chunk_state *chunks;
+	size_t *lengths;
+	size_t nchunks, in_flight;
+	bool cancelled;
+	/* Fetching with BINARY, until the server says it can't */
+	bool binary;
+	/* The chunks before this one are decoded into the start of data */
+	enum part_encoding encoding;
+	struct b64_decoder b64;
+	struct qp_decoder qp;
+	size_t decoded_chunks, decoded;
+};
+
+struct chunk_request {
+	struct part_download *download;
+	size_t chunk;
+	bool binary;
+};
+
+static struct imap_connection *primary_connection(struct imap_connection *imap) {
+	return imap->lanes.primary ? imap->lanes.primary : imap;
+}
+
+/* Whether we decode the pieces, rather than the server */
+static bool download_decodes(struct part_download *download) {
+	return !download->binary && download->encoding != PART_PLAIN;
+}
+
+static void download_free(struct part_download *download) {
+	free(download->mailbox);
+	free(download->data);
+	free(download->chunks);
+	free(download->lengths);
+	free(download);
+}
+
+static void download_remove(struct imap_connection *imap,
+		struct part_download *download) {
+	for (size_t i = 0; i < imap->downloads->length; ++i) {
+		if (imap->downloads->items[i] == download) {
+			list_del(imap->downloads, i);
+			break;
+		}
+	}
+	download_free(download);
+}
+
+static struct part_download *find_download(struct imap_connection *imap,
+		const char *mailbox, long uid, int part) {
+	for (size_t i = 0; imap->downloads && i < imap->downloads->length; ++i) {
+		struct part_download *download = imap->downloads->items[i];
+		if (download->uid == uid && download->part == part
+				&& strcmp(download->mailbox, mailbox) == 0) {
+			return download;
+		}
+	}
+	return NULL;
+}
+
+static void post_progress(struct imap_connection *imap,
+		struct part_download *download, bool done) {
+	struct aerc_part_progress *progress =
+		calloc(1, sizeof(struct aerc_part_progress));
+	progress->index = download->index;
+	progress->part = download->part;
+	progress->received = download->received;
+	progress->total = download->size;
+	progress->done = done;
+	progress->cancelled = download->cancelled;
+	worker_post_message(imap->data, WORKER_MESSAGE_PART_PROGRESS, NULL,
+			progress);
+}
+
+/* Returns true if it could be freed right away */
+static bool download_cancel(struct imap_connection *imap,
+		struct part_download *download) {
+	download->cancelled = true;
+	post_progress(imap, download, true);
+	if (download->in_flight) {
+		// It goes once the server's done with its chunks
+		return false;
+	}
+	download_remove(imap, download);
+	return true;
+}
+
+static void download_finish(struct imap_connection *imap,
+		struct part_download *download) {
+	struct mailbox *mbox = get_mailbox(imap, download->mailbox);
+	struct mailbox_message *msg = NULL;
+	for (size_t i = 0; mbox && i < mbox->messages->length; ++i) {
+		struct mailbox_message *_msg = mbox->messages->items[i];
+		if (_msg->populated && _msg->uid == download->uid) {
+			msg = _msg;
+			break;
+		}
+	}
+	if (!msg || !msg->parts || download->part >= (int)msg->parts->length) {
+		worker_log(L_DEBUG, "Message went away before its download finished");
+		download_remove(imap, download);
+		return;
+	}
+	worker_log(L_DEBUG, "Downloaded part %d of message %ld (%zd bytes)",
+			download->part, download->uid, download->length);
+	struct message_part *part = msg->parts->items[download->part];
+	free(part->content);
+	if (download_decodes(download)) {
+		if (download->encoding == PART_BASE64) {
+			download->decoded += b64_decoder_finish(&download->b64,
+					download->data + download->decoded);
+		} else {
+			download->decoded += qp_decoder_finish(&download->qp,
+					(char *)download->data + download->decoded);
+		}
+		download->length = download->decoded;
+	}
+	part->content = download->data;
+	part->size = download->length;
+	part->content[part->size] = '\0';
+	download->data = NULL;
+	message_part_decode(part, download->binary
+			|| download->encoding != PART_PLAIN);
+	post_progress(imap, download, true);
+	// .PEEK kept the server from marking it read while we were at it
+	imap_send(imap, NULL, NULL, "UID STORE %ld +FLAGS.SILENT (\\Seen)",
+			download->uid);
+	msg->flags |= FLAG_SEEN;
+	if (imap->events.message_updated) {
+		imap->events.message_updated(imap, msg);
+	}
+	download_remove(imap, download);
+}
+
+static void download_pump(struct imap_connection *imap,
+		struct part_download *download);
+static void handle_part_chunk(struct imap_connection *imap,
+		struct mailbox_message *msg, size_t part, size_t offset,
+		const char *data, size_t len, bool decoded);
+
+/* Starts over without BINARY, keeping the buffer */
+static void download_restart(struct part_download *download) {
+	download->binary = false;
+	memset(download->chunks, 0, download->nchunks * sizeof(enum chunk_state));
+	memset(download->lengths, 0, download->nchunks * sizeof(size_t));
+	download->received = download->length = 0;
+	download->decoded_chunks = download->decoded = 0;
+	b64_decoder_init(&download->b64);
+	qp_decoder_init(&download->qp, QP_BODY);
+}
+
+static void chunk_done(struct imap_connection *imap, void *data,
+		enum imap_status status, const char *args) {
+	struct chunk_request *request = data;
+	struct part_download *download = request->download;
+	size_t chunk = request->chunk;
+	bool stale = request->binary != download->binary;
+	bool binary = request->binary;
+	free(request);
+	// The lane's done with it either way, the rest is the main connection's
+	imap = primary_connection(imap);
+	download->in_flight--;
+	if (stale) {
+		// Sent before we started over, its chunk is wanted again already
+		status = STATUS_OK;
+	} else if (download->chunks[chunk] != CHUNK_DONE) {
+		// Lost with the connection, or the server didn't send it
+		download->chunks[chunk] = CHUNK_WANTED;
+	}
+	if (status == STATUS_NO && binary && !download->cancelled) {
+		// i.e. [UNKNOWN-CTE], an encoding the server can't undo for us
+		worker_log(L_DEBUG, "Server couldn't decode part %d of message %ld, "
+				"downloading it as is", download->part, download->uid);
+		download_restart(download);
+		status = STATUS_OK;
+	}
+	if ((status == STATUS_NO || status == STATUS_BAD) && !download->cancelled) {
+		worker_log(L_ERROR, "Unable to download message part: %s", args);
+		download_cancel(imap, download);
+		return;
+	}
+	if (download->cancelled) {
+		if (!download->in_flight) {
+			download_remove(imap, download);
+		}
+		return;
+	}
+	for (size_t i = 0; i < download->nchunks; ++i) {
+		if (download->chunks[i] != CHUNK_DONE) {
+			download_pump(imap, download);
+			return;
+		}
+	}
+	if (download->in_flight) {
+		// Only requests from before we started over, which we'll ignore
+		return;
+	}
+	download_finish(imap, download);
+}
+
+static void download_pump(struct imap_connection *imap,
+		struct part_download *download) {
+	if (!imap->socket || !imap->logged_in
+			|| imap->reconnect.state != RECONNECT_NONE) {
+		// imap_worker_resume_downloads picks up where we left off
+		return;
+	}
+	if (!imap->selected || strcmp(imap->selected, download->mailbox) != 0) {
+		download_cancel(imap, download);
+		return;
+	}
+	// Keep the main connection free for the message list
+	struct imap_connection *conn = imap_worker_bulk_lane(imap);
+	if (!conn) {
+		conn = imap;
+	}
+	conn->events.part_chunk = handle_part_chunk;
+	for (size_t i = 0; i < download->nchunks
+			&& download->in_flight < CHUNKS_IN_FLIGHT; ++i) {
+		if (download->chunks[i] != CHUNK_WANTED) {
+			continue;
+		}
+		struct chunk_request *request = malloc(sizeof(struct chunk_request));
+		request->download = download;
+		request->chunk = i;
+		request->binary = download->binary;
+		download->chunks[i] = CHUNK_SENT;
+		download->in_flight++;
+		size_t offset = i * CHUNK_SIZE;
+		size_t len = download->size - offset < CHUNK_SIZE ?
+			download->size - offset : CHUNK_SIZE;
+		if (i == download->nchunks - 1) {
+			// In case BODYSTRUCTURE undercounted
+			len += CHUNK_SIZE;
+		}
+		imap_send(conn, chunk_done, request,
+				"UID FETCH %ld (UID %s.PEEK[%d]<%zd.%zd>)", download->uid,
+				download->binary ? "BINARY" : "BODY", download->part + 1,
+				offset, len);
+	}
+}
+
+/*
+ * Decoding happens in place and in order, which works out because neither
+ * encoding ever decodes to more than it took up.
+ */
+static void download_decode(struct part_download *download) {
+	while (download->decoded_chunks < download->nchunks
+			&& download->chunks[download->decoded_chunks] == CHUNK_DONE) {
+		size_t chunk = download->decoded_chunks++;
+		char *src = (char *)download->data + chunk * CHUNK_SIZE;
+		uint8_t *dst = download->data + download->decoded;
+		if (download->encoding == PART_BASE64) {
+			download->decoded += b64_decoder_update(&download->b64, src,
+					download->lengths[chunk], dst);
+		} else {
+			download->decoded += qp_decoder_update(&download->qp, src,
+					download->lengths[chunk], (char *)dst);
+		}
+	}
+}
+
+static void handle_part_chunk(struct imap_connection *imap,
+		struct mailbox_message *msg, size_t part, size_t offset,
+		const char *data, size_t len, bool decoded) {
+	struct imap_connection *primary = primary_connection(imap);
+	struct part_download *download = imap->selected ?
+		find_download(primary, imap->selected, msg->uid, part) : NULL;
+	if (!download || download->cancelled || decoded != download->binary
+			|| offset % CHUNK_SIZE
+			|| offset / CHUNK_SIZE >= download->nchunks) {
+		return;
+	}
+	size_t chunk = offset / CHUNK_SIZE;
+	if (download->chunks[chunk] == CHUNK_DONE) {
+		return;
+	}
+	if (offset + len > download->size) {
+		download->size = offset + len;
+		download->data = realloc(download->data, download->size + 1);
+	}
+	memcpy(download->data + offset, data, len);
+	if (offset + len > download->length) {
+		download->length = offset + len;
+	}
+	download->chunks[chunk] = CHUNK_DONE;
+	download->lengths[chunk] = len;
+	download->received += len;
+	if (download_decodes(download)) {
+		download_decode(download);
+	}
+	post_progress(primary, download, false);
+}
+
+bool imap_worker_download_part(struct imap_connection *imap, int index,
+		int part) {
+	struct mailbox *mbox = imap->selected ?
+		get_mailbox(imap, imap->selected) : NULL;
+	struct mailbox_message *msg = mbox ? get_message(mbox, index) : NULL;
+	if (!msg || !msg->populated || !msg->parts
+			|| part >= (int)msg->parts->length) {
+		return false;
+	}
+	struct message_part *mpart = msg->parts->items[part];
+	if (mpart->size < CHUNKED_THRESHOLD) {
+		return false;
+	}
+	if (!imap->downloads) {
+		imap->downloads = create_list();
+	}
+	struct part_download *download =
+		find_download(imap, imap->selected, msg->uid, part);
+	if (download) {
+		// The viewer asks again whenever the message changes
+		if (download->cancelled) {
+			download->cancelled = false;
+			download_pump(imap, download);
+		}
+		return true;
+	}
+	download = calloc(1, sizeof(struct part_download));
+	download->mailbox = strdup(imap->selected);
+	download->uid = msg->uid;
+	download->index = index;
+	download->part = part;
+	download->size = mpart->size;
+	download->data = malloc(download->size + 1);
+	download->nchunks = (download->size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	download->chunks = calloc(download->nchunks, sizeof(enum chunk_state));
+	download->lengths = calloc(download->nchunks, sizeof(size_t));
+	if (!mpart->body_encoding) {
+		download->encoding = PART_PLAIN;
+	} else if (strcasecmp(mpart->body_encoding, "base64") == 0) {
+		download->encoding = PART_BASE64;
+	} else if (strcasecmp(mpart->body_encoding, "quoted-printable") == 0) {
+		download->encoding = PART_QUOTED_PRINTABLE;
+	}
+	// Nothing for the server to decode otherwise
+	download->binary = imap->cap->binary && download->encoding != PART_PLAIN;
+	b64_decoder_init(&download->b64);
+	qp_decoder_init(&download->qp, QP_BODY);
+	list_add(imap->downloads, download);
+	worker_log(L_DEBUG, "Downloading part %d of message %ld in %zd chunks",
+			part, msg->uid, download->nchunks);
+	post_progress(imap, download, false);
+	download_pump(imap, download);
+	return true;
+}
+
+void imap_worker_resume_downloads(struct imap_connection *imap) {
+	for (size_t i = 0; imap->downloads && i < imap->downloads->length; ++i) {
+		struct part_download *download = imap->downloads->items[i];
+		if (!download->cancelled) {
+			worker_log(L_DEBUG, "Resuming download of message %ld at %zd of "
+					"%zd bytes", download->uid, download->received,
+					download->size);
+			download_pump(imap, download);
+		}
+	}
+}
+
+void imap_worker_cancel_downloads(struct imap_connection *imap) {
+	for (size_t i = 0; imap->downloads && i < imap->downloads->length; ++i) {
+		struct part_download *download = imap->downloads->items[i];
+		if (download->cancelled) {
+			continue;
+		}
+		worker_log(L_DEBUG, "Cancelled download of message %ld",
+				download->uid);
+		if (download_cancel(imap, download)) {
+			--i;
+		}
+	}
+}
+
+void handle_worker_cancel_message_part(struct worker_pipe *pipe,
+		struct worker_message *message) {
+	struct imap_connection *imap = pipe->data;
+	worker_post_message(pipe, WORKER_ACK, message, NULL);
+	imap_worker_cancel_downloads(imap);
+}
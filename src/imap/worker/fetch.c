@@ -7,14 +7,16 @@
 #include <stdio.h>
 
 #include "imap/imap.h"
-#include "worker.h"
+#include "worker.h" // must be included before imap/worker.h
+#include "imap/worker.h"
+#include "log.h"
 
 void handle_worker_fetch_messages(struct worker_pipe *pipe,
 		struct worker_message *message) {
 	struct imap_connection *imap = pipe->data;
 	struct message_range *range = message->data;
 
-	const char *what = "UID FLAGS INTERNALDATE BODYSTRUCTURE BODY.PEEK["
+	const char *what = "UID FLAGS INTERNALDATE RFC822.SIZE BODYSTRUCTURE BODY.PEEK["
 			"HEADER.FIELDS (DATE FROM SUBJECT TO CC MESSAGE-ID REFERENCES "
 			"CONTENT-TYPE IN-REPLY-TO REPLY-TO)]";
 
@@ -23,20 +25,57 @@ void handle_worker_fetch_messages(struct worker_pipe *pipe,
 	free(range);
 }
 
-void handle_worker_fetch_message_part(struct worker_pipe *pipe,
-		struct worker_message *message) {
-	struct imap_connection *imap = pipe->data;
-	struct fetch_part_request *request = message->data;
-	++request->index; // IMAP is 1 indexed
-	++request->part;
+struct part_request {
+	int index, part;
+};
 
-	const char *fmt = "BODY[%d]";
-	int len = snprintf(NULL, 0, fmt, request->part);
+static void fetch_section(struct imap_connection *imap, imap_callback_t callback,
+		void *data, const char *section, int index, int part) {
+	// FLAGS, to hear about the \Seen that fetching the part sets
+	const char *fmt = "%s[%d] FLAGS";
+	int len = snprintf(NULL, 0, fmt, section, part + 1);
 	char *what = malloc(len + 1);
-	snprintf(what, len + 1, fmt, request->part);
+	snprintf(what, len + 1, fmt, section, part + 1);
 
-	imap_fetch(imap, NULL, NULL, request->index, request->index, what);
+	// IMAP is 1 indexed
+	imap_fetch(imap, callback, data, index + 1, index + 1, what);
 
 	free(what);
+}
+
+static void fetch_binary_done(struct imap_connection *imap, void *data,
+		enum imap_status status, const char *args) {
+	struct part_request *request = data;
+	if (status == STATUS_NO && imap->socket) {
+		// i.e. [UNKNOWN-CTE], an encoding the server can't undo for us
+		worker_log(L_DEBUG, "Server couldn't decode part %d of message %d, "
+				"fetching it as is", request->part, request->index);
+		fetch_section(imap, NULL, NULL, "BODY", request->index, request->part);
+	}
+	free(request);
+}
+
+void fetch_message_part(struct imap_connection *imap, int index, int part) {
+	if (!imap->cap->binary) {
+		fetch_section(imap, NULL, NULL, "BODY", index, part);
+		return;
+	}
+	/*
+	 * The server decodes base64 and quoted-printable for us, which saves a
+	 * third of the transfer for base64 and the work of decoding it here.
+	 */
+	struct part_request *request = malloc(sizeof(struct part_request));
+	request->index = index;
+	request->part = part;
+	fetch_section(imap, fetch_binary_done, request, "BINARY", index, part);
+}
+
+void handle_worker_fetch_message_part(struct worker_pipe *pipe,
+		struct worker_message *message) {
+	struct imap_connection *imap = pipe->data;
+	struct fetch_part_request *request = message->data;
+	if (!imap_worker_download_part(imap, request->index, request->part)) {
+		fetch_message_part(imap, request->index, request->part);
+	}
 	free(request);
 }
@@ -0,0 +1,305 @@
+/*
+ * imap/worker/lanes.c - Extra connections to the same IMAP account
+ *
+ * With connections=2 or more, message bodies are downloaded and other mailboxes
+ * are polled for their counts on a second connection (the bulk lane) so they
+ * don't hold up the main one, and with 3 a third connection sits in IDLE on
+ * INBOX. Lanes share the main connection's mailboxes but leave keeping them up
+ * to date to it: they only handle command completions and the responses to
+ * what they asked for, and find messages by UID since their sequence numbers
+ * may not match. That's also why headers are still fetched on the main
+ * connection, since we don't know the UIDs of messages we haven't fetched yet.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef USE_OPENSSL
+#include <openssl/x509.h>
+#endif
+
+#include "absocket.h"
+#include "imap/imap.h"
+#include "worker.h" // must be included before imap/worker.h
+#include "imap/worker.h"
+#include "internal/imap.h"
+#include "log.h"
+#include "util/list.h"
+
+static const char *lane_names[] = {
+	[LANE_INTERACTIVE] = "interactive",
+	[LANE_BULK] = "bulk",
+	[LANE_IDLE] = "idle",
+};
+
+static void lane_free(struct imap_connection *lane) {
+	if (lane->socket) {
+		imap_disconnect(lane, "Connection closed");
+	}
+	free(lane->selected);
+	free(lane->cap);
+	list_free(lane->select_queue);
+	// The mailboxes and uri belong to the main connection
+	imap_close(lane);
+}
+
+static void lane_connected(struct imap_connection *lane, const char *error) {
+	if (error) {
+		worker_log(L_DEBUG, "Unable to open %s connection: %s",
+				lane_names[lane->lanes.type], error);
+		lane->lanes.dead = true;
+		return;
+	}
+#ifdef USE_OPENSSL
+	struct imap_connection *primary = lane->lanes.primary;
+	if (lane->socket->use_ssl) {
+		/*
+		 * The user approved the main connection's certificate, so that's the
+		 * only one we'll talk to without asking.
+		 */
+		X509 *cert = primary->socket ? primary->socket->cert : NULL;
+		if (!cert || !lane->socket->cert
+				|| X509_cmp(cert, lane->socket->cert) != 0) {
+			worker_log(L_ERROR, "The %s connection was offered a different "
+					"certificate, closing it", lane_names[lane->lanes.type]);
+			lane->lanes.dead = true;
+			return;
+		}
+	}
+#endif
+	lane->mode = RECV_LINE;
+}
+
+static void lane_disconnected(struct imap_connection *lane, const char *error) {
+	worker_log(L_DEBUG, "Lost %s connection: %s",
+			lane_names[lane->lanes.type], error);
+	lane->lanes.dead = true;
+}
+
+static void handle_noop_done(struct imap_connection *imap, void *data,
+		enum imap_status status, const char *args) {
+	imap->lanes.nudged = false;
+}
+
+static void lane_update(struct imap_connection *lane, const char *cmd) {
+	if (lane->lanes.type != LANE_IDLE || lane->mode != RECV_IDLE) {
+		return;
+	}
+	if (strcmp(cmd, "EXISTS") != 0 && strcmp(cmd, "EXPUNGE") != 0
+			&& strcmp(cmd, "FETCH") != 0 && strcmp(cmd, "RECENT") != 0) {
+		return;
+	}
+	struct imap_connection *primary = lane->lanes.primary;
+	if (!primary->logged_in || primary->lanes.nudged
+			|| primary->reconnect.state != RECONNECT_NONE
+			|| !primary->selected || strcmp(primary->selected, "INBOX") != 0) {
+		return;
+	}
+	// The main connection gets the details the next time it talks to the server
+	primary->lanes.nudged = true;
+	imap_send(primary, handle_noop_done, NULL, "NOOP");
+}
+
+static void lane_logged_in(struct imap_connection *lane, void *data,
+		enum imap_status status, const char *args) {
+	if (status != STATUS_OK) {
+		worker_log(L_DEBUG, "Unable to log in on %s connection: %s",
+				lane_names[lane->lanes.type], args);
+		lane->lanes.dead = true;
+		return;
+	}
+	struct imap_connection *primary = lane->lanes.primary;
+	if (primary->cap) {
+		// The main connection already asked what logging in unlocks
+		memcpy(lane->cap, primary->cap, sizeof(struct imap_capabilities));
+	}
+	worker_log(L_DEBUG, "Opened %s connection", lane_names[lane->lanes.type]);
+	lane->lanes.ready = true;
+	if (lane->lanes.type == LANE_IDLE) {
+		// imap_receive starts IDLE once this has been quiet for a bit
+		imap_send(lane, NULL, NULL, "EXAMINE \"INBOX\"");
+	}
+}
+
+static void lane_ready(struct imap_connection *lane, void *data,
+		enum imap_status status, const char *args) {
+	if (status != STATUS_OK && status != STATUS_PREAUTH) {
+		lane->lanes.dead = true;
+		return;
+	}
+	struct imap_connection *primary = lane->lanes.primary;
+	if (!lane->cap && primary->reconnect.cap) {
+		lane->cap = malloc(sizeof(struct imap_capabilities));
+		memcpy(lane->cap, primary->reconnect.cap,
+				sizeof(struct imap_capabilities));
+	}
+	if (!lane->cap) {
+		lane->lanes.dead = true;
+	} else if (status == STATUS_PREAUTH) {
+		lane->logged_in = true;
+		lane_logged_in(lane, NULL, STATUS_OK, NULL);
+	} else if (!imap_worker_login(lane, lane_logged_in, NULL)) {
+		lane->lanes.dead = true;
+	}
+}
+
+static void lane_open(struct imap_connection *imap, enum imap_lane type) {
+	struct imap_connection *lane = calloc(1, sizeof(struct imap_connection));
+	lane->data = imap->data;
+	lane->uri = imap->uri;
+	lane->socket_flags = imap->socket_flags;
+	lane->events.message_updated = imap->events.message_updated;
+	lane->events.mailbox_status = imap->events.mailbox_status;
+	lane->events.connected = lane_connected;
+	lane->events.disconnected = lane_disconnected;
+	lane->events.lane_update = lane_update;
+	worker_log(L_DEBUG, "Opening %s connection", lane_names[type]);
+	if (!imap_connect(lane, imap->uri, imap->use_ssl, lane_ready, lane)) {
+		lane->lanes.dead = true;
+	}
+	list_free(lane->mailboxes);
+	lane->mailboxes = imap->mailboxes;
+	lane->lanes.primary = imap;
+	lane->lanes.type = type;
+	imap->lanes.open[type] = lane;
+}
+
+void imap_worker_open_lanes(struct imap_connection *imap) {
+	if (imap->lanes.primary || imap->lanes.wanted <= 1) {
+		return;
+	}
+	if (imap->socket && imap->socket->use_ssl && !imap->use_ssl) {
+		worker_log(L_DEBUG, "Not opening extra connections after STARTTLS");
+		return;
+	}
+	for (int type = LANE_BULK; type < LANE_COUNT && type < imap->lanes.wanted;
+			++type) {
+		if (imap->lanes.open[type]) {
+			continue;
+		}
+		if (type == LANE_IDLE && !imap->cap->idle) {
+			continue;
+		}
+		lane_open(imap, type);
+	}
+}
+
+void imap_worker_close_lanes(struct imap_connection *imap) {
+	for (int type = LANE_BULK; type < LANE_COUNT; ++type) {
+		struct imap_connection *lane = imap->lanes.open[type];
+		if (lane) {
+			imap->lanes.open[type] = NULL;
+			lane_free(lane);
+		}
+	}
+	imap->lanes.idle_covered = false;
+}
+
+bool imap_worker_lanes(struct worker_pipe *pipe) {
+	struct imap_connection *imap = pipe->data;
+	bool working = false;
+	for (int type = LANE_BULK; type < LANE_COUNT; ++type) {
+		struct imap_connection *lane = imap->lanes.open[type];
+		if (!lane) {
+			continue;
+		}
+		if (lane->lanes.dead) {
+			// We'll try again the next time the main connection comes up
+			imap->lanes.open[type] = NULL;
+			lane_free(lane);
+			continue;
+		}
+		if (imap_receive(lane)) {
+			working = true;
+		}
+	}
+	struct imap_connection *idle = imap->lanes.open[LANE_IDLE];
+	// With NOTIFY, we still have to IDLE to hear about other mailboxes
+	imap->lanes.idle_covered = idle && idle->lanes.ready && !imap->watch.notify
+		&& idle->mode == RECV_IDLE && imap->selected
+		&& strcmp(imap->selected, "INBOX") == 0;
+	return working;
+}
+
+struct route_data {
+	struct imap_connection *primary;
+	int index, part;
+};
+
+static void handle_lane_fetch(struct imap_connection *lane, void *data,
+		enum imap_status status, const char *args) {
+	struct route_data *route = data;
+	struct imap_connection *primary = route->primary;
+	if (status != STATUS_OK && primary->socket && primary->logged_in) {
+		worker_log(L_DEBUG, "Bulk connection couldn't fetch part %d of "
+				"message %d, trying again", route->part, route->index);
+		fetch_message_part(primary, route->index, route->part);
+	}
+	free(route);
+}
+
+static void handle_lane_select(struct imap_connection *lane, void *data,
+		enum imap_status status, const char *args) {
+	if (status != STATUS_OK) {
+		worker_log(L_DEBUG, "Unable to select mailbox on bulk connection: %s",
+				args);
+	}
+}
+
+struct imap_connection *imap_worker_lane(struct imap_connection *imap,
+		enum imap_lane type) {
+	struct imap_connection *lane = imap->lanes.open[type];
+	if (!lane || !lane->lanes.ready || lane->lanes.dead || !lane->socket
+			|| !lane->logged_in) {
+		return NULL;
+	}
+	return lane;
+}
+
+struct imap_connection *imap_worker_bulk_lane(struct imap_connection *imap) {
+	struct imap_connection *lane = imap_worker_lane(imap, LANE_BULK);
+	if (!lane || !imap->selected) {
+		return NULL;
+	}
+	if (!lane->selected || strcmp(lane->selected, imap->selected) != 0) {
+		if (lane->select_queue->length) {
+			// Still catching up with the last mailbox switch
+			return NULL;
+		}
+		imap_select(lane, handle_lane_select, NULL, imap->selected);
+	}
+	return lane;
+}
+
+bool imap_worker_route(struct worker_pipe *pipe, struct worker_message *message) {
+	struct imap_connection *imap = pipe->data;
+	if (message->type != WORKER_FETCH_MESSAGE_PART) {
+		return false;
+	}
+	struct fetch_part_request *request = message->data;
+	struct mailbox *mbox = imap->selected ?
+		get_mailbox(imap, imap->selected) : NULL;
+	struct mailbox_message *msg = mbox ? get_message(mbox, request->index) : NULL;
+	if (!msg || !msg->populated) {
+		return false;
+	}
+	if (imap_worker_download_part(imap, request->index, request->part)) {
+		// Big parts come in chunks, on the bulk lane if it's there
+		free(request);
+		return true;
+	}
+	struct imap_connection *lane = imap_worker_bulk_lane(imap);
+	if (!lane) {
+		return false;
+	}
+	struct route_data *route = malloc(sizeof(struct route_data));
+	route->primary = imap;
+	route->index = request->index;
+	route->part = request->part;
+	imap_send(lane, handle_lane_fetch, route, "UID FETCH %ld (UID FLAGS %s[%d])",
+			msg->uid, lane->cap->binary ? "BINARY" : "BODY", request->part + 1);
+	free(request);
+	return true;
+}
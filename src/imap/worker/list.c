@@ -27,6 +27,9 @@ void imap_list_callback(struct imap_connection *imap,
 			list_add(mboxes, dest);
 		}
 		worker_post_message(data->pipe, WORKER_LIST_DONE, data->message, mboxes);
+		if (!imap->watch.started) {
+			imap_worker_watch_start(imap, true);
+		}
 	} else {
 		worker_post_message(data->pipe, WORKER_LIST_ERROR, data->message, NULL);
 	}
@@ -38,5 +41,10 @@ void handle_worker_list(struct worker_pipe *pipe, struct worker_message *message
 	struct list_data *data = malloc(sizeof(struct list_data));
 	data->pipe = pipe; data->message = message;
 	worker_post_message(pipe, WORKER_ACK, message, NULL);
-	imap_list(imap, imap_list_callback, data, "", "%");
+	if (imap->cap->list_status) {
+		// Gets the unread counts for the sidebar in the same round trip
+		imap_list_status(imap, imap_list_callback, data, "", "%");
+	} else {
+		imap_list(imap, imap_list_callback, data, "", "%");
+	}
 }
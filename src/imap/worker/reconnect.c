@@ -0,0 +1,163 @@
+/*
+ * imap/worker/reconnect.c - Brings the IMAP connection back after it drops
+ *
+ * Once we've been connected, losing the socket puts us in RECONNECT_WAITING.
+ * Attempts back off exponentially, log in with the credentials and
+ * capabilities from last time (the capabilities only over TLS, see
+ * handle_imap_ready), and then reselect the mailbox the user was looking at.
+ * The UI keeps its model in the meantime and only hears about what changed,
+ * and any actions it sends are held until we're done.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "imap/imap.h"
+#include "worker.h" // must be included before imap/worker.h
+#include "imap/worker.h"
+#include "internal/imap.h"
+#include "log.h"
+#include "util/list.h"
+#include "util/time.h"
+
+#define MAX_BACKOFF 60
+
+static void schedule_attempt(struct imap_connection *imap, const char *error) {
+	struct worker_pipe *pipe = imap->data;
+	int delay = 0;
+	if (imap->reconnect.attempts > 0) {
+		delay = MAX_BACKOFF;
+		if (imap->reconnect.attempts <= 6) {
+			delay = 1 << (imap->reconnect.attempts - 1);
+		}
+	}
+	imap->reconnect.state = RECONNECT_WAITING;
+	get_nanoseconds(&imap->reconnect.next_attempt);
+	imap->reconnect.next_attempt.tv_sec += delay;
+	worker_log(L_DEBUG, "Reconnecting in %d seconds", delay);
+
+	const char *fmt = "Connection lost (%s), reconnecting...";
+	int len = snprintf(NULL, 0, fmt, error);
+	char *buf = malloc(len + 1);
+	snprintf(buf, len + 1, fmt, error);
+	worker_post_message(pipe, WORKER_DISCONNECTED, NULL, buf);
+}
+
+void handle_imap_disconnected(struct imap_connection *imap, const char *error) {
+	struct worker_pipe *pipe = imap->data;
+	if (imap->reconnect.state == RECONNECT_NONE && !imap->reconnect.enabled) {
+		// We never got as far as logging in, so there's nothing to go back to
+		int len = snprintf(NULL, 0, "Error connecting to IMAP server: %s", error);
+		char *buf = malloc(len + 1);
+		snprintf(buf, len + 1, "Error connecting to IMAP server: %s", error);
+		worker_post_message(pipe, WORKER_CONNECT_ERROR, NULL, buf);
+		return;
+	}
+	if (imap->reconnect.state == RECONNECT_NONE) {
+		imap->reconnect.attempts = 0;
+	} else {
+		imap->reconnect.attempts++;
+	}
+	// They're probably gone too, and we'll be reopening them anyway
+	imap_worker_close_lanes(imap);
+	// The server may have changed its mind, the next greeting will tell us
+	free(imap->cap);
+	imap->cap = NULL;
+	schedule_attempt(imap, error);
+}
+
+static void reconnect_done(struct imap_connection *imap, void *data,
+		enum imap_status status, const char *args) {
+	struct worker_pipe *pipe = imap->data;
+	char *summary = data;
+	if (status == STATUS_BYE) {
+		// Lost it again, handle_imap_disconnected will try again
+		free(summary);
+		return;
+	}
+	if (status != STATUS_OK) {
+		worker_log(L_ERROR, "Unable to reselect %s: %s", imap->selected, args);
+	}
+	imap->reconnect.state = RECONNECT_NONE;
+	imap->reconnect.attempts = 0;
+	worker_post_message(pipe, WORKER_RECONNECT_DONE, NULL, summary);
+	imap_worker_open_lanes(imap);
+	imap_worker_resume_downloads(imap);
+	if (imap->watch.started) {
+		// NOTIFY only lasts as long as the connection
+		imap_worker_watch_start(imap, false);
+	}
+}
+
+void imap_resync_after_reconnect(struct imap_connection *imap, char *summary) {
+	imap->reconnect.state = RECONNECT_RESYNCING;
+	if (imap->selected && get_mailbox(imap, imap->selected)) {
+		imap_resync(imap, reconnect_done, summary);
+	} else {
+		reconnect_done(imap, summary, STATUS_OK, NULL);
+	}
+}
+
+bool imap_worker_defer_action(struct worker_pipe *pipe,
+		struct worker_message *message) {
+	struct imap_connection *imap = pipe->data;
+	if (imap->reconnect.state == RECONNECT_NONE) {
+		return false;
+	}
+	switch (message->type) {
+	case WORKER_CONFIGURE:
+	case WORKER_CONNECT:
+#ifdef USE_OPENSSL
+	case WORKER_CONNECT_CERT_OKAY:
+#endif
+		return false;
+	default:
+		break;
+	}
+	if (!imap->reconnect.deferred) {
+		imap->reconnect.deferred = create_list();
+	}
+	list_add(imap->reconnect.deferred, message);
+	return true;
+}
+
+bool imap_worker_reconnect(struct worker_pipe *pipe) {
+	struct imap_connection *imap = pipe->data;
+	if (imap->reconnect.state == RECONNECT_NONE) {
+		list_t *deferred = imap->reconnect.deferred;
+		if (!deferred || !deferred->length) {
+			return false;
+		}
+		imap->reconnect.deferred = NULL;
+		worker_log(L_DEBUG, "Handling %zd actions from while we were offline",
+				deferred->length);
+		for (size_t i = 0; i < deferred->length; ++i) {
+			struct worker_message *message = deferred->items[i];
+			handle_message(pipe, message);
+			worker_message_free(message);
+		}
+		list_free(deferred);
+		return true;
+	}
+	if (imap->reconnect.state != RECONNECT_WAITING) {
+		return false;
+	}
+	struct timespec now;
+	get_nanoseconds(&now);
+	if (now.tv_sec < imap->reconnect.next_attempt.tv_sec
+			|| (now.tv_sec == imap->reconnect.next_attempt.tv_sec
+				&& now.tv_nsec < imap->reconnect.next_attempt.tv_nsec)) {
+		return false;
+	}
+	worker_log(L_DEBUG, "Reconnecting to IMAP server (attempt %d)",
+			imap->reconnect.attempts + 1);
+	imap->reconnect.state = RECONNECT_CONNECTING;
+	if (!imap_reconnect(imap, handle_imap_ready, pipe)) {
+		imap->reconnect.attempts++;
+		schedule_attempt(imap, "unable to open socket");
+	}
+	return true;
+}
@@ -0,0 +1,61 @@
+/*
+ * imap/worker/search.c - Handles IMAP worker search actions
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "imap/imap.h"
+#include "worker.h" // must be included before imap/worker.h
+#include "imap/worker.h"
+#include "log.h"
+
+static void search_done(struct imap_connection *imap, void *data,
+		enum imap_status status, const char *args) {
+	struct worker_pipe *pipe = data;
+	if (status != STATUS_OK || !imap->selected) {
+		worker_post_message(pipe, WORKER_SEARCH_MAILBOX_ERROR, NULL,
+				strdup(args && status != STATUS_BYE ? args : "Search failed"));
+		imap_searched_clear(imap);
+		return;
+	}
+	struct aerc_search_result *result =
+		calloc(1, sizeof(struct aerc_search_result));
+	result->mailbox = strdup(imap->selected);
+	result->length = imap->searched.length;
+	result->count = imap->searched.count;
+	result->ranges = malloc(result->length * sizeof(struct aerc_range) + 1);
+	for (size_t i = 0; i < result->length; ++i) {
+		// Sequence numbers start at 1, message indexes at 0
+		result->ranges[i].min = imap->searched.ranges[i].min - 1;
+		result->ranges[i].max = imap->searched.ranges[i].max - 1;
+	}
+	worker_log(L_DEBUG, "Found %zd messages", result->count);
+	worker_post_message(pipe, WORKER_SEARCH_MAILBOX_DONE, NULL, result);
+	imap_searched_clear(imap);
+}
+
+void handle_worker_search_mailbox(struct worker_pipe *pipe,
+		struct worker_message *message) {
+	struct imap_connection *imap = pipe->data;
+	char *query = message->data;
+	worker_post_message(pipe, WORKER_ACK, message, NULL);
+	if (!imap->selected) {
+		worker_post_message(pipe, WORKER_SEARCH_MAILBOX_ERROR, message,
+				strdup("No mailbox selected"));
+		free(query);
+		return;
+	}
+	const char *error = NULL;
+	char *keys = imap_search_compile(query, imap->cap->literal_plus, &error);
+	free(query);
+	if (!keys) {
+		worker_post_message(pipe, WORKER_SEARCH_MAILBOX_ERROR, message,
+				strdup(error));
+		return;
+	}
+	imap_search(imap, search_done, pipe, keys);
+	free(keys);
+}
@@ -0,0 +1,126 @@
+/*
+ * imap/worker/sort.c - Handles IMAP worker sort actions
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "imap/imap.h"
+#include "worker.h" // must be included before imap/worker.h
+#include "imap/worker.h"
+#include "log.h"
+
+struct sort_data {
+	struct worker_pipe *pipe;
+	struct aerc_sort_request request;
+};
+
+static const char *sort_criteria(enum aerc_sort_key key) {
+	switch (key) {
+	case SORT_ARRIVAL:
+		return "ARRIVAL";
+	case SORT_DATE:
+		return "DATE";
+	case SORT_FROM:
+		return "FROM";
+	case SORT_SUBJECT:
+		return "SUBJECT";
+	case SORT_SIZE:
+		return "SIZE";
+	default:
+		return NULL;
+	}
+}
+
+/*
+ * The server gives us the smallest first, and the message list shows the
+ * largest at the top unless asked otherwise. Threads keep their replies under
+ * the message they're replying to either way.
+ */
+static size_t *make_order(struct imap_connection *imap, bool thread,
+		bool reverse, unsigned char **depth) {
+	size_t n = imap->sorted.length;
+	size_t *order = malloc(n * sizeof(size_t));
+	*depth = NULL;
+	if (!thread) {
+		for (size_t row = 0; row < n; ++row) {
+			size_t i = reverse ? row : n - row - 1;
+			order[row] = imap->sorted.seq[i] - 1;
+		}
+		return order;
+	}
+	*depth = malloc(n * sizeof(unsigned char));
+	size_t *starts = malloc((n + 1) * sizeof(size_t));
+	size_t threads = 0;
+	for (size_t i = 0; i < n; ++i) {
+		if (i == 0 || imap->sorted.depth[i] == 0) {
+			starts[threads++] = i;
+		}
+	}
+	starts[threads] = n;
+	size_t row = 0;
+	for (size_t k = 0; k < threads; ++k) {
+		size_t t = reverse ? k : threads - k - 1;
+		for (size_t i = starts[t]; i < starts[t + 1]; ++i, ++row) {
+			order[row] = imap->sorted.seq[i] - 1;
+			(*depth)[row] = imap->sorted.depth[i];
+		}
+	}
+	free(starts);
+	return order;
+}
+
+static void sort_done(struct imap_connection *imap, void *_data,
+		enum imap_status status, const char *args) {
+	struct sort_data *data = _data;
+	if (status != STATUS_OK || !imap->selected) {
+		worker_post_message(data->pipe, WORKER_SORT_MAILBOX_ERROR, NULL,
+				args && status != STATUS_BYE ? strdup(args) : NULL);
+		imap_sorted_clear(imap);
+		free(data);
+		return;
+	}
+	bool thread = data->request.key == SORT_THREAD;
+	struct aerc_sort_result *result = calloc(1, sizeof(struct aerc_sort_result));
+	result->mailbox = strdup(imap->selected);
+	result->length = imap->sorted.length;
+	result->order = make_order(imap, thread, data->request.reverse,
+			&result->depth);
+	worker_log(L_DEBUG, "Sorted %zd messages", result->length);
+	worker_post_message(data->pipe, WORKER_SORT_MAILBOX_DONE, NULL, result);
+	imap_sorted_clear(imap);
+	free(data);
+}
+
+void handle_worker_sort_mailbox(struct worker_pipe *pipe,
+		struct worker_message *message) {
+	struct imap_connection *imap = pipe->data;
+	struct aerc_sort_request *request = message->data;
+	worker_post_message(pipe, WORKER_ACK, message, NULL);
+	const char *criteria = sort_criteria(request->key);
+	const char *algorithm = NULL;
+	if (request->key == SORT_THREAD) {
+		if (imap->cap->thread_references) {
+			algorithm = "REFERENCES";
+		} else if (imap->cap->thread_orderedsubject) {
+			algorithm = "ORDEREDSUBJECT";
+		}
+	}
+	if (!imap->selected || (!algorithm && (!criteria || !imap->cap->sort))) {
+		// The UI sorts what it has instead
+		worker_post_message(pipe, WORKER_SORT_MAILBOX_ERROR, message, NULL);
+		free(request);
+		return;
+	}
+	struct sort_data *data = malloc(sizeof(struct sort_data));
+	data->pipe = pipe;
+	data->request = *request;
+	free(request);
+	if (algorithm) {
+		imap_thread(imap, sort_done, data, algorithm);
+	} else {
+		imap_sort(imap, sort_done, data, criteria);
+	}
+}
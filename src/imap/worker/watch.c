@@ -0,0 +1,92 @@
+/*
+ * imap/worker/watch.c - Keeps message counts current for every mailbox
+ *
+ * IDLE only tells us about the selected mailbox. For the rest, we ask the
+ * server to NOTIFY us with STATUS responses when it can, and otherwise ask for
+ * them every so often, with one LIST-STATUS if the server has it or a STATUS
+ * per mailbox sent all at once if it doesn't. Those go on the bulk lane when
+ * there is one, so a slow STATUS doesn't hold up the message list.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "imap/imap.h"
+#include "worker.h" // must be included before imap/worker.h
+#include "imap/worker.h"
+#include "internal/imap.h"
+#include "log.h"
+#include "util/time.h"
+
+// Used unless the account sets poll-interval
+#define POLL_INTERVAL 120
+
+static int poll_interval(struct imap_connection *imap) {
+	return imap->watch.interval > 0 ? imap->watch.interval : POLL_INTERVAL;
+}
+
+static void schedule_poll(struct imap_connection *imap, int delay) {
+	get_nanoseconds(&imap->watch.next_poll);
+	imap->watch.next_poll.tv_sec += delay;
+}
+
+static void handle_notify_done(struct imap_connection *imap, void *data,
+		enum imap_status status, const char *args) {
+	if (status == STATUS_OK) {
+		worker_log(L_DEBUG, "Server will notify us of mailbox changes");
+		imap->watch.notify = true;
+	} else if (status != STATUS_BYE) {
+		worker_log(L_DEBUG, "NOTIFY failed (%s), polling instead", args);
+		schedule_poll(imap, 0);
+	}
+}
+
+void imap_worker_watch_start(struct imap_connection *imap, bool listed) {
+	imap->watch.started = true;
+	imap->watch.notify = false;
+	if (imap->cap->notify) {
+		imap_notify(imap, handle_notify_done, NULL);
+	} else {
+		// LIST-STATUS already brought us up to date if the server has it
+		schedule_poll(imap,
+				listed && imap->cap->list_status ? poll_interval(imap) : 0);
+	}
+}
+
+static void poll_status(struct imap_connection *imap) {
+	struct imap_connection *conn = imap_worker_lane(imap, LANE_BULK);
+	if (!conn) {
+		conn = imap;
+	}
+	if (imap->cap->list_status) {
+		imap_list_status(conn, NULL, NULL, "", "%");
+		return;
+	}
+	// These go out in one write, so the answers come back in one round trip
+	for (size_t i = 0; i < imap->mailboxes->length; ++i) {
+		struct mailbox *mbox = imap->mailboxes->items[i];
+		if ((imap->selected && strcmp(imap->selected, mbox->name) == 0)
+				|| mailbox_get_flag(imap, mbox->name, "\\noselect")) {
+			continue;
+		}
+		imap_status(conn, NULL, NULL, mbox->name);
+	}
+}
+
+bool imap_worker_watch(struct worker_pipe *pipe) {
+	struct imap_connection *imap = pipe->data;
+	if (!imap->watch.started || imap->watch.notify || !imap->logged_in
+			|| imap->reconnect.state != RECONNECT_NONE) {
+		return false;
+	}
+	struct timespec now;
+	get_nanoseconds(&now);
+	if (now.tv_sec < imap->watch.next_poll.tv_sec) {
+		return false;
+	}
+	poll_status(imap);
+	schedule_poll(imap, poll_interval(imap));
+	return true;
+}
@@ -22,6 +22,7 @@ struct action_handler {
 };
 
 struct action_handler handlers[] = {
+	{ WORKER_CONFIGURE, handle_worker_configure },
 	{ WORKER_CONNECT, handle_worker_connect },
 	{ WORKER_LIST, handle_worker_list },
 	{ WORKER_SELECT_MAILBOX, handle_worker_select_mailbox },
@@ -31,13 +32,19 @@ struct action_handler handlers[] = {
 	{ WORKER_CREATE_MAILBOX, handle_worker_create_mailbox },
 	{ WORKER_FETCH_MESSAGES, handle_worker_fetch_messages },
 	{ WORKER_FETCH_MESSAGE_PART, handle_worker_fetch_message_part },
+	{ WORKER_CANCEL_MESSAGE_PART, handle_worker_cancel_message_part },
 	{ WORKER_DELETE_MAILBOX, handle_worker_delete_mailbox },
 	{ WORKER_DELETE_MESSAGE, handle_worker_delete_message },
 	{ WORKER_COPY_MESSAGE, handle_worker_copy_message },
 	{ WORKER_MOVE_MESSAGE, handle_worker_move_message },
+	{ WORKER_SORT_MAILBOX, handle_worker_sort_mailbox },
+	{ WORKER_SEARCH_MAILBOX, handle_worker_search_mailbox },
 };
 
 void handle_message(struct worker_pipe *pipe, struct worker_message *message) {
+	if (imap_worker_route(pipe, message)) {
+		return;
+	}
 	for (size_t i = 0; i < sizeof(handlers) / sizeof(struct action_handler); i++) {
 		if (handlers[i].action == message->type) {
 			handlers[i].handler(pipe, message);
@@ -56,20 +63,11 @@ struct aerc_message *serialize_message(struct mailbox_message *source) {
 		return dest;
 	}
 	dest->uid = source->uid;
-	dest->flags = create_list();
-	for (size_t i = 0; i < source->flags->length; ++i) {
-		list_add(dest->flags, strdup(source->flags->items[i]));
-	}
-	dest->headers = create_list();
-	for (size_t i = 0; i < source->headers->length; ++i) {
-		struct email_header *header = source->headers->items[i];
-		struct email_header *copy = malloc(sizeof(struct email_header));
-		copy->key = strdup(header->key);
-		copy->value = strdup(header->value);
-		list_add(dest->headers, copy);
-	}
-	dest->internal_date = calloc(1, sizeof(struct tm));
-	memcpy(dest->internal_date, source->internal_date, sizeof(struct tm));
+	dest->size = source->size;
+	dest->flags = source->flags;
+	dest->headers = copy_headers(source->headers);
+	dest->internal_date = source->internal_date;
+	dest->internal_zone = source->internal_zone;
 	if (source->parts) {
 		dest->parts = create_list();
 		for (size_t i = 0; i < source->parts->length; ++i) {
@@ -91,7 +89,7 @@ struct aerc_message *serialize_message(struct mailbox_message *source) {
 }
 
 struct aerc_mailbox *serialize_mailbox(struct mailbox *source) {
-	struct aerc_mailbox *dest = calloc(1, sizeof(struct mailbox));
+	struct aerc_mailbox *dest = calloc(1, sizeof(struct aerc_mailbox));
 	dest->name = strdup(source->name);
 	dest->exists = source->exists;
 	dest->recent = source->recent;
@@ -103,6 +101,7 @@ struct aerc_mailbox *serialize_mailbox(struct mailbox *source) {
 		// TODO: Send along the permanent bool as well
 		list_add(dest->flags, strdup(flag->name));
 	}
+	keyword_table_copy(&dest->keywords, &source->keywords);
 	dest->messages = create_list();
 	for (size_t i = 0; i < source->messages->length; ++i) {
 		list_add(dest->messages, serialize_message(source->messages->items[i]));
@@ -126,6 +125,17 @@ static void update_message(struct imap_connection *imap,
 	worker_post_message(pipe, WORKER_MESSAGE_UPDATED, NULL, update);
 }
 
+static void mailbox_status(struct imap_connection *imap, struct mailbox *mbox) {
+	struct worker_pipe *pipe = imap->data;
+	struct aerc_mailbox_status *status = calloc(1,
+			sizeof(struct aerc_mailbox_status));
+	status->name = strdup(mbox->name);
+	status->exists = mbox->exists;
+	status->recent = mbox->recent;
+	status->unseen = mbox->unseen;
+	worker_post_message(pipe, WORKER_MAILBOX_STATUS, NULL, status);
+}
+
 static void delete_mailbox(struct imap_connection *imap, const char *mailbox) {
 	struct worker_pipe *pipe = imap->data;
 	worker_post_message(pipe, WORKER_MAILBOX_DELETED, NULL, strdup(mailbox));
@@ -148,21 +158,39 @@ void *imap_worker(void *_pipe) {
 	imap->data = pipe;
 	imap->events.mailbox_updated = update_mailbox;
 	imap->events.mailbox_deleted = delete_mailbox;
+	imap->events.mailbox_status = mailbox_status;
 	imap->events.message_updated = update_message;
 	imap->events.message_deleted = delete_message;
+	imap->events.connected = handle_imap_connected;
+	imap->events.disconnected = handle_imap_disconnected;
 	worker_log(L_DEBUG, "Starting IMAP worker");
 	while (1) {
 		bool sleep = true;
 		if (worker_get_action(pipe, &message)) {
 			if (message->type == WORKER_END) {
+				if (imap->uri && imap->uri->password) {
+					// Kept around for reconnecting until now
+					memset(imap->uri->password, 0, strlen(imap->uri->password));
+				}
+				imap_worker_close_lanes(imap);
+				imap_worker_cancel_downloads(imap);
 				imap_close(imap);
 				free(imap);
 				worker_message_free(message);
 				return NULL;
-			} else {
+			} else if (!imap_worker_defer_action(pipe, message)) {
 				handle_message(pipe, message);
+				worker_message_free(message);
 			}
-			worker_message_free(message);
+			sleep = false;
+		}
+		if (imap_worker_reconnect(pipe)) {
+			sleep = false;
+		}
+		if (imap_worker_lanes(pipe)) {
+			sleep = false;
+		}
+		if (imap_worker_watch(pipe)) {
 			sleep = false;
 		}
 		if (imap_receive(imap)) {
@@ -34,6 +34,8 @@ struct message_handler {
 struct message_handler message_handlers[] = {
 	{ WORKER_CONNECT_DONE, handle_worker_connect_done },
 	{ WORKER_CONNECT_ERROR, handle_worker_connect_error },
+	{ WORKER_DISCONNECTED, handle_worker_disconnected },
+	{ WORKER_RECONNECT_DONE, handle_worker_reconnect_done },
 	{ WORKER_SELECT_MAILBOX_DONE, handle_worker_select_done },
 	{ WORKER_SELECT_MAILBOX_ERROR, handle_worker_select_error },
 	{ WORKER_LIST_DONE, handle_worker_list_done },
@@ -42,6 +44,12 @@ struct message_handler message_handlers[] = {
 	{ WORKER_CONNECT_CERT_CHECK, handle_worker_connect_cert_check },
 #endif
 	{ WORKER_MAILBOX_UPDATED, handle_worker_mailbox_updated },
+	{ WORKER_MAILBOX_STATUS, handle_worker_mailbox_status },
+	{ WORKER_SORT_MAILBOX_DONE, handle_worker_sort_done },
+	{ WORKER_SORT_MAILBOX_ERROR, handle_worker_sort_error },
+	{ WORKER_MESSAGE_PART_PROGRESS, handle_worker_message_part_progress },
+	{ WORKER_SEARCH_MAILBOX_DONE, handle_worker_search_done },
+	{ WORKER_SEARCH_MAILBOX_ERROR, handle_worker_search_error },
 	{ WORKER_MAILBOX_DELETED, handle_worker_mailbox_deleted },
 	{ WORKER_MESSAGE_UPDATED, handle_worker_message_updated },
 	{ WORKER_MESSAGE_DELETED, handle_worker_message_deleted },
@@ -112,10 +120,10 @@ int main(int argc, char **argv) {
 		account->worker.pipe = worker_pipe_new();
 		account->ui.fetch_requests = create_list();
 		account->config = ac;
-		worker_post_action(account->worker.pipe, WORKER_CONNECT, NULL,
-				ac->source);
 		worker_post_action(account->worker.pipe, WORKER_CONFIGURE, NULL,
 				ac->extras);
+		worker_post_action(account->worker.pipe, WORKER_CONNECT, NULL,
+				ac->source);
 		// TODO: Detect appropriate worker based on source
 		pthread_create(&account->worker.thread, NULL, imap_worker,
 				account->worker.pipe);
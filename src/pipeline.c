@@ -24,8 +24,7 @@ static int header_cmp(const void *_a, const void *_b) {
 	return strcmp(a, b);
 }
 
-static void add_header(void *_header) {
-	struct email_header *header = _header;
+static void add_header(struct email_header *header) {
 	if (list_seq_find(config->ui.show_headers, header_cmp, header->key) == -1) {
 		return;
 	}
@@ -49,7 +48,10 @@ static void subp_complete(struct subprocess *subp) {
 	char *argv[] = { "sh", "-c", config->viewer.pager, NULL };
 	subp = subprocess_init(argv, true);
 	header_subp = subp;
-	list_foreach(state->msg->headers, add_header);
+	for (size_t i = 0; state->msg->headers
+			&& i < state->msg->headers->length; ++i) {
+		add_header(&state->msg->headers->items[i]);
+	}
 	if (capture) {
 		unsigned char *data = malloc(capture->len);
 		memcpy(data, capture->data, capture->len);
@@ -81,22 +83,12 @@ static void spawn_subprocess(struct account_state *account,
 	state->msg = msg;
 	state->part = part;
 
-	// Strip non-printable characters from message
-	// TODO: this actually mutates the "official" copy of the message in memory
-	// maybe we want to copy it somewhere else first or translate it on the fly
-	// or something
-	char *data = (char *)part->content;
-	int i = 0;
-	while (i < part->size) {
-		uint32_t ch = utf8_decode((const char **)&data);
-		int usize = utf8_chsize(ch);
-		i += usize;
-		if ((ch <= 0x1F && ch != '\n' && ch != '\r') || ch == 0x7F || ch == 0x200B) {
-			// Delete these characters
-			memmove(&data[-usize], data, part->size - i);
-			part->size -= usize - 1;
-			data -= usize - 1;
-		}
+	// Strip non-printable characters, once per message and into a copy
+	if (!part->filtered && part->content) {
+		size_t size;
+		part->filtered = (uint8_t *)utf8_sanitize((const char *)part->content,
+				part->size, &size);
+		part->filtered_size = size;
 	}
 
 	char *argv[] = { "sh", "-c", "cat", NULL };
@@ -114,12 +106,12 @@ static void spawn_subprocess(struct account_state *account,
 	struct subprocess *subp = subprocess_init(argv, false);
 	subp->user = state;
 	subp->complete = subp_complete;
-	if (part->size == 0) {
+	if (part->filtered_size == 0) {
 		// Don't actually run preprocessor on empty input
 		subp_complete(subp);
 		return;
 	}
-	subprocess_queue_stdin(subp, part->content, part->size);
+	subprocess_queue_stdin(subp, part->filtered, part->filtered_size);
 	subprocess_capture_stdout(subp);
 	subprocess_capture_stderr(subp);
 
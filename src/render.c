@@ -1,10 +1,16 @@
+#define _POSIX_C_SOURCE 200809L
+// For tm_gmtoff and tm_zone
+#define _DEFAULT_SOURCE
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <termbox.h>
 #include <time.h>
 #include "colors.h"
+#include "columns.h"
 #include "config.h"
+#include "sort.h"
 #include "state.h"
 #include "ui.h"
 #include "util/unicode.h"
@@ -116,10 +122,19 @@ void render_sidebar(struct geometry geo) {
 				tb_put_cell(geo.x + l, geo.y, &cell);
 				l++;
 			}
+			int right = geo.width - 1;
 			if (get_mailbox_flag(mailbox, "\\HasChildren")) {
 				cell.ch = '.';
 				tb_put_cell(geo.x + geo.width - 2, geo.y, &cell);
 				tb_put_cell(geo.x + geo.width - 3, geo.y, &cell);
+				right -= 3;
+			}
+			if (mailbox->unseen > 0) {
+				char count[24];
+				int len = snprintf(count, sizeof(count), " %ld", mailbox->unseen);
+				if (len < right) {
+					tb_printf(geo.x + right - len, geo.y, &cell, "%s", count);
+				}
 			}
 		}
 		geo.x = _x;
@@ -193,19 +208,65 @@ void render_status(struct geometry geo) {
 	}
 }
 
-void render_item(struct geometry geo, struct aerc_message *message, bool selected) {
+/*
+ * Every redraw formats the date of every row on screen, and they're mostly the
+ * rows that were there last time, so we keep what strftime gave us.
+ */
+#define DATE_CACHE_SIZE 256
+
+static struct {
+	time_t when;
+	short zone;
+	bool used;
+	char text[64];
+} date_cache[DATE_CACHE_SIZE];
+static char *date_cache_format;
+
+/* Formats a date as it was in the zone it came in, in minutes east of UTC */
+static const char *format_date(time_t date, short zone) {
+	const char *format = config->ui.timestamp_format;
+	if (!date_cache_format || strcmp(date_cache_format, format) != 0) {
+		free(date_cache_format);
+		date_cache_format = strdup(format);
+		memset(date_cache, 0, sizeof(date_cache));
+	}
+	time_t when = date + zone * 60;
+	size_t slot = (size_t)(when ^ (when >> 16) ^ zone) % DATE_CACHE_SIZE;
+	if (!date_cache[slot].used || date_cache[slot].when != when
+			|| date_cache[slot].zone != zone) {
+		struct tm tm;
+		gmtime_r(&when, &tm);
+		// gmtime_r says UTC, so %z and %Z would too
+		char name[8];
+		snprintf(name, sizeof(name), "%c%02d%02d", zone < 0 ? '-' : '+',
+				abs(zone) / 60, abs(zone) % 60);
+		tm.tm_gmtoff = zone * 60;
+		tm.tm_zone = name;
+		strftime(date_cache[slot].text, sizeof(date_cache[slot].text),
+				format, &tm);
+		date_cache[slot].when = when;
+		date_cache[slot].zone = zone;
+		date_cache[slot].used = true;
+	}
+	return date_cache[slot].text;
+}
+
+void render_item(struct geometry geo, struct aerc_mailbox *mailbox,
+		size_t index, int depth, bool selected) {
 	if (geo.y > geo.height) {
 		return;
 	}
+	struct message_columns *columns = get_message_columns(mailbox);
 	struct tb_cell cell;
 	get_color("message-list-unselected", &cell);
-	if (!message || !message->fetched) {
+	if (!columns->fetched[index]) {
 		add_loading(geo);
+		struct aerc_message *message = mailbox->messages->items[index];
 		if (message) {
 			request_fetch(message);
 		}
 	} else {
-		bool seen = get_message_flag(message, "\\Seen");
+		bool seen = columns->flags[index] & FLAG_SEEN;
 		if (selected) {
 			get_color("message-list-selected", &cell);
 			if (!seen) {
@@ -217,11 +278,12 @@ void render_item(struct geometry geo, struct aerc_message *message, bool selecte
 				get_color("message-list-unselected-unread", &cell);
 			}
 		}
-		char date[64];
-		strftime(date, sizeof(date), config->ui.timestamp_format,
-				message->internal_date);
-		const char *subject = get_message_header(message, "Subject");
-		int l = tb_printf(geo.x, geo.y, &cell, "%s %s", date, subject);
+		const char *date = format_date(columns->date[index],
+				columns->zone[index]);
+		const char *subject = columns->strings + columns->subject[index];
+		// Replies are indented under the message they're replying to
+		int l = tb_printf(geo.x, geo.y, &cell, "%s %*s%s", date,
+				depth * 2, "", subject);
 		geo.x += l;
 		geo.width -= 1;
 		geo.height = 1;
@@ -244,25 +306,29 @@ void render_items(struct geometry geo) {
 		return;
 	}
 
-	if (account->selected && mailbox->messages->length == 0) {
+	if (account->selected && get_message_rows(mailbox) == 0) {
 		geo.x += geo.width / 2 - strlen(config->ui.empty_message) / 2;
 		get_color("message-list-empty", &cell);
 		tb_printf(geo.x, geo.y, &cell, config->ui.empty_message);
 	}
 
+	if (account->ui.sort.dirty) {
+		// New headers came in since we last sorted
+		sort_locally(account, mailbox);
+	}
+
 	int limit = geo.height + geo.y;
-	int selected = mailbox->messages->length - account->ui.selected_message - 1;
-	for (int i = mailbox->messages->length - account->ui.list_offset - 1;
-			i >= 0 && geo.y < limit;
-			--i, ++geo.y) {
-		if ((size_t)i >= mailbox->messages->length) {
-			continue;
-		}
-		struct aerc_message *message = mailbox->messages->items[i];
-		const char *subject = get_message_header(message, "Subject");
-		worker_log(L_DEBUG, "Rendering message %d of %zd at %d (offs %zd) [%s]",
-				i, mailbox->messages->length, geo.y, account->ui.list_offset, subject);
-		render_item(geo, message, selected == i);
+	size_t rows = get_message_rows(mailbox);
+	struct message_columns *columns = get_message_columns(mailbox);
+	for (size_t row = account->ui.list_offset;
+			row < rows && geo.y < limit;
+			++row, ++geo.y) {
+		size_t i = get_message_index(mailbox, row);
+		worker_log(L_DEBUG, "Rendering message %zd of %zd at %d (offs %zd) [%s]",
+				i, mailbox->messages->length, geo.y, account->ui.list_offset,
+				columns->strings + columns->subject[i]);
+		render_item(geo, mailbox, i, get_message_depth(mailbox, row),
+				account->ui.selected_message == row);
 	}
 }
 
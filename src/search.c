@@ -0,0 +1,28 @@
+/*
+ * search.c - filters the message list
+ *
+ * The server does the searching, and we show the messages it found in
+ * whatever order the list is in. Only the rows on screen get their headers
+ * fetched, as with the unfiltered list.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <string.h>
+#include "search.h"
+#include "state.h"
+#include "ui.h"
+#include "worker.h"
+
+void request_search(struct account_state *account) {
+	struct aerc_mailbox *mbox = get_aerc_mailbox(account, account->selected);
+	if (!mbox) {
+		return;
+	}
+	if (!account->ui.search.query) {
+		set_message_filter(mbox, NULL, 0);
+		request_rerender(PANEL_MESSAGE_LIST);
+		return;
+	}
+	worker_post_action(account->worker.pipe, WORKER_SEARCH_MAILBOX, NULL,
+			strdup(account->ui.search.query));
+}
@@ -0,0 +1,195 @@
+/*
+ * sort.c - orders the message list
+ *
+ * Sorting and threading are the server's job when it supports SORT and
+ * THREAD (RFC 5256), since it can do it without us downloading anything. When
+ * it doesn't, we sort the messages we've fetched headers for and put the rest
+ * at the bottom until they've been fetched too.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "columns.h"
+#include "log.h"
+#include "sort.h"
+#include "state.h"
+#include "ui.h"
+#include "worker.h"
+
+struct sort_name {
+	const char *name;
+	enum aerc_sort_key key;
+};
+
+static struct sort_name sort_names[] = {
+	{ "none", SORT_NONE },
+	{ "arrival", SORT_ARRIVAL },
+	{ "date", SORT_DATE },
+	{ "from", SORT_FROM },
+	{ "subject", SORT_SUBJECT },
+	{ "size", SORT_SIZE },
+	{ "thread", SORT_THREAD },
+};
+
+bool parse_sort_key(const char *name, enum aerc_sort_key *key) {
+	for (size_t i = 0; i < sizeof(sort_names) / sizeof(sort_names[0]); ++i) {
+		if (strcasecmp(sort_names[i].name, name) == 0) {
+			*key = sort_names[i].key;
+			return true;
+		}
+	}
+	return false;
+}
+
+void request_sort(struct account_state *account) {
+	struct aerc_mailbox *mbox = get_aerc_mailbox(account, account->selected);
+	if (!mbox) {
+		return;
+	}
+	if (account->ui.sort.key == SORT_NONE) {
+		set_message_order(mbox, NULL, NULL, 0);
+		account->ui.sort.local = false;
+		return;
+	}
+	if (account->ui.sort.local) {
+		sort_locally(account, mbox);
+		return;
+	}
+	struct aerc_sort_request *request = malloc(sizeof(struct aerc_sort_request));
+	request->key = account->ui.sort.key;
+	request->reverse = account->ui.sort.reverse;
+	worker_post_action(account->worker.pipe, WORKER_SORT_MAILBOX, NULL, request);
+}
+
+static enum aerc_sort_key local_key;
+static const struct message_columns *local_columns;
+
+static int compare_dates(size_t a, size_t b) {
+	time_t da = local_columns->date[a], db = local_columns->date[b];
+	return da < db ? -1 : da > db;
+}
+
+static int compare_strings(const uint32_t *column, size_t a, size_t b) {
+	return strcasecmp(local_columns->strings + column[a],
+			local_columns->strings + column[b]);
+}
+
+static int compare_items(const void *_a, const void *_b) {
+	size_t a = *(const size_t *)_a, b = *(const size_t *)_b;
+	const struct message_columns *columns = local_columns;
+	bool af = columns->fetched[a], bf = columns->fetched[b];
+	if (af != bf) {
+		// Messages we know nothing about yet go to the bottom
+		return af ? 1 : -1;
+	}
+	int cmp = 0;
+	if (af) {
+		switch (local_key) {
+		case SORT_DATE:
+			cmp = compare_dates(a, b);
+			break;
+		case SORT_FROM:
+			cmp = compare_strings(columns->from, a, b);
+			break;
+		case SORT_SUBJECT:
+			cmp = compare_strings(columns->thread_subject, a, b);
+			break;
+		case SORT_SIZE:
+			cmp = columns->bytes[a] < columns->bytes[b] ? -1
+				: columns->bytes[a] > columns->bytes[b];
+			break;
+		case SORT_THREAD:
+			// Group by subject first, then in order within each group
+			cmp = compare_strings(columns->thread_subject, a, b);
+			if (!cmp) {
+				cmp = compare_dates(a, b);
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	if (!cmp) {
+		cmp = a < b ? -1 : a > b;
+	}
+	return cmp;
+}
+
+struct sort_group {
+	size_t first;
+	size_t start, length;
+};
+
+static int compare_groups(const void *_a, const void *_b) {
+	const struct sort_group *a = _a, *b = _b;
+	enum aerc_sort_key key = local_key;
+	local_key = SORT_DATE;
+	int cmp = compare_items(&a->first, &b->first);
+	local_key = key;
+	return cmp;
+}
+
+/*
+ * Without THREAD we approximate it the way ORDEREDSUBJECT does, with messages
+ * that share a subject following the earliest of them, and the groups ordered
+ * by that first message.
+ */
+static void thread_locally(const size_t *items, size_t n, bool reverse,
+		size_t *order, unsigned char *depth) {
+	const struct message_columns *columns = local_columns;
+	struct sort_group *groups = malloc(n * sizeof(struct sort_group));
+	size_t ngroups = 0;
+	for (size_t i = 0; i < n; ++i) {
+		bool same = i > 0 && columns->fetched[items[i]]
+			&& columns->fetched[items[i - 1]]
+			&& compare_strings(columns->thread_subject,
+					items[i], items[i - 1]) == 0;
+		if (same) {
+			groups[ngroups - 1].length++;
+		} else {
+			groups[ngroups++] = (struct sort_group){ items[i], i, 1 };
+		}
+	}
+	qsort(groups, ngroups, sizeof(struct sort_group), compare_groups);
+	size_t row = 0;
+	for (size_t k = 0; k < ngroups; ++k) {
+		struct sort_group *group = &groups[reverse ? k : ngroups - k - 1];
+		for (size_t i = 0; i < group->length; ++i, ++row) {
+			order[row] = items[group->start + i];
+			depth[row] = i == 0 ? 0 : 1;
+		}
+	}
+	free(groups);
+}
+
+void sort_locally(struct account_state *account, struct aerc_mailbox *mbox) {
+	local_columns = get_message_columns(mbox);
+	size_t n = local_columns->length;
+	size_t *items = malloc(n * sizeof(size_t));
+	for (size_t i = 0; i < n; ++i) {
+		items[i] = i;
+	}
+	local_key = account->ui.sort.key;
+	qsort(items, n, sizeof(size_t), compare_items);
+	size_t *order = malloc(n * sizeof(size_t));
+	unsigned char *depth = NULL;
+	if (local_key == SORT_THREAD) {
+		depth = malloc(n * sizeof(unsigned char));
+		thread_locally(items, n, account->ui.sort.reverse, order, depth);
+	} else {
+		// Largest at the top, like the unsorted list
+		for (size_t row = 0; row < n; ++row) {
+			size_t i = account->ui.sort.reverse ? row : n - row - 1;
+			order[row] = items[i];
+		}
+	}
+	free(items);
+	local_columns = NULL;
+	set_message_order(mbox, order, depth, n);
+	account->ui.sort.dirty = false;
+	request_rerender(PANEL_MESSAGE_LIST);
+}
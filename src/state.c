@@ -1,9 +1,11 @@
 #define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include "columns.h"
 #include "email/headers.h"
 #include "config.h"
 #include "state.h"
@@ -56,8 +58,12 @@ struct aerc_mailbox *get_aerc_mailbox(struct account_state *account,
 
 void free_aerc_mailbox(struct aerc_mailbox *mbox) {
 	if (!mbox) return;
+	set_message_order(mbox, NULL, NULL, 0);
+	set_message_filter(mbox, NULL, 0);
 	free(mbox->name);
 	free_flat_list(mbox->flags);
+	keyword_table_finish(&mbox->keywords);
+	free_message_columns(mbox->columns);
 	for (size_t i = 0; i < mbox->messages->length; ++i) {
 		struct aerc_message *msg = mbox->messages->items[i];
 		free_aerc_message(msg);
@@ -65,6 +71,179 @@ void free_aerc_mailbox(struct aerc_mailbox *mbox) {
 	free(mbox);
 }
 
+static bool mailbox_ordered(struct aerc_mailbox *mbox) {
+	// The order is stale until the next sort if messages came or went
+	return mbox->order && mbox->order_length == mbox->messages->length;
+}
+
+static size_t sorted_index(struct aerc_mailbox *mbox, size_t row) {
+	if (mailbox_ordered(mbox)) {
+		return mbox->order[row];
+	}
+	return mbox->messages->length - row - 1;
+}
+
+static size_t sorted_row(struct aerc_mailbox *mbox, size_t index) {
+	if (mailbox_ordered(mbox)) {
+		return mbox->rows[index];
+	}
+	return mbox->messages->length - index - 1;
+}
+
+static bool filter_matches(struct aerc_mailbox *mbox, size_t index) {
+	size_t lo = 0, hi = mbox->filter_length;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (index < mbox->filter[mid].min) {
+			hi = mid;
+		} else if (index > mbox->filter[mid].max) {
+			lo = mid + 1;
+		} else {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Messages that arrived since the last search stay hidden until it runs again,
+ * since we don't know if they match.
+ */
+static void build_view(struct aerc_mailbox *mbox) {
+	size_t n = mbox->messages->length;
+	if (mbox->view.built && mbox->view.total == n) {
+		return;
+	}
+	free(mbox->view.order);
+	free(mbox->view.rows);
+	mbox->view.order = malloc(n * sizeof(size_t) + 1);
+	mbox->view.rows = malloc(n * sizeof(size_t) + 1);
+	mbox->view.length = 0;
+	for (size_t i = 0; i < n; ++i) {
+		mbox->view.rows[i] = SIZE_MAX;
+	}
+	for (size_t row = 0; row < n; ++row) {
+		size_t i = sorted_index(mbox, row);
+		if (filter_matches(mbox, i)) {
+			mbox->view.order[mbox->view.length] = i;
+			mbox->view.rows[i] = mbox->view.length++;
+		}
+	}
+	mbox->view.total = n;
+	mbox->view.built = true;
+}
+
+size_t get_message_rows(struct aerc_mailbox *mbox) {
+	if (mbox->filter) {
+		build_view(mbox);
+		return mbox->view.length;
+	}
+	return mbox->messages->length;
+}
+
+size_t get_message_index(struct aerc_mailbox *mbox, size_t row) {
+	if (mbox->filter) {
+		build_view(mbox);
+		return mbox->view.order[row];
+	}
+	return sorted_index(mbox, row);
+}
+
+size_t get_message_row(struct aerc_mailbox *mbox, size_t index) {
+	if (mbox->filter) {
+		build_view(mbox);
+		return index < mbox->view.total ? mbox->view.rows[index] : SIZE_MAX;
+	}
+	return sorted_row(mbox, index);
+}
+
+unsigned char get_message_depth(struct aerc_mailbox *mbox, size_t row) {
+	if (!mailbox_ordered(mbox) || !mbox->depth) {
+		return 0;
+	}
+	if (mbox->filter) {
+		build_view(mbox);
+		row = mbox->rows[mbox->view.order[row]];
+	}
+	return mbox->depth[row];
+}
+
+void set_message_order(struct aerc_mailbox *mbox, size_t *order,
+		unsigned char *depth, size_t length) {
+	free(mbox->order);
+	free(mbox->rows);
+	free(mbox->depth);
+	mbox->order = order;
+	mbox->depth = depth;
+	mbox->rows = NULL;
+	mbox->order_length = length;
+	mbox->view.built = false;
+	if (!order) {
+		return;
+	}
+	mbox->rows = malloc(length * sizeof(size_t));
+	for (size_t row = 0; row < length; ++row) {
+		if (order[row] >= length) {
+			// The server knows about messages we don't yet
+			set_message_order(mbox, NULL, NULL, 0);
+			return;
+		}
+		mbox->rows[order[row]] = row;
+	}
+}
+
+void set_message_filter(struct aerc_mailbox *mbox, struct aerc_range *filter,
+		size_t length) {
+	free(mbox->filter);
+	free(mbox->view.order);
+	free(mbox->view.rows);
+	memset(&mbox->view, 0, sizeof(mbox->view));
+	mbox->filter = filter;
+	mbox->filter_length = length;
+}
+
+static void remove_message_filter(struct aerc_mailbox *mbox, size_t index) {
+	size_t out = 0;
+	for (size_t i = 0; i < mbox->filter_length; ++i) {
+		struct aerc_range range = mbox->filter[i];
+		if (range.min > index) {
+			range.min--;
+			range.max--;
+		} else if (range.max >= index) {
+			if (range.min == range.max) {
+				continue;
+			}
+			range.max--;
+		}
+		mbox->filter[out++] = range;
+	}
+	mbox->filter_length = out;
+	mbox->view.built = false;
+}
+
+void remove_message_order(struct aerc_mailbox *mbox, size_t index) {
+	if (mbox->filter) {
+		remove_message_filter(mbox, index);
+	}
+	if (!mbox->order || index >= mbox->order_length) {
+		return;
+	}
+	size_t removed = mbox->rows[index];
+	for (size_t row = 0, out = 0; row < mbox->order_length; ++row) {
+		if (row == removed) {
+			continue;
+		}
+		size_t i = mbox->order[row];
+		mbox->order[out] = i > index ? i - 1 : i;
+		if (mbox->depth) {
+			mbox->depth[out] = mbox->depth[row];
+		}
+		mbox->rows[mbox->order[out]] = out;
+		++out;
+	}
+	mbox->order_length--;
+}
+
 void free_aerc_message_part(struct aerc_message_part *part) {
 	if (!part) return;
 	free(part->type);
@@ -72,20 +251,13 @@ void free_aerc_message_part(struct aerc_message_part *part) {
 	free(part->body_id);
 	free(part->body_description);
 	free(part->body_encoding);
+	free(part->filtered);
 	free(part);
 }
 
 void free_aerc_message(struct aerc_message *msg) {
 	if (!msg) return;
-	free_flat_list(msg->flags);
-	if (msg->headers) {
-		for (size_t i = 0; i < msg->headers->length; ++i) {
-			struct email_header *header = msg->headers->items[i];
-			free(header->key);
-			free(header->value);
-		}
-	}
-	free_flat_list(msg->headers);
+	free_headers(msg->headers);
 	if (msg->parts) {
 		for (size_t i = 0; i < msg->parts->length; ++i) {
 			struct aerc_message_part *part = msg->parts->items[i];
@@ -96,20 +268,8 @@ void free_aerc_message(struct aerc_message *msg) {
 	free(msg);
 }
 
-const char *get_message_header(struct aerc_message *msg, char *key) {
-	if (!msg || !msg->headers) {
-		return NULL;
-	}
-	for (size_t i = 0; i < msg->headers->length; ++i) {
-		struct email_header *header = msg->headers->items[i];
-		if (!header->key) {
-			break;
-		}
-		if (strcasecmp(header->key, key) == 0) {
-			return header->value;
-		}
-	}
-	return NULL;
+const char *get_message_header(struct aerc_message *msg, enum header_id id) {
+	return msg ? find_header(msg->headers, id) : NULL;
 }
 
 bool get_mailbox_flag(struct aerc_mailbox *mbox, char *flag) {
@@ -123,15 +283,8 @@ bool get_mailbox_flag(struct aerc_mailbox *mbox, char *flag) {
 	return false;
 }
 
-bool get_message_flag(struct aerc_message *msg, char *flag) {
-	if (!msg->flags) return false;
-	for (size_t i = 0; i < msg->flags->length; ++i) {
-		const char *_flag = msg->flags->items[i];
-		if (strcmp(flag, _flag) == 0) {
-			return true;
-		}
-	}
-	return false;
+bool get_message_flag(struct aerc_message *msg, uint64_t flag) {
+	return msg->flags & flag;
 }
 
 struct account_config *config_for_account(const char *name) {
@@ -2,6 +2,7 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <termbox.h>
@@ -276,19 +277,21 @@ void rerender_item(size_t index) {
 		return;
 	}
 	int folder_width = config->ui.sidebar_width;
+	size_t row = get_message_row(mailbox, index);
+	if (row == SIZE_MAX || row < account->ui.list_offset) {
+		return;
+	}
 	struct geometry geo = {
 		.width = tb_width(),
 		.height = tb_height(),
 		.x = folder_width,
-		.y = state->panels.message_list.y +
-			mailbox->messages->length - account->ui.list_offset - (index + 1)
+		.y = state->panels.message_list.y + row - account->ui.list_offset
 	};
 	worker_log(L_DEBUG, "Rerendering item %zd at %d", index, geo.y);
 	struct aerc_message *message = mailbox->messages->items[index];
 	if (!message) {
 		return;
 	}
-	size_t selected = mailbox->messages->length - account->ui.selected_message - 1;
 	for (size_t i = 0; i < loading_indicators->length; ++i) {
 		struct loading_indicator *indic = loading_indicators->items[i];
 		if (indic->x == geo.x && indic->y == geo.y) {
@@ -298,7 +301,8 @@ void rerender_item(size_t index) {
 	}
 	geo.width -= folder_width;
 	geo.height -= 2;
-	render_item(geo, message, selected == index);
+	render_item(geo, mailbox, index, get_message_depth(mailbox, row),
+			account->ui.selected_message == row);
 	tb_present();
 }
 
@@ -22,7 +22,13 @@
  * SOFTWARE.
  */
 
-#include <ctype.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define B64_SIMD
+#endif
 #include "util/base64.h"
 
 static const char b64_table[] = {
@@ -88,10 +94,9 @@ char *b64_encode(const char *src, size_t len, size_t *flen) {
 		buf[2] = ((tmp[1] & 0x0f) << 2) + ((tmp[2] & 0xc0) >> 6);
 		buf[3] = tmp[2] & 0x3f;
 
-		// perform same write to `enc` with new allocation
-		size_t delta = (i > 3 ? 0 : 3 - i) + (j > i + 1 ? 0 : i + 1 - j);
-		if (idx + delta > size) {
-			size += delta;
+		// the last group is padded out to 4 characters too
+		if (idx + 4 > size) {
+			size = idx + 4;
 			enc = (char *) realloc(enc, size + 1);
 		}
 		for (j = 0; (j < i + 1); ++j) {
@@ -112,109 +117,227 @@ char *b64_encode(const char *src, size_t len, size_t *flen) {
 	return enc;
 }
 
-unsigned char *b64_decode(const char *src, size_t len, size_t *decsize) {
-	int i = 0;
-	int j = 0;
-	int l = 0;
-	// max size estimate
-	size_t size = len * 3 / 4;
-	size_t idx = 0;
-	unsigned char *dec = NULL;
-	unsigned char buf[3];
-	unsigned char tmp[4];
+/*
+ * The decoder is our own rather than b64.c's. It goes through a table instead
+ * of isalnum and a search of b64_table, and where the CPU has SSSE3 or AVX2 it
+ * decodes 16 or 32 characters at a time (using Wojciech Muła's lookup method)
+ * until it comes to a line break. Which one we use is decided once, when we
+ * first decode something, so the build doesn't need -mavx2 for it.
+ */
+#define S 0x40 /* whitespace, skipped */
+#define P 0x41 /* padding */
+#define X 0x80 /* anything else */
 
-	// alloc
-	dec = (unsigned char *) malloc(size + 1);
-	if (NULL == dec) { return NULL; }
+static const uint8_t b64_values[256] = {
+	X, X, X, X, X, X, X, X, X, S, S, S, S, S, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	S, X, X, X, X, X, X, X, X, X, X, 62, X, X, X, 63,
+	52, 53, 54, 55, 56, 57, 58, 59, 60, 61, X, X, X, P, X, X,
+	X, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+	15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, X, X, X, X, X,
+	X, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+	41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+};
 
-	// parse until end of source
-	while (len--) {
-		if (isspace(src[j])) { j++; continue; }
-		// break if char is `=' or not base64 char
-		if ('=' == src[j]) { break; }
-		if (!(isalnum(src[j]) || '+' == src[j] || '/' == src[j])) { break; }
+#undef S
+#undef P
+#undef X
 
-		// read up to 4 bytes at a time into `tmp'
-		tmp[i++] = src[j++];
+#ifdef B64_SIMD
+/* Decodes 32 characters into 24 bytes, and writes 32 */
+__attribute__((target("avx2")))
+static bool decode_avx2(const unsigned char **in, unsigned char **out) {
+	const __m256i lut_lo = _mm256_setr_epi8(
+			0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+			0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+			0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+			0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m256i lut_hi = _mm256_setr_epi8(
+			0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+			0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+			0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+			0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lut_roll = _mm256_setr_epi8(
+			0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+			0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i nibble = _mm256_set1_epi8(0x0F);
+	__m256i chunk = _mm256_loadu_si256((const __m256i *)*in);
+	__m256i hi = _mm256_and_si256(_mm256_srli_epi32(chunk, 4), nibble);
+	__m256i lo = _mm256_and_si256(chunk, nibble);
+	__m256i bad = _mm256_and_si256(_mm256_shuffle_epi8(lut_lo, lo),
+			_mm256_shuffle_epi8(lut_hi, hi));
+	if (_mm256_movemask_epi8(_mm256_cmpgt_epi8(bad, _mm256_setzero_si256()))) {
+		return false;
+	}
+	__m256i slash = _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('/'));
+	__m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(slash, hi));
+	__m256i values = _mm256_add_epi8(chunk, roll);
+	// Four 6 bit values to three bytes, in each 32 bit word
+	__m256i merged = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+	__m256i packed = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+	packed = _mm256_shuffle_epi8(packed, _mm256_setr_epi8(
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+	packed = _mm256_permutevar8x32_epi32(packed,
+			_mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+	_mm256_storeu_si256((__m256i *)*out, packed);
+	*in += 32;
+	*out += 24;
+	return true;
+}
 
-		// if 4 bytes read then decode into `buf'
-		if (4 == i) {
-			// translate values in `tmp' from table
-			for (i = 0; i < 4; ++i) {
-				// find translation char in `b64_table'
-				for (l = 0; l < 64; ++l) {
-					if (tmp[i] == b64_table[l]) {
-						tmp[i] = l;
-						break;
-					}
-				}
-			}
+/* Decodes 16 characters into 12 bytes, and writes 16 */
+__attribute__((target("ssse3")))
+static bool decode_ssse3(const unsigned char **in, unsigned char **out) {
+	const __m128i lut_lo = _mm_setr_epi8(
+			0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+			0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m128i lut_hi = _mm_setr_epi8(
+			0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+			0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i lut_roll = _mm_setr_epi8(
+			0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i nibble = _mm_set1_epi8(0x0F);
+	__m128i chunk = _mm_loadu_si128((const __m128i *)*in);
+	__m128i hi = _mm_and_si128(_mm_srli_epi32(chunk, 4), nibble);
+	__m128i lo = _mm_and_si128(chunk, nibble);
+	__m128i bad = _mm_and_si128(_mm_shuffle_epi8(lut_lo, lo),
+			_mm_shuffle_epi8(lut_hi, hi));
+	if (_mm_movemask_epi8(_mm_cmpgt_epi8(bad, _mm_setzero_si128()))) {
+		return false;
+	}
+	__m128i slash = _mm_cmpeq_epi8(chunk, _mm_set1_epi8('/'));
+	__m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(slash, hi));
+	__m128i values = _mm_add_epi8(chunk, roll);
+	__m128i merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+	__m128i packed = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+	packed = _mm_shuffle_epi8(packed, _mm_setr_epi8(
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+	_mm_storeu_si128((__m128i *)*out, packed);
+	*in += 16;
+	*out += 12;
+	return true;
+}
 
-			// decode
-			buf[0] = (tmp[0] << 2) + ((tmp[1] & 0x30) >> 4);
-			buf[1] = ((tmp[1] & 0xf) << 4) + ((tmp[2] & 0x3c) >> 2);
-			buf[2] = ((tmp[2] & 0x3) << 6) + tmp[3];
+__attribute__((target("avx2")))
+static void decode_blocks_avx2(const unsigned char **in,
+		const unsigned char *end, unsigned char **out) {
+	while (end - *in >= 32 && decode_avx2(in, out));
+	while (end - *in >= 16 && decode_ssse3(in, out));
+}
 
-			// unlikely
-			if (idx + 3 > size) {
-				size += 16;
-				dec = (unsigned char *) realloc(dec, size + 1);
-			}
-			if (dec != NULL){
-				for (i = 0; i < 3; ++i) {
-					dec[idx++] = buf[i];
-				}
-			} else {
-				return NULL;
-			}
+__attribute__((target("ssse3")))
+static void decode_blocks_ssse3(const unsigned char **in,
+		const unsigned char *end, unsigned char **out) {
+	while (end - *in >= 16 && decode_ssse3(in, out));
+}
+#endif
 
-			// reset
-			i = 0;
-		}
+static void decode_blocks_none(const unsigned char **in,
+		const unsigned char *end, unsigned char **out) {
+	// The table does it all
+}
+
+/* Decodes whole blocks until one has something besides base64 in it */
+static void (*decode_blocks)(const unsigned char **in,
+		const unsigned char *end, unsigned char **out);
+static pthread_once_t decode_blocks_once = PTHREAD_ONCE_INIT;
+
+static void pick_decode_blocks(void) {
+	decode_blocks = decode_blocks_none;
+#ifdef B64_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		decode_blocks = decode_blocks_avx2;
+	} else if (__builtin_cpu_supports("ssse3")) {
+		decode_blocks = decode_blocks_ssse3;
 	}
+#endif
+}
 
-	// remainder
-	if (i > 0) {
-		// fill `tmp' with `\0' at most 4 times
-		for (j = i; j < 4; ++j) {
-			tmp[j] = '\0';
-		}
+void b64_decoder_init(struct b64_decoder *decoder) {
+	decoder->bits = 0;
+	decoder->count = 0;
+	decoder->done = false;
+}
 
-		// translate remainder
-		for (j = 0; j < 4; ++j) {
-			// find translation char in `b64_table'
-			for (l = 0; l < 64; ++l) {
-				if (tmp[j] == b64_table[l]) {
-					tmp[j] = l;
+size_t b64_decoder_update(struct b64_decoder *decoder, const char *src,
+		size_t len, unsigned char *dst) {
+	const unsigned char *in = (const unsigned char *)src, *end = in + len;
+	unsigned char *out = dst;
+	pthread_once(&decode_blocks_once, pick_decode_blocks);
+	while (in < end && !decoder->done) {
+		if (decoder->count == 0) {
+			decode_blocks(&in, end, &out);
+			while (end - in >= 4) {
+				uint8_t a = b64_values[in[0]], b = b64_values[in[1]],
+					c = b64_values[in[2]], d = b64_values[in[3]];
+				if ((a | b | c | d) & 0xC0) {
 					break;
 				}
+				out[0] = a << 2 | b >> 4;
+				out[1] = b << 4 | c >> 2;
+				out[2] = c << 6 | d;
+				in += 4;
+				out += 3;
+			}
+			if (in == end) {
+				break;
 			}
 		}
-
-		// decode remainder
-		buf[0] = (tmp[0] << 2) + ((tmp[1] & 0x30) >> 4);
-		buf[1] = ((tmp[1] & 0xf) << 4) + ((tmp[2] & 0x3c) >> 2);
-		buf[2] = ((tmp[2] & 0x3) << 6) + tmp[3];
-
-		// write remainer decoded buffer to `dec'
-		if (idx + (i - 1) > size) {
-			size += 16;
-			dec = (unsigned char *) realloc(dec, size + 1);
+		// Around line breaks and at the end we go a character at a time
+		uint8_t value = b64_values[*in++];
+		if (value == 0x40) {
+			continue;
+		} else if (value > 0x40) {
+			decoder->done = true;
+			break;
 		}
-		if (dec != NULL){
-			for (j = 0; (j < i - 1); ++j) {
-				dec[idx++] = buf[j];
-			}
-		} else {
-			return NULL;
+		decoder->bits = decoder->bits << 6 | value;
+		if (++decoder->count == 4) {
+			out[0] = decoder->bits >> 16;
+			out[1] = decoder->bits >> 8;
+			out[2] = decoder->bits;
+			out += 3;
+			decoder->bits = 0;
+			decoder->count = 0;
 		}
 	}
+	return out - dst;
+}
 
-	dec[idx] = '\0';
-	// Return back the size of decoded string if demanded.
-	if (decsize != NULL) {
-		*decsize = size;
+size_t b64_decoder_finish(struct b64_decoder *decoder, unsigned char *dst) {
+	size_t written = 0;
+	if (decoder->count > 1) {
+		uint32_t bits = decoder->bits << (6 * (4 - decoder->count));
+		dst[0] = bits >> 16;
+		dst[1] = bits >> 8;
+		written = decoder->count - 1;
 	}
+	b64_decoder_init(decoder);
+	return written;
+}
 
+unsigned char *b64_decode(const char *src, size_t len, size_t *decsize) {
+	unsigned char *dec = malloc(B64_DECODE_SIZE(len));
+	if (!dec) {
+		return NULL;
+	}
+	struct b64_decoder decoder;
+	b64_decoder_init(&decoder);
+	size_t size = b64_decoder_update(&decoder, src, len, dec);
+	size += b64_decoder_finish(&decoder, dec + size);
+	dec[size] = '\0';
+	if (decsize) {
+		*decsize = size;
+	}
 	return dec;
 }
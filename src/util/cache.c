@@ -0,0 +1,105 @@
+/*
+ * util/cache.c - private files under $XDG_CACHE_HOME/aerc
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util/cache.h"
+#include "log.h"
+
+static bool make_directory(const char *path) {
+	if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+		worker_log(L_DEBUG, "Unable to create %s: %s", path, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+char *get_cache_path(const char *name) {
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	char base[PATH_MAX];
+	if (xdg && *xdg) {
+		snprintf(base, sizeof(base), "%s", xdg);
+	} else if (home) {
+		snprintf(base, sizeof(base), "%s/.cache", home);
+		make_directory(base);
+	} else {
+		return NULL;
+	}
+	size_t len = strlen(base);
+	snprintf(base + len, sizeof(base) - len, "/aerc");
+	if (!make_directory(base)) {
+		return NULL;
+	}
+	char *path = malloc(strlen(base) + strlen(name) + 2);
+	char *p = path + sprintf(path, "%s/", base);
+	for (; *name; ++name) {
+		*p++ = isalnum((unsigned char)*name) || strchr("@.-_:", *name)
+			? *name : '_';
+	}
+	*p = '\0';
+	return path;
+}
+
+void *read_cache_file(const char *path, size_t *len) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1 || (st.st_mode & 077) || st.st_uid != getuid()) {
+		worker_log(L_ERROR, "Ignoring %s, it may be accessible to others", path);
+		close(fd);
+		return NULL;
+	}
+	char *data = malloc(st.st_size + 1);
+	ssize_t amt = 0, total = 0;
+	while (total < st.st_size
+			&& (amt = read(fd, data + total, st.st_size - total)) > 0) {
+		total += amt;
+	}
+	close(fd);
+	if (amt < 0) {
+		free(data);
+		return NULL;
+	}
+	data[total] = '\0';
+	*len = total;
+	return data;
+}
+
+bool write_cache_file(const char *path, const void *data, size_t len) {
+	char *tmp = malloc(strlen(path) + 5);
+	sprintf(tmp, "%s.tmp", path);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		worker_log(L_DEBUG, "Unable to write %s: %s", tmp, strerror(errno));
+		free(tmp);
+		return false;
+	}
+	const char *buf = data;
+	size_t total = 0;
+	while (total < len) {
+		ssize_t amt = write(fd, buf + total, len - total);
+		if (amt <= 0) {
+			break;
+		}
+		total += amt;
+	}
+	bool ok = close(fd) == 0 && total == len && rename(tmp, path) == 0;
+	if (!ok) {
+		unlink(tmp);
+	}
+	free(tmp);
+	return ok;
+}
@@ -1,6 +1,19 @@
+/*
+ * util/iconv.c - converts text to UTF-8
+ *
+ * Opening an iconv descriptor is slow next to converting a header word with
+ * it, so each thread keeps the ones it's used. Single byte charsets don't go
+ * through iconv at all after the first time: we ask it once what each of the
+ * 128 high bytes turns into and convert with that table, copying ASCII over
+ * as it is.
+ */
+#define _POSIX_C_SOURCE 200809L
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <iconv.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stddef.h>
@@ -8,6 +21,154 @@
 
 #include "log.h"
 #include "util/iconv.h"
+#include "util/scan.h"
+
+#define CONVERTER_CACHE_SIZE 8
+
+struct charset_table {
+	/* UTF-8 for each byte from 0x80 up, empty if it doesn't map to anything */
+	char utf8[128][3];
+	uint8_t len[128];
+};
+
+struct converter {
+	char name[32];
+	iconv_t ic;
+	struct charset_table *table;
+};
+
+struct converter_cache {
+	struct converter converters[CONVERTER_CACHE_SIZE];
+	size_t length, next;
+};
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static void converter_free(struct converter *conv) {
+	if (conv->ic != (iconv_t)-1) {
+		iconv_close(conv->ic);
+	}
+	free(conv->table);
+}
+
+static void cache_free(void *_cache) {
+	struct converter_cache *cache = _cache;
+	for (size_t i = 0; i < cache->length; ++i) {
+		converter_free(&cache->converters[i]);
+	}
+	free(cache);
+}
+
+static void cache_init(void) {
+	pthread_key_create(&cache_key, cache_free);
+}
+
+/* "ISO-8859-1", "iso8859_1" and "iso88591" are all the same charset */
+static bool normalize(const char *name, char *out, size_t size) {
+	size_t len = 0;
+	for (; *name; ++name) {
+		if (!isalnum((unsigned char)*name)) {
+			continue;
+		}
+		if (len + 1 == size) {
+			return false;
+		}
+		out[len++] = tolower((unsigned char)*name);
+	}
+	out[len] = '\0';
+	return true;
+}
+
+static bool single_byte(const char *name) {
+	const char *prefixes[] = { "iso8859", "windows125", "cp125", "koi8", "latin" };
+	for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); ++i) {
+		if (strncmp(name, prefixes[i], strlen(prefixes[i])) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static struct charset_table *build_table(iconv_t ic) {
+	struct charset_table *table = calloc(1, sizeof(struct charset_table));
+	for (int i = 0; i < 128; ++i) {
+		char in = (char)(0x80 + i), *_in = &in, out[8], *_out = out;
+		size_t inlen = 1, outlen = sizeof(out);
+		iconv(ic, NULL, NULL, NULL, NULL);
+		if (iconv(ic, &_in, &inlen, &_out, &outlen) == (size_t)-1) {
+			// Not part of the charset, we skip it like iconv_convert4 would
+			continue;
+		}
+		size_t len = sizeof(out) - outlen;
+		if (len > sizeof(table->utf8[i])) {
+			// Outside the BMP, so not really a single byte charset after all
+			free(table);
+			return NULL;
+		}
+		memcpy(table->utf8[i], out, len);
+		table->len[i] = len;
+	}
+	return table;
+}
+
+static struct converter *get_converter(const char *from) {
+	pthread_once(&cache_once, cache_init);
+	struct converter_cache *cache = pthread_getspecific(cache_key);
+	if (!cache) {
+		cache = calloc(1, sizeof(struct converter_cache));
+		pthread_setspecific(cache_key, cache);
+	}
+	char name[32];
+	if (!normalize(from, name, sizeof(name))) {
+		return NULL;
+	}
+	for (size_t i = 0; i < cache->length; ++i) {
+		if (strcmp(cache->converters[i].name, name) == 0) {
+			return &cache->converters[i];
+		}
+	}
+	iconv_t ic = iconv_open("UTF-8", from);
+	if (ic == (iconv_t)-1) {
+		return NULL;
+	}
+	struct converter *conv;
+	if (cache->length < CONVERTER_CACHE_SIZE) {
+		conv = &cache->converters[cache->length++];
+	} else {
+		// Mail doesn't use many charsets, so it hardly matters which goes
+		conv = &cache->converters[cache->next];
+		cache->next = (cache->next + 1) % CONVERTER_CACHE_SIZE;
+		converter_free(conv);
+	}
+	strcpy(conv->name, name);
+	conv->ic = ic;
+	conv->table = single_byte(name) ? build_table(ic) : NULL;
+	if (conv->table) {
+		iconv_close(ic);
+		conv->ic = (iconv_t)-1;
+	}
+	return conv;
+}
+
+static unsigned char *convert_table(const struct charset_table *table,
+		const char *str, size_t inlen, size_t *outlen) {
+	unsigned char *rv = malloc(inlen * 3 + 1), *out = rv;
+	const char *end = str + inlen;
+	while (str < end) {
+		const char *ascii = scan_ascii(str, end);
+		memcpy(out, str, ascii - str);
+		out += ascii - str;
+		for (str = ascii; str < end && (unsigned char)*str >= 0x80; ++str) {
+			uint8_t i = (unsigned char)*str - 0x80;
+			memcpy(out, table->utf8[i], 3);
+			out += table->len[i];
+		}
+	}
+	*out = 0;
+	*outlen = out - rv;
+	return rv;
+}
 
 unsigned char *iconv_convert(const char *str, const char *from) {
 	size_t outlen = 0;
@@ -25,11 +186,17 @@ unsigned char *iconv_convert4(const char *str, const char *from, size_t inlen, s
 	const unsigned char *in;
 	size_t o, _o, len, res, written = 0;
 	int delta;
-	iconv_t ic = iconv_open("UTF-8", from);
-	if (ic == (iconv_t) -1) {
+	struct converter *conv = get_converter(from);
+	if (!conv) {
 		worker_log(L_ERROR, "Failed to convert '%s' to utf-8: unknown encoding, please report", from);
 		return NULL;
 	}
+	if (conv->table) {
+		return convert_table(conv->table, str, inlen, outlen);
+	}
+	iconv_t ic = conv->ic;
+	// Whatever the last conversion left shifted in doesn't apply to this one
+	iconv(ic, NULL, NULL, NULL, NULL);
 	len = o = 2 * inlen;
 	out = rv = calloc(1, len + 1);
 	in = (const unsigned char *)str;
@@ -61,7 +228,5 @@ unsigned char *iconv_convert4(const char *str, const char *from, size_t inlen, s
 
 	*out = 0;
 	*outlen = written;
-
-	iconv_close(ic);
 	return rv;
 }
@@ -0,0 +1,208 @@
+/*
+ * util/scan.c - finds the next delimiter in a buffer
+ *
+ * Compares 16 (SSE2) or 32 (AVX2) bytes against every delimiter at once and
+ * turns the matches into a bit mask, so finding the end of a token costs about
+ * a compare per delimiter per vector rather than a branch per byte. SSE2 is
+ * always there on x86_64; AVX2 is used when the CPU has it, which we check
+ * once rather than leave to the compiler flags.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_AVX2
+#endif
+
+#include "util/scan.h"
+
+const char *scan_find_scalar(const char *str, const char *end,
+		const char *set) {
+	for (; str < end; ++str) {
+		if (!*str || strchr(set, *str)) {
+			return str;
+		}
+	}
+	return end;
+}
+
+static const char *ascii_sse2(const char *str, const char *end) {
+	// The top bit is all we need, and movemask hands it to us directly
+#ifdef __SSE2__
+	while (end - str >= 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)str);
+		unsigned int mask = (unsigned int)_mm_movemask_epi8(chunk);
+		if (mask) {
+			return str + __builtin_ctz(mask);
+		}
+		str += 16;
+	}
+#endif
+	for (; str < end; ++str) {
+		if ((unsigned char)*str >= 0x80) {
+			return str;
+		}
+	}
+	return end;
+}
+
+static const char *printable_sse2(const char *str, const char *end) {
+	/*
+	 * Bytes from 0x80 up are negative as signed chars, so one compare finds
+	 * them along with the control characters.
+	 */
+#ifdef __SSE2__
+	const __m128i space = _mm_set1_epi8(' ' - 1), del = _mm_set1_epi8(0x7F);
+	const __m128i lf = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r');
+	while (end - str >= 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)str);
+		__m128i bad = _mm_or_si128(_mm_cmpgt_epi8(space, chunk),
+				_mm_cmpeq_epi8(chunk, del));
+		__m128i breaks = _mm_or_si128(_mm_cmpeq_epi8(chunk, lf),
+				_mm_cmpeq_epi8(chunk, cr));
+		unsigned int mask = (unsigned int)_mm_movemask_epi8(
+				_mm_andnot_si128(breaks, bad));
+		if (mask) {
+			return str + __builtin_ctz(mask);
+		}
+		str += 16;
+	}
+#endif
+	for (; str < end; ++str) {
+		unsigned char c = *str;
+		if ((c < ' ' && c != '\n' && c != '\r') || c >= 0x7F) {
+			return str;
+		}
+	}
+	return end;
+}
+
+#ifdef SCAN_AVX2
+__attribute__((target("avx2")))
+static const char *find_avx2(const char *str, const char *end,
+		const char *set) {
+	size_t n = strlen(set);
+	__m256i wide[SCAN_SET_MAX + 1];
+	wide[0] = _mm256_setzero_si256();
+	for (size_t i = 0; i < n; ++i) {
+		wide[i + 1] = _mm256_set1_epi8(set[i]);
+	}
+	while (end - str >= 32) {
+		__m256i chunk = _mm256_loadu_si256((const __m256i *)str);
+		__m256i hits = _mm256_cmpeq_epi8(chunk, wide[0]);
+		for (size_t i = 1; i <= n; ++i) {
+			hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(chunk, wide[i]));
+		}
+		unsigned int mask = (unsigned int)_mm256_movemask_epi8(hits);
+		if (mask) {
+			return str + __builtin_ctz(mask);
+		}
+		str += 32;
+	}
+	// Less than a vector left, which scan_find won't hand back to us
+	return scan_find(str, end, set);
+}
+
+__attribute__((target("avx2")))
+static const char *ascii_avx2(const char *str, const char *end) {
+	while (end - str >= 32) {
+		__m256i chunk = _mm256_loadu_si256((const __m256i *)str);
+		unsigned int mask = (unsigned int)_mm256_movemask_epi8(chunk);
+		if (mask) {
+			return str + __builtin_ctz(mask);
+		}
+		str += 32;
+	}
+	return ascii_sse2(str, end);
+}
+
+__attribute__((target("avx2")))
+static const char *printable_avx2(const char *str, const char *end) {
+	const __m256i space = _mm256_set1_epi8(' ' - 1), del = _mm256_set1_epi8(0x7F);
+	const __m256i lf = _mm256_set1_epi8('\n'), cr = _mm256_set1_epi8('\r');
+	while (end - str >= 32) {
+		__m256i chunk = _mm256_loadu_si256((const __m256i *)str);
+		__m256i bad = _mm256_or_si256(_mm256_cmpgt_epi8(space, chunk),
+				_mm256_cmpeq_epi8(chunk, del));
+		__m256i breaks = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, lf),
+				_mm256_cmpeq_epi8(chunk, cr));
+		unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+				_mm256_andnot_si256(breaks, bad));
+		if (mask) {
+			return str + __builtin_ctz(mask);
+		}
+		str += 32;
+	}
+	return printable_sse2(str, end);
+}
+#endif
+
+static struct {
+	/* Only for long runs, scan_find does the first few vectors itself */
+	const char *(*find)(const char *, const char *, const char *);
+	const char *(*ascii)(const char *, const char *);
+	const char *(*printable)(const char *, const char *);
+} scanners;
+static pthread_once_t scanners_once = PTHREAD_ONCE_INIT;
+
+static void pick_scanners(void) {
+	scanners.find = NULL;
+	scanners.ascii = ascii_sse2;
+	scanners.printable = printable_sse2;
+#ifdef SCAN_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		scanners.find = find_avx2;
+		scanners.ascii = ascii_avx2;
+		scanners.printable = printable_avx2;
+	}
+#endif
+}
+
+const char *scan_find(const char *str, const char *end, const char *set) {
+	size_t n = strlen(set);
+	assert(n <= SCAN_SET_MAX);
+#ifdef __SSE2__
+	__m128i narrow[SCAN_SET_MAX + 1];
+	narrow[0] = _mm_setzero_si128();
+	for (size_t i = 0; i < n; ++i) {
+		narrow[i + 1] = _mm_set1_epi8(set[i]);
+	}
+	/*
+	 * Most tokens end within a vector or two, where calling out to the AVX2
+	 * loop costs more than it saves, so it only takes over for long ones.
+	 */
+	for (int vectors = 0; end - str >= 16; ++vectors) {
+		if (vectors == 4 && end - str >= 64) {
+			pthread_once(&scanners_once, pick_scanners);
+			if (scanners.find) {
+				return scanners.find(str, end, set);
+			}
+		}
+		__m128i chunk = _mm_loadu_si128((const __m128i *)str);
+		__m128i hits = _mm_cmpeq_epi8(chunk, narrow[0]);
+		for (size_t i = 1; i <= n; ++i) {
+			hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, narrow[i]));
+		}
+		unsigned int mask = (unsigned int)_mm_movemask_epi8(hits);
+		if (mask) {
+			return str + __builtin_ctz(mask);
+		}
+		str += 16;
+	}
+#endif
+	return scan_find_scalar(str, end, set);
+}
+
+const char *scan_ascii(const char *str, const char *end) {
+	pthread_once(&scanners_once, pick_scanners);
+	return scanners.ascii(str, end);
+}
+
+const char *scan_printable(const char *str, const char *end) {
+	pthread_once(&scanners_once, pick_scanners);
+	return scanners.printable(str, end);
+}
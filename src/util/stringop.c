@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 
 #include "util/list.h"
 
@@ -71,6 +72,17 @@ int is_prefix_of(const char *prefix, const char *str) {
 	return 1;
 }
 
+bool parse_boolean(const char *value) {
+	const char *true_values[] = { "enabled", "enable", "true", "yes", "on",
+		"1" };
+	for (size_t i = 0; i < sizeof(true_values) / sizeof(true_values[0]); ++i) {
+		if (strcasecmp(value, true_values[i]) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
 list_t *split_string(const char *str, const char *delims) {
 	/*
 	 * Splits up a string at each delimiter, and returns a list_t with the
@@ -23,3 +23,10 @@ void get_nanoseconds(struct timespec *tp) {
 
 	(void) tp;
 }
+
+double get_elapsed_ms(const struct timespec *since) {
+	struct timespec now;
+	get_nanoseconds(&now);
+	return (now.tv_sec - since->tv_sec) * 1000.0
+		+ (now.tv_nsec - since->tv_nsec) / 1e6;
+}
@@ -0,0 +1,86 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util/scan.h"
+#include "util/unicode.h"
+
+static const char replacement[] = "\xEF\xBF\xBD";
+
+/*
+ * Returns the length of the valid UTF-8 sequence at s, or 0 if it isn't one.
+ * Overlong forms, surrogates and anything past U+10FFFF don't count.
+ */
+static size_t valid_sequence(const unsigned char *s, const unsigned char *end) {
+	unsigned char lo = 0x80, hi = 0xBF;
+	size_t len;
+	if (s[0] >= 0xC2 && s[0] <= 0xDF) {
+		len = 2;
+	} else if (s[0] >= 0xE0 && s[0] <= 0xEF) {
+		len = 3;
+		if (s[0] == 0xE0) {
+			lo = 0xA0;
+		} else if (s[0] == 0xED) {
+			hi = 0x9F;
+		}
+	} else if (s[0] >= 0xF0 && s[0] <= 0xF4) {
+		len = 4;
+		if (s[0] == 0xF0) {
+			lo = 0x90;
+		} else if (s[0] == 0xF4) {
+			hi = 0x8F;
+		}
+	} else {
+		return 0;
+	}
+	if ((size_t)(end - s) < len || s[1] < lo || s[1] > hi) {
+		return 0;
+	}
+	for (size_t i = 2; i < len; ++i) {
+		if (s[i] < 0x80 || s[i] > 0xBF) {
+			return 0;
+		}
+	}
+	return len;
+}
+
+char *utf8_sanitize(const char *src, size_t len, size_t *outlen) {
+	// Only replacements make it any longer, and there usually aren't any
+	size_t size = len + 1, written = 0;
+	char *out = malloc(size);
+	const char *end = src + len;
+	while (src < end) {
+		const char *run = scan_printable(src, end);
+		memcpy(out + written, src, run - src);
+		written += run - src;
+		if (run == end) {
+			break;
+		}
+		const unsigned char *s = (const unsigned char *)run;
+		size_t n = *s < 0x80 ? 1 : valid_sequence(s, (const unsigned char *)end);
+		if (n == 0) {
+			// Leave room for this and the rest of the input as it is
+			size_t need = written + 3 + (end - run - 1) + 1;
+			if (need > size) {
+				size = need + len / 8;
+				out = realloc(out, size);
+			}
+			memcpy(out + written, replacement, sizeof(replacement) - 1);
+			written += sizeof(replacement) - 1;
+			src = run + 1;
+			continue;
+		}
+		bool keep = n > 1
+			// Zero width space
+			&& !(n == 3 && s[0] == 0xE2 && s[1] == 0x80 && s[2] == 0x8B);
+		if (keep) {
+			memcpy(out + written, run, n);
+			written += n;
+		}
+		src = run + n;
+	}
+	out[written] = '\0';
+	*outlen = written;
+	return out;
+}
@@ -0,0 +1,78 @@
+#define _POSIX_C_SOURCE 200809L
+#include <string.h>
+#include <stdlib.h>
+#include "tests.h"
+#include "util/base64.h"
+
+/* Every byte value, wrapped at 76 characters the way MIME does it */
+static char *encode_wrapped(unsigned char *data, size_t len) {
+	for (size_t i = 0; i < len; ++i) {
+		data[i] = (i * 7) % 256;
+	}
+	size_t _;
+	char *flat = b64_encode((char *)data, len, &_);
+	size_t flat_len = strlen(flat);
+	char *wrapped = malloc(flat_len + flat_len / 76 * 2 + 1);
+	size_t j = 0;
+	for (size_t i = 0; i < flat_len; ++i) {
+		if (i && i % 76 == 0) {
+			wrapped[j++] = '\r';
+			wrapped[j++] = '\n';
+		}
+		wrapped[j++] = flat[i];
+	}
+	wrapped[j] = '\0';
+	free(flat);
+	return wrapped;
+}
+
+static void test_b64_decode_binary(void **state) {
+	unsigned char data[1000];
+	char *wrapped = encode_wrapped(data, sizeof(data));
+	size_t len;
+	unsigned char *plain = b64_decode(wrapped, strlen(wrapped), &len);
+	assert_int_equal(len, sizeof(data));
+	assert_memory_equal(plain, data, sizeof(data));
+	free(plain);
+	free(wrapped);
+}
+
+static void test_b64_decoder_chunks(void **state) {
+	unsigned char data[200];
+	char *wrapped = encode_wrapped(data, sizeof(data));
+	size_t total = strlen(wrapped);
+	unsigned char *plain = malloc(B64_DECODE_SIZE(total));
+	for (size_t split = 0; split <= total; ++split) {
+		struct b64_decoder decoder;
+		b64_decoder_init(&decoder);
+		size_t len = b64_decoder_update(&decoder, wrapped, split, plain);
+		len += b64_decoder_update(&decoder, wrapped + split, total - split,
+				plain + len);
+		len += b64_decoder_finish(&decoder, plain + len);
+		assert_int_equal(len, sizeof(data));
+		assert_memory_equal(plain, data, sizeof(data));
+	}
+	free(plain);
+	free(wrapped);
+}
+
+static void test_b64_decode_stops(void **state) {
+	size_t len;
+	unsigned char *plain = b64_decode("aGVsbG8=IGdhcmJhZ2U", 19, &len);
+	assert_int_equal(len, 5);
+	assert_string_equal((char *)plain, "hello");
+	free(plain);
+	plain = b64_decode("aGk", 3, &len);
+	assert_int_equal(len, 2);
+	assert_string_equal((char *)plain, "hi");
+	free(plain);
+}
+
+int run_tests_base64() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_b64_decode_binary),
+		cmocka_unit_test(test_b64_decoder_chunks),
+		cmocka_unit_test(test_b64_decode_stops),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
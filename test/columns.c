@@ -0,0 +1,70 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <string.h>
+#include "tests.h"
+#include "columns.h"
+#include "email/headers.h"
+#include "state.h"
+#include "worker.h"
+
+static struct aerc_message *make_message(long uid, const char *headers,
+		time_t date) {
+	struct aerc_message *msg = calloc(1, sizeof(struct aerc_message));
+	msg->fetched = true;
+	msg->uid = uid;
+	msg->size = uid * 100;
+	msg->headers = parse_headers(headers);
+	msg->internal_date = date;
+	msg->internal_zone = 120;
+	return msg;
+}
+
+static void test_message_columns(void **state) {
+	struct aerc_mailbox *mbox = calloc(1, sizeof(struct aerc_mailbox));
+	mbox->messages = create_list();
+	list_add(mbox->messages, make_message(1,
+			"Subject: Re: Fwd: hello\r\nFrom: a@example.org\r\n", 1721206800));
+	list_add(mbox->messages, calloc(1, sizeof(struct aerc_message)));
+	list_add(mbox->messages, make_message(3, "From: c@example.org\r\n", 1721293200));
+
+	struct message_columns *columns = get_message_columns(mbox);
+	assert_int_equal(columns->length, 3);
+	assert_true(columns->fetched[0]);
+	assert_false(columns->fetched[1]);
+	assert_int_equal(columns->uid[2], 3);
+	assert_int_equal(columns->bytes[2], 300);
+	assert_int_equal(columns->date[0], 1721206800);
+	assert_int_equal(columns->zone[0], 120);
+	assert_string_equal(columns->strings + columns->subject[0],
+			"Re: Fwd: hello");
+	assert_string_equal(columns->strings + columns->thread_subject[0], "hello");
+	assert_string_equal(columns->strings + columns->from[0], "a@example.org");
+	assert_string_equal(columns->strings + columns->subject[2], "");
+
+	struct aerc_message *fetched = make_message(2, "Subject: two\r\n", 0);
+	fetched->flags = FLAG_SEEN;
+	free_aerc_message(mbox->messages->items[1]);
+	mbox->messages->items[1] = fetched;
+	update_message_columns(mbox, 1);
+	assert_true(columns->fetched[1]);
+	assert_int_equal(columns->flags[1], FLAG_SEEN);
+	assert_string_equal(columns->strings + columns->subject[1], "two");
+
+	struct aerc_message *removed = mbox->messages->items[0];
+	list_del(mbox->messages, 0);
+	remove_message_columns(mbox, 0);
+	free_aerc_message(removed);
+	assert_true(get_message_columns(mbox) == columns);
+	assert_int_equal(columns->length, 2);
+	assert_int_equal(columns->uid[0], 2);
+	assert_int_equal(columns->uid[1], 3);
+
+	free_aerc_mailbox(mbox);
+}
+
+int run_tests_columns() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_message_columns),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
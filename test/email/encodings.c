@@ -0,0 +1,83 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <string.h>
+#include "tests.h"
+#include "email/encodings.h"
+#include "util/iconv.h"
+
+static const char *qp_body = "Caf=C3=A9 au lait, =3D=3d and a soft =\r\n"
+	"line break with_underscores, =\nan =ZZ escape and a trailing =";
+static const char *qp_plain = "Café au lait, == and a soft "
+	"line break with_underscores, an =ZZ escape and a trailing =";
+
+static void test_quoted_printable_decode(void **state) {
+	char *data = strdup(qp_body);
+	int len = quoted_printable_decode(data, strlen(data), QP_BODY);
+	assert_int_equal(len, strlen(qp_plain));
+	assert_memory_equal(data, qp_plain, len);
+	free(data);
+
+	data = strdup("=3F_is_a_question=3F");
+	len = quoted_printable_decode(data, strlen(data), QP_HEADERS);
+	assert_int_equal(len, 16);
+	assert_memory_equal(data, "? is a question?", len);
+	free(data);
+}
+
+static void test_qp_decoder_pieces(void **state) {
+	size_t total = strlen(qp_body);
+	char *out = malloc(total);
+	for (size_t split = 0; split <= total; ++split) {
+		for (size_t second = split; second <= total; ++second) {
+			struct qp_decoder decoder;
+			qp_decoder_init(&decoder, QP_BODY);
+			size_t len = qp_decoder_update(&decoder, qp_body, split, out);
+			len += qp_decoder_update(&decoder, qp_body + split,
+					second - split, out + len);
+			len += qp_decoder_update(&decoder, qp_body + second,
+					total - second, out + len);
+			len += qp_decoder_finish(&decoder, out + len);
+			assert_int_equal(len, strlen(qp_plain));
+			assert_memory_equal(out, qp_plain, len);
+		}
+	}
+	free(out);
+}
+
+static void test_iso_8859_1_to_utf8(void **state) {
+	unsigned char *data = (unsigned char *)strdup("na\xefve caf\xe9, "
+			"a long enough run of plain ASCII to fill a vector or two");
+	int len = iso_8859_1_to_utf8(&data, strlen((char *)data));
+	assert_int_equal(len, strlen((char *)data));
+	assert_string_equal((char *)data, "na\xc3\xafve caf\xc3\xa9, "
+			"a long enough run of plain ASCII to fill a vector or two");
+	free(data);
+}
+
+static void test_iconv_single_byte(void **state) {
+	size_t len;
+	// Twice, so the second comes from the cache
+	for (int i = 0; i < 2; ++i) {
+		unsigned char *out = iconv_convert4("\x80 5, \x93quoted\x94",
+				"Windows-1252", 13, &len);
+		assert_int_equal(len, 19);
+		assert_string_equal((char *)out,
+				"\xe2\x82\xac 5, \xe2\x80\x9cquoted\xe2\x80\x9d");
+		free(out);
+	}
+	unsigned char *out = iconv_convert("\xf0\xd2\xc9\xd7\xc5\xd4", "koi8-r");
+	assert_string_equal((char *)out, "\xd0\x9f\xd1\x80\xd0\xb8\xd0\xb2"
+			"\xd0\xb5\xd1\x82");
+	free(out);
+	assert_null(iconv_convert("abc", "not-a-charset"));
+}
+
+int run_tests_encodings() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_quoted_printable_decode),
+		cmocka_unit_test(test_qp_decoder_pieces),
+		cmocka_unit_test(test_iso_8859_1_to_utf8),
+		cmocka_unit_test(test_iconv_single_byte),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -8,18 +8,18 @@ static void test_parse_headers_simple(void **state) {
 	const char *headers = "Subject: hello world\r\n"
 		"Date: test\r\n"
 		"From: Foo Bar <fbar@example.org>";
-	list_t *output = create_list();
-	parse_headers(headers, output);
+	struct email_headers *output = parse_headers(headers);
 	assert_int_equal(3, output->length);
 	struct email_header expected[] = {
-		{ "Subject", "hello world" },
-		{ "Date", "test" },
-		{ "From", "Foo Bar <fbar@example.org>" }
+		{ "Subject", "hello world", HEADER_SUBJECT },
+		{ "Date", "test", HEADER_DATE },
+		{ "From", "Foo Bar <fbar@example.org>", HEADER_FROM }
 	};
 	for (int i = 0; i < 3; ++i) {
-		struct email_header *test = output->items[i];
+		struct email_header *test = &output->items[i];
 		assert_string_equal(test->key, expected[i].key);
 		assert_string_equal(test->value, expected[i].value);
+		assert_int_equal(test->id, expected[i].id);
 	}
 	free_headers(output);
 }
@@ -29,26 +29,52 @@ static void test_parse_headers_continued(void **state) {
 		" extended\r\n"
 		"Date: test\r\n"
 		"From: Foo Bar <fbar@example.org>";
-	list_t *output = create_list();
-	parse_headers(headers, output);
+	struct email_headers *output = parse_headers(headers);
 	assert_int_equal(3, output->length);
 	struct email_header expected[] = {
-		{ "Subject", "hello world extended" },
-		{ "Date", "test" },
-		{ "From", "Foo Bar <fbar@example.org>" }
+		{ "Subject", "hello world extended", HEADER_SUBJECT },
+		{ "Date", "test", HEADER_DATE },
+		{ "From", "Foo Bar <fbar@example.org>", HEADER_FROM }
 	};
 	for (int i = 0; i < 3; ++i) {
-		struct email_header *test = output->items[i];
+		struct email_header *test = &output->items[i];
 		assert_string_equal(test->key, expected[i].key);
 		assert_string_equal(test->value, expected[i].value);
+		assert_int_equal(test->id, expected[i].id);
 	}
 	free_headers(output);
 }
 
+static void test_parse_headers_folded(void **state) {
+	const char *headers = "References: <1@example.org>\r\n"
+		" <2@example.org>\r\n"
+		"\t<3@example.org>\r\n"
+		"Subject: =?iso-8859-1?q?caf=E9?= and\r\n"
+		" =?utf-8?b?0L/RgNC40LLQtdGC?=\r\n"
+		"X-Mailer: test\r\n"
+		"\r\n";
+	struct email_headers *output = parse_headers(headers);
+	assert_int_equal(3, output->length);
+	assert_string_equal(find_header(output, HEADER_REFERENCES),
+			"<1@example.org> <2@example.org> <3@example.org>");
+	assert_string_equal(find_header(output, HEADER_SUBJECT),
+			"caf\xc3\xa9 and \xd0\xbf\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82");
+	assert_null(find_header(output, HEADER_FROM));
+	assert_int_equal(output->items[2].id, HEADER_OTHER);
+	assert_string_equal(output->items[2].value, "test");
+
+	struct email_headers *copy = copy_headers(output);
+	free_headers(output);
+	assert_string_equal(find_header(copy, HEADER_REFERENCES),
+			"<1@example.org> <2@example.org> <3@example.org>");
+	free_headers(copy);
+}
+
 int run_tests_headers() {
 	const struct CMUnitTest tests[] = {
 		cmocka_unit_test(test_parse_headers_simple),
 		cmocka_unit_test(test_parse_headers_continued),
+		cmocka_unit_test(test_parse_headers_folded),
 	};
 	return cmocka_run_group_tests(tests, NULL, NULL);
 }
@@ -0,0 +1,44 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <string.h>
+#include "tests.h"
+#include "imap/date.h"
+
+static void test_parse_imap_date(void **state) {
+	time_t time;
+	short zone;
+	const char *str = "17-Jul-2024 09:12:44 +0200";
+	const char *end = parse_imap_date(str, &time, &zone);
+	assert_true(end == str + strlen(str));
+	assert_int_equal(time, 1721200364);
+	assert_int_equal(zone, 120);
+}
+
+static void test_parse_imap_date_padded_day(void **state) {
+	time_t time;
+	short zone;
+	const char *end = parse_imap_date(" 7-jul-2024 09:12:44 -0430", &time, &zone);
+	assert_non_null(end);
+	assert_int_equal(*end, '\0');
+	assert_int_equal(time, 1720343564 + (4 * 60 + 30) * 60);
+	assert_int_equal(zone, -270);
+}
+
+static void test_parse_imap_date_invalid(void **state) {
+	time_t time;
+	short zone;
+	assert_null(parse_imap_date("", &time, &zone));
+	assert_null(parse_imap_date("17-Foo-2024 09:12:44 +0200", &time, &zone));
+	assert_null(parse_imap_date("17-Jul-2024 09:12 +0200", &time, &zone));
+	assert_null(parse_imap_date("17-Jul-2024 09:12:44", &time, &zone));
+	assert_null(parse_imap_date("32-Jul-2024 09:12:44 +0200", &time, &zone));
+}
+
+int run_tests_date() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_parse_imap_date),
+		cmocka_unit_test(test_parse_imap_date_padded_day),
+		cmocka_unit_test(test_parse_imap_date_invalid),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "tests.h"
@@ -54,6 +55,46 @@ static void test_handle_line_known_handler(void **state) {
 	imap_close(imap);
 }
 
+static void test_lane_update(struct imap_connection *imap, const char *cmd) {
+	handler_called++;
+	assert_string_equal(cmd, "EXISTS");
+}
+
+static void test_handle_line_lane(void **state) {
+	int _;
+	struct imap_connection *imap = malloc(sizeof(struct imap_connection));
+	imap_init(imap);
+	imap->lanes.primary = imap;
+	imap->events.lane_update = test_lane_update;
+
+	// Left to the main connection, so no handler is looked up
+	imap_arg_t *arg = calloc(1, sizeof(imap_arg_t));
+	imap_parse_args("* 3 EXISTS", arg, &_);
+	handle_line(imap, arg);
+	imap_arg_free(arg);
+	assert_int_equal(handler_called, 1);
+
+	// Lanes still need to hear about their own commands
+	arg = calloc(1, sizeof(imap_arg_t));
+	imap_parse_args("a001 OK done", arg, &_);
+	expect_string(__wrap_hashtable_get, key, "OK");
+	will_return(__wrap_hashtable_get, NULL);
+	handle_line(imap, arg);
+	imap_arg_free(arg);
+	assert_int_equal(handler_called, 1);
+
+	// Including the answers to status polls
+	arg = calloc(1, sizeof(imap_arg_t));
+	imap_parse_args("* STATUS Lists (MESSAGES 12)", arg, &_);
+	expect_string(__wrap_hashtable_get, key, "STATUS");
+	will_return(__wrap_hashtable_get, NULL);
+	handle_line(imap, arg);
+	imap_arg_free(arg);
+	assert_int_equal(handler_called, 1);
+
+	imap_close(imap);
+}
+
 static void test_imap_receive_simple(void **state) {
 	struct imap_connection *imap = malloc(sizeof(struct imap_connection));
 	imap_init(imap);
@@ -224,6 +265,386 @@ static void test_imap_receive_full_buffer(void **state) {
 	imap_close(imap);
 }
 
+static void test_callback(struct imap_connection *imap,
+		void *data, enum imap_status status, const char *args) {
+	handler_called++;
+	assert_int_equal(status, STATUS_BYE);
+}
+
+static void test_disconnected(struct imap_connection *imap, const char *error) {
+	handler_called++;
+	assert_null(imap->socket);
+	assert_int_equal(imap->mode, RECV_WAIT);
+}
+
+static void test_imap_receive_disconnect(void **state) {
+	struct imap_connection *imap = calloc(1, sizeof(struct imap_connection));
+	imap_init(imap);
+	imap->mode = RECV_LINE;
+	imap->events.disconnected = test_disconnected;
+	imap_pending_push(imap, test_callback, NULL);
+
+	will_return(__wrap_ab_recv, 0);
+	will_return(__wrap_poll, 0);
+	imap->poll[0].revents = POLLIN;
+
+	imap_receive(imap);
+
+	// The pending command failed and then we were told about it
+	assert_int_equal(handler_called, 2);
+
+	imap_close(imap);
+}
+
+static void test_code_callback(struct imap_connection *imap,
+		void *data, enum imap_status status, const char *args) {
+	handler_called++;
+	assert_int_equal(status, STATUS_NO);
+	assert_true(imap_resp_code_is(imap, "AUTHENTICATIONFAILED"));
+	assert_false(imap_resp_code_is(imap, "AUTHENTICATION"));
+	assert_false(imap_resp_code_is(imap, "CAPABILITY"));
+}
+
+static void test_handle_imap_status_code(void **state) {
+	int _;
+	struct imap_connection *imap = calloc(1, sizeof(struct imap_connection));
+	imap_init(imap);
+	unsigned int tag = imap_pending_push(imap, test_code_callback, NULL);
+	char line[64];
+	snprintf(line, sizeof(line),
+			"a%u NO [AUTHENTICATIONFAILED] Bad password\r\n", tag);
+
+	imap_arg_t *arg = calloc(1, sizeof(imap_arg_t));
+	imap_parse_args(line, arg, &_);
+	// The code goes through the line handler on its own first
+	expect_string(__wrap_hashtable_get, key, "AUTHENTICATIONFAILED");
+	will_return(__wrap_hashtable_get, NULL);
+	handle_imap_status(imap, arg->str, "NO", arg->next->next);
+	imap_arg_free(arg);
+
+	assert_int_equal(handler_called, 1);
+	// Only while the callback runs
+	assert_null(imap->resp_code);
+
+	imap_close(imap);
+}
+
+static void test_mailbox_status(struct imap_connection *imap,
+		struct mailbox *mbox) {
+	handler_called++;
+}
+
+static void test_handle_imap_mailbox_status(void **state) {
+	int _;
+	struct imap_connection *imap = malloc(sizeof(struct imap_connection));
+	imap_init(imap);
+	imap->selected = NULL;
+	imap->events.mailbox_status = test_mailbox_status;
+	struct mailbox *mbox = get_or_make_mailbox(imap, "Lists");
+
+	imap_arg_t *arg = calloc(1, sizeof(imap_arg_t));
+	imap_parse_args("* STATUS Lists (MESSAGES 12 UNSEEN 3 UIDNEXT 40)", arg, &_);
+	handle_imap_mailbox_status(imap, "*", "STATUS", arg->next->next);
+	assert_int_equal(mbox->exists, 12);
+	assert_int_equal(mbox->unseen, 3);
+	assert_int_equal(handler_called, 1);
+	// Nothing changed, so nobody hears about it
+	handle_imap_mailbox_status(imap, "*", "STATUS", arg->next->next);
+	assert_int_equal(handler_called, 1);
+	imap_arg_free(arg);
+
+	// The selected mailbox is kept up to date by SELECT and IDLE
+	imap->selected = "Lists";
+	arg = calloc(1, sizeof(imap_arg_t));
+	imap_parse_args("* STATUS Lists (MESSAGES 13 UNSEEN 4)", arg, &_);
+	handle_imap_mailbox_status(imap, "*", "STATUS", arg->next->next);
+	assert_int_equal(mbox->exists, 12);
+	assert_int_equal(handler_called, 1);
+	imap_arg_free(arg);
+
+	// A lane goes by what the main connection has selected, not its own
+	struct imap_connection primary = { .selected = "INBOX" };
+	imap->lanes.primary = &primary;
+	arg = calloc(1, sizeof(imap_arg_t));
+	imap_parse_args("* STATUS Lists (MESSAGES 13 UNSEEN 4)", arg, &_);
+	handle_imap_mailbox_status(imap, "*", "STATUS", arg->next->next);
+	assert_int_equal(mbox->exists, 13);
+	assert_int_equal(handler_called, 2);
+	imap_arg_free(arg);
+	imap->lanes.primary = NULL;
+
+	imap_close(imap);
+}
+
+static void test_handle_imap_thread(void **state) {
+	int _;
+	struct imap_connection *imap = malloc(sizeof(struct imap_connection));
+	imap_init(imap);
+
+	imap_arg_t *arg = calloc(1, sizeof(imap_arg_t));
+	imap_parse_args("* THREAD (2)(3 6 (4 23)(44 7 96))", arg, &_);
+	handle_imap_thread(imap, "*", "THREAD", arg->next->next);
+	imap_arg_free(arg);
+
+	long seq[] = { 2, 3, 6, 4, 23, 44, 7, 96 };
+	unsigned char depth[] = { 0, 0, 1, 2, 3, 2, 3, 4 };
+	assert_int_equal(imap->sorted.length, 8);
+	for (size_t i = 0; i < 8; ++i) {
+		assert_int_equal(imap->sorted.seq[i], seq[i]);
+		assert_int_equal(imap->sorted.depth[i], depth[i]);
+	}
+
+	imap_close(imap);
+}
+
+static void test_handle_imap_esearch(void **state) {
+	int _;
+	struct imap_connection *imap = malloc(sizeof(struct imap_connection));
+	imap_init(imap);
+
+	imap_arg_t *arg = calloc(1, sizeof(imap_arg_t));
+	imap_parse_args("* ESEARCH (TAG \"a5\") MIN 2 MAX 47 COUNT 6 "
+			"ALL 10:11,2,12,46:47", arg, &_);
+	handle_imap_esearch(imap, "*", "ESEARCH", arg->next->next);
+	imap_arg_free(arg);
+
+	assert_int_equal(imap->searched.length, 3);
+	assert_int_equal(imap->searched.ranges[0].min, 2);
+	assert_int_equal(imap->searched.ranges[0].max, 2);
+	assert_int_equal(imap->searched.ranges[1].min, 10);
+	assert_int_equal(imap->searched.ranges[1].max, 12);
+	assert_int_equal(imap->searched.ranges[2].min, 46);
+	assert_int_equal(imap->searched.ranges[2].max, 47);
+	assert_int_equal(imap->searched.count, 6);
+
+	const char *error = NULL;
+	char *keys = imap_search_compile("from:alice subject:\"lunch plans\" "
+			"since:2024-01-05 -is:read budget", false, &error);
+	assert_string_equal(keys, "FROM \"alice\" SUBJECT \"lunch plans\" "
+			"SENTSINCE 5-Jan-2024 NOT SEEN TEXT \"budget\"");
+	free(keys);
+	assert_null(imap_search_compile("from:bj\xc3\xb6rn", false, &error));
+	keys = imap_search_compile("from:bj\xc3\xb6rn", true, &error);
+	assert_string_equal(keys, "CHARSET UTF-8 FROM {6+}\r\nbj\xc3\xb6rn");
+	free(keys);
+	assert_null(imap_search_compile("since:yesterday", true, &error));
+
+	imap_close(imap);
+}
+
+static void test_parse_literal8(void **state) {
+	int remaining;
+	const char line[] = "* 3 FETCH (BINARY[1] ~{5}\r\na\0b\0c)\r\n";
+	imap_arg_t *arg = calloc(1, sizeof(imap_arg_t));
+
+	// Cut off partway through the literal, we need the rest plus the ")\r\n"
+	imap_parse_args_n(line, 26, arg, &remaining);
+	assert_true(remaining >= 5);
+	imap_arg_free(arg);
+
+	arg = calloc(1, sizeof(imap_arg_t));
+	int len = imap_parse_args_n(line, sizeof(line) - 1, arg, &remaining);
+	assert_int_equal(remaining, 0);
+	assert_int_equal(len, sizeof(line) - 1);
+	imap_arg_t *body = arg->next->next->next->list->next->next;
+	assert_int_equal(body->type, IMAP_STRING);
+	assert_int_equal(body->len, 5);
+	assert_memory_equal(body->str, "a\0b\0c", 5);
+	imap_arg_free(arg);
+}
+
+static size_t chunk_offset;
+static bool chunk_decoded;
+
+static void test_parse_long_atoms(void **state) {
+	int remaining;
+	// Long enough that the delimiters land past the first few vectors
+	const char line[] = "* 4 FETCH (BODY[HEADER.FIELDS.NOT (X-SPAM-STATUS "
+		"X-SPAM-LEVEL)] NIL X-ATOM-THAT-GOES-ON-FOR-A-WHILE-LONGER-STILL)\r\n"
+		"* 5 EXISTS\r\n";
+	imap_arg_t *arg = calloc(1, sizeof(imap_arg_t));
+	int len = imap_parse_args_n(line, sizeof(line) - 1, arg, &remaining);
+	assert_int_equal(remaining, 0);
+	assert_int_equal(len, sizeof(line) - 1 - strlen("* 5 EXISTS\r\n"));
+	assert_memory_equal(arg->original, line, len);
+	assert_int_equal(strlen(arg->original), len);
+	imap_arg_t *list = arg->next->next->next->list;
+	assert_string_equal(list->str, "BODY");
+	assert_string_equal(list->next->str, "HEADER.FIELDS.NOT (X-SPAM-STATUS "
+			"X-SPAM-LEVEL)");
+	assert_string_equal(list->next->next->next->str,
+			"X-ATOM-THAT-GOES-ON-FOR-A-WHILE-LONGER-STILL");
+	imap_arg_free(arg);
+
+	// Long enough for scan_find to switch to its wide loop
+	char long_line[400];
+	char atom[301];
+	memset(atom, 'x', 300);
+	atom[300] = '\0';
+	snprintf(long_line, sizeof(long_line), "* OK %s done\r\n", atom);
+	arg = calloc(1, sizeof(imap_arg_t));
+	len = imap_parse_args_n(long_line, strlen(long_line), arg, &remaining);
+	assert_int_equal(remaining, 0);
+	assert_int_equal(len, strlen(long_line));
+	assert_string_equal(arg->next->next->str, atom);
+	assert_string_equal(arg->next->next->next->str, "done");
+	imap_arg_free(arg);
+}
+
+static void test_parse_unterminated(void **state) {
+	int remaining;
+	const char *lines[] = {
+		"* 4 FETCH (UID 12 FLAGS (\\Seen",
+		"* 4 FETCH (BODY[] \"hel",
+		"* 4 FETCH (BODY[] {10}\r\nhel",
+		"* OK [CAPABILITY IMAP4rev1",
+		"* 5 EXISTS\r",
+		"a001 OK 1,2:4",
+	};
+	for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); ++i) {
+		// Exactly the bytes we have so far, followed by more of the line
+		size_t n = strlen(lines[i]);
+		char *line = malloc(n + 8);
+		memcpy(line, lines[i], n);
+		memset(line + n, 'x', 8);
+		imap_arg_t *arg = calloc(1, sizeof(imap_arg_t));
+		int len = imap_parse_args_n(line, n, arg, &remaining);
+		assert_true(remaining > 0);
+		assert_true(len <= (int)n);
+		imap_arg_free(arg);
+		free(line);
+	}
+}
+
+static void test_part_chunk(struct imap_connection *imap,
+		struct mailbox_message *msg, size_t part, size_t offset,
+		const char *data, size_t len, bool decoded) {
+	handler_called++;
+	chunk_offset = offset;
+	chunk_decoded = decoded;
+	assert_int_equal(part, 1);
+	assert_int_equal(len, 5);
+	assert_memory_equal(data, "hello", 5);
+}
+
+static void test_handle_imap_fetch_partial(void **state) {
+	int _;
+	struct imap_connection *imap = malloc(sizeof(struct imap_connection));
+	imap_init(imap);
+	imap->events.part_chunk = test_part_chunk;
+	imap->events.message_updated = NULL;
+	struct mailbox *mbox = get_or_make_mailbox(imap, "INBOX");
+	imap->selected = "INBOX";
+	struct mailbox_message *msg = calloc(1, sizeof(struct mailbox_message));
+	msg->populated = true;
+	msg->parts = create_list();
+	list_add(msg->parts, calloc(1, sizeof(struct message_part)));
+	list_add(msg->parts, calloc(1, sizeof(struct message_part)));
+	list_add(mbox->messages, msg);
+
+	imap_arg_t *arg = calloc(1, sizeof(imap_arg_t));
+	// As handle_line passes it on
+	imap_parse_args("* FETCH 1 (UID 7 BODY[2]<262144> {5}\r\nhello)\r\n",
+			arg, &_);
+	handle_imap_fetch(imap, "*", "FETCH", arg->next->next);
+	imap_arg_free(arg);
+
+	// The pieces go to whoever asked for them, not into the part
+	assert_int_equal(handler_called, 1);
+	assert_int_equal(chunk_offset, 262144);
+	assert_false(chunk_decoded);
+	assert_int_equal(msg->uid, 7);
+	assert_null(((struct message_part *)msg->parts->items[1])->content);
+	// It was a .PEEK, and the server didn't say the message was read
+	assert_false(msg->flags & FLAG_SEEN);
+
+	arg = calloc(1, sizeof(imap_arg_t));
+	imap_parse_args("* FETCH 1 (UID 7 BINARY[2]<0> ~{5}\r\nhello)\r\n",
+			arg, &_);
+	handle_imap_fetch(imap, "*", "FETCH", arg->next->next);
+	imap_arg_free(arg);
+	assert_int_equal(handler_called, 2);
+	assert_int_equal(chunk_offset, 0);
+	assert_true(chunk_decoded);
+
+	imap->selected = NULL;
+	imap_close(imap);
+}
+
+static void test_handle_imap_fetch_flags(void **state) {
+	int _;
+	struct imap_connection *imap = malloc(sizeof(struct imap_connection));
+	imap_init(imap);
+	imap->events.message_updated = NULL;
+	struct mailbox *mbox = get_or_make_mailbox(imap, "INBOX");
+	imap->selected = "INBOX";
+	struct mailbox_message *msg = calloc(1, sizeof(struct mailbox_message));
+	list_add(mbox->messages, msg);
+
+	imap_arg_t *arg = calloc(1, sizeof(imap_arg_t));
+	imap_parse_args("* FETCH 1 (FLAGS (\\Seen $Junk \\flagged))\r\n",
+			arg, &_);
+	handle_imap_fetch(imap, "*", "FETCH", arg->next->next);
+	imap_arg_free(arg);
+	assert_int_equal(mbox->keywords.length, 1);
+	uint64_t junk = flag_bit(&mbox->keywords, "$junk", false);
+	assert_int_equal(msg->flags, FLAG_SEEN | FLAG_FLAGGED | junk);
+	assert_string_equal(flag_name(&mbox->keywords, junk), "$Junk");
+
+	// Keywords keep their bit, and new ones get the next
+	arg = calloc(1, sizeof(imap_arg_t));
+	imap_parse_args("* FETCH 1 (FLAGS ($Forwarded $Junk))\r\n", arg, &_);
+	handle_imap_fetch(imap, "*", "FETCH", arg->next->next);
+	imap_arg_free(arg);
+	assert_int_equal(mbox->keywords.length, 2);
+	uint64_t forwarded = flag_bit(&mbox->keywords, "$Forwarded", false);
+	assert_int_equal(forwarded, junk << 1);
+	assert_int_equal(msg->flags, junk | forwarded);
+	assert_int_equal(flag_bit(&mbox->keywords, "\\Bogus", true), 0);
+
+	imap->selected = NULL;
+	imap_close(imap);
+}
+
+static void test_imap_pending_ring(void **state) {
+	struct imap_connection *imap = malloc(sizeof(struct imap_connection));
+	imap_init(imap);
+	struct imap_pending_callback cb;
+
+	// More than fit in the initial window
+	for (long i = 1; i <= 300; ++i) {
+		assert_int_equal(imap_pending_push(imap, NULL, (void *)i), i);
+	}
+	assert_true(imap_pending_pop(imap, "a200", &cb));
+	assert_int_equal((long)cb.data, 200);
+	assert_false(imap_pending_pop(imap, "a200", &cb));
+	assert_true(imap_pending_pop(imap, "a3", &cb));
+	assert_int_equal((long)cb.data, 3);
+	assert_false(imap_pending_pop(imap, "a301", &cb));
+	assert_false(imap_pending_pop(imap, "a3x", &cb));
+	assert_false(imap_pending_pop(imap, "b3", &cb));
+	assert_false(imap_pending_pop(imap, "*", &cb));
+
+	imap_close(imap);
+}
+
+static void test_imap_capabilities_cache_format(void **state) {
+	struct imap_capabilities *cap = imap_capabilities_parse(
+			"IMAP4rev1 idle\tAUTH=PLAIN  X-UNKNOWN LITERAL+ THREAD=REFERENCES\n");
+	assert_true(cap->imap4rev1);
+	assert_true(cap->idle);
+	assert_true(cap->auth_plain);
+	assert_true(cap->literal_plus);
+	assert_true(cap->thread_references);
+	assert_false(cap->starttls);
+	assert_false(cap->thread_orderedsubject);
+
+	char *str = imap_capabilities_format(cap);
+	assert_string_equal(str, "IMAP4rev1 AUTH=PLAIN IDLE LITERAL+ THREAD=REFERENCES");
+	free(str);
+	free(cap);
+}
+
 static int setup(void **state) {
 	handler_called = 0;
 	return 0;
@@ -238,6 +659,19 @@ int run_tests_imap() {
 		cmocka_unit_test_setup(test_imap_receive_partial_line, setup),
 		cmocka_unit_test_setup(test_imap_receive_multi_partial_line, setup),
 		cmocka_unit_test_setup(test_imap_receive_full_buffer, setup),
+		cmocka_unit_test_setup(test_imap_receive_disconnect, setup),
+		cmocka_unit_test_setup(test_handle_line_lane, setup),
+		cmocka_unit_test_setup(test_handle_imap_status_code, setup),
+		cmocka_unit_test_setup(test_handle_imap_mailbox_status, setup),
+		cmocka_unit_test_setup(test_handle_imap_thread, setup),
+		cmocka_unit_test_setup(test_handle_imap_esearch, setup),
+		cmocka_unit_test_setup(test_parse_literal8, setup),
+		cmocka_unit_test_setup(test_parse_long_atoms, setup),
+		cmocka_unit_test_setup(test_parse_unterminated, setup),
+		cmocka_unit_test_setup(test_handle_imap_fetch_partial, setup),
+		cmocka_unit_test_setup(test_handle_imap_fetch_flags, setup),
+		cmocka_unit_test_setup(test_imap_pending_ring, setup),
+		cmocka_unit_test_setup(test_imap_capabilities_cache_format, setup),
 	};
 	return cmocka_run_group_tests(tests, setup, NULL);
 }
@@ -16,8 +16,13 @@ int main(int argc, char **argv) {
 	ret += run_tests_urlparse();
 	ret += run_tests_imap();
 	ret += run_tests_headers();
+	ret += run_tests_encodings();
 	ret += run_tests_bind();
 	ret += run_tests_subprocess();
+	ret += run_tests_base64();
+	ret += run_tests_unicode();
+	ret += run_tests_columns();
+	ret += run_tests_date();
 
 	return ret;
 }
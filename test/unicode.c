@@ -0,0 +1,27 @@
+#define _POSIX_C_SOURCE 200809L
+#include <string.h>
+#include <stdlib.h>
+#include "tests.h"
+#include "util/unicode.h"
+
+static void test_utf8_sanitize(void **state) {
+	const char text[] = "Plain enough text to fill a vector or two,\r\n"
+		"caf\xc3\xa9\x07 with a\tbell\x7f and a zero\xe2\x80\x8bwidth space, "
+		"a stray \xff byte, an overlong \xc0\xaf slash and \xe2\x82";
+	const char expected[] = "Plain enough text to fill a vector or two,\r\n"
+		"caf\xc3\xa9 with abell and a zerowidth space, "
+		"a stray \xef\xbf\xbd byte, an overlong \xef\xbf\xbd\xef\xbf\xbd slash "
+		"and \xef\xbf\xbd\xef\xbf\xbd";
+	size_t len;
+	char *out = utf8_sanitize(text, sizeof(text) - 1, &len);
+	assert_int_equal(len, sizeof(expected) - 1);
+	assert_string_equal(out, expected);
+	free(out);
+}
+
+int run_tests_unicode() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_utf8_sanitize),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}